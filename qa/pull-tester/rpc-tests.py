@@ -97,6 +97,7 @@ BASE_SCRIPTS= [
     'addressindex.py',
     'spentindex.py',
     'timestampindex.py',
+    'index_builder.py',
     'decodescript.py',
     'blockchain.py',
     'disablewallet.py',
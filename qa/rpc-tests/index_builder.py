@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+#
+# Test that indexes enabled on a node with an existing chain are built in
+# the background, without -reindex, and reported by getindexinfo.
+
+import time
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import JSONRPCException
+
+from test_framework.util import (
+    assert_equal,
+    assert_raises_message,
+    initialize_chain_clean,
+    start_nodes,
+    stop_nodes,
+    connect_nodes,
+    wait_bitcoinds,
+    fail,
+)
+
+from test_framework.mininode import COIN
+
+
+class IndexBuilderTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def start_network(self, extra_args):
+        self.nodes = start_nodes(2, self.options.tmpdir, extra_args)
+        connect_nodes(self.nodes[0], 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def setup_network(self):
+        # Neither node has an index to begin with.
+        self.start_network([['-debug']] * 2)
+
+    def wait_for_indexes(self, node, names):
+        for _ in range(600):
+            info = node.getindexinfo()
+            if all(name in info and info[name]['synced'] for name in names):
+                return info
+            time.sleep(0.1)
+        fail('indexes not synced: %s' % node.getindexinfo())
+
+    def run_test(self):
+        self.nodes[0].generate(105)
+        self.sync_all()
+
+        addr1 = self.nodes[1].getnewaddress()
+        txid1 = self.nodes[0].sendtoaddress(addr1, 2)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        addr2 = self.nodes[0].getnewaddress()
+        txid2 = self.nodes[1].sendtoaddress(addr2, 1)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        assert_equal(self.nodes[1].getindexinfo(), {})
+        assert_raises_message(JSONRPCException,
+            "Use -txindex or -txheightindex to enable blockchain transaction queries",
+            self.nodes[1].getrawtransaction, txid1)
+
+        # Enable the indexes on the existing chain, without -reindex.
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.start_network([
+            ['-debug', '-txindex', '-experimentalfeatures', '-insightexplorer'],
+            ['-debug', '-txheightindex'],
+        ])
+
+        info = self.wait_for_indexes(self.nodes[0], ['txindex', 'addressindex', 'spentindex', 'timestampindex'])
+        assert_equal(info['txindex']['best_block_height'], 107)
+        info = self.wait_for_indexes(self.nodes[1], ['txheightindex'])
+        assert_equal(info['txheightindex']['best_block_height'], 107)
+
+        tx1 = self.nodes[0].getrawtransaction(txid1, 1)
+        assert_equal(tx1['height'], 106)
+        assert_equal(self.nodes[1].getrawtransaction(txid1), self.nodes[0].getrawtransaction(txid1))
+        assert_equal(self.nodes[1].getrawtransaction(txid2), self.nodes[0].getrawtransaction(txid2))
+
+        # The spent and address indexes come from the block and undo files.
+        vout = list(filter(lambda o: o['value'] == 2, tx1['vout']))
+        spentinfo = self.nodes[0].getspentinfo({'txid': txid1, 'index': vout[0]['n']})
+        assert_equal(spentinfo['txid'], txid2)
+        assert_equal(spentinfo['height'], 107)
+
+        bal = self.nodes[0].getaddressbalance(addr1)
+        assert_equal(bal['balance'], 0)
+        assert_equal(bal['received'], 2 * COIN)
+        assert_equal(sorted(self.nodes[0].getaddresstxids(addr1)), sorted([txid1, txid2]))
+
+        # From here on each block is indexed as it is connected.
+        txid3 = self.nodes[0].sendtoaddress(addr1, 3)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+        assert_equal(self.nodes[0].getaddressbalance(addr1)['balance'], 3 * COIN)
+        assert_equal(self.nodes[0].getrawtransaction(txid3, 1)['height'], 108)
+        self.wait_for_indexes(self.nodes[1], ['txheightindex'])
+        for _ in range(600):
+            if self.nodes[1].getindexinfo()['txheightindex']['best_block_height'] == 108:
+                break
+            time.sleep(0.1)
+        assert_equal(self.nodes[1].getrawtransaction(txid3), self.nodes[0].getrawtransaction(txid3))
+
+        # The indexes persist across restarts.
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.start_network([
+            ['-debug', '-txindex', '-experimentalfeatures', '-insightexplorer'],
+            ['-debug', '-txheightindex'],
+        ])
+        info = self.nodes[0].getindexinfo()
+        assert_equal(sorted(info.keys()), ['addressindex', 'spentindex', 'timestampindex', 'txindex'])
+        assert_equal(self.nodes[0].getaddressbalance(addr1)['balance'], 3 * COIN)
+
+
+if __name__ == '__main__':
+    IndexBuilderTest().main()
@@ -24,8 +24,8 @@ import time
 '''
 Test behavior of -maxuploadtarget.
 
-* Verify that getdata requests for old blocks (>1week) are dropped
-if uploadtarget has been reached.
+* Verify that getdata requests for old blocks (>1week) are held back,
+without disconnecting the peer, if uploadtarget has been reached.
 * Verify that getdata requests for recent blocks are respected even
 if uploadtarget has been reached.
 * Verify that the upload counters are reset after 24 hours.
@@ -74,6 +74,11 @@ class TestNode(NodeConnCB):
             return self.peer_disconnected
         return wait_until(disconnected, timeout=10)
 
+    def wait_for_block(self, sha256, count, timeout=30):
+        def received():
+            return self.block_receive_map.get(sha256, 0) == count
+        return wait_until(received, timeout=timeout)
+
     # Wrapper for the NodeConn's send_message function
     def send_message(self, message):
         self.connection.send_message(message)
@@ -204,7 +209,7 @@ class MaxUploadTest(BitcoinTestFramework):
         big_new_block = int(big_new_block, 16)
 
         # test_nodes[0] will test what happens if we just keep requesting the
-        # the same big old block too many times (expect: disconnect)
+        # the same big old block too many times (expect: held back)
 
         getdata_request = msg_getdata()
         getdata_request.inv.append(CInv(2, big_old_block))
@@ -214,21 +219,28 @@ class MaxUploadTest(BitcoinTestFramework):
         max_bytes_available = max_bytes_per_day - daily_buffer
         success_count = max_bytes_available / old_block_size
 
-        # 2304GB will be reserved for relaying new blocks, so expect this to
-        # succeed for ~14 tries.
-        for i in range(int(success_count)):
+        # 2304GB will be reserved for relaying new blocks, which leaves
+        # enough for ~14 tries. That is paced over the rest of the day, so
+        # only the first few, which fit in the burst allowance of the pace,
+        # are sent right away. A couple more may get through (depending on
+        # how long the test has been running so far).
+        received = 0
+        for i in range(int(success_count) + 3):
             test_nodes[0].send_message(getdata_request)
-            test_nodes[0].sync_with_ping()
-            assert_equal(test_nodes[0].block_receive_map[big_old_block], i+1)
-
+            if not test_nodes[0].wait_for_block(big_old_block, i+1, timeout=5):
+                break
+            received += 1
+        assert(received > 0)
+        assert(received <= int(success_count) + 2)
+
+        # The rest wait in the peer's queue of historical blocks, and the
+        # peer stays connected.
+        def old_block_queued():
+            return any(p['bulkbytesqueued'] > 0 for p in self.nodes[0].getpeerinfo())
+        assert(wait_until(old_block_queued, timeout=10))
+        assert(not test_nodes[0].wait_for_disconnect())
         assert_equal(len(self.nodes[0].getpeerinfo()), 3)
-        # At most a couple more tries should succeed (depending on how long 
-        # the test has been running so far).
-        for i in range(3):
-            test_nodes[0].send_message(getdata_request)
-        test_nodes[0].wait_for_disconnect()
-        assert_equal(len(self.nodes[0].getpeerinfo()), 2)
-        print("Peer 0 disconnected after downloading old block too many times")
+        print("Peer 0 held back after downloading old block too many times")
 
         # Requesting the current block on test_nodes[1] should succeed indefinitely,
         # even when over the max upload target.
@@ -241,23 +253,30 @@ class MaxUploadTest(BitcoinTestFramework):
 
         print("Peer 1 able to repeatedly download new block")
 
-        # But if test_nodes[1] tries for an old block, it gets disconnected too.
+        # If test_nodes[1] tries for an old block, it is held back too, but
+        # new blocks are still sent to it ahead of the old one.
         getdata_request.inv = [CInv(2, big_old_block)]
         test_nodes[1].send_message(getdata_request)
-        test_nodes[1].wait_for_disconnect()
-        assert_equal(len(self.nodes[0].getpeerinfo()), 1)
+        getdata_request.inv = [CInv(2, big_new_block)]
+        test_nodes[1].send_message(getdata_request)
+        assert(test_nodes[1].wait_for_block(big_new_block, 201))
+        assert_equal(test_nodes[1].block_receive_map.get(big_old_block, 0), 0)
+        assert_equal(len(self.nodes[0].getpeerinfo()), 3)
 
-        print("Peer 1 disconnected after trying to download old block")
+        print("Peer 1 still served new blocks while its old block is held back")
+        getdata_request.inv = [CInv(2, big_old_block)]
 
         print("Advancing system time on node to clear counters...")
 
         # If we advance the time by 24 hours, then the counters should reset,
-        # and test_nodes[2] should be able to retrieve the old block.
+        # test_nodes[2] should be able to retrieve the old block, and the
+        # old block held back for test_nodes[1] is sent.
         self.nodes[0].setmocktime(int(time.time()))
         test_nodes[2].sync_with_ping()
         test_nodes[2].send_message(getdata_request)
         test_nodes[2].sync_with_ping()
         assert_equal(test_nodes[2].block_receive_map[big_old_block], 1)
+        assert(test_nodes[1].wait_for_block(big_old_block, 1))
 
         print("Peer 2 able to download old block")
 
@@ -8,8 +8,13 @@
 #
 
 from test_framework.test_framework import BitcoinTestFramework
-from test_framework.util import assert_equal, bytes_to_hex_str, start_nodes
+from test_framework.util import assert_equal, bytes_to_hex_str, start_nodes, \
+    get_coinbase_address, wait_and_assert_operationid_status
+from test_framework.mininode import CBlock, OutputDescription, \
+    deser_uint256, deser_uint256_vector, deser_vector
 
+from decimal import Decimal
+from io import BytesIO
 import zmq
 import struct
 
@@ -27,8 +32,17 @@ class ZMQTest(BitcoinTestFramework):
         self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, b"hashblock")
         self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, b"hashtx")
         self.zmqSubSocket.connect("tcp://127.0.0.1:%i" % self.port)
+        self.zmqRawBlockSocket = self.zmqContext.socket(zmq.SUB)
+        self.zmqRawBlockSocket.setsockopt(zmq.SUBSCRIBE, b"rawblock")
+        self.zmqRawBlockSocket.connect("tcp://127.0.0.1:%i" % self.port)
+        self.zmqShieldedSocket = self.zmqContext.socket(zmq.SUB)
+        self.zmqShieldedSocket.setsockopt(zmq.SUBSCRIBE, b"shieldedoutputs")
+        self.zmqShieldedSocket.setsockopt(zmq.SUBSCRIBE, b"nullifiers")
+        self.zmqShieldedSocket.connect("tcp://127.0.0.1:%i" % self.port)
         return start_nodes(self.num_nodes, self.options.tmpdir, extra_args=[
-            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port)],
+            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port),
+             '-zmqpubrawblock=tcp://127.0.0.1:'+str(self.port),
+             '-zmqpubshieldedoutputs=tcp://127.0.0.1:'+str(self.port), '-zmqpubnullifiers=tcp://127.0.0.1:'+str(self.port)],
             [],
             [],
             []
@@ -39,6 +53,7 @@ class ZMQTest(BitcoinTestFramework):
 
         genhashes = self.nodes[0].generate(1)
         self.sync_all()
+        allgenhashes = list(genhashes)
 
         print("listen...")
         msg = self.zmqSubSocket.recv_multipart()
@@ -62,6 +77,7 @@ class ZMQTest(BitcoinTestFramework):
         n = 10
         genhashes = self.nodes[1].generate(n)
         self.sync_all()
+        allgenhashes += genhashes
 
         zmqHashes = []
         blockcount = 0
@@ -94,6 +110,67 @@ class ZMQTest(BitcoinTestFramework):
 
         assert_equal(hashRPC, hashZMQ) #blockhash from generate must be equal to the hash received over zmq
 
+        # rawblock carries every new tip, whether it was mined locally or relayed
+        for x in range(0, len(allgenhashes)):
+            msg = self.zmqRawBlockSocket.recv_multipart()
+            assert_equal(msg[0], b"rawblock")
+            assert_equal(struct.unpack('<I', msg[-1])[-1], x)
+            block = CBlock()
+            block.deserialize(BytesIO(msg[1]))
+            block.calc_sha256()
+            assert_equal(block.hash, allgenhashes[x])
+
+        self.check_shielded_notifications()
+
+    def recv_shielded(self, count):
+        # Messages for the same transaction may come in either order.
+        msgs = {}
+        for x in range(0, count):
+            msg = self.zmqShieldedSocket.recv_multipart()
+            f = BytesIO(msg[1])
+            txid = "%064x" % deser_uint256(f)
+            blockhash = "%064x" % deser_uint256(f)
+            sprout = deser_uint256_vector(f)
+            if msg[0] == b"shieldedoutputs":
+                sapling = [o.cmu for o in deser_vector(f, OutputDescription)]
+            else:
+                assert_equal(msg[0], b"nullifiers")
+                sapling = deser_uint256_vector(f)
+            assert_equal(f.read(), b"")
+            msgs[msg[0]] = (txid, blockhash, sprout, sapling, struct.unpack('<I', msg[-1])[-1])
+        return msgs
+
+    def check_shielded_notifications(self):
+        nullblock = "0" * 64
+
+        # Shielding coinbase creates a Sapling output and spends no notes, so
+        # only shieldedoutputs is sent; first for the mempool, then for the block.
+        saplingAddr = self.nodes[0].z_getnewaddress('sapling')
+        recipients = [{"address": saplingAddr, "amount": Decimal('10')}]
+        myopid = self.nodes[0].z_sendmany(get_coinbase_address(self.nodes[0]), recipients, 1, 0)
+        shieldtxid = wait_and_assert_operationid_status(self.nodes[0], myopid)
+        cmus = [int(o['cmu'], 16) for o in self.nodes[0].getrawtransaction(shieldtxid, 1)['vShieldedOutput']]
+
+        msgs = self.recv_shielded(1)
+        assert_equal(msgs[b"shieldedoutputs"], (shieldtxid, nullblock, [], cmus, 0))
+
+        blockhash = self.nodes[0].generate(1)[0]
+        msgs = self.recv_shielded(1)
+        assert_equal(msgs[b"shieldedoutputs"], (shieldtxid, blockhash, [], cmus, 1))
+
+        # Spending the note publishes its nullifier, and the change output.
+        recipients = [{"address": self.nodes[1].getnewaddress(), "amount": Decimal('5')}]
+        myopid = self.nodes[0].z_sendmany(saplingAddr, recipients, 1, 0)
+        spendtxid = wait_and_assert_operationid_status(self.nodes[0], myopid)
+        tx = self.nodes[0].getrawtransaction(spendtxid, 1)
+        nullifiers = [int(spend['nullifier'], 16) for spend in tx['vShieldedSpend']]
+        cmus = [int(o['cmu'], 16) for o in tx['vShieldedOutput']]
+        assert_equal(len(nullifiers), 1)
+
+        msgs = self.recv_shielded(2)
+        assert_equal(msgs[b"nullifiers"], (spendtxid, nullblock, [], nullifiers, 0))
+        assert_equal(msgs[b"shieldedoutputs"], (spendtxid, nullblock, [], cmus, 2))
+
 
 if __name__ == '__main__':
     ZMQTest ().main ()
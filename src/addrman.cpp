@@ -91,6 +91,7 @@ CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, in
     mapAddr[addr] = nId;
     mapInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
+    nSize = vRandom.size();
     if (pnId)
         *pnId = nId;
     return &mapInfo[nId];
@@ -125,6 +126,7 @@ void CAddrMan::Delete(int nId)
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
+    nSize = vRandom.size();
     mapAddr.erase(info);
     mapInfo.erase(nId);
     nNew--;
@@ -145,11 +147,11 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     }
 }
 
-void CAddrMan::MakeTried(CAddrInfo& info, int nId)
+void CAddrMan::MakeTried(CAddrInfo& info, int nId, const std::vector<int>* pvNewPos)
 {
     // remove the entry from all new buckets
     for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-        int pos = info.GetBucketPosition(nKey, true, bucket);
+        int pos = pvNewPos ? (*pvNewPos)[bucket] : info.GetBucketPosition(nKey, true, bucket);
         if (vvNew[bucket][pos] == nId) {
             vvNew[bucket][pos] = -1;
             info.nRefCount--;
@@ -193,7 +195,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     info.fInTried = true;
 }
 
-void CAddrMan::Good_(const CService& addr, int64_t nTime)
+void CAddrMan::Good_(const CService& addr, int64_t nTime, const std::vector<int>* pvNewPos)
 {
     int nId;
     CAddrInfo* pinfo = Find(addr, &nId);
@@ -224,7 +226,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     int nUBucket = -1;
     for (unsigned int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
         int nB = (n + nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
-        int nBpos = info.GetBucketPosition(nKey, true, nB);
+        int nBpos = pvNewPos ? (*pvNewPos)[nB] : info.GetBucketPosition(nKey, true, nB);
         if (vvNew[nB][nBpos] == nId) {
             nUBucket = nB;
             break;
@@ -239,10 +241,10 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     LogPrint("addrman", "Moving %s to tried\n", addr.ToString());
 
     // move nId to the tried tables
-    MakeTried(info, nId);
+    MakeTried(info, nId, pvNewPos);
 }
 
-bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimePenalty)
+bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimePenalty, int nUBucket, int nUBucketPos)
 {
     if (!addr.IsRoutable())
         return false;
@@ -286,8 +288,12 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         fNew = true;
     }
 
-    int nUBucket = pinfo->GetNewBucket(nKey, source);
-    int nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+    // The precomputed position is for addr's port, which an existing entry
+    // for the same IP need not share.
+    if (nUBucket == -1 || (CService)*pinfo != (CService)addr) {
+        nUBucket = pinfo->GetNewBucket(nKey, source);
+        nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+    }
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
@@ -329,6 +335,15 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
     info.nAttempts++;
 }
 
+void CAddrMan::SleepUnlocked(int64_t n)
+{
+    // Let Add and Good through while we back off; the tables are looked at
+    // afresh once we have the lock again.
+    LEAVE_CRITICAL_SECTION(cs);
+    MilliSleep(n);
+    ENTER_CRITICAL_SECTION(cs);
+}
+
 CAddrInfo CAddrMan::Select_(bool newOnly)
 {
     if (size() == 0)
@@ -357,7 +372,7 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
                 if (i++ > kMaxRetries)
                     return CAddrInfo();
                 if (i % kRetriesBetweenSleep == 0 && !nKey.IsNull())
-                    MilliSleep(kRetrySleepInterval);
+                    SleepUnlocked(kRetrySleepInterval);
             }
             int nId = vvTried[nKBucket][nKBucketPos];
             assert(mapInfo.count(nId) == 1);
@@ -379,7 +394,7 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
                 if (i++ > kMaxRetries)
                     return CAddrInfo();
                 if (i % kRetriesBetweenSleep == 0 && !nKey.IsNull())
-                    MilliSleep(kRetrySleepInterval);
+                    SleepUnlocked(kRetrySleepInterval);
             }
             int nId = vvNew[nUBucket][nUBucketPos];
             assert(mapInfo.count(nId) == 1);
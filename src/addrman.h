@@ -12,8 +12,10 @@
 #include "timedata.h"
 #include "util.h"
 
+#include <atomic>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <stdint.h>
 #include <vector>
 
@@ -204,6 +206,19 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! vRandom.size(), readable without taking cs
+    std::atomic<size_t> nSize;
+
+    //! number of calls that may have changed the serialized tables
+    std::atomic<uint64_t> nChanges;
+
+    //! nKey, taken under cs so that bucket hashes can be computed outside it
+    uint256 GetBucketKey() const
+    {
+        LOCK(cs);
+        return nKey;
+    }
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -221,8 +236,9 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
-    //! Move an entry from the "new" table(s) to the "tried" table
-    void MakeTried(CAddrInfo& info, int nId);
+    //! Move an entry from the "new" table(s) to the "tried" table.
+    //! pvNewPos, if given, holds the entry's position in each "new" bucket.
+    void MakeTried(CAddrInfo& info, int nId, const std::vector<int>* pvNewPos = NULL);
 
     //! Delete an entry. It must not be in tried, and have refcount 0.
     void Delete(int nId);
@@ -231,17 +247,22 @@ protected:
     void ClearNew(int nUBucket, int nUBucketPos);
 
     //! Mark an entry "good", possibly moving it from "new" to "tried".
-    void Good_(const CService &addr, int64_t nTime);
+    void Good_(const CService &addr, int64_t nTime, const std::vector<int>* pvNewPos = NULL);
 
-    //! Add an entry to the "new" table.
-    bool Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty);
+    //! Add an entry to the "new" table. nUBucket and nUBucketPos, if not -1,
+    //! are where addr goes for this source under the current nKey.
+    bool Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty, int nUBucket = -1, int nUBucketPos = -1);
 
     //! Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64_t nTime);
 
     //! Select an address to connect to, if newOnly is set to true, only the new table is selected from.
+    //! Drops cs while it backs off, so the caller must hold it exactly once.
     CAddrInfo Select_(bool newOnly);
 
+    //! Sleep for n milliseconds with cs released.
+    void SleepUnlocked(int64_t n);
+
     //! Wraps GetRandInt to allow tests to override RandomInt and make it deterministic.
     virtual int RandomInt(int nMax);
 
@@ -300,7 +321,8 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::unordered_map<int, int> mapUnkIds;
+        mapUnkIds.reserve(mapInfo.size());
         int nIds = 0;
         for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             mapUnkIds[(*it).first] = nIds;
@@ -439,6 +461,10 @@ public:
             LogPrint("addrman", "addrman lost %i new and %i tried addresses due to collisions\n", nLostUnk, nLost);
         }
 
+        // The tables now match what was read.
+        nSize = vRandom.size();
+        nChanges = 0;
+
         Check();
     }
 
@@ -461,9 +487,11 @@ public:
         nIdCount = 0;
         nTried = 0;
         nNew = 0;
+        nSize = 0;
+        nChanges++;
     }
 
-    CAddrMan()
+    CAddrMan() : nChanges(0)
     {
         Clear();
     }
@@ -476,8 +504,13 @@ public:
     //! Return the number of (unique) addresses in all tables.
     size_t size() const
     {
-        LOCK(cs); // TODO: Cache this in an atomic to avoid this overhead
-        return vRandom.size();
+        return nSize;
+    }
+
+    //! A counter that moves whenever the serialized tables may have changed.
+    uint64_t GetChangeCount() const
+    {
+        return nChanges;
     }
 
     //! Consistency check
@@ -496,26 +529,38 @@ public:
     //! Add a single address.
     bool Add(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty = 0)
     {
-        LOCK(cs);
-        bool fRet = false;
-        Check();
-        fRet |= Add_(addr, source, nTimePenalty);
-        Check();
-        if (fRet)
-            LogPrint("addrman", "Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort(), source.ToString(), nTried, nNew);
-        return fRet;
+        return Add(std::vector<CAddress>(1, addr), source, nTimePenalty);
     }
 
     //! Add multiple addresses.
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64_t nTimePenalty = 0)
     {
+        // Hash out the bucket positions before taking the lock, so that
+        // large addr messages hold up Select and Good as little as possible.
+        uint256 nKeyUsed = GetBucketKey();
+        std::vector<std::pair<int, int> > vBucket;
+        vBucket.reserve(vAddr.size());
+        for (const CAddress& addr : vAddr) {
+            CAddrInfo info(addr, source);
+            int nUBucket = info.GetNewBucket(nKeyUsed, source);
+            vBucket.push_back(std::make_pair(nUBucket, info.GetBucketPosition(nKeyUsed, true, nUBucket)));
+        }
+
         LOCK(cs);
+        bool fHints = nKey == nKeyUsed;
         int nAdd = 0;
         Check();
-        for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-            nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+        for (size_t i = 0; i < vAddr.size(); i++) {
+            if (fHints)
+                nAdd += Add_(vAddr[i], source, nTimePenalty, vBucket[i].first, vBucket[i].second) ? 1 : 0;
+            else
+                nAdd += Add_(vAddr[i], source, nTimePenalty) ? 1 : 0;
+        }
+        nChanges++;
         Check();
-        if (nAdd)
+        if (nAdd == 1 && vAddr.size() == 1)
+            LogPrint("addrman", "Added %s from %s: %i tried, %i new\n", vAddr[0].ToStringIPPort(), source.ToString(), nTried, nNew);
+        else if (nAdd)
             LogPrint("addrman", "Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString(), nTried, nNew);
         return nAdd > 0;
     }
@@ -523,9 +568,18 @@ public:
     //! Mark an entry as accessible.
     void Good(const CService &addr, int64_t nTime = GetTime())
     {
+        // Moving an entry to "tried" has to look for it in every "new"
+        // bucket; work out where it would be outside the lock.
+        uint256 nKeyUsed = GetBucketKey();
+        CAddrInfo info = CAddrInfo(CAddress(addr), CNetAddr());
+        std::vector<int> vNewPos(ADDRMAN_NEW_BUCKET_COUNT);
+        for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++)
+            vNewPos[bucket] = info.GetBucketPosition(nKeyUsed, true, bucket);
+
         LOCK(cs);
         Check();
-        Good_(addr, nTime);
+        Good_(addr, nTime, nKey == nKeyUsed ? &vNewPos : NULL);
+        nChanges++;
         Check();
     }
 
@@ -535,6 +589,7 @@ public:
         LOCK(cs);
         Check();
         Attempt_(addr, nTime);
+        nChanges++;
         Check();
     }
 
@@ -572,6 +627,7 @@ public:
         LOCK(cs);
         Check();
         Connected_(addr, nTime);
+        nChanges++;
         Check();
     }
 
@@ -0,0 +1,171 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "baseindex.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "undo.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/thread.hpp>
+
+//! How often to log the progress of an index that is catching up, in seconds.
+static const int64_t INDEX_PROGRESS_LOG_INTERVAL = 30;
+
+static CCriticalSection cs_indexes;
+static std::vector<CBaseIndex*> vIndexes;
+
+void RegisterIndex(CBaseIndex* pindex)
+{
+    {
+        LOCK(cs_indexes);
+        vIndexes.push_back(pindex);
+    }
+    RegisterValidationInterface(pindex);
+}
+
+void UnregisterIndex(CBaseIndex* pindex)
+{
+    UnregisterValidationInterface(pindex);
+    LOCK(cs_indexes);
+    vIndexes.erase(std::remove(vIndexes.begin(), vIndexes.end(), pindex), vIndexes.end());
+}
+
+std::vector<CBaseIndex*> GetIndexes()
+{
+    LOCK(cs_indexes);
+    return vIndexes;
+}
+
+CBaseIndex::CBaseIndex(const std::string& strNameIn) :
+    strName(strNameIn), nBestHeight(-1), fSynced(false), fTipChanged(false)
+{
+}
+
+void CBaseIndex::UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock)
+{
+    boost::unique_lock<boost::mutex> lock(mutexTip);
+    fTipChanged = true;
+    condTip.notify_one();
+}
+
+void CBaseIndex::SetBestBlock(const uint256& hash, int nHeight)
+{
+    LOCK(cs);
+    hashBestBlock = hash;
+    nBestHeight = nHeight;
+}
+
+uint256 CBaseIndex::GetBestBlock() const
+{
+    LOCK(cs);
+    return hashBestBlock;
+}
+
+int CBaseIndex::GetBestHeight() const
+{
+    LOCK(cs);
+    return nBestHeight;
+}
+
+bool CBaseIndex::IsSynced() const
+{
+    LOCK(cs);
+    return fSynced;
+}
+
+void CBaseIndex::ThreadSync()
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+
+    // Leave the disk to block download until the node has caught up.
+    while (IsInitialBlockDownload(consensusParams)) {
+        boost::this_thread::interruption_point();
+        MilliSleep(1000);
+    }
+    LogPrintf("%s: %s at height %d, syncing with the active chain\n", __func__, strName, GetBestHeight());
+
+    int64_t nLastLog = GetTime();
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        // Work out the next step: disconnect the best block if it has left
+        // the active chain, or connect the block after it.
+        const CBlockIndex* pindex = NULL;
+        bool fConnect = true;
+        CDiskBlockPos pos, posUndo;
+        uint256 hashPrev;
+        {
+            LOCK(cs_main);
+            uint256 hashBest = GetBestBlock();
+            const CBlockIndex* pindexBest = NULL;
+            if (!hashBest.IsNull()) {
+                BlockMap::const_iterator mi = mapBlockIndex.find(hashBest);
+                if (mi != mapBlockIndex.end()) {
+                    pindexBest = mi->second;
+                } else {
+                    // Entries for blocks that are indexed again are
+                    // overwritten.
+                    LogPrintf("%s: %s best block %s is unknown, indexing from genesis\n", __func__, strName, hashBest.ToString());
+                }
+            }
+            if (pindexBest && !chainActive.Contains(pindexBest)) {
+                pindex = pindexBest;
+                fConnect = false;
+            } else {
+                pindex = pindexBest ? chainActive.Next(pindexBest) : chainActive.Genesis();
+            }
+
+            if (!pindex) {
+                if (!IsSynced()) {
+                    LogPrintf("%s: %s synced at height %d\n", __func__, strName, GetBestHeight());
+                    LOCK(cs);
+                    fSynced = true;
+                }
+                if (!ReachedTip())
+                    return;
+            } else {
+                // Blocks without data (pruned, or below a chainstate
+                // snapshot) are stepped over without entries.
+                if (pindex->nStatus & BLOCK_HAVE_DATA)
+                    pos = pindex->GetBlockPos();
+                if (NeedsUndo() && pindex->pprev && (pindex->nStatus & BLOCK_HAVE_UNDO)) {
+                    posUndo = pindex->GetUndoPos();
+                    hashPrev = pindex->pprev->GetBlockHash();
+                }
+            }
+        }
+
+        if (!pindex) {
+            // Wait for the tip to move.
+            boost::unique_lock<boost::mutex> lock(mutexTip);
+            while (!fTipChanged)
+                condTip.wait(lock);
+            fTipChanged = false;
+            continue;
+        }
+
+        CBlock block;
+        CBlockUndo blockundo;
+        if ((!pos.IsNull() && (!ReadBlockFromDisk(block, pos, consensusParams) || block.GetHash() != pindex->GetBlockHash())) ||
+                (!posUndo.IsNull() && !UndoReadFromDisk(blockundo, posUndo, hashPrev))) {
+            LogPrintf("%s: %s failed to read block %s\n", __func__, strName, pindex->GetBlockHash().ToString());
+            MilliSleep(1000);
+            continue;
+        }
+        if (!(fConnect ? ConnectBlock(block, pindex, blockundo) : DisconnectBlock(block, pindex, blockundo))) {
+            LogPrintf("%s: %s failed to write block %s\n", __func__, strName, pindex->GetBlockHash().ToString());
+            MilliSleep(1000);
+            continue;
+        }
+
+        if (GetTime() - nLastLog >= INDEX_PROGRESS_LOG_INTERVAL) {
+            LogPrintf("%s: syncing %s, at height %d\n", __func__, strName, GetBestHeight());
+            nLastLog = GetTime();
+        }
+    }
+}
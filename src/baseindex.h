@@ -0,0 +1,90 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_BASEINDEX_H
+#define BITCOIN_BASEINDEX_H
+
+#include "sync.h"
+#include "uint256.h"
+#include "validationinterface.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlock;
+class CBlockIndex;
+class CBlockUndo;
+
+/**
+ * An index that is built from the block files in the background, while the
+ * node stays online, and then follows the active chain. Each index keeps its
+ * own best block, so that it can be enabled without a -reindex, and resumes
+ * where it left off after a restart.
+ *
+ * Derived classes write the entries of a block together with the new best
+ * block, and report it with SetBestBlock.
+ */
+class CBaseIndex : public CValidationInterface
+{
+private:
+    const std::string strName;
+
+    mutable CCriticalSection cs;
+    //! The last block indexed.
+    uint256 hashBestBlock;
+    int nBestHeight;
+    bool fSynced;
+
+    //! Wakes the sync thread when the tip changes.
+    boost::mutex mutexTip;
+    boost::condition_variable condTip;
+    bool fTipChanged;
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock);
+
+    void SetBestBlock(const uint256& hash, int nHeight);
+
+    /** Whether ConnectBlock and DisconnectBlock need the undo data of the block. */
+    virtual bool NeedsUndo() const { return false; }
+
+    /**
+     * Called with cs_main held when the index has caught up with the tip of
+     * the active chain. Returning false stops the sync thread, for indexes
+     * that are kept up to date elsewhere from then on.
+     */
+    virtual bool ReachedTip() { return true; }
+
+public:
+    CBaseIndex(const std::string& strNameIn);
+    virtual ~CBaseIndex() {}
+
+    /** Add the entries of the block after the best block. */
+    virtual bool ConnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo) = 0;
+    /** Remove the entries of the best block. */
+    virtual bool DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo) = 0;
+
+    const std::string& GetName() const { return strName; }
+    uint256 GetBestBlock() const;
+    int GetBestHeight() const;
+    /** Whether the index has caught up with the active chain. */
+    bool IsSynced() const;
+
+    /**
+     * Build the index once initial block download is over, then keep it at
+     * the tip of the active chain. Runs until interrupted, or ReachedTip
+     * returns false.
+     */
+    void ThreadSync();
+};
+
+/** Make an index visible to getindexinfo, and start receiving chain tip updates. */
+void RegisterIndex(CBaseIndex* pindex);
+void UnregisterIndex(CBaseIndex* pindex);
+std::vector<CBaseIndex*> GetIndexes();
+
+#endif // BITCOIN_BASEINDEX_H
@@ -0,0 +1,104 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "addrman.h"
+#include "random.h"
+
+#include <atomic>
+#include <vector>
+#include <boost/thread/thread.hpp>
+
+static const size_t NUM_SOURCES = 64;
+static const size_t NUM_ADDRESSES_PER_SOURCE = 256;
+
+static CNetAddr RandomIP()
+{
+    // A routable IPv4 address; 1.x.x.x through 126.x.x.x.
+    uint32_t n = GetRand(126 << 24) + (1 << 24);
+    struct in_addr ip;
+    ip.s_addr = htonl(n);
+    return CNetAddr(ip);
+}
+
+static void CreateAddresses(std::vector<CNetAddr>& vSources, std::vector<std::vector<CAddress>>& vAddresses)
+{
+    vSources.clear();
+    vAddresses.clear();
+    for (size_t i = 0; i < NUM_SOURCES; i++) {
+        vSources.push_back(RandomIP());
+        vAddresses.emplace_back();
+        for (size_t j = 0; j < NUM_ADDRESSES_PER_SOURCE; j++) {
+            CAddress addr(CService(RandomIP(), 8033));
+            addr.nTime = GetTime() - GetRand(60 * 60);
+            vAddresses.back().push_back(addr);
+        }
+    }
+}
+
+static void FillAddrMan(CAddrMan& addrman, const std::vector<CNetAddr>& vSources, const std::vector<std::vector<CAddress>>& vAddresses)
+{
+    for (size_t i = 0; i < vSources.size(); i++)
+        addrman.Add(vAddresses[i], vSources[i]);
+    // Move some of them to tried, as successful connections would.
+    for (size_t i = 0; i < vSources.size(); i += 4)
+        addrman.Good(vAddresses[i][0]);
+}
+
+// Addr messages of 256 addresses each, from a spread of sources.
+static void AddrManAdd(benchmark::State& state)
+{
+    std::vector<CNetAddr> vSources;
+    std::vector<std::vector<CAddress>> vAddresses;
+    CreateAddresses(vSources, vAddresses);
+
+    CAddrMan addrman;
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        addrman.Add(vAddresses[i % NUM_SOURCES], vSources[i % NUM_SOURCES]);
+        i++;
+    }
+}
+
+static void AddrManSelect(benchmark::State& state)
+{
+    std::vector<CNetAddr> vSources;
+    std::vector<std::vector<CAddress>> vAddresses;
+    CreateAddresses(vSources, vAddresses);
+
+    CAddrMan addrman;
+    FillAddrMan(addrman, vSources, vAddresses);
+    while (state.KeepRunning()) {
+        CAddrInfo addr = addrman.Select();
+        assert(addr.IsRoutable());
+    }
+}
+
+// Connection selection while another thread handles addr gossip, which
+// makes any contention on the addrman lock visible.
+static void AddrManSelectWhileAdding(benchmark::State& state)
+{
+    std::vector<CNetAddr> vSources;
+    std::vector<std::vector<CAddress>> vAddresses;
+    CreateAddresses(vSources, vAddresses);
+
+    CAddrMan addrman;
+    FillAddrMan(addrman, vSources, vAddresses);
+
+    std::atomic<bool> fStop(false);
+    boost::thread adder([&] {
+        for (size_t i = 0; !fStop; i++)
+            addrman.Add(vAddresses[i % NUM_SOURCES], vSources[(i + 1) % NUM_SOURCES]);
+    });
+    while (state.KeepRunning()) {
+        CAddrInfo addr = addrman.Select();
+        assert(addr.IsRoutable());
+    }
+    fStop = true;
+    adder.join();
+}
+
+BENCHMARK(AddrManAdd);
+BENCHMARK(AddrManSelect);
+BENCHMARK(AddrManSelectWhileAdding);
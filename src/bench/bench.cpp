@@ -33,6 +33,10 @@ benchmark::BenchRunner::RunAll(benchmark::duration elapsedTimeForOne)
     for (const auto &p: benchmarks()) {
         State state(p.first, elapsedTimeForOne);
         p.second(state);
+        for (const auto &c: state.counters) {
+            std::cout << p.first << "/" << c.first << "," << 1 << "," << c.second << "," << c.second << "," << c.second << ","
+                      << 0 << "," << 0 << "," << 0 << "\n";
+        }
     }
     perf_fini();
 }
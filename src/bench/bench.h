@@ -30,6 +30,7 @@ static void CODE_TO_TIME(benchmark::State& state)
        ... do stuff you want to time...
     }
     ... do any cleanup needed...
+    state.counters["things"] = ...;  // optional, reported as an extra row
 }
 
 BENCHMARK(CODE_TO_TIME);
@@ -59,6 +60,11 @@ namespace benchmark {
         uint64_t minCycles;
         uint64_t maxCycles;
     public:
+        // Named values measured by the benchmark other than time, such as
+        // allocations per iteration. Each is reported as a row of its own,
+        // with the value in the timing columns.
+        std::map<std::string, uint64_t> counters;
+
         State(std::string _name, duration _maxElapsed) :
             name(_name),
             maxElapsed(_maxElapsed),
@@ -0,0 +1,151 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "support/allocators/arena.h"
+#include "version.h"
+
+#include <cassert>
+#include <memory>
+#include <string>
+
+static const int BLOCK_TRANSPARENT_TXS = 1000;
+static const int BLOCK_SAPLING_TXS = 100;
+
+// A block shaped like a busy mainnet block: mostly P2PKH spends, plus some
+// Sapling transactions with shielded spends and outputs.
+static CDataStream MakeSerializedBlock()
+{
+    CBlock block;
+    for (int i = 0; i < BLOCK_TRANSPARENT_TXS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        for (auto& in : tx.vin) {
+            in.prevout = COutPoint(uint256S("0x" + std::to_string(i + 1)), 0);
+            in.scriptSig = CScript() << std::vector<unsigned char>(72, 0x30)
+                                     << std::vector<unsigned char>(33, 0x02);
+        }
+        tx.vout.resize(2);
+        for (auto& out : tx.vout) {
+            out.nValue = 1000 + i;
+            out.scriptPubKey = CScript() << OP_DUP << OP_HASH160
+                                         << std::vector<unsigned char>(20, i & 0xff)
+                                         << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    for (int i = 0; i < BLOCK_SAPLING_TXS; i++) {
+        CMutableTransaction tx;
+        tx.fOverwintered = true;
+        tx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+        tx.nVersion = SAPLING_TX_VERSION;
+        tx.nExpiryHeight = i;
+        tx.vShieldedSpend.resize(1);
+        tx.vShieldedOutput.resize(2);
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    return ss;
+}
+
+// Forwards to std::allocator and counts what passes through it, so that the
+// default mode's allocations can be counted without replacing operator new.
+template <typename T>
+struct counting_allocator : public std::allocator<T> {
+    typedef T value_type;
+
+    uint64_t* pnAllocations;
+    uint64_t* pnBytes;
+
+    counting_allocator(uint64_t* pnAllocationsIn, uint64_t* pnBytesIn) : pnAllocations(pnAllocationsIn), pnBytes(pnBytesIn) {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U>& a) : pnAllocations(a.pnAllocations), pnBytes(a.pnBytes) {}
+    template <typename U>
+    struct rebind {
+        typedef counting_allocator<U> other;
+    };
+
+    T* allocate(std::size_t n)
+    {
+        ++*pnAllocations;
+        *pnBytes += n * sizeof(T);
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+// The default mode: each transaction and its control block is one heap
+// allocation, as made by make_shared when a CTransactionRef is deserialized.
+// Reports the allocations made for the transaction objects of one block.
+static void DeserializeBlock(benchmark::State& state)
+{
+    const CDataStream serialized = MakeSerializedBlock();
+
+    uint64_t nAllocations = 0;
+    uint64_t nBytes = 0;
+    {
+        CDataStream ss(serialized.begin(), serialized.end(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        UnserializeBlock(ss, block, counting_allocator<CTransaction>(&nAllocations, &nBytes));
+    }
+
+    while (state.KeepRunning()) {
+        CDataStream ss(serialized.begin(), serialized.end(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        ss >> block;
+    }
+    state.counters["tx_allocations"] = nAllocations;
+    state.counters["tx_alloc_bytes"] = nBytes;
+}
+
+// The arena mode: the transactions of each block are allocated from a fresh
+// arena, which is freed with the block. Reports the heap allocations the
+// arena made for one block, under the same names as the default mode.
+static void DeserializeBlockArena(benchmark::State& state)
+{
+    const CDataStream serialized = MakeSerializedBlock();
+
+    uint64_t nAllocations = 0;
+    uint64_t nBytes = 0;
+    uint64_t nObjects = 0;
+    while (state.KeepRunning()) {
+        CDataStream ss(serialized.begin(), serialized.end(), SER_NETWORK, PROTOCOL_VERSION);
+        auto arena = std::make_shared<MonotonicArena>();
+        CBlock block;
+        UnserializeBlock(ss, block, arena_allocator<CTransaction>(arena));
+        nAllocations = arena->GetChunks();
+        nBytes = arena->GetChunkBytes();
+        nObjects = arena->GetAllocations();
+    }
+    state.counters["tx_allocations"] = nAllocations;
+    state.counters["tx_alloc_bytes"] = nBytes;
+    state.counters["arena_objects"] = nObjects;
+}
+
+// Sum the serialized sizes of a block's transactions, as the mempool, miner
+// and block connection do; the sizes are cached when the transactions are
+// deserialized.
+static void BlockTransactionSizes(benchmark::State& state)
+{
+    CDataStream ss = MakeSerializedBlock();
+    CBlock block;
+    ss >> block;
+
+    uint64_t nTotal = 0;
+    while (state.KeepRunning()) {
+        for (const CTransactionRef& tx : block.vtx) {
+            nTotal += tx->GetTotalSize();
+        }
+    }
+    assert(nTotal > 0);
+}
+
+BENCHMARK(DeserializeBlock);
+BENCHMARK(DeserializeBlockArena);
+BENCHMARK(BlockTransactionSizes);
@@ -0,0 +1,79 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "key.h"
+#include "keystore.h"
+#include "random.h"
+#include "script/ismine.h"
+#include "script/standard.h"
+
+#include <vector>
+
+static const int NUM_KEYS = 5000;
+static const int NUM_SCRIPTS = 1000;
+
+static void AddKeys(CBasicKeyStore& keystore, std::vector<CScript>& vOwned)
+{
+    for (int i = 0; i < NUM_KEYS; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        if (i < NUM_SCRIPTS)
+            vOwned.push_back(GetScriptForDestination(key.GetPubKey().GetID()));
+    }
+}
+
+// Scanning outputs paying to the wallet, as in a rescan.
+static void IsMineOwned(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    std::vector<CScript> vScripts;
+    AddKeys(keystore, vScripts);
+    while (state.KeepRunning()) {
+        for (const CScript& script : vScripts)
+            assert(IsMine(keystore, script) == ISMINE_SPENDABLE);
+    }
+}
+
+// Scanning outputs paying to others, the common case for a rescan.
+static void IsMineOther(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    std::vector<CScript> vOwned;
+    AddKeys(keystore, vOwned);
+    std::vector<CScript> vScripts;
+    for (int i = 0; i < NUM_SCRIPTS; i++) {
+        uint160 hash;
+        GetRandBytes(hash.begin(), hash.size());
+        vScripts.push_back(GetScriptForDestination(CKeyID(hash)));
+    }
+    while (state.KeepRunning()) {
+        for (const CScript& script : vScripts)
+            assert(IsMine(keystore, script) == ISMINE_NO);
+    }
+}
+
+// Watch-only outputs, which are still solved to tell whether they are solvable.
+static void IsMineWatched(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    std::vector<CScript> vOwned;
+    AddKeys(keystore, vOwned);
+    std::vector<CScript> vScripts;
+    for (int i = 0; i < NUM_SCRIPTS; i++) {
+        uint160 hash;
+        GetRandBytes(hash.begin(), hash.size());
+        vScripts.push_back(GetScriptForDestination(CKeyID(hash)));
+        keystore.AddWatchOnly(vScripts.back());
+    }
+    while (state.KeepRunning()) {
+        for (const CScript& script : vScripts)
+            assert(IsMine(keystore, script) == ISMINE_WATCH_UNSOLVABLE);
+    }
+}
+
+BENCHMARK(IsMineOwned);
+BENCHMARK(IsMineOther);
+BENCHMARK(IsMineWatched);
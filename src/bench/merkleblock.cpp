@@ -0,0 +1,80 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "bloom.h"
+#include "key.h"
+#include "merkleblock.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "script/standard.h"
+
+#include <vector>
+
+static const int NUM_TRANSACTIONS = 2000;
+static const int NUM_FILTERS = 8;
+
+// A block of P2PKH payments, roughly what a light wallet asks to have filtered.
+static CBlock CreateBlock()
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    for (int i = 0; i < NUM_TRANSACTIONS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        for (CTxIn& txin : tx.vin) {
+            txin.prevout = COutPoint(GetRandHash(), 0);
+            txin.scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+        }
+        tx.vout.resize(2);
+        for (CTxOut& txout : tx.vout)
+            txout.scriptPubKey = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, i & 0xff))));
+        block.vtx.push_back(MakeTransactionRef(tx));
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static std::vector<CBloomFilter> CreateFilters()
+{
+    std::vector<CBloomFilter> vFilters;
+    for (int i = 0; i < NUM_FILTERS; i++) {
+        CBloomFilter filter(20, 0.0001, GetRand(1 << 30), BLOOM_UPDATE_P2PUBKEY_ONLY);
+        for (int j = 0; j < 20; j++)
+            filter.insert(GetRandHash());
+        vFilters.push_back(filter);
+    }
+    return vFilters;
+}
+
+// Serving one block to several filtering peers, extracting the elements of
+// each transaction again for every peer.
+static void MerkleBlockUncached(benchmark::State& state)
+{
+    CBlock block = CreateBlock();
+    std::vector<CBloomFilter> vFilters = CreateFilters();
+    while (state.KeepRunning()) {
+        for (CBloomFilter& filter : vFilters)
+            CMerkleBlock merkleBlock(block, filter);
+    }
+}
+
+// The same, with the elements extracted once and shared between the peers.
+static void MerkleBlockCached(benchmark::State& state)
+{
+    CBlock block = CreateBlock();
+    std::vector<CBloomFilter> vFilters = CreateFilters();
+    CBloomElementsCache cache(1);
+    while (state.KeepRunning()) {
+        CBloomElementsCache::ElementsRef pElements = cache.Get(block);
+        for (CBloomFilter& filter : vFilters)
+            CMerkleBlock merkleBlock(block, *pElements, filter);
+    }
+}
+
+BENCHMARK(MerkleBlockUncached);
+BENCHMARK(MerkleBlockCached);
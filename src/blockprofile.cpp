@@ -0,0 +1,149 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "blockprofile.h"
+
+#include "primitives/transaction.h"
+
+#include <rust/metrics.h>
+
+CBlockProfiler blockProfiler;
+
+BlockProfileTxType GetBlockProfileTxType(const CTransaction& tx)
+{
+    if (!tx.vJoinSplit.empty()) {
+        return PROFILE_TX_SPROUT;
+    }
+    if (!(tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())) {
+        return PROFILE_TX_SAPLING;
+    }
+    return PROFILE_TX_TRANSPARENT;
+}
+
+const char* BlockProfileTxTypeName(BlockProfileTxType type)
+{
+    switch (type) {
+        case PROFILE_TX_TRANSPARENT: return "transparent";
+        case PROFILE_TX_SPROUT: return "sprout";
+        case PROFILE_TX_SAPLING: return "sapling";
+        default: return "unknown";
+    }
+}
+
+void CBlockProfile::AddTransaction(const CTransaction& tx)
+{
+    nTx[GetBlockProfileTxType(tx)]++;
+    nInputs += tx.vin.size();
+    nJoinSplits += tx.vJoinSplit.size();
+    nSaplingSpends += tx.vShieldedSpend.size();
+    nSaplingOutputs += tx.vShieldedOutput.size();
+}
+
+void CBlockProfile::AddProofTime(const CTransaction& tx, int64_t nMicros)
+{
+    BlockProfileTxType type = GetBlockProfileTxType(tx);
+    if (type == PROFILE_TX_SPROUT) {
+        nTimeJoinSplitProofs += nMicros;
+    } else if (type == PROFILE_TX_SAPLING) {
+        nTimeSaplingProofs += nMicros;
+    }
+    nTimeByType[type] += nMicros;
+}
+
+CBlockProfiler::CBlockProfiler(size_t nMaxProfilesIn) : nMaxProfiles(nMaxProfilesIn) {}
+
+void CBlockProfiler::SetMaxProfiles(size_t nMaxProfilesIn)
+{
+    LOCK(cs);
+    nMaxProfiles = nMaxProfilesIn;
+    while (profiles.size() > nMaxProfiles) {
+        profiles.pop_front();
+    }
+    if (nMaxProfiles == 0) {
+        mapPending.clear();
+    }
+}
+
+bool CBlockProfiler::IsEnabled() const
+{
+    LOCK(cs);
+    return nMaxProfiles > 0;
+}
+
+void CBlockProfiler::BlockAccepted(const CBlockProfile& accepted)
+{
+    LOCK(cs);
+    if (nMaxProfiles == 0) {
+        return;
+    }
+    // Blocks that are never connected would otherwise stay here forever.
+    // Evict an arbitrary entry; under normal operation the map holds only
+    // the blocks in flight.
+    if (mapPending.size() >= MAX_PENDING_BLOCK_PROFILES && !mapPending.count(accepted.hash)) {
+        mapPending.erase(mapPending.begin());
+    }
+    mapPending[accepted.hash] = accepted;
+}
+
+static void RecordMetrics(const CBlockProfile& profile)
+{
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeSaplingProofs * 0.000001, "phase", "sapling_proofs");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeJoinSplitProofs * 0.000001, "phase", "joinsplit_proofs");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeScripts * 0.000001, "phase", "scripts");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeUtxo * 0.000001, "phase", "utxo");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeTrees * 0.000001, "phase", "trees");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeHistory * 0.000001, "phase", "history");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeIndex * 0.000001, "phase", "index");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeFlush * 0.000001, "phase", "flush");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimeChainState * 0.000001, "phase", "chainstate");
+    MetricsHistogram("zcash.chain.connect.phase.seconds", profile.nTimePostConnect * 0.000001, "phase", "postconnect");
+
+    MetricsHistogram("zcash.chain.connect.tx.seconds", profile.nTimeByType[PROFILE_TX_TRANSPARENT] * 0.000001, "type", "transparent");
+    MetricsHistogram("zcash.chain.connect.tx.seconds", profile.nTimeByType[PROFILE_TX_SPROUT] * 0.000001, "type", "sprout");
+    MetricsHistogram("zcash.chain.connect.tx.seconds", profile.nTimeByType[PROFILE_TX_SAPLING] * 0.000001, "type", "sapling");
+    MetricsHistogram("zcash.chain.connect.tx.count", profile.nTx[PROFILE_TX_TRANSPARENT], "type", "transparent");
+    MetricsHistogram("zcash.chain.connect.tx.count", profile.nTx[PROFILE_TX_SPROUT], "type", "sprout");
+    MetricsHistogram("zcash.chain.connect.tx.count", profile.nTx[PROFILE_TX_SAPLING], "type", "sapling");
+}
+
+void CBlockProfiler::BlockConnected(CBlockProfile profile)
+{
+    {
+        LOCK(cs);
+        if (nMaxProfiles == 0) {
+            return;
+        }
+        auto it = mapPending.find(profile.hash);
+        if (it != mapPending.end()) {
+            profile.nTimeSaplingProofs += it->second.nTimeSaplingProofs;
+            profile.nTimeJoinSplitProofs += it->second.nTimeJoinSplitProofs;
+            for (int i = 0; i < PROFILE_TX_TYPES; i++) {
+                profile.nTimeByType[i] += it->second.nTimeByType[i];
+            }
+            mapPending.erase(it);
+        }
+        profiles.push_back(profile);
+        while (profiles.size() > nMaxProfiles) {
+            profiles.pop_front();
+        }
+    }
+    RecordMetrics(profile);
+}
+
+std::optional<CBlockProfile> CBlockProfiler::Get(const uint256& hash) const
+{
+    LOCK(cs);
+    for (auto it = profiles.rbegin(); it != profiles.rend(); ++it) {
+        if (it->hash == hash) {
+            return *it;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<CBlockProfile> CBlockProfiler::GetRecent() const
+{
+    LOCK(cs);
+    return std::vector<CBlockProfile>(profiles.rbegin(), profiles.rend());
+}
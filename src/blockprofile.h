@@ -0,0 +1,131 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_BLOCKPROFILE_H
+#define BITCOIN_BLOCKPROFILE_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <optional>
+#include <stdint.h>
+#include <vector>
+
+class CTransaction;
+
+/** Default for -blockprofiles, the number of connected blocks to keep profiles for. */
+static const unsigned int DEFAULT_BLOCK_PROFILES = 100;
+/**
+ * Maximum number of accepted but not yet connected blocks whose checks are
+ * remembered. Matches the block download window, so that checks done during
+ * initial block download are still attributed to their blocks.
+ */
+static const size_t MAX_PENDING_BLOCK_PROFILES = 1024;
+
+/** The kinds of transaction that block connection time is broken down by. */
+enum BlockProfileTxType {
+    PROFILE_TX_TRANSPARENT = 0,
+    /** Has at least one JoinSplit, including Sprout to Sapling migrations. */
+    PROFILE_TX_SPROUT,
+    /** Has Sapling spends or outputs and no JoinSplits. */
+    PROFILE_TX_SAPLING,
+    PROFILE_TX_TYPES
+};
+
+BlockProfileTxType GetBlockProfileTxType(const CTransaction& tx);
+const char* BlockProfileTxTypeName(BlockProfileTxType type);
+
+/**
+ * Where the time went while a block was checked and connected. All times are
+ * in microseconds.
+ */
+struct CBlockProfile
+{
+    uint256 hash;
+    int nHeight = -1;
+    /** When the block was connected, in seconds since the epoch. */
+    int64_t nTimeConnected = 0;
+
+    unsigned int nTx[PROFILE_TX_TYPES] = {};
+    unsigned int nInputs = 0;
+    unsigned int nJoinSplits = 0;
+    unsigned int nSaplingSpends = 0;
+    unsigned int nSaplingOutputs = 0;
+
+    /** Sapling proofs and signatures, checked when the block was accepted. */
+    int64_t nTimeSaplingProofs = 0;
+    /** JoinSplit proofs, checked when connecting, and JoinSplit signatures. */
+    int64_t nTimeJoinSplitProofs = 0;
+    /** Transparent scripts, including waiting for the script check threads. */
+    int64_t nTimeScripts = 0;
+    /** Coin and nullifier lookups, input values and coin updates. */
+    int64_t nTimeUtxo = 0;
+    /** Appending note commitments to the Sprout and Sapling trees. */
+    int64_t nTimeTrees = 0;
+    /** Checking the light client root and appending to the history tree. */
+    int64_t nTimeHistory = 0;
+    /** Writing undo data and the enabled indexes. */
+    int64_t nTimeIndex = 0;
+    /** All of ConnectBlock; checks done when the block was accepted are not included. */
+    int64_t nTimeConnect = 0;
+    /** Flushing the block's coins into the coins cache. */
+    int64_t nTimeFlush = 0;
+    /** Writing the chainstate to disk, when that was needed. */
+    int64_t nTimeChainState = 0;
+    /** Mempool updates and notifications after connecting. */
+    int64_t nTimePostConnect = 0;
+    /** All of ConnectTip. */
+    int64_t nTimeTotal = 0;
+
+    /**
+     * Time spent on each kind of transaction in the proof, script and UTXO
+     * phases. Script checks run on the script check threads are not included.
+     */
+    int64_t nTimeByType[PROFILE_TX_TYPES] = {};
+
+    /** Count a transaction of the block. */
+    void AddTransaction(const CTransaction& tx);
+    /** Record microseconds spent checking proofs of a transaction. */
+    void AddProofTime(const CTransaction& tx, int64_t nMicros);
+};
+
+/**
+ * Keeps the profiles of the most recently connected blocks.
+ *
+ * Sapling proofs are checked when a block is accepted, which may be long
+ * before it is connected, so those timings are held per block hash until the
+ * block is connected and then merged into its profile.
+ */
+class CBlockProfiler
+{
+private:
+    mutable CCriticalSection cs;
+    size_t nMaxProfiles;
+    /** Profiles of connected blocks, oldest first. */
+    std::deque<CBlockProfile> profiles;
+    /** Checks done when accepting blocks that are not connected yet. */
+    std::map<uint256, CBlockProfile> mapPending;
+
+public:
+    explicit CBlockProfiler(size_t nMaxProfilesIn = DEFAULT_BLOCK_PROFILES);
+
+    /** Set how many profiles to keep; 0 disables profiling. */
+    void SetMaxProfiles(size_t nMaxProfilesIn);
+    bool IsEnabled() const;
+
+    /** Remember the checks done when a block was accepted. */
+    void BlockAccepted(const CBlockProfile& accepted);
+    /** Store the profile of a connected block and record it as metrics. */
+    void BlockConnected(CBlockProfile profile);
+
+    std::optional<CBlockProfile> Get(const uint256& hash) const;
+    /** Returns the stored profiles, most recently connected first. */
+    std::vector<CBlockProfile> GetRecent() const;
+};
+
+extern CBlockProfiler blockProfiler;
+
+#endif // BITCOIN_BLOCKPROFILE_H
@@ -5,6 +5,7 @@
 #include "bloom.h"
 
 #include "primitives/transaction.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "script/script.h"
 #include "script/standard.h"
@@ -37,10 +38,54 @@ CBloomFilter::CBloomFilter(const unsigned int nElements, const double nFPRate, c
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+CBloomElements::CBloomElements(const CTransaction& tx) : hash(tx.GetHash())
+{
+    std::vector<unsigned char> data;
+    vOutputs.reserve(tx.vout.size());
+    for (const CTxOut& txout : tx.vout) {
+        CScript::const_iterator pc = txout.scriptPubKey.begin();
+        while (pc < txout.scriptPubKey.end()) {
+            opcodetype opcode;
+            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                AddElement(data.data(), data.size());
+        }
+        txnouttype type;
+        std::vector<std::vector<unsigned char> > vSolutions;
+        bool fPayToPubKey = Solver(txout.scriptPubKey, type, vSolutions) &&
+            (type == TX_PUBKEY || type == TX_MULTISIG);
+        vOutputs.push_back({(uint32_t)vElementEnd.size(), fPayToPubKey});
+    }
+
+    for (const CTxIn& txin : tx.vin) {
+        // Serialized as in CBloomFilter::contains(const COutPoint&).
+        unsigned char prevout[36];
+        memcpy(prevout, txin.prevout.hash.begin(), 32);
+        WriteLE32(prevout + 32, txin.prevout.n);
+        AddElement(prevout, sizeof(prevout));
+
+        CScript::const_iterator pc = txin.scriptSig.begin();
+        while (pc < txin.scriptSig.end()) {
+            opcodetype opcode;
+            if (!txin.scriptSig.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                AddElement(data.data(), data.size());
+        }
+    }
+}
+
+void CBloomElements::AddElement(const unsigned char* pch, size_t nLen)
+{
+    vch.insert(vch.end(), pch, pch + nLen);
+    vElementEnd.push_back(vch.size());
+}
+
+inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const unsigned char* pDataToHash, size_t nDataLen) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, pDataToHash, nDataLen) % (vData.size() * 8);
 }
 
 void CBloomFilter::insert(const std::vector<unsigned char>& vKey)
@@ -49,7 +94,7 @@ void CBloomFilter::insert(const std::vector<unsigned char>& vKey)
         return;
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, vKey.data(), vKey.size());
         // Sets bit nIndex of vData
         vData[nIndex >> 3] |= (1 << (7 & nIndex));
     }
@@ -70,12 +115,17 @@ void CBloomFilter::insert(const uint256& hash)
 }
 
 bool CBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(vKey.data(), vKey.size());
+}
+
+bool CBloomFilter::contains(const unsigned char* pKey, size_t nKeyLen) const
 {
     if (vData.empty()) // Avoid divide-by-zero (CVE-2013-5700)
         return true;
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, pKey, nKeyLen);
         // Checks bit nIndex of vData
         if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
             return false;
@@ -93,8 +143,7 @@ bool CBloomFilter::contains(const COutPoint& outpoint) const
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    std::vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 bool CBloomFilter::IsWithinSizeConstraints() const
@@ -103,68 +152,54 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (vData.empty()) // zero-size = "match-all" filter
+        return true;
+    return IsRelevantAndUpdate(CBloomElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
     //  for finding tx when they appear in a block
     if (vData.empty()) // zero-size = "match-all" filter
         return true;
-    const uint256& hash = tx.GetHash();
-    if (contains(hash))
+    if (contains(elements.hash))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    size_t n = 0;
+    for (unsigned int i = 0; i < elements.vOutputs.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
+        const CBloomElements::Output& output = elements.vOutputs[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        std::vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (; n < output.nElementsEnd; n++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.GetElement(n), elements.GetElementSize(n)))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    std::vector<std::vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                    insert(COutPoint(elements.hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && output.fPayToPubKey)
+                    insert(COutPoint(elements.hash, i));
                 break;
             }
         }
+        n = output.nElementsEnd;
     }
 
     if (fFound)
         return true;
 
-    for (const CTxIn& txin : tx.vin)
+    // Match if the filter contains an outpoint tx spends, or any arbitrary
+    // script data element in any scriptSig in tx
+    for (; n < elements.size(); n++)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(elements.GetElement(n), elements.GetElementSize(n)))
             return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        std::vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
     }
 
     return false;
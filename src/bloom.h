@@ -6,12 +6,12 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -30,6 +30,41 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that a CBloomFilter is matched against:
+ * its txid, the pushes in each scriptPubKey, and the outpoint and scriptSig
+ * pushes of each input. Extracting them once lets any number of filters be
+ * matched against a transaction without parsing its scripts again.
+ */
+class CBloomElements
+{
+public:
+    struct Output {
+        //! One past the index of this output's last element.
+        uint32_t nElementsEnd;
+        //! Whether the output is pay-to-pubkey or multisig, for BLOOM_UPDATE_P2PUBKEY_ONLY.
+        bool fPayToPubKey;
+    };
+
+    uint256 hash;
+    //! The elements of every output, followed by those of every input.
+    std::vector<Output> vOutputs;
+
+    explicit CBloomElements(const CTransaction& tx);
+
+    size_t size() const { return vElementEnd.size(); }
+    const unsigned char* GetElement(size_t n) const { return vch.data() + GetElementBegin(n); }
+    size_t GetElementSize(size_t n) const { return vElementEnd[n] - GetElementBegin(n); }
+
+private:
+    //! Every element, back to back.
+    std::vector<unsigned char> vch;
+    std::vector<uint32_t> vElementEnd;
+
+    uint32_t GetElementBegin(size_t n) const { return n ? vElementEnd[n - 1] : 0; }
+    void AddElement(const unsigned char* pch, size_t nLen);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -49,7 +84,9 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(unsigned int nHashNum, const unsigned char* pDataToHash, size_t nDataLen) const;
+
+    bool contains(const unsigned char* pKey, size_t nKeyLen) const;
 
 public:
     /**
@@ -88,6 +125,7 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    bool IsRelevantAndUpdate(const CBloomElements& elements);
 };
 
 /**
@@ -41,7 +41,7 @@ static CBlock CreateGenesisBlock(const char* pszTimestamp, const CScript& genesi
     genesis.nNonce   = nNonce;
     genesis.nSolution = nSolution;
     genesis.nVersion = nVersion;
-    genesis.vtx.push_back(txNew);
+    genesis.vtx.push_back(MakeTransactionRef(std::move(txNew)));
     genesis.hashPrevBlock.SetNull();
     genesis.hashMerkleRoot = genesis.BuildMerkleTree();
     return genesis;
@@ -190,6 +190,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0000000000000000000000000000000000000000000000000152d608a8c7cab7");
 
+        // By default assume that the proofs and signatures in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x00000543378a75f173914390c672838c9fbd9dc86ae647ffae18ed6b626edb30"); // 1035353
+
         /**
          * The message start string should be awesome! ⓩ❤
          */
@@ -246,6 +249,10 @@ public:
                             //   total number of tx / (checkpoint block height / (24 * 24))
         };
 
+        // No chainstate snapshot hashes have been published yet, so
+        // -loadsnapshot needs -snapshothash on every network.
+        mapAssumeutxo = {};
+
         // Hardcoded fallback value for the Sprout shielded value pool balance
         // for nodes that have not reindexed since the introduction of monitoring
         // in #2795.
@@ -450,6 +457,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x0000000000000000000000000000000000000000000000000000001959b78e6f");
 
+        // By default assume that the proofs and signatures in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x005dd2092f75382581468e870b51233a8950bf9c396689c513e5a80f00c14609"); // 650000
+
         pchMessageStart[0] = 0xfa;
         pchMessageStart[1] = 0x1a;
         pchMessageStart[2] = 0xf9;
@@ -636,6 +646,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00");
 
+        // By default assume that the proofs and signatures in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         pchMessageStart[0] = 0xaa;
         pchMessageStart[1] = 0xe8;
         pchMessageStart[2] = 0x3f;
@@ -32,6 +32,14 @@ struct CCheckpointData {
     double fTransactionsPerDay;
 };
 
+/** A chainstate snapshot known to be good, as reported by dumptxoutset. */
+struct CAssumeutxoData {
+    uint256 hashBlock;
+    uint256 hashSnapshot;
+};
+
+typedef std::map<int, CAssumeutxoData> MapAssumeutxo;
+
 class CBaseKeyConstants : public KeyConstants {
 public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
@@ -90,6 +98,8 @@ public:
     }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
+    /** Chainstate snapshots that -loadsnapshot accepts without -snapshothash, by height */
+    const MapAssumeutxo& Assumeutxo() const { return mapAssumeutxo; }
     /** Return the founder's reward address and script for a given block height */
     std::string GetFoundersRewardAddressAtHeight(int height) const;
     CScript GetFoundersRewardScriptAtHeight(int height) const;
@@ -119,6 +129,7 @@ protected:
     bool fMineBlocksOnDemand = false;
     bool fTestnetToBeDeprecatedFieldRPC = false;
     CCheckpointData checkpointData;
+    MapAssumeutxo mapAssumeutxo;
     std::vector<std::string> vFoundersRewardAddress;
     std::vector<std::string> vYcashFoundersRewardAddress;
 
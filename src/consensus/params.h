@@ -357,6 +357,11 @@ struct Params {
     int64_t MaxActualTimespan(int nHeight) const;
 
     uint256 nMinimumChainWork;
+    /**
+     * By default assume that the proofs and signatures in ancestors of this
+     * block are valid (see -assumevalid).
+     */
+    uint256 defaultAssumeValid;
 };
 } // namespace Consensus
 
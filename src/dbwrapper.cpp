@@ -13,16 +13,68 @@
 #include <memenv.h>
 #include <stdint.h>
 
+#include <algorithm>
+
 #include <boost/scoped_ptr.hpp>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CDBProfile CDBProfile::Chainstate(int nMaxOpenFiles, bool fCompression)
+{
+    CDBProfile profile;
+    profile.strName = "chainstate";
+    profile.fCompression = fCompression;
+    profile.nMaxOpenFiles = nMaxOpenFiles;
+    return profile;
+}
+
+CDBProfile CDBProfile::Index(int nMaxOpenFiles, bool fCompression)
+{
+    CDBProfile profile;
+    profile.strName = "index";
+    profile.fCompression = fCompression;
+    // Larger blocks compress better and suit the range scans of the address
+    // and spent indexes; point lookups are still served by the bloom filter.
+    profile.nBlockSize = 16 * 1024;
+    profile.nMaxOpenFiles = nMaxOpenFiles;
+    return profile;
+}
+
+bool IsDBCompressionSupported()
+{
+    static const bool fSupported = []() {
+        leveldb::Env* penv = leveldb::NewMemEnv(leveldb::Env::Default());
+        leveldb::Options options;
+        options.env = penv;
+        options.create_if_missing = true;
+        options.compression = leveldb::kSnappyCompression;
+        bool fCompressed = false;
+        leveldb::DB* pdb;
+        if (leveldb::DB::Open(options, "compression-probe", &pdb).ok()) {
+            // 64 KiB of zeroes shrinks to a few KiB with Snappy.
+            const size_t nValueSize = 64 * 1024;
+            if (pdb->Put(leveldb::WriteOptions(), "k", std::string(nValueSize, '\0')).ok()) {
+                pdb->CompactRange(NULL, NULL);
+                leveldb::Range range("a", "z");
+                uint64_t nSize = 0;
+                pdb->GetApproximateSizes(&range, 1, &nSize);
+                fCompressed = nSize > 0 && nSize < nValueSize / 2;
+            }
+            delete pdb;
+        }
+        delete penv;
+        return fCompressed;
+    }();
+    return fSupported;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBProfile& profile)
 {
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
     options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
+    options.compression = profile.fCompression && IsDBCompressionSupported() ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.block_size = profile.nBlockSize;
+    options.max_open_files = std::max(profile.nMaxOpenFiles, DB_MIN_OPEN_FILES);
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +83,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CDBWrapper::CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profileIn) : profile(profileIn)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -50,7 +102,12 @@ CDBWrapper::CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory, bo
             dbwrapper_private::HandleError(result);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        if (profile.fCompression && !IsCompressed()) {
+            LogPrintf("Warning: the %s profile asks for Snappy compression, but LevelDB was built without it; storing %s uncompressed\n",
+                profile.strName, path.string());
+        }
+        LogPrintf("Opening LevelDB in %s (%s profile, compression %s, max %d open files)\n", path.string(),
+            profile.strName, IsCompressed() ? "on" : "off", options.max_open_files);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
@@ -76,6 +133,11 @@ bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
     return true;
 }
 
+bool CDBWrapper::GetProperty(const std::string& property, std::string& value) const
+{
+    return pdb->GetProperty(property, &value);
+}
+
 bool CDBWrapper::IsEmpty()
 {
     boost::scoped_ptr<CDBIterator> it(NewIterator());
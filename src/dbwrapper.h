@@ -18,6 +18,11 @@
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
 
+//! Number of table files each database may keep open when no budget is given
+static const int DB_MIN_OPEN_FILES = 64;
+//! Upper bound on the number of table files a single database keeps open
+static const int DB_MAX_OPEN_FILES = 1000;
+
 class dbwrapper_error : public std::runtime_error
 {
 public:
@@ -26,6 +31,38 @@ public:
 
 class CDBWrapper;
 
+/**
+ * LevelDB tuning for one database. The chainstate is dominated by point
+ * lookups of small records that are already compressed, while the block
+ * index (and the -insightexplorer indexes stored with it) grows large and is
+ * mostly scanned in key order, so they are tuned separately.
+ */
+struct CDBProfile
+{
+    //! Short name used in log messages and getdbstats
+    std::string strName;
+    //! Snappy-compress table blocks, if LevelDB is built with Snappy
+    bool fCompression;
+    //! Bloom filter bits per key, or 0 for no filter
+    int nBloomBits;
+    //! Approximate amount of user data packed per table block
+    size_t nBlockSize;
+    //! Maximum number of table files kept open
+    int nMaxOpenFiles;
+
+    CDBProfile() : strName("default"), fCompression(false), nBloomBits(10), nBlockSize(4096), nMaxOpenFiles(DB_MIN_OPEN_FILES) {}
+
+    static CDBProfile Chainstate(int nMaxOpenFiles = DB_MIN_OPEN_FILES, bool fCompression = false);
+    static CDBProfile Index(int nMaxOpenFiles = DB_MIN_OPEN_FILES, bool fCompression = true);
+};
+
+/**
+ * Whether the LevelDB we are linked against compresses with Snappy. Without
+ * it, LevelDB silently stores blocks uncompressed, so this is found out once
+ * by writing a compressible value to an in-memory database.
+ */
+bool IsDBCompressionSupported();
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -45,11 +82,19 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -65,6 +110,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -76,7 +129,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -165,16 +226,33 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! tuning profile the database was opened with
+    CDBProfile profile;
+
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
      * @param[in] nCacheSize  Configures various leveldb cache settings.
      * @param[in] fMemory     If true, use leveldb's memory environment.
      * @param[in] fWipe       If true, remove all existing data.
+     * @param[in] profileIn   Compression, bloom filter and file handle settings.
      */
-    CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profileIn = CDBProfile());
     ~CDBWrapper();
 
+    /** The profile the database was requested with. */
+    const CDBProfile& GetProfile() const { return profile; }
+    /** Whether table blocks are actually compressed. */
+    bool IsCompressed() const { return options.compression != leveldb::kNoCompression; }
+    /** The number of table files LevelDB may keep open, after clamping. */
+    int GetMaxOpenFiles() const { return options.max_open_files; }
+
+    /**
+     * Query one of LevelDB's internal properties, such as "leveldb.stats"
+     * or "leveldb.num-files-at-level<N>".
+     */
+    bool GetProperty(const std::string& property, std::string& value) const;
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const
     {
@@ -258,6 +336,22 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Compact a certain range of keys in the database.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+
+#include "arith_uint256.h"
+#include "blockprofile.h"
+#include "primitives/transaction.h"
+
+static CBlockProfile MakeProfile(int nHeight)
+{
+    CBlockProfile profile;
+    profile.hash = ArithToUint256(nHeight + 1);
+    profile.nHeight = nHeight;
+    return profile;
+}
+
+TEST(BlockProfile, TransactionTypes) {
+    CMutableTransaction mtx;
+    mtx.vin.resize(2);
+    EXPECT_EQ(PROFILE_TX_TRANSPARENT, GetBlockProfileTxType(CTransaction(mtx)));
+
+    mtx.vShieldedOutput.resize(1);
+    EXPECT_EQ(PROFILE_TX_SAPLING, GetBlockProfileTxType(CTransaction(mtx)));
+
+    // Migration transactions count as Sprout, as their JoinSplit proofs
+    // dominate.
+    mtx.vJoinSplit.resize(1);
+    EXPECT_EQ(PROFILE_TX_SPROUT, GetBlockProfileTxType(CTransaction(mtx)));
+
+    CTransaction tx(mtx);
+    CBlockProfile profile;
+    profile.AddTransaction(tx);
+    profile.AddProofTime(tx, 50);
+    EXPECT_EQ(1, profile.nTx[PROFILE_TX_SPROUT]);
+    EXPECT_EQ(2, profile.nInputs);
+    EXPECT_EQ(1, profile.nJoinSplits);
+    EXPECT_EQ(1, profile.nSaplingOutputs);
+    EXPECT_EQ(50, profile.nTimeJoinSplitProofs);
+    EXPECT_EQ(0, profile.nTimeSaplingProofs);
+    EXPECT_EQ(50, profile.nTimeByType[PROFILE_TX_SPROUT]);
+}
+
+TEST(BlockProfile, RingBuffer) {
+    CBlockProfiler profiler(3);
+    for (int i = 0; i < 5; i++) {
+        profiler.BlockConnected(MakeProfile(i));
+    }
+
+    auto recent = profiler.GetRecent();
+    ASSERT_EQ(3, recent.size());
+    EXPECT_EQ(4, recent[0].nHeight);
+    EXPECT_EQ(2, recent[2].nHeight);
+    EXPECT_FALSE(profiler.Get(MakeProfile(1).hash));
+    ASSERT_TRUE(profiler.Get(MakeProfile(3).hash));
+    EXPECT_EQ(3, profiler.Get(MakeProfile(3).hash)->nHeight);
+
+    profiler.SetMaxProfiles(1);
+    EXPECT_EQ(1, profiler.GetRecent().size());
+
+    profiler.SetMaxProfiles(0);
+    EXPECT_FALSE(profiler.IsEnabled());
+    profiler.BlockConnected(MakeProfile(5));
+    EXPECT_TRUE(profiler.GetRecent().empty());
+}
+
+TEST(BlockProfile, MergesAcceptedChecks) {
+    CBlockProfiler profiler;
+
+    CBlockProfile accepted = MakeProfile(10);
+    accepted.nTimeSaplingProofs = 700;
+    accepted.nTimeByType[PROFILE_TX_SAPLING] = 700;
+    profiler.BlockAccepted(accepted);
+
+    CBlockProfile connected = MakeProfile(10);
+    connected.nTimeScripts = 30;
+    connected.nTimeByType[PROFILE_TX_SAPLING] = 20;
+    profiler.BlockConnected(connected);
+
+    auto profile = profiler.Get(accepted.hash);
+    ASSERT_TRUE(profile);
+    EXPECT_EQ(700, profile->nTimeSaplingProofs);
+    EXPECT_EQ(30, profile->nTimeScripts);
+    EXPECT_EQ(720, profile->nTimeByType[PROFILE_TX_SAPLING]);
+
+    // The accepted checks are only merged once.
+    profiler.BlockConnected(connected);
+    EXPECT_EQ(0, profiler.GetRecent()[0].nTimeSaplingProofs);
+}
@@ -57,7 +57,7 @@ TEST(CheckBlock, BlockSproutRejectsBadVersion) {
 
     CTransaction tx {mtx};
     CBlock block;
-    block.vtx.push_back(tx);
+    block.vtx.push_back(MakeTransactionRef(tx));
 
     MockCValidationState state;
     CBlockIndex indexPrev {Params().GenesisBlock()};
@@ -112,7 +112,7 @@ protected:
     void ExpectValidBlockFromTx(const CTransaction& tx) {
         // Create a block and add the transaction to it.
         CBlock block;
-        block.vtx.push_back(tx);
+        block.vtx.push_back(MakeTransactionRef(tx));
 
         // Set the previous block index to the genesis block.
         CBlockIndex indexPrev {Params().GenesisBlock()};
@@ -129,7 +129,7 @@ protected:
     void ExpectInvalidBlockFromTx(const CTransaction& tx, int level, std::string reason) {
         // Create a block and add the transaction to it.
         CBlock block;
-        block.vtx.push_back(tx);
+        block.vtx.push_back(MakeTransactionRef(tx));
 
         // Set the previous block index to the genesis block.
         CBlockIndex indexPrev {Params().GenesisBlock()};
@@ -150,7 +150,7 @@ TEST_F(ContextualCheckBlockTest, BadCoinbaseHeight) {
     mtx.vout.pop_back(); // remove the FR output
 
     CBlock block;
-    block.vtx.push_back(mtx);
+    block.vtx.push_back(MakeTransactionRef(mtx));
 
     // Treating block as genesis should pass
     MockCValidationState state;
@@ -163,7 +163,7 @@ TEST_F(ContextualCheckBlockTest, BadCoinbaseHeight) {
 
     // Treating block as non-genesis should fail
     CTransaction tx2 {mtx};
-    block.vtx[0] = tx2;
+    block.vtx[0] = MakeTransactionRef(tx2);
     CBlock prev;
     CBlockIndex indexPrev {prev};
     indexPrev.nHeight = 0;
@@ -173,14 +173,14 @@ TEST_F(ContextualCheckBlockTest, BadCoinbaseHeight) {
     // Setting to an incorrect height should fail
     mtx.vin[0].scriptSig = CScript() << 2 << OP_0;
     CTransaction tx3 {mtx};
-    block.vtx[0] = tx3;
+    block.vtx[0] = MakeTransactionRef(tx3);
     EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-cb-height", false)).Times(1);
     EXPECT_FALSE(ContextualCheckBlock(block, state, Params(), &indexPrev, true));
 
     // After correcting the scriptSig, should pass
     mtx.vin[0].scriptSig = CScript() << 1 << OP_0;
     CTransaction tx4 {mtx};
-    block.vtx[0] = tx4;
+    block.vtx[0] = MakeTransactionRef(tx4);
     EXPECT_TRUE(ContextualCheckBlock(block, state, Params(), &indexPrev, true));
 }
 
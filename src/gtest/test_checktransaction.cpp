@@ -535,6 +535,34 @@ TEST(ChecktransactionTests, BadTxnsInvalidJoinsplitSignature) {
     ContextualCheckTransaction(tx, state, chainparams, 0, true, [](const Consensus::Params&) { return false; });
 }
 
+TEST(ChecktransactionTests, AssumeValidSkipsJoinsplitSignature) {
+    SelectParams(CBaseChainParams::REGTEST);
+    auto chainparams = Params();
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.joinSplitSig.bytes[0] += 1;
+    CTransaction tx(mtx);
+
+    // Blocks covered by -assumevalid don't check the JoinSplit signature.
+    MockCValidationState state;
+    EXPECT_CALL(state, DoS(::testing::_, ::testing::_, ::testing::_, ::testing::_, ::testing::_)).Times(0);
+    EXPECT_TRUE(ContextualCheckTransaction(
+        tx, state, chainparams, 0, true,
+        [](const Consensus::Params&) { return true; }, false));
+
+    // The other contextual rules are still enforced.
+    mtx.joinSplitSig.bytes[0] -= 1;
+    mtx.fOverwintered = true;
+    mtx.nVersion = OVERWINTER_TX_VERSION;
+    mtx.nVersionGroupId = OVERWINTER_VERSION_GROUP_ID;
+    mtx.nExpiryHeight = 0;
+    CTransaction tx2(mtx);
+    EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "tx-overwinter-not-active", false)).Times(1);
+    EXPECT_FALSE(ContextualCheckTransaction(
+        tx2, state, chainparams, 0, true,
+        [](const Consensus::Params&) { return true; }, false));
+}
+
 TEST(ChecktransactionTests, JoinsplitSignatureDetectsOldBranchId) {
     SelectParams(CBaseChainParams::REGTEST);
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, 1);
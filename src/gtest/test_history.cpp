@@ -21,11 +21,11 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         return false;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
+    bool HaveCoin(const COutPoint &outpoint) const {
         return false;
     }
 
@@ -203,3 +203,25 @@ TEST(History, GarbageMemoryHash) {
     // Check history root and garbage history root are equal
     EXPECT_EQ(historyRoot, historyRootGarbage);
 }
+
+TEST(History, PeakPositions) {
+    // A tree with 14 leaves has 25 nodes and peaks of altitude 3, 2 and 1.
+    std::vector<std::pair<uint32_t, uint32_t>> positions;
+    EXPECT_EQ(libzcash::GetPeakPositions(25, false, positions), 3);
+    std::vector<std::pair<uint32_t, uint32_t>> peaks = {{14, 3}, {21, 2}, {24, 1}};
+    EXPECT_EQ(positions, peaks);
+
+    // The extra nodes are the children along the right slope of the last peak.
+    positions.clear();
+    EXPECT_EQ(libzcash::GetPeakPositions(25, true, positions), 3);
+    std::vector<std::pair<uint32_t, uint32_t>> withExtra = {{14, 3}, {21, 2}, {24, 1}, {22, 0}, {23, 0}};
+    EXPECT_EQ(positions, withExtra);
+
+    // A single leaf is its own peak.
+    positions.clear();
+    EXPECT_EQ(libzcash::GetPeakPositions(1, true, positions), 1);
+    EXPECT_EQ(positions.size(), 1);
+    EXPECT_EQ(positions[0].first, 0);
+
+    EXPECT_THROW(libzcash::GetPeakPositions(0, false, positions), std::runtime_error);
+}
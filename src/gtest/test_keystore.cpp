@@ -4,6 +4,8 @@
 
 #include "keystore.h"
 #include "random.h"
+#include "script/ismine.h"
+#include "script/standard.h"
 #ifdef ENABLE_WALLET
 #include "wallet/crypter.h"
 #endif
@@ -273,6 +275,57 @@ TEST(KeystoreTests, StoreAndRetrieveSaplingFullViewingKey) {
     EXPECT_TRUE(addresses.count(addr));
 }
 
+TEST(KeystoreTests, ScriptOwnership) {
+    CBasicKeyStore keyStore;
+    ScriptOwnership ownership;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CScript p2pkh = GetScriptForDestination(pubkey.GetID());
+    CScript p2pk = GetScriptForRawPubKey(pubkey);
+
+    // Only pay-to-pubkey(-hash) scripts are in the table
+    EXPECT_FALSE(keyStore.GetScriptOwnership(GetScriptForDestination(CScriptID(p2pkh)), ownership));
+    EXPECT_FALSE(keyStore.GetScriptOwnership(CScript() << OP_RETURN, ownership));
+    ASSERT_TRUE(keyStore.GetScriptOwnership(p2pkh, ownership));
+    EXPECT_EQ(ScriptOwnership::NONE, ownership);
+    EXPECT_EQ(ISMINE_NO, IsMine(keyStore, p2pkh));
+
+    // Watch-only scripts are still solved by IsMine
+    ASSERT_TRUE(keyStore.AddWatchOnly(p2pkh));
+    ASSERT_TRUE(keyStore.GetScriptOwnership(p2pkh, ownership));
+    EXPECT_EQ(ScriptOwnership::WATCHED, ownership);
+    EXPECT_EQ(ISMINE_WATCH_UNSOLVABLE, IsMine(keyStore, p2pkh));
+    ASSERT_TRUE(keyStore.AddWatchOnly(p2pk));
+    EXPECT_EQ(ISMINE_WATCH_SOLVABLE, IsMine(keyStore, p2pkh));
+    EXPECT_EQ(ISMINE_WATCH_SOLVABLE, IsMine(keyStore, p2pk));
+
+    // Adding the key makes both scripts spendable
+    ASSERT_TRUE(keyStore.AddKey(key));
+    ASSERT_TRUE(keyStore.GetScriptOwnership(p2pkh, ownership));
+    EXPECT_EQ(ScriptOwnership::SPENDABLE, ownership);
+    ASSERT_TRUE(keyStore.GetScriptOwnership(p2pk, ownership));
+    EXPECT_EQ(ScriptOwnership::SPENDABLE, ownership);
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, p2pkh));
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, p2pk));
+
+    // ... and removing the watch-only script leaves them spendable
+    ASSERT_TRUE(keyStore.RemoveWatchOnly(p2pkh));
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, p2pkh));
+
+    // Removing a watch-only script without a key drops it from the table
+    CKey key2;
+    key2.MakeNewKey(false);
+    CScript p2pk2 = GetScriptForRawPubKey(key2.GetPubKey());
+    ASSERT_TRUE(keyStore.AddWatchOnly(p2pk2));
+    EXPECT_EQ(ISMINE_WATCH_SOLVABLE, IsMine(keyStore, p2pk2));
+    ASSERT_TRUE(keyStore.RemoveWatchOnly(p2pk2));
+    ASSERT_TRUE(keyStore.GetScriptOwnership(p2pk2, ownership));
+    EXPECT_EQ(ScriptOwnership::NONE, ownership);
+    EXPECT_EQ(ISMINE_NO, IsMine(keyStore, p2pk2));
+}
+
 #ifdef ENABLE_WALLET
 class TestCCryptoKeyStore : public CCryptoKeyStore
 {
@@ -415,4 +468,29 @@ TEST(KeystoreTests, StoreAndRetrieveSpendingKeyInEncryptedStore) {
     ASSERT_EQ(1, addrs.count(addr));
     ASSERT_EQ(1, addrs.count(addr2));
 }
+
+TEST(KeystoreTests, ScriptOwnershipInEncryptedStore) {
+    TestCCryptoKeyStore keyStore;
+    CKeyingMaterial vMasterKey(32, 0);
+    GetRandBytes(vMasterKey.data(), 32);
+
+    CKey key;
+    key.MakeNewKey(true);
+    ASSERT_TRUE(keyStore.AddKey(key));
+    CScript p2pkh = GetScriptForDestination(key.GetPubKey().GetID());
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, p2pkh));
+
+    // Keys stay spendable when they are encrypted, and while locked
+    ASSERT_TRUE(keyStore.EncryptKeys(vMasterKey));
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, p2pkh));
+    ASSERT_TRUE(keyStore.Lock());
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, p2pkh));
+
+    // Keys added after encryption are in the table too
+    ASSERT_TRUE(keyStore.Unlock(vMasterKey));
+    CKey key2;
+    key2.MakeNewKey(true);
+    ASSERT_TRUE(keyStore.AddKey(key2));
+    EXPECT_EQ(ISMINE_SPENDABLE, IsMine(keyStore, GetScriptForRawPubKey(key2.GetPubKey())));
+}
 #endif
@@ -31,19 +31,18 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
+        if (outpoint.n != 0) {
+            return false;
+        }
         CTxOut txOut;
         txOut.nValue = 4288035;
-        CCoins newCoins;
-        newCoins.vout.resize(2);
-        newCoins.vout[0] = txOut;
-        newCoins.nHeight = 92045;
-        coins.swap(newCoins);
+        coin = Coin(txOut, 92045, false);
         return true;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        return true;
+    bool HaveCoin(const COutPoint &outpoint) const {
+        return outpoint.n == 0;
     }
 
     uint256 GetBestBlock() const {
@@ -94,7 +93,7 @@ TEST(Mempool, PriorityStatsDoNotCrash) {
     unsigned int nHeight = 92045;
     double dPriority = view.GetPriority(tx, nHeight);
 
-    CTxMemPoolEntry entry(tx, nFees, nTime, dPriority, nHeight, true, false, SPROUT_BRANCH_ID);
+    CTxMemPoolEntry entry(MakeTransactionRef(tx), nFees, nTime, dPriority, nHeight, true, false, SPROUT_BRANCH_ID);
 
     // Check it does not crash (ie. the death test fails)
     EXPECT_NONFATAL_FAILURE(EXPECT_DEATH(testPool.addUnchecked(tx.GetHash(), entry), ""), "");
@@ -126,6 +125,45 @@ TEST(Mempool, OverwinterNotActiveYet) {
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
 }
 
+// A transaction checked ahead of AcceptToMemoryPool is rejected for the same
+// reason, and a check done for another block height is not trusted.
+TEST(Mempool, PreVerifiedTransaction) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+
+    CTxMemPool pool(::minRelayTxFee);
+    bool missingInputs;
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.vJoinSplit.resize(0); // no joinsplits
+    mtx.fOverwintered = true;
+    mtx.nVersion = OVERWINTER_TX_VERSION;
+    mtx.nVersionGroupId = OVERWINTER_VERSION_GROUP_ID;
+    mtx.nExpiryHeight = 0;
+    CTransaction tx1(mtx);
+
+    LOCK(cs_main);
+    int nextHeight = chainActive.Height() + 1;
+
+    CTxPreVerification verified = PreVerifyTransaction(tx1, Params(), nextHeight);
+    EXPECT_EQ(verified.nHeight, nextHeight);
+    EXPECT_FALSE(verified.fValid);
+    EXPECT_EQ(verified.state.GetRejectReason(), "tx-overwinter-not-active");
+
+    CValidationState state1;
+    EXPECT_FALSE(AcceptToMemoryPool(Params(), pool, state1, tx1, false, &missingInputs, false, &verified));
+    EXPECT_EQ(state1.GetRejectReason(), "tx-overwinter-not-active");
+
+    // A result for a different height is ignored and the checks are redone.
+    CTxPreVerification stale;
+    stale.nHeight = nextHeight + 1;
+    stale.fValid = true;
+    CValidationState state2;
+    EXPECT_FALSE(AcceptToMemoryPool(Params(), pool, state2, tx1, false, &missingInputs, false, &stale));
+    EXPECT_EQ(state2.GetRejectReason(), "tx-overwinter-not-active");
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+}
 
 // Sprout transaction version 3 when Overwinter is not active:
 // 1. pass CheckTransaction (and CheckTransactionWithoutProofVerification)
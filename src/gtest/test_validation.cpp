@@ -44,25 +44,18 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
-        if (coin && txid == coin.value().first.second) {
-            CCoins newCoins;
-            newCoins.vout.resize(2);
-            newCoins.vout[0] = coin.value().second.first;
-            newCoins.nHeight = coin.value().second.second;
-            coins.swap(newCoins);
+    bool GetCoin(const COutPoint &outpoint, Coin &coinOut) const {
+        if (coin && outpoint.hash == coin.value().first.second && outpoint.n == 0) {
+            coinOut = Coin(coin.value().second.first, coin.value().second.second, false);
             return true;
         } else {
             return false;
         }
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        if (coin && txid == coin.value().first.second) {
-            return true;
-        } else {
-            return false;
-        }
+    bool HaveCoin(const COutPoint &outpoint) const {
+        Coin coinOut;
+        return GetCoin(outpoint, coinOut);
     }
 
     uint256 GetBestBlock() const {
@@ -221,14 +214,14 @@ TEST(Validation, ReceivedBlockTransactions) {
 
     // Create a fake genesis block
     CBlock block1;
-    block1.vtx.push_back(GetValidSproutReceive(sk, 5, true));
+    block1.vtx.push_back(MakeTransactionRef(GetValidSproutReceive(sk, 5, true)));
     block1.hashMerkleRoot = block1.BuildMerkleTree();
     CBlockIndex fakeIndex1 {block1};
 
     // Create a fake child block
     CBlock block2;
     block2.hashPrevBlock = block1.GetHash();
-    block2.vtx.push_back(GetValidSproutReceive(sk, 10, true));
+    block2.vtx.push_back(MakeTransactionRef(GetValidSproutReceive(sk, 10, true)));
     block2.hashMerkleRoot = block2.BuildMerkleTree();
     CBlockIndex fakeIndex2 {block2};
     fakeIndex2.pprev = &fakeIndex1;
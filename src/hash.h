@@ -149,6 +149,31 @@ public:
 };
 
 
+/** Writes data to an underlying stream, while hashing the written data. */
+template<typename Dest>
+class CHashingWriter : public CHashWriter
+{
+private:
+    Dest* dest;
+
+public:
+    explicit CHashingWriter(Dest* destIn) : CHashWriter(destIn->GetType(), destIn->GetVersion()), dest(destIn) {}
+
+    void write(const char *pch, size_t nSize)
+    {
+        dest->write(pch, nSize);
+        CHashWriter::write(pch, nSize);
+    }
+
+    template<typename T>
+    CHashingWriter<Dest>& operator<<(const T& obj)
+    {
+        // Serialize to this stream
+        ::Serialize(*this, obj);
+        return (*this);
+    }
+};
+
 /** A writer stream (for serialization) that computes a 256-bit BLAKE2b hash. */
 class CBLAKE2bWriter
 {
@@ -199,6 +224,7 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nDataLen);
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
@@ -237,4 +263,10 @@ public:
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
 
+/** Optimized SipHash-2-4 implementation for a uint256 followed by a 32-bit
+ *  little-endian value (as used for outpoints). It is identical to hashing the
+ *  36 serialized bytes with CSipHasher(k0, k1).
+ */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+
 #endif // BITCOIN_HASH_H
@@ -0,0 +1,251 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "indexbuilder.h"
+
+#include "main.h"
+#include "txdb.h"
+#include "undo.h"
+#include "util.h"
+
+const char* GetBlockTreeIndexName(BlockTreeIndex index)
+{
+    switch (index) {
+    case TX_INDEX: return "txindex";
+    case ADDRESS_INDEX: return "addressindex";
+    case SPENT_INDEX: return "spentindex";
+    case TIMESTAMP_INDEX: return "timestampindex";
+    }
+    assert(false);
+}
+
+bool IsBlockTreeIndexEnabled(BlockTreeIndex index)
+{
+    switch (index) {
+    case TX_INDEX: return fTxIndex;
+    case ADDRESS_INDEX: return fAddressIndex;
+    case SPENT_INDEX: return fSpentIndex;
+    case TIMESTAMP_INDEX: return fTimestampIndex;
+    }
+    assert(false);
+}
+
+CBlockTreeIndexBuilder::CBlockTreeIndexBuilder(BlockTreeIndex indexIn) :
+    CBaseIndex(GetBlockTreeIndexName(indexIn)), index(indexIn)
+{
+    uint256 hash;
+    int nHeight;
+    if (pblocktree->ReadIndexBestBlock(GetName(), hash, nHeight))
+        SetBestBlock(hash, nHeight);
+}
+
+bool CBlockTreeIndexBuilder::WriteBestBlock(const uint256& hash, int nHeight)
+{
+    if (!pblocktree->WriteIndexBestBlock(GetName(), hash, nHeight))
+        return false;
+    SetBestBlock(hash, nHeight);
+    return true;
+}
+
+bool CBlockTreeIndexBuilder::NeedsUndo() const
+{
+    return index == ADDRESS_INDEX || index == SPENT_INDEX;
+}
+
+bool CBlockTreeIndexBuilder::ReachedTip()
+{
+    AssertLockHeld(cs_main);
+    // Until both are written the builder keeps running, and tries again
+    // when the tip moves.
+    if (!pblocktree->WriteFlag(GetName(), true)) {
+        LogPrintf("%s: failed to write the %s flag\n", __func__, GetName());
+        return true;
+    }
+    if (!pblocktree->EraseIndexBestBlock(GetName())) {
+        LogPrintf("%s: failed to erase the %s best block\n", __func__, GetName());
+        pblocktree->WriteFlag(GetName(), false);
+        return true;
+    }
+
+    switch (index) {
+    case TX_INDEX: fTxIndex = true; break;
+    case ADDRESS_INDEX: fAddressIndex = true; break;
+    case SPENT_INDEX: fSpentIndex = true; break;
+    case TIMESTAMP_INDEX: fTimestampIndex = true; break;
+    }
+
+    // The mempool indexes only hold the transactions accepted while the
+    // flag was set, so add the ones already in the mempool.
+    if (index == ADDRESS_INDEX || index == SPENT_INDEX) {
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        CCoinsViewCache view(&viewMemPool);
+        mempool.addIndexes(view, index == ADDRESS_INDEX, index == SPENT_INDEX);
+    }
+
+    LogPrintf("%s: %s built, now maintained with each block\n", __func__, GetName());
+    return false;
+}
+
+bool CBlockTreeIndexBuilder::ConnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo)
+{
+    if (NeedsUndo() && !block.vtx.empty() && blockundo.vtxundo.size() + 1 != block.vtx.size()) {
+        // Without undo data the spent outputs are unknown.
+        LogPrintf("%s: no undo data for block %s, %s will be incomplete\n", __func__, pindex->GetBlockHash().ToString(), GetName());
+        return WriteBestBlock(pindex->GetBlockHash(), pindex->nHeight);
+    }
+
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    std::vector<CAddressIndexDbEntry> addressIndex;
+    std::vector<CAddressUnspentDbEntry> addressUnspentIndex;
+    std::vector<CSpentIndexDbEntry> spentIndex;
+
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
+        const uint256 hash = tx.GetHash();
+
+        if (index == TX_INDEX) {
+            vPos.push_back(std::make_pair(hash, pos));
+            pos.nTxOffset += tx.GetTotalSize();
+        }
+
+        if (!tx.IsCoinBase() && NeedsUndo()) {
+            const CTxUndo &txundo = blockundo.vtxundo[i-1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("%s: transaction and undo data inconsistent", __func__);
+            for (size_t j = 0; j < tx.vin.size(); j++) {
+                const CTxIn &input = tx.vin[j];
+                const CTxOut &prevout = txundo.vprevout[j].out;
+                CScript::ScriptType scriptType = prevout.scriptPubKey.GetType();
+                const uint160 addrHash = prevout.scriptPubKey.AddressHash();
+                if (index == ADDRESS_INDEX && scriptType != CScript::UNKNOWN) {
+                    addressIndex.push_back(std::make_pair(
+                        CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, j, true),
+                        prevout.nValue * -1));
+                    addressUnspentIndex.push_back(std::make_pair(
+                        CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
+                        CAddressUnspentValue()));
+                }
+                if (index == SPENT_INDEX) {
+                    spentIndex.push_back(std::make_pair(
+                        CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                        CSpentIndexValue(hash, j, pindex->nHeight, prevout.nValue, scriptType, addrHash)));
+                }
+            }
+        }
+
+        if (index == ADDRESS_INDEX) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut &out = tx.vout[k];
+                CScript::ScriptType scriptType = out.scriptPubKey.GetType();
+                if (scriptType != CScript::UNKNOWN) {
+                    uint160 const addrHash = out.scriptPubKey.AddressHash();
+                    addressIndex.push_back(std::make_pair(
+                        CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, k, false),
+                        out.nValue));
+                    addressUnspentIndex.push_back(std::make_pair(
+                        CAddressUnspentKey(scriptType, addrHash, hash, k),
+                        CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+                }
+            }
+        }
+    }
+
+    switch (index) {
+    case TX_INDEX:
+        if (!pblocktree->WriteTxIndex(vPos))
+            return false;
+        break;
+    case ADDRESS_INDEX:
+        if (!pblocktree->WriteAddressIndex(addressIndex) || !pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+            return false;
+        break;
+    case SPENT_INDEX:
+        if (!pblocktree->UpdateSpentIndex(spentIndex))
+            return false;
+        break;
+    case TIMESTAMP_INDEX: {
+        // As in ConnectBlock, logical timestamps increase along the chain.
+        unsigned int logicalTS = pindex->nTime;
+        unsigned int prevLogicalTS = 0;
+        if (pindex->pprev)
+            pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS);
+        if (logicalTS <= prevLogicalTS)
+            logicalTS = prevLogicalTS + 1;
+        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())) ||
+                !pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
+            return false;
+        break;
+    }
+    }
+
+    return WriteBestBlock(pindex->GetBlockHash(), pindex->nHeight);
+}
+
+bool CBlockTreeIndexBuilder::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo)
+{
+    // Like DisconnectBlock in main.cpp, this leaves transaction and
+    // timestamp entries in place.
+    if (NeedsUndo() && !block.vtx.empty() && blockundo.vtxundo.size() + 1 == block.vtx.size()) {
+        std::vector<CAddressIndexDbEntry> addressIndex;
+        std::vector<CAddressUnspentDbEntry> addressUnspentIndex;
+        std::vector<CSpentIndexDbEntry> spentIndex;
+
+        for (int i = block.vtx.size() - 1; i >= 0; i--) {
+            const CTransaction &tx = *block.vtx[i];
+            uint256 const hash = tx.GetHash();
+
+            if (index == ADDRESS_INDEX) {
+                for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                    const CTxOut &out = tx.vout[k];
+                    CScript::ScriptType scriptType = out.scriptPubKey.GetType();
+                    if (scriptType != CScript::UNKNOWN) {
+                        uint160 const addrHash = out.scriptPubKey.AddressHash();
+                        addressIndex.push_back(std::make_pair(
+                            CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, k, false),
+                            out.nValue));
+                        addressUnspentIndex.push_back(std::make_pair(
+                            CAddressUnspentKey(scriptType, addrHash, hash, k),
+                            CAddressUnspentValue()));
+                    }
+                }
+            }
+
+            if (i == 0)
+                continue;
+            const CTxUndo &txundo = blockundo.vtxundo[i-1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("%s: transaction and undo data inconsistent", __func__);
+            for (unsigned int j = tx.vin.size(); j-- > 0;) {
+                const CTxIn &input = tx.vin[j];
+                const Coin &coin = txundo.vprevout[j];
+                if (index == ADDRESS_INDEX) {
+                    CScript::ScriptType scriptType = coin.out.scriptPubKey.GetType();
+                    if (scriptType != CScript::UNKNOWN) {
+                        uint160 const addrHash = coin.out.scriptPubKey.AddressHash();
+                        addressIndex.push_back(std::make_pair(
+                            CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, j, true),
+                            coin.out.nValue * -1));
+                        addressUnspentIndex.push_back(std::make_pair(
+                            CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
+                            CAddressUnspentValue(coin.out.nValue, coin.out.scriptPubKey, coin.nHeight)));
+                    }
+                }
+                if (index == SPENT_INDEX) {
+                    spentIndex.push_back(std::make_pair(
+                        CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                        CSpentIndexValue()));
+                }
+            }
+        }
+
+        if (index == ADDRESS_INDEX &&
+                (!pblocktree->EraseAddressIndex(addressIndex) || !pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)))
+            return false;
+        if (index == SPENT_INDEX && !pblocktree->UpdateSpentIndex(spentIndex))
+            return false;
+    }
+
+    return WriteBestBlock(pindex->pprev ? pindex->pprev->GetBlockHash() : uint256(), pindex->nHeight - 1);
+}
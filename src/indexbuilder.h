@@ -0,0 +1,56 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_INDEXBUILDER_H
+#define BITCOIN_INDEXBUILDER_H
+
+#include "baseindex.h"
+
+/** The indexes kept in the block tree database. */
+enum BlockTreeIndex {
+    TX_INDEX,
+    ADDRESS_INDEX,
+    SPENT_INDEX,
+    TIMESTAMP_INDEX,
+};
+
+/**
+ * Builds one of the block tree database indexes (-txindex, or those of
+ * -insightexplorer and -lightwalletd) for a node that has the blocks but not
+ * the index, instead of requiring a -reindex. Entries are the same as those
+ * ConnectBlock writes, and are built from the block and undo files in the
+ * background. Once the builder reaches the tip it sets the index flag, under
+ * cs_main, and ConnectBlock and DisconnectBlock maintain the index from the
+ * next block on.
+ *
+ * Progress is kept in the block tree database. The entries of a block are
+ * written before the best block moves past it, and writing them again gives
+ * the same result, so a builder interrupted in between just redoes that
+ * block.
+ */
+class CBlockTreeIndexBuilder : public CBaseIndex
+{
+private:
+    const BlockTreeIndex index;
+
+    bool WriteBestBlock(const uint256& hash, int nHeight);
+
+protected:
+    bool NeedsUndo() const;
+    bool ReachedTip();
+
+public:
+    CBlockTreeIndexBuilder(BlockTreeIndex indexIn);
+
+    bool ConnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo);
+    bool DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo);
+};
+
+/** The name of a block tree index, as used for its flag and by getindexinfo. */
+const char* GetBlockTreeIndexName(BlockTreeIndex index);
+
+/** Whether a block tree index is maintained with each block (requires cs_main). */
+bool IsBlockTreeIndexEnabled(BlockTreeIndex index);
+
+#endif // BITCOIN_INDEXBUILDER_H
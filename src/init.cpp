@@ -10,6 +10,7 @@
 #include "init.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockprofile.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/upgrades.h"
@@ -18,6 +19,7 @@
 #include "fs.h"
 #include "httpserver.h"
 #include "httprpc.h"
+#include "indexbuilder.h"
 #include "key.h"
 #if defined(ENABLE_MINING) || defined(ENABLE_WALLET)
 #include "key_io.h"
@@ -34,6 +36,7 @@
 #include "script/sigcache.h"
 #include "scheduler.h"
 #include "txdb.h"
+#include "txheightindex.h"
 #include "torcontrol.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -158,9 +161,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -174,7 +177,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -240,8 +242,15 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsflusher;
+        pcoinsflusher = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
+        for (CBaseIndex* pindex : GetIndexes()) {
+            UnregisterIndex(pindex);
+            delete pindex;
+        }
+        ptxheightindex = NULL;
         delete pblocktree;
         pblocktree = NULL;
     }
@@ -252,6 +261,10 @@ void Shutdown()
 
 #if ENABLE_ZMQ
     if (pzmqNotificationInterface) {
+#ifdef ENABLE_WALLET
+        if (pwalletMain)
+            pwalletMain->NotifyWalletEvent.disconnect_all_slots();
+#endif
         UnregisterValidationInterface(pzmqNotificationInterface);
         delete pzmqNotificationInterface;
         pzmqNotificationInterface = NULL;
@@ -362,6 +375,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
+    strUsage += HelpMessageOpt("-blockprofiles=<n>", strprintf(_("Keep timing profiles of the last <n> connected blocks for getblockprofile (0 to disable, default: %u)"), DEFAULT_BLOCK_PROFILES));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to reject transactions from network peers. Automatic broadcast and rebroadcast of any transactions from inbound peers is disabled, unless '-whitelistforcerelay' is '1', in which case whitelisted peers' transactions will be relayed. RPC transactions are not affected. (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
@@ -373,6 +387,9 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-daemon", _("Run in the background as a daemon and accept commands"));
 #endif
     }
+    strUsage += HelpMessageOpt("-assumevalid=<hex>", strprintf(_("If this block is in the chain assume that it and its ancestors have valid proofs and signatures, including Sapling proofs and JoinSplit signatures (0 to verify all, default: %s, testnet: %s)"),
+        Params(CBaseChainParams::MAIN).GetConsensus().defaultAssumeValid.GetHex(),
+        Params(CBaseChainParams::TESTNET).GetConsensus().defaultAssumeValid.GetHex()));
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-paramsdir=<dir>", _("Specify Zcash network parameters directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
@@ -380,6 +397,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
     strUsage += HelpMessageOpt("-ibdskiptxverification", strprintf(_("Skip transaction verification during initial block download up to the last checkpoint height (a.k.a. -fastsync). Incompatible with flags that disable checkpoints. (default = %u)"), DEFAULT_IBD_SKIP_TX_VERIFICATION));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
+    strUsage += HelpMessageOpt("-loadsnapshot=<file>", _("Start a new data directory from a chainstate snapshot written by dumptxoutset, and sync from its block; blocks before it are never downloaded"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
@@ -390,12 +408,16 @@ std::string HelpMessage(HelpMessageMode mode)
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files on startup"));
+    strUsage += HelpMessageOpt("-snapshothash=<hex>", _("The hash of the -loadsnapshot file, as reported by dumptxoutset. Required unless the snapshot's block has a hash compiled in"));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-fastsync", _("Do a faster, PoW-only verification of blocks during initial block download (a.k.a. -ibdskiptxverification)"));
     strUsage += HelpMessageOpt("-txexpirynotify=<cmd>", _("Execute command when transaction expires (%s in cmd is replaced by transaction id)"));
-    strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-txheightindex", strprintf(_("Maintain a compact index from transaction id to block height, used by the getrawtransaction rpc call when -txindex is off. "
+            "It is built in the background once the node has synced, and is a fraction of the size of -txindex (default: %u)"), DEFAULT_TXHEIGHTINDEX));
+    strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call. "
+            "On a node that already has the blocks it is built in the background (default: %u)"), DEFAULT_TXINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -413,6 +435,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), DEFAULT_MAX_PEER_CONNECTIONS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER));
+    strUsage += HelpMessageOpt("-msghandworkers=<n>", strprintf(_("Number of threads that serve requested blocks and handle received blocks, so that other peers' messages are not held up (0-%d, 0 = handle them on the message handler thread, default: %d)"), MAX_MSGHAND_WORKERS, DEFAULT_MSGHAND_WORKERS));
     strUsage += HelpMessageOpt("-mempoolevictionmemoryminutes=<n>", strprintf(_("The number of minutes before allowing rejected transactions to re-enter the mempool. (default: %u)"), DEFAULT_MEMPOOL_EVICTION_MEMORY_MINUTES));
     strUsage += HelpMessageOpt("-mempooltxcostlimit=<n>",strprintf(_("An upper bound on the maximum size in bytes of all transactions in the mempool. (default: %s)"), DEFAULT_MEMPOOL_TOTAL_COST_LIMIT));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
@@ -435,6 +458,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-whitelistrelay", strprintf(_("Accept relayed transactions received from whitelisted inbound peers even when not relaying transactions (default: %d)"), DEFAULT_WHITELISTRELAY));
     strUsage += HelpMessageOpt("-whitelistforcerelay", strprintf(_("Force relay of transactions from whitelisted inbound peers even they violate local relay policy (default: %d)"), DEFAULT_WHITELISTFORCERELAY));
     strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
+    strUsage += HelpMessageOpt("-maxpeeruploadrate=<n>", strprintf(_("Limit the rate at which historical blocks are sent to each peer (in KB/s), 0 = no limit (default: %d)"), DEFAULT_MAX_PEER_UPLOAD_RATE));
 
 #ifdef ENABLE_WALLET
     strUsage += CWallet::GetWalletHelpString(showDebug);
@@ -446,6 +470,12 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubshieldedoutputs=<address>", _("Enable publish shielded outputs of transactions in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubnullifiers=<address>", _("Enable publish nullifiers of transactions in <address>"));
+#ifdef ENABLE_WALLET
+    strUsage += HelpMessageOpt("-zmqpubwalletevent=<address>", _("Enable publish wallet events in <address>"));
+#endif
+    strUsage += HelpMessageOpt("-zmqsendqueuesize=<n>", strprintf(_("Drop ZeroMQ notifications when more than <n> MB are waiting to be sent (default: %u)"), DEFAULT_ZMQ_SEND_QUEUE_SIZE));
 #endif
 
     strUsage += HelpMessageGroup(_("Monitoring options:"));
@@ -474,10 +504,10 @@ std::string HelpMessage(HelpMessageMode mode)
                 "Use given addresses for block subsidy share paid to the funding stream with id <streamId> (regtest-only)");
     }
 #ifdef YCASH_WR
-    std::string debugCategories = "addrman, alert, bench, coindb, db, deletetx, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
+    std::string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, deletetx, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
                              "rand, receiveunsafe, reindex, rpc, selectcoins, tor, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
 #else
-    std::string debugCategories = "addrman, alert, bench, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
+    std::string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
                              "rand, receiveunsafe, reindex, rpc, selectcoins, tor, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
 #endif // YCASH_WR
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -992,6 +1022,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #endif
     }
 
+    // a node loaded from a snapshot has no blocks before it to index
+    if (mapArgs.count("-loadsnapshot")) {
+        if (GetBoolArg("-txindex", DEFAULT_TXINDEX) || fExperimentalInsightExplorer || fExperimentalLightWalletd)
+            return InitError(_("-loadsnapshot is incompatible with -txindex, -insightexplorer and -lightwalletd."));
+        if (GetBoolArg("-reindex", false))
+            return InitError(_("-loadsnapshot is incompatible with -reindex."));
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     int nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
@@ -999,7 +1037,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Trim requested connection counts, to fit into system limitations
     nMaxConnections = std::max(std::min(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
+    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + 2 * DB_MAX_OPEN_FILES);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
     nMaxConnections = std::min(nFD - MIN_CORE_FILEDESCRIPTORS, nMaxConnections);
@@ -1007,6 +1045,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (nMaxConnections < nUserMaxConnections)
         InitWarning(strprintf(_("Reducing -maxconnections from %d to %d, because of system limitations."), nUserMaxConnections, nMaxConnections));
 
+    // Whatever is left of the descriptor limit after connections and core
+    // usage goes to LevelDB's table caches. Sockets must stay selectable, so
+    // descriptors above FD_SETSIZE are not handed out.
+    int nDBFileBudget = std::min(nFD, (int)FD_SETSIZE) - nBind - MIN_CORE_FILEDESCRIPTORS - nMaxConnections;
+
     // ensure that the user has not disabled checkpoints when requesting to
     // skip transaction verification in initial block download.
     if (GetBoolArg("-ibdskiptxverification", DEFAULT_IBD_SKIP_TX_VERIFICATION)
@@ -1061,6 +1104,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         || GetBoolArg("-fastsync", DEFAULT_IBD_SKIP_TX_VERIFICATION);
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
+    hashAssumeValid = uint256S(GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
+    if (!hashAssumeValid.IsNull())
+        LogPrintf("Assuming ancestors of block %s have valid proofs and signatures.\n", hashAssumeValid.GetHex());
+    else
+        LogPrintf("Validating proofs and signatures for all blocks.\n");
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
@@ -1070,6 +1119,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    blockProfiler.SetMaxProfiles(std::max<int64_t>(0, GetArg("-blockprofiles", DEFAULT_BLOCK_PROFILES)));
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
@@ -1516,6 +1567,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             chainparams.GetConsensus().nPostBlossomPowTargetSpacing,
             GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET)*1024*1024);
     }
+    if (mapArgs.count("-maxpeeruploadrate")) {
+        CNode::SetMaxPeerUploadRate(std::max<int64_t>(0, GetArg("-maxpeeruploadrate", DEFAULT_MAX_PEER_UPLOAD_RATE))*1000);
+    }
 
     // ********************************************************* Step 7: load block chain
 
@@ -1540,14 +1594,30 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nBlockTreeDBCache = nTotalCache * 3 / 4;
     }
     nTotalCache -= nBlockTreeDBCache;
+    // -txindex makes the txid to height index redundant.
+    bool fTxHeightIndex = GetBoolArg("-txheightindex", DEFAULT_TXHEIGHTINDEX) && !GetBoolArg("-txindex", DEFAULT_TXINDEX);
+    int64_t nTxHeightIndexCache = 0;
+    if (fTxHeightIndex) {
+        nTxHeightIndexCache = std::min(nTotalCache / 16, (int64_t)(1 << 26));
+        nTotalCache -= nTxHeightIndexCache;
+    }
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    if (fTxHeightIndex)
+        LogPrintf("* Using %.1fMiB for txid to height index database\n", nTxHeightIndexCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
+    // Split the file budget the same way as the cache: the block index gets
+    // the larger share when it also carries the insight indexes.
+    int nBlockTreeDBFiles = GetBoolArg("-insightexplorer", false) ? nDBFileBudget * 3 / 4 : nDBFileBudget / 2;
+    int nCoinDBFiles = nDBFileBudget - nBlockTreeDBFiles;
+    CDBProfile blockTreeDBProfile = CDBProfile::Index(std::min(nBlockTreeDBFiles, DB_MAX_OPEN_FILES));
+    CDBProfile coinDBProfile = CDBProfile::Chainstate(std::min(nCoinDBFiles, DB_MAX_OPEN_FILES));
+
     bool clearWitnessCaches = false;
 
     bool fLoaded = false;
@@ -1562,15 +1632,40 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsflusher;
+                delete pcoinsdbview;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, blockTreeDBProfile);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex, coinDBProfile);
+                pcoinsflusher = new CCoinsViewFlusher(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsflusher);
+
+                // If necessary, upgrade from older database format.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                if (mapArgs.count("-loadsnapshot") && !fReindex) {
+                    uiInterface.InitMessage(_("Loading chainstate snapshot..."));
+                    CChainstateSnapshotInfo snapshotInfo;
+                    if (!LoadChainstateSnapshot(GetArg("-loadsnapshot", ""), chainparams, uint256S(GetArg("-snapshothash", "")), snapshotInfo)) {
+                        strLoadError = _("Error loading chainstate snapshot");
+                        break;
+                    }
+                } else if (!fReindex) {
+                    bool fSnapshotLoading = false;
+                    pblocktree->ReadFlag("snapshotloading", fSnapshotLoading);
+                    if (fSnapshotLoading) {
+                        strLoadError = _("Loading a chainstate snapshot did not finish. Restart with -loadsnapshot to load it again");
+                        break;
+                    }
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1594,31 +1689,24 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
+                // Indexes that are newly enabled are built in the background
+                // below, but dropping one requires a reindex.
+                if (fTxIndex && !GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
                     break;
                 }
-
-                // Check for changed -insightexplorer state
-                bool fInsightExplorerPreviouslySet = false;
-                pblocktree->ReadFlag("insightexplorer", fInsightExplorerPreviouslySet);
-                if (fExperimentalInsightExplorer != fInsightExplorerPreviouslySet) {
+                if ((fSpentIndex || fTimestampIndex) && !fExperimentalInsightExplorer) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -insightexplorer");
                     break;
                 }
-
-                // Check for changed -lightwalletd state
-                bool fLightWalletdPreviouslySet = false;
-                pblocktree->ReadFlag("lightwalletd", fLightWalletdPreviouslySet);
-                if (fExperimentalLightWalletd != fLightWalletdPreviouslySet) {
+                if (fAddressIndex && !fExperimentalInsightExplorer && !fExperimentalLightWalletd) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -lightwalletd");
                     break;
                 }
 
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
-                if (fHavePruned && !fPruneMode) {
+                if (fHavePruned && !fPruneMode && !fSnapshotChainstate) {
                     strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
                     break;
                 }
@@ -1653,7 +1741,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     }
                 }
 
-                if (!CVerifyDB().VerifyDB(chainparams, pcoinsdbview, GetArg("-checklevel", DEFAULT_CHECKLEVEL),
+                if (!CVerifyDB().VerifyDB(chainparams, pcoinsflusher, GetArg("-checklevel", DEFAULT_CHECKLEVEL),
                               GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
@@ -1697,6 +1785,33 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    {
+        LOCK(cs_main);
+        if (fTxHeightIndex) {
+            // Entries hold heights rather than block file positions, so the
+            // index survives -reindex.
+            ptxheightindex = new CTxHeightIndex(nTxHeightIndexCache);
+            RegisterIndex(ptxheightindex);
+        }
+
+        // Indexes enabled since the block tree database was created are
+        // built from the block files while the node runs.
+        std::vector<BlockTreeIndex> vBuild;
+        if (GetBoolArg("-txindex", DEFAULT_TXINDEX) && !fTxIndex)
+            vBuild.push_back(TX_INDEX);
+        if ((fExperimentalInsightExplorer || fExperimentalLightWalletd) && !fAddressIndex)
+            vBuild.push_back(ADDRESS_INDEX);
+        if (fExperimentalInsightExplorer && !fSpentIndex)
+            vBuild.push_back(SPENT_INDEX);
+        if (fExperimentalInsightExplorer && !fTimestampIndex)
+            vBuild.push_back(TIMESTAMP_INDEX);
+        for (BlockTreeIndex index : vBuild)
+            RegisterIndex(new CBlockTreeIndexBuilder(index));
+
+        for (const CBaseIndex* pindex : GetIndexes())
+            LogPrintf("Index %s at height %d, syncing in the background\n", pindex->GetName(), pindex->GetBestHeight());
+    }
+
     fs::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fsbridge::fopen(est_path, "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
@@ -1714,6 +1829,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         CWallet::InitLoadWallet(clearWitnessCaches);
         if (!pwalletMain)
             return false;
+#if ENABLE_ZMQ
+        if (pzmqNotificationInterface) {
+            pwalletMain->NotifyWalletEvent.connect(boost::bind(&CZMQNotificationInterface::WalletEvent, pzmqNotificationInterface, _1));
+        }
+#endif
     }
 #else // ENABLE_WALLET
     LogPrintf("No wallet support compiled in!\n");
@@ -1789,6 +1909,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // if pruning, unset the service bit and perform the initial blockstore prune
     // after any wallet rescanning has taken place.
+    if (fSnapshotChainstate && !fPruneMode) {
+        LogPrintf("Unsetting NODE_NETWORK on a chainstate loaded from a snapshot\n");
+        nLocalServices &= ~NODE_NETWORK;
+    }
     if (fPruneMode) {
         LogPrintf("Unsetting NODE_NETWORK on prune mode\n");
         nLocalServices &= ~NODE_NETWORK;
@@ -1819,6 +1943,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles, chainparams));
+    if (fSnapshotChainstate) {
+        threadGroup.create_thread(boost::bind(&ThreadValidateSnapshotHistory, chainparams));
+    }
+    for (CBaseIndex* pindex : GetIndexes()) {
+        boost::function<void()> threadindex = boost::bind(&CBaseIndex::ThreadSync, pindex);
+        threadGroup.create_thread(
+            boost::bind(&TraceThread<boost::function<void()>>, pindex->GetName().c_str(), threadindex)
+        );
+    }
 
     // Wait for genesis block to be processed
     bool fHaveGenesis = false;
@@ -7,8 +7,10 @@
 
 #include "key.h"
 #include "pubkey.h"
+#include "random.h"
 #include "util.h"
 
+SaltedKeyStoreHasher::SaltedKeyStoreHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
 bool CKeyStore::AddKey(const CKey &key) {
     return AddKeyPubKey(key, key.GetPubKey());
@@ -63,6 +65,38 @@ bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    AddSpendableScripts(pubkey);
+    return true;
+}
+
+/**
+ * Whether the ownership of a script is kept in mapScriptOwnership: it is
+ * pay-to-pubkey-hash, or pay-to-pubkey with a push of a compressed or
+ * uncompressed key. Together these are the outputs the wallet hands out.
+ */
+static bool IsOwnershipTracked(const CScript &script)
+{
+    if (script.IsPayToPublicKeyHash())
+        return true;
+    if (script.size() != CPubKey::COMPRESSED_PUBLIC_KEY_SIZE + 2 && script.size() != CPubKey::PUBLIC_KEY_SIZE + 2)
+        return false;
+    return script[0] == script.size() - 2 && script.back() == OP_CHECKSIG;
+}
+
+void CBasicKeyStore::AddSpendableScripts(const CPubKey &pubkey)
+{
+    AssertLockHeld(cs_KeyStore);
+    mapScriptOwnership[GetScriptForDestination(pubkey.GetID())] = ScriptOwnership::SPENDABLE;
+    mapScriptOwnership[GetScriptForRawPubKey(pubkey)] = ScriptOwnership::SPENDABLE;
+}
+
+bool CBasicKeyStore::GetScriptOwnership(const CScript &scriptPubKey, ScriptOwnership &ownershipOut) const
+{
+    if (!IsOwnershipTracked(scriptPubKey))
+        return false;
+    LOCK(cs_KeyStore);
+    ScriptOwnershipMap::const_iterator mi = mapScriptOwnership.find(scriptPubKey);
+    ownershipOut = mi != mapScriptOwnership.end() ? mi->second : ScriptOwnership::NONE;
     return true;
 }
 
@@ -114,6 +148,8 @@ bool CBasicKeyStore::AddWatchOnly(const CScript &dest)
 {
     LOCK(cs_KeyStore);
     setWatchOnly.insert(dest);
+    if (IsOwnershipTracked(dest))
+        mapScriptOwnership.insert(std::make_pair(dest, ScriptOwnership::WATCHED));
     CPubKey pubKey;
     if (ExtractPubKey(dest, pubKey))
         mapWatchKeys[pubKey.GetID()] = pubKey;
@@ -124,6 +160,9 @@ bool CBasicKeyStore::RemoveWatchOnly(const CScript &dest)
 {
     LOCK(cs_KeyStore);
     setWatchOnly.erase(dest);
+    ScriptOwnershipMap::iterator mi = mapScriptOwnership.find(dest);
+    if (mi != mapScriptOwnership.end() && mi->second == ScriptOwnership::WATCHED)
+        mapScriptOwnership.erase(mi);
     CPubKey pubKey;
     if (ExtractPubKey(dest, pubKey))
         mapWatchKeys.erase(pubKey.GetID());
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_KEYSTORE_H
 #define BITCOIN_KEYSTORE_H
 
+#include "hash.h"
 #include "key.h"
 #include "pubkey.h"
 #include "script/script.h"
@@ -14,8 +15,19 @@
 #include "zcash/Address.hpp"
 #include "zcash/NoteEncryption.hpp"
 
+#include <unordered_map>
+#include <unordered_set>
+
 #include <boost/signals2/signal.hpp>
 
+/** What a keystore knows about a pay-to-pubkey or pay-to-pubkey-hash script. */
+enum class ScriptOwnership
+{
+    NONE,       //! no key or watch-only entry for the script
+    SPENDABLE,  //! the script pays to a key in the store
+    WATCHED,    //! the script is watch-only, and its key is not in the store
+};
+
 /** A virtual base class for key stores */
 class CKeyStore
 {
@@ -52,6 +64,11 @@ public:
     virtual bool HaveWatchOnly(const CScript &dest) const =0;
     virtual bool HaveWatchOnly() const =0;
 
+    //! Look up a pay-to-pubkey or pay-to-pubkey-hash script in the table kept
+    //! alongside the keys and watch-only scripts, without solving it.
+    //! Returns false for scripts of any other form.
+    virtual bool GetScriptOwnership(const CScript &scriptPubKey, ScriptOwnership &ownershipOut) const =0;
+
     //! Add a spending key to the store.
     virtual bool AddSproutSpendingKey(const libzcash::SproutSpendingKey &sk) =0;
 
@@ -96,24 +113,60 @@ public:
         libzcash::SproutViewingKey& vkOut) const =0;
 };
 
-typedef std::map<CKeyID, CKey> KeyMap;
-typedef std::map<CKeyID, CPubKey> WatchKeyMap;
-typedef std::map<CScriptID, CScript > ScriptMap;
-typedef std::set<CScript> WatchOnlySet;
+/**
+ * Hasher for the keystore maps. Key and script IDs come from scripts that
+ * others can choose, so they are hashed with a salt rather than truncated.
+ */
+class SaltedKeyStoreHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedKeyStoreHasher();
+
+    size_t operator()(const uint160& id) const {
+        return CSipHasher(k0, k1).Write(id.begin(), id.size()).Finalize();
+    }
+    size_t operator()(const uint256& hash) const {
+        return SipHashUint256(k0, k1, hash);
+    }
+    size_t operator()(const CScript& script) const {
+        return CSipHasher(k0, k1).Write(script.empty() ? NULL : &script[0], script.size()).Finalize();
+    }
+    size_t operator()(const libzcash::SaplingPaymentAddress& addr) const {
+        return SipHashUint256(k0, k1, addr.pk_d);
+    }
+    size_t operator()(const libzcash::SaplingExtendedFullViewingKey& extfvk) const {
+        return SipHashUint256(k0, k1, extfvk.fvk.ovk);
+    }
+};
+
+typedef std::unordered_map<CKeyID, CKey, SaltedKeyStoreHasher> KeyMap;
+typedef std::unordered_map<CKeyID, CPubKey, SaltedKeyStoreHasher> WatchKeyMap;
+typedef std::unordered_map<CScriptID, CScript, SaltedKeyStoreHasher> ScriptMap;
+typedef std::unordered_set<CScript, SaltedKeyStoreHasher> WatchOnlySet;
+typedef std::unordered_map<CScript, ScriptOwnership, SaltedKeyStoreHasher> ScriptOwnershipMap;
 typedef std::map<libzcash::SproutPaymentAddress, libzcash::SproutSpendingKey> SproutSpendingKeyMap;
 typedef std::map<libzcash::SproutPaymentAddress, libzcash::SproutViewingKey> SproutViewingKeyMap;
 typedef std::map<libzcash::SproutPaymentAddress, ZCNoteDecryption> NoteDecryptorMap;
 
 // Full viewing key has equivalent functionality to a transparent address
 // When encrypting wallet, encrypt SaplingSpendingKeyMap, while leaving SaplingFullViewingKeyMap unencrypted
-typedef std::map<
+typedef std::unordered_map<
     libzcash::SaplingExtendedFullViewingKey,
-    libzcash::SaplingExtendedSpendingKey> SaplingSpendingKeyMap;
-typedef std::map<
+    libzcash::SaplingExtendedSpendingKey,
+    SaltedKeyStoreHasher> SaplingSpendingKeyMap;
+typedef std::unordered_map<
     libzcash::SaplingIncomingViewingKey,
-    libzcash::SaplingExtendedFullViewingKey> SaplingFullViewingKeyMap;
+    libzcash::SaplingExtendedFullViewingKey,
+    SaltedKeyStoreHasher> SaplingFullViewingKeyMap;
 // Only maps from default addresses to ivk, may need to be reworked when adding diversified addresses. 
-typedef std::map<libzcash::SaplingPaymentAddress, libzcash::SaplingIncomingViewingKey> SaplingIncomingViewingKeyMap;
+typedef std::unordered_map<
+    libzcash::SaplingPaymentAddress,
+    libzcash::SaplingIncomingViewingKey,
+    SaltedKeyStoreHasher> SaplingIncomingViewingKeyMap;
 
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
@@ -132,6 +185,14 @@ protected:
     SaplingFullViewingKeyMap mapSaplingFullViewingKeys;
     SaplingIncomingViewingKeyMap mapSaplingIncomingViewingKeys;
 
+    //! Ownership of the pay-to-pubkey and pay-to-pubkey-hash scripts of the
+    //! keys and watch-only scripts above, so that IsMine can answer for them
+    //! with one lookup.
+    ScriptOwnershipMap mapScriptOwnership;
+
+    //! Mark the scripts paying to a key in the store as spendable (requires cs_KeyStore).
+    void AddSpendableScripts(const CPubKey &pubkey);
+
 public:
     bool SetHDSeed(const HDSeed& seed);
     bool HaveHDSeed() const;
@@ -178,6 +239,7 @@ public:
     virtual bool RemoveWatchOnly(const CScript &dest);
     virtual bool HaveWatchOnly(const CScript &dest) const;
     virtual bool HaveWatchOnly() const;
+    virtual bool GetScriptOwnership(const CScript &scriptPubKey, ScriptOwnership &ownershipOut) const;
 
     bool AddSproutSpendingKey(const libzcash::SproutSpendingKey &sk);
     bool HaveSproutSpendingKey(const libzcash::SproutPaymentAddress &address) const
@@ -304,10 +366,13 @@ public:
 };
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
-typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
+typedef std::unordered_map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> >, SaltedKeyStoreHasher> CryptedKeyMap;
 typedef std::map<libzcash::SproutPaymentAddress, std::vector<unsigned char> > CryptedSproutSpendingKeyMap;
 
 //! Sapling 
-typedef std::map<libzcash::SaplingExtendedFullViewingKey, std::vector<unsigned char> > CryptedSaplingSpendingKeyMap;
+typedef std::unordered_map<
+    libzcash::SaplingExtendedFullViewingKey,
+    std::vector<unsigned char>,
+    SaltedKeyStoreHasher> CryptedSaplingSpendingKeyMap;
 
 #endif // BITCOIN_KEYSTORE_H
@@ -9,6 +9,8 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
+#include "blockprofile.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -26,6 +28,7 @@
 #include "policy/policy.h"
 #include "pow.h"
 #include "reverse_iterator.h"
+#include "txheightindex.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "undo.h"
@@ -81,10 +84,12 @@ bool fSpentIndex = false;       // insightexplorer
 bool fTimestampIndex = false;   // insightexplorer
 bool fHavePruned = false;
 bool fPruneMode = false;
+bool fSnapshotChainstate = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 bool fIBDSkipTxVerification = DEFAULT_IBD_SKIP_TX_VERIFICATION;
+uint256 hashAssumeValid;
 bool fCoinbaseEnforcedShieldingEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -197,6 +202,14 @@ namespace {
       */
     multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
+    /**
+     * Serializes ActivateBestChain() as a whole. It releases cs_main between
+     * steps, and blocks from different peers are processed on parallel
+     * workers, so without this the tip notifications could be delivered out
+     * of order. Always taken before cs_main.
+     */
+    CCriticalSection cs_chainstate;
+
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
     int nLastBlockFile = 0;
@@ -251,6 +264,7 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for compact block reconstruction.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -260,11 +274,22 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /** Peers we asked to announce new blocks with cmpctblock messages, least recently useful first. */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /**
+     * The base of a chainstate snapshot, and the next block below it that
+     * ThreadValidateSnapshotHistory needs. Blocks from there up to the base
+     * are downloaded once the tip is synced. Protected by cs_main.
+     */
+    CBlockIndex* pindexSnapshotBase = NULL;
+    CBlockIndex* pindexSnapshotHistoryNext = NULL;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -305,6 +330,8 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex *pindexLastCommonBlock;
+    //! The best header we have sent our peer.
+    CBlockIndex *pindexBestHeaderSent;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
@@ -314,6 +341,14 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants invs or headers (when possible) for block announcements.
+    bool fPreferHeaders;
+    //! Whether this peer wants new blocks announced with cmpctblock messages (BIP 152 high-bandwidth mode).
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer can serve compact blocks, so that we may request them.
+    bool fProvidesHeaderAndIDs;
+    //! Number of consecutive headers announcements whose first header didn't connect.
+    int nUnconnectingHeaders;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -322,11 +357,16 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock.SetNull();
         pindexLastCommonBlock = NULL;
+        pindexBestHeaderSent = NULL;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        nUnconnectingHeaders = 0;
     }
 };
 
@@ -385,6 +425,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -407,21 +448,93 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false, still setting pit, if the block was already in flight from the same peer.
+// If pit is provided, a new entry gets a PartiallyDownloadedBlock for compact block reconstruction.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it is from the same node.
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit) {
+            *pit = &itInFlight->second.second;
+        }
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
     int nHeight = pindex != NULL ? pindex->nHeight : chainActive.Height(); // Help block timeout computation
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams, nHeight)};
+    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams, nHeight),
+                            std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
-    state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), std::move(newentry));
+    state->nBlocksInFlight++;
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit) {
+        *pit = &itInFlight->second.second;
+    }
+    return true;
+}
+
+/**
+ * Ask a peer that just gave us a new tip to announce future blocks with
+ * cmpctblock messages, replacing the peer we asked longest ago once
+ * MAX_HB_CMPCTBLOCK_PEERS peers have been asked. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom) {
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (!nodestate->fProvidesHeaderAndIDs) {
+        return;
+    }
+    for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+            return;
+        }
+    }
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCTBLOCK_PEERS) {
+        NodeId nodeidEvict = lNodesAnnouncingHeaderAndIDs.front();
+        {
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vNodes) {
+                if (pnode->GetId() == nodeidEvict) {
+                    pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                    break;
+                }
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+/** Whether we are close enough to the tip to fetch announced blocks directly. Requires cs_main. */
+bool CanDirectFetch(const Consensus::Params& consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetTime() - consensusParams.PoWTargetSpacing(pindexBestHeader->nHeight) * 20;
+}
+
+/**
+ * Whether the peer is known to have the given header, either because it
+ * announced it or a descendant to us, or because we sent it. Requires cs_main.
+ */
+bool PeerHasHeader(const CNodeState* state, const CBlockIndex* pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -560,6 +673,38 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 }
 
+/** Add blocks below the snapshot base that the history validation needs next,
+ *  and that are neither downloaded nor in flight, to vBlocks, until it has at
+ *  most count entries. */
+void FindSnapshotBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks) {
+    if (count == 0 || pindexSnapshotHistoryNext == NULL)
+        return;
+
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+    ProcessBlockAvailability(nodeid);
+
+    int nWindowStart = pindexSnapshotHistoryNext->nHeight;
+    int nWindowEnd = std::min<int>(nWindowStart + BLOCK_DOWNLOAD_WINDOW, pindexSnapshotBase->nHeight);
+    CBlockIndex* pindexWindowEnd = pindexSnapshotBase->GetAncestor(nWindowEnd);
+    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->GetAncestor(nWindowEnd) != pindexWindowEnd)
+        return;
+
+    std::vector<CBlockIndex*> vWindow(nWindowEnd - nWindowStart + 1);
+    CBlockIndex* pindexWalk = pindexWindowEnd;
+    for (size_t i = vWindow.size(); i > 0; i--) {
+        vWindow[i - 1] = pindexWalk;
+        pindexWalk = pindexWalk->pprev;
+    }
+    for (CBlockIndex* pindex : vWindow) {
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) && mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
+            vBlocks.push_back(pindex);
+            if (vBlocks.size() == count)
+                return;
+        }
+    }
+}
+
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -615,6 +760,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewFlusher *pcoinsflusher = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -634,7 +781,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // have been mined or received.
     // 10,000 orphans, each of which is at most 5,000 bytes big is
     // at most 500 megabytes of orphans:
-    unsigned int sz = GetSerializeSize(tx, SER_NETWORK, tx.nVersion);
+    unsigned int sz = tx.GetTotalSize();
     if (sz > 5000)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
@@ -797,6 +944,8 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
  *    nHeight can become valid at a later height), we make the bans conditional on not
  *    being in Initial Block Download mode.
  * 4. The isInitBlockDownload argument is a function parameter to assist with testing.
+ * 5. fCheckShieldedAuth is only cleared for blocks covered by -assumevalid; it skips the
+ *    JoinSplit signature and the Sapling proofs and signatures, but not the other rules.
  */
 bool ContextualCheckTransaction(
         const CTransaction& tx,
@@ -804,7 +953,9 @@ bool ContextualCheckTransaction(
         const CChainParams& chainparams,
         const int nHeight,
         const bool isMined,
-        bool (*isInitBlockDownload)(const Consensus::Params&))
+        bool (*isInitBlockDownload)(const Consensus::Params&),
+        bool fCheckShieldedAuth,
+        const PrecomputedTransactionData* txdata)
 {
     const int DOS_LEVEL_BLOCK = 100;
     // DoS level set to 10 to be more forgiving.
@@ -921,7 +1072,7 @@ bool ContextualCheckTransaction(
 
         // Reject transactions that exceed pre-sapling size limits
         static_assert(MAX_BLOCK_SIZE > MAX_TX_SIZE_BEFORE_SAPLING); // sanity
-        if (::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) > MAX_TX_SIZE_BEFORE_SAPLING)
+        if (tx.GetTotalSize() > MAX_TX_SIZE_BEFORE_SAPLING)
             return state.DoS(
                 dosLevelPotentiallyRelaxing,
                 error("ContextualCheckTransaction(): size limits failed"),
@@ -1081,6 +1232,11 @@ bool ContextualCheckTransaction(
     uint256 dataToBeSigned;
     uint256 prevDataToBeSigned;
 
+    // Everything below authorizes the shielded parts of the transaction.
+    if (!fCheckShieldedAuth) {
+        return true;
+    }
+
     if (!tx.vJoinSplit.empty() ||
         !tx.vShieldedSpend.empty() ||
         !tx.vShieldedOutput.empty())
@@ -1088,8 +1244,8 @@ bool ContextualCheckTransaction(
         // Empty output script.
         CScript scriptCode;
         try {
-            dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId);
-            prevDataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, prevConsensusBranchId);
+            dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId, txdata);
+            prevDataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, prevConsensusBranchId, txdata);
         } catch (std::logic_error ex) {
             // A logic error should never occur because we pass NOT_AN_INPUT and
             // SIGHASH_ALL to SignatureHash().
@@ -1193,22 +1349,25 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
         transactionsValidated.increment();
     }
 
-    if (!CheckTransactionWithoutProofVerification(tx, state)) {
-        return false;
-    } else {
-        // Ensure that zk-SNARKs verify
-        for (const JSDescription &joinsplit : tx.vJoinSplit) {
-            if (!verifier.VerifySprout(joinsplit, tx.joinSplitPubKey)) {
-                return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
-                                    REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
-            }
+    return CheckTransactionWithoutProofVerification(tx, state) &&
+           CheckTransactionProofs(tx, state, verifier);
+}
+
+bool CheckTransactionProofs(const CTransaction& tx, CValidationState &state,
+                            ProofVerifier& verifier)
+{
+    // Ensure that zk-SNARKs verify
+    for (const JSDescription &joinsplit : tx.vJoinSplit) {
+        if (!verifier.VerifySprout(joinsplit, tx.joinSplitPubKey)) {
+            return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
+                                REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
         }
+    }
 
-        // Sapling zk-SNARK proofs are checked in librustzcash_sapling_check_{spend,output},
-        // called from ContextualCheckTransaction.
+    // Sapling zk-SNARK proofs are checked in librustzcash_sapling_check_{spend,output},
+    // called from ContextualCheckTransaction.
 
-        return true;
-    }
+    return true;
 }
 
 /**
@@ -1279,7 +1438,7 @@ bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidatio
     // Size limits
     static_assert(MAX_BLOCK_SIZE >= MAX_TX_SIZE_AFTER_SAPLING); // sanity
     static_assert(MAX_TX_SIZE_AFTER_SAPLING > MAX_TX_SIZE_BEFORE_SAPLING); // sanity
-    if (::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) > MAX_TX_SIZE_AFTER_SAPLING)
+    if (tx.GetTotalSize() > MAX_TX_SIZE_AFTER_SAPLING)
         return state.DoS(100, error("CheckTransaction(): size limits failed"),
                          REJECT_INVALID, "bad-txns-oversize");
 
@@ -1481,10 +1640,31 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+CTxPreVerification PreVerifyTransaction(const CTransaction& tx, const CChainParams& chainparams, int nHeight)
+{
+    CTxPreVerification result;
+    result.nHeight = nHeight;
+
+    auto verifier = ProofVerifier::Strict();
+    if (!CheckTransaction(tx, result.state, verifier)) {
+        error("PreVerifyTransaction: CheckTransaction failed");
+        return result;
+    }
+
+    result.txdata = std::make_shared<const PrecomputedTransactionData>(tx);
+    if (!ContextualCheckTransaction(tx, result.state, chainparams, nHeight, false, IsInitialBlockDownload, true, result.txdata.get())) {
+        error("PreVerifyTransaction: ContextualCheckTransaction failed");
+        return result;
+    }
+
+    result.fValid = true;
+    return result;
+}
+
 bool AcceptToMemoryPool(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee)
+        bool* pfMissingInputs, bool fRejectAbsurdFee, const CTxPreVerification* pverified)
 {
     AssertLockHeld(cs_main);
     LOCK(pool.cs); // mempool "read lock" (held through pool.addUnchecked())
@@ -1502,13 +1682,29 @@ bool AcceptToMemoryPool(
         return false;
     }
 
-    auto verifier = ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
-        return error("AcceptToMemoryPool: CheckTransaction failed");
+    // Compute the signature hash midstates once. They are shared by the
+    // shielded and transparent signature checks below, and kept with the
+    // mempool entry so that block validation can reuse them.
+    std::shared_ptr<const PrecomputedTransactionData> txdata;
+    if (pverified && pverified->nHeight == nextBlockHeight) {
+        // The context-free checks were done before taking the locks, for the
+        // block we are about to check against.
+        if (!pverified->fValid) {
+            state = pverified->state;
+            return error("AcceptToMemoryPool: pre-verification failed");
+        }
+        txdata = pverified->txdata;
+    } else {
+        auto verifier = ProofVerifier::Strict();
+        if (!CheckTransaction(tx, state, verifier))
+            return error("AcceptToMemoryPool: CheckTransaction failed");
 
-    // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, chainparams, nextBlockHeight, false)) {
-        return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
+        txdata = std::make_shared<const PrecomputedTransactionData>(tx);
+
+        // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
+        if (!ContextualCheckTransaction(tx, state, chainparams, nextBlockHeight, false, IsInitialBlockDownload, true, txdata.get())) {
+            return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
+        }
     }
 
     // DoS mitigation: reject transactions expiring soon
@@ -1573,25 +1769,22 @@ bool AcceptToMemoryPool(
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            if (view.HaveCoin(outpoint)) {
+                return false;
+            }
+        }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         for (const CTxIn txin : tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(error("AcceptToMemoryPool: inputs already spent"),
-                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // Are the shielded spends' requirements met?
         auto unmetShieldedReq = view.HaveShieldedRequirements(tx);
         if (unmetShieldedReq) {
@@ -1637,8 +1830,8 @@ bool AcceptToMemoryPool(
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         for (const CTxIn &txin : tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1647,7 +1840,7 @@ bool AcceptToMemoryPool(
         // We don't yet know if the transaction commits to consensusBranchId,
         // but if the entry gets added to the mempool, then it has passed
         // ContextualCheckInputs and therefore this is correct.
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(MakeTransactionRef(tx), nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId, txdata);
         unsigned int nSize = entry.GetTxSize();
 
         // Before zcashd 4.2.0, we had a condition here to always accept a tx if it contained
@@ -1701,8 +1894,7 @@ bool AcceptToMemoryPool(
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        PrecomputedTransactionData txdata(tx);
-        if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+        if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, *txdata, chainparams.GetConsensus(), consensusBranchId))
         {
             return error("AcceptToMemoryPool: ConnectInputs failed %s", hash.ToString());
         }
@@ -1716,7 +1908,7 @@ bool AcceptToMemoryPool(
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+        if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, *txdata, chainparams.GetConsensus(), consensusBranchId))
         {
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
@@ -1805,6 +1997,24 @@ bool GetAddressUnspent(const uint160& addressHash, int type,
     return true;
 }
 
+/** Read the transaction at postx, and the hash of the block containing it. */
+static bool ReadTransactionFromDisk(const CDiskTxPos& postx, CTransaction& txOut, uint256& hashBlock)
+{
+    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: OpenBlockFile failed", __func__);
+    CBlockHeader header;
+    try {
+        file >> header;
+        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+        file >> txOut;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    hashBlock = header.GetHash();
+    return true;
+}
+
 /**
  * Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock.
  * If blockIndex is provided, the transaction is fetched from the corresponding block.
@@ -1824,18 +2034,8 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::P
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
+                if (!ReadTransactionFromDisk(postx, txOut, hashBlock))
+                    return false;
                 if (txOut.GetHash() != hash)
                     return error("%s: txid mismatch", __func__);
                 return true;
@@ -1845,13 +2045,27 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::P
             return false;
         }
 
+        if (ptxheightindex) {
+            // The index only keeps a prefix of each txid, so check each
+            // candidate that is still on the active chain.
+            for (const CTxHeightIndexEntry& entry : ptxheightindex->Find(hash)) {
+                CBlockIndex* pindex = chainActive[entry.nHeight];
+                if (!pindex || !(pindex->nStatus & BLOCK_HAVE_DATA))
+                    continue;
+                CDiskTxPos postx(pindex->GetBlockPos(), entry.nTxOffset);
+                if (ReadTransactionFromDisk(postx, txOut, hashBlock) &&
+                        txOut.GetHash() == hash && hashBlock == pindex->GetBlockHash())
+                    return true;
+            }
+            // Not indexed yet, fall back to the slow lookup.
+        }
+
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
-                CCoinsViewCache &view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1861,7 +2075,8 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::P
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
-            for (const CTransaction &tx : block.vtx) {
+            for (const CTransactionRef& ptx : block.vtx) {
+                const CTransaction& tx = *ptx;
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -2190,20 +2405,10 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         for (const CTxIn &txin : tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -2211,7 +2416,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2261,14 +2466,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2284,8 +2489,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2314,6 +2519,28 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
+std::shared_ptr<const PrecomputedTransactionData> GetPrecomputedTxData(const CTransaction& tx)
+{
+    auto txdata = mempool.GetTxData(tx.GetHash());
+    if (!txdata) {
+        txdata = std::make_shared<const PrecomputedTransactionData>(tx);
+    }
+    return txdata;
+}
+
+const std::vector<std::shared_ptr<const PrecomputedTransactionData>>& GetBlockTxData(const CBlock& block)
+{
+    if (block.vTxData.size() != block.vtx.size() || block.hashTxDataRoot != block.hashMerkleRoot) {
+        block.vTxData.clear();
+        block.vTxData.reserve(block.vtx.size());
+        for (const CTransactionRef& ptx : block.vtx) {
+            block.vTxData.push_back(GetPrecomputedTxData(*ptx));
+        }
+        block.hashTxDataRoot = block.hashMerkleRoot;
+    }
+    return block.vTxData;
+}
+
 bool ContextualCheckInputs(
     const CTransaction& tx,
     CValidationState &state,
@@ -2321,7 +2548,7 @@ bool ContextualCheckInputs(
     bool fScriptChecks,
     unsigned int flags,
     bool cacheStore,
-    PrecomputedTransactionData& txdata,
+    const PrecomputedTransactionData& txdata,
     const Consensus::Params& consensusParams,
     uint32_t consensusBranchId,
     std::vector<CScriptCheck> *pvChecks)
@@ -2345,11 +2572,11 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2362,7 +2589,7 @@ bool ContextualCheckInputs(
                     // notice their transactions failing before a second network
                     // upgrade occurs.
                     auto prevConsensusBranchId = PrevEpochBranchId(consensusBranchId, consensusParams);
-                    CScriptCheck checkPrev(*coins, tx, i, flags, cacheStore, prevConsensusBranchId, &txdata);
+                    CScriptCheck checkPrev(coin.out, tx, i, flags, cacheStore, prevConsensusBranchId, &txdata);
                     if (checkPrev()) {
                         return state.DoS(
                             10, false, REJECT_INVALID, strprintf(
@@ -2377,7 +2604,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2428,6 +2655,8 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -2455,47 +2684,47 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
-} // anon namespace
+enum DisconnectResult
+{
+    DISCONNECT_OK,      // All good.
+    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
+    DISCONNECT_FAILED   // Something else went wrong.
+};
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
- * @return True on success.
+ * @return A DisconnectResult.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static DisconnectResult ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
 
-    return fClean;
-}
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent()) {
+            error("%s: undo data adding output to missing transaction", __func__);
+            return DISCONNECT_FAILED;
+        }
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+    }
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
-enum DisconnectResult
-{
-    DISCONNECT_OK,      // All good.
-    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
-    DISCONNECT_FAILED   // Something else went wrong.
-};
+    return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
+}
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state.
@@ -2530,7 +2759,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 const hash = tx.GetHash();
 
         // insightexplorer
@@ -2557,21 +2786,16 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        bool is_coinbase = tx.IsCoinBase();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != coin.nHeight || is_coinbase != coin.fCoinBase) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+            }
         }
 
         // unspend nullifiers
@@ -2579,16 +2803,17 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size()) {
                 error("DisconnectBlock(): transaction and undo data inconsistent");
                 return DISCONNECT_FAILED;
             }
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
-                    fClean = false;
+                DisconnectResult res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
+                if (res == DISCONNECT_FAILED)
+                    return DISCONNECT_FAILED;
+                fClean = fClean && res != DISCONNECT_UNCLEAN;
 
                 // insightexplorer
                 // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2304
@@ -2607,7 +2832,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
                         // restore unspent index
                         addressUnspentIndex.push_back(make_pair(
                             CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
-                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, view.AccessCoin(out).nHeight)));
                     }
                 }
                 // insightexplorer
@@ -2720,11 +2945,48 @@ static bool ShouldCheckTransactions(const CChainParams& chainparams, const CBloc
              && Checkpoints::IsAncestorOfLastCheckpoint(chainparams.Checkpoints(), pindex));
 }
 
+/**
+ * Determine whether the proofs and signatures of a block may be assumed valid.
+ * Returns `true` only if all of the following are true:
+ *   - the -assumevalid block is in our block index and `pindex` is one of its ancestors
+ *   - the -assumevalid block is on the chain of our best header
+ *   - our best header has at least the minimum chain work
+ *   - our best header is more than two weeks' worth of work beyond `pindex`,
+ *     so that a recently mined block is never skipped.
+ * The UTXO, nullifier, anchor and value pool rules are still enforced.
+ */
+bool IsAssumedValid(const CChainParams& chainparams, const CBlockIndex* pindex) {
+    if (hashAssumeValid.IsNull() || pindexBestHeader == NULL) {
+        return false;
+    }
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end()) {
+        return false;
+    }
+    const CBlockIndex* pindexAssumeValid = it->second;
+    if (pindexAssumeValid->GetAncestor(pindex->nHeight) != pindex) {
+        return false;
+    }
+    if (pindexBestHeader->GetAncestor(pindexAssumeValid->nHeight) != pindexAssumeValid) {
+        return false;
+    }
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    if (pindexBestHeader->nChainWork < UintToArith256(consensusParams.nMinimumChainWork)) {
+        return false;
+    }
+    return GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) > 60 * 60 * 24 * 7 * 2;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck,
+                  CBlockProfile* pprofile)
 {
     AssertLockHeld(cs_main);
 
+    int64_t nTimeConnectStart = GetTimeMicros();
+    CBlockProfile profileDummy;
+    CBlockProfile& profile = pprofile ? *pprofile : profileDummy;
+
     bool fExpensiveChecks = true;
 
     // If this block is an ancestor of a checkpoint, disable expensive checks
@@ -2732,6 +2994,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         fExpensiveChecks = false;
     }
 
+    // Likewise if this block is an ancestor of the -assumevalid block
+    if (fExpensiveChecks && IsAssumedValid(chainparams, pindex)) {
+        fExpensiveChecks = false;
+    }
+
     // proof verification is expensive, disable if possible
     auto verifier = fExpensiveChecks ? ProofVerifier::Strict() : ProofVerifier::Disabled();
 
@@ -2740,7 +3007,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     bool fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
 
     // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams, verifier, !fJustCheck, !fJustCheck, fCheckTransactions))
+    if (!CheckBlock(block, state, chainparams, verifier, !fJustCheck, !fJustCheck, fCheckTransactions, &profile))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2792,12 +3059,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
-    for (const CTransaction& tx : block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+    int64_t nTimeOverwriteStart = GetTimeMicros();
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+            }
+        }
     }
+    profile.nTimeUtxo += GetTimeMicros() - nTimeOverwriteStart;
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
 
@@ -2846,12 +3118,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     size_t total_sapling_tx = 0;
 
-    std::vector<PrecomputedTransactionData> txdata;
-    txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+    // Transactions that passed through our mempool already carry their
+    // signature hash midstates; the rest were computed once for this block,
+    // usually by ContextualCheckBlock().
+    const auto& txdata = GetBlockTxData(block);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         const uint256 hash = tx.GetHash();
+        int64_t nTimeTx0 = GetTimeMicros();
+        profile.AddTransaction(tx);
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -2918,8 +3194,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 return state.DoS(100, error("ConnectBlock(): too many sigops"),
                                  REJECT_INVALID, "bad-blk-sigops");
         }
-
-        txdata.emplace_back(tx);
+        int64_t nTimeTx1 = GetTimeMicros();
 
         if (!tx.IsCoinBase())
         {
@@ -2927,10 +3202,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
+            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, *txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
+        int64_t nTimeTx2 = GetTimeMicros();
 
         // insightexplorer
         // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2656
@@ -2954,11 +3230,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             }
         }
 
+        int64_t nTimeTx3 = GetTimeMicros();
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
+        int64_t nTimeTx4 = GetTimeMicros();
 
         for (const JSDescription &joinsplit : tx.vJoinSplit) {
             for (const uint256 &note_commitment : joinsplit.commitments) {
@@ -2971,15 +3249,22 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         for (const OutputDescription &outputDescription : tx.vShieldedOutput) {
             sapling_tree.append(outputDescription.cmu);
         }
+        int64_t nTimeTx5 = GetTimeMicros();
+
+        profile.nTimeUtxo += (nTimeTx1 - nTimeTx0) + (nTimeTx4 - nTimeTx3);
+        profile.nTimeScripts += nTimeTx2 - nTimeTx1;
+        profile.nTimeTrees += nTimeTx5 - nTimeTx4;
+        profile.nTimeByType[GetBlockProfileTxType(tx)] += (nTimeTx2 - nTimeTx0) + (nTimeTx4 - nTimeTx3);
 
         if (!(tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())) {
             total_sapling_tx += 1;
         }
 
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        pos.nTxOffset += tx.GetTotalSize();
     }
 
+    int64_t nTimeAnchorStart = GetTimeMicros();
     view.PushAnchor(sprout_tree);
     view.PushAnchor(sapling_tree);
     if (!fJustCheck) {
@@ -2996,6 +3281,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
     blockundo.old_sprout_tree_root = old_sprout_tree_root;
+    int64_t nTimeHistoryStart = GetTimeMicros();
+    profile.nTimeTrees += nTimeHistoryStart - nTimeAnchorStart;
 
     if (IsActivationHeight(pindex->nHeight, chainparams.GetConsensus(), Consensus::UPGRADE_HEARTWOOD)) {
         // In the block that activates ZIP 221, block.hashLightClientRoot MUST
@@ -3045,18 +3332,21 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
+    profile.nTimeHistory += nTime1 - nTimeHistoryStart;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
+    int64_t nTimeWaitStart = GetTimeMicros();
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
+    profile.nTimeScripts += nTime2 - nTimeWaitStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
     if (fJustCheck)
@@ -3137,14 +3427,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     int64_t nTime3 = GetTimeMicros(); nTimeIndex += nTime3 - nTime2;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
+    profile.nTimeIndex += nTime3 - nTime2;
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime4 = GetTimeMicros(); nTimeCallbacks += nTime4 - nTime3;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3), nTimeCallbacks * 0.000001);
+    profile.nTimeConnect = nTime4 - nTimeConnectStart;
 
     return true;
 }
@@ -3192,10 +3484,13 @@ bool static FlushStateToDisk(
         nLastFlush = nNow;
     }
     size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // With a background writer, the cache handed to it stays in memory until
+    // it is committed, so the cache may only use half of the budget.
+    size_t nCacheLimit = pcoinsflusher ? nCoinCacheUsage / 2 : nCoinCacheUsage;
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
-    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCacheLimit;
     // The cache is over the limit, we have to write now.
-    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCacheLimit;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -3234,16 +3529,20 @@ bool static FlushStateToDisk(
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With a background writer this only hands the cache over, waiting
+        // for the previous write if it is still running.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        if (mode == FLUSH_STATE_ALWAYS && pcoinsflusher && !pcoinsflusher->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     // Don't flush the wallet witness cache (SetBestChain()) here, see #4301
@@ -3414,7 +3713,8 @@ bool static DisconnectTip(CValidationState &state, const CChainParams& chainpara
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
-        for (const CTransaction &tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             // ignore validation errors in resurrected transactions
             list<CTransaction> removed;
             CValidationState stateDummy;
@@ -3461,13 +3761,16 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
 {
     assert(pblock && pindexNew->pprev == chainActive.Tip());
     int64_t nTime1 = GetTimeMicros();
+    CBlockProfile profile;
+    profile.hash = pindexNew->GetBlockHash();
+    profile.nHeight = pindexNew->nHeight;
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams, false, &profile);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -3512,6 +3815,13 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
     MetricsIncrementCounter("zcash.chain.verified.block.total");
     MetricsHistogram("zcash.chain.verified.block.seconds", (nTime6 - nTime1) * 0.000001);
+
+    profile.nTimeConnected = GetTime();
+    profile.nTimeFlush = nTime4 - nTime3;
+    profile.nTimeChainState = nTime5 - nTime4;
+    profile.nTimePostConnect = nTime6 - nTime5;
+    profile.nTimeTotal = nTime6 - nTime1;
+    blockProfiler.BlockConnected(profile);
     return true;
 }
 
@@ -3731,6 +4041,10 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
  */
 bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams, const CBlock* pblock)
 {
+    // Held until the last notification for the new tip has been sent, so
+    // that the tip changes and their signals are seen in the same order.
+    LOCK(cs_chainstate);
+
     CBlockIndex *pindexMostWork = NULL;
     CBlockIndex *pindexNewTip = NULL;
     do {
@@ -3738,8 +4052,10 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
 
         bool fInitialDownload;
         int nNewHeight;
+        const CBlockIndex *pindexFork;
         {
             LOCK(cs_main);
+            CBlockIndex *pindexOldTip = chainActive.Tip();
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -3750,6 +4066,7 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = pindexOldTip ? chainActive.FindFork(pindexOldTip) : NULL;
             fInitialDownload = IsInitialBlockDownload(chainparams.GetConsensus());
             nNewHeight = chainActive.Height();
         }
@@ -3765,13 +4082,47 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
             {
-                LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (nNewHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                LOCK2(cs_main, cs_vNodes);
+                // Find the hashes of all blocks that weren't previously in the best chain.
+                std::vector<uint256> vHashes;
+                CBlockIndex *pindexToAnnounce = pindexNewTip;
+                while (pindexToAnnounce != pindexFork) {
+                    vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                    pindexToAnnounce = pindexToAnnounce->pprev;
+                    if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                        // Limit announcements in case of a huge reorganization.
+                        // Rely on the peer's synchronization mechanism in that case.
+                        break;
+                    }
+                }
+                // Peers in high-bandwidth compact block mode get the new tip as
+                // a cmpctblock straight away when we have it in memory, saving
+                // them the getdata round trip. Everyone else gets the new
+                // blocks announced with headers or inv from SendMessages.
+                std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                for (CNode* pnode : vNodes) {
+                    if (nNewHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        CNodeState* nodestate = State(pnode->GetId());
+                        if (pblock && pblock->GetHash() == hashNewTip && nodestate && nodestate->fPreferHeaderAndIDs &&
+                                pindexNewTip->pprev == pindexFork) {
+                            if (!PeerHasHeader(nodestate, pindexNewTip) && PeerHasHeader(nodestate, pindexNewTip->pprev)) {
+                                if (!pcmpctblock) {
+                                    pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
+                                }
+                                LogPrint("net", "%s sending cmpctblock %s to peer=%d\n", __func__, hashNewTip.ToString(), pnode->id);
+                                pnode->PushMessage("cmpctblock", *pcmpctblock);
+                                nodestate->pindexBestHeaderSent = pindexNewTip;
+                                continue;
+                            }
+                        }
+                        for (auto it = vHashes.rbegin(); it != vHashes.rend(); ++it) {
+                            pnode->PushBlockHash(*it);
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
-            GetMainSignals().UpdatedBlockTip(pindexNewTip);
+            GetMainSignals().UpdatedBlockTip(pindexNewTip, pblock && pblock->GetHash() == hashNewTip ? pblock : NULL);
         }
     } while (pindexNewTip != pindexMostWork);
     CheckBlockIndex(chainparams.GetConsensus());
@@ -3955,14 +4306,15 @@ bool ReceivedBlockTransactions(
     pindexNew->nChainTx = 0;
     CAmount sproutValue = 0;
     CAmount saplingValue = 0;
-    for (auto tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         // Negative valueBalance "takes" money from the transparent value pool
         // and adds it to the Sapling value pool. Positive valueBalance "gives"
         // money to the transparent value pool, removing from the Sapling value
         // pool. So we invert the sign here.
         saplingValue += -tx.valueBalance;
 
-        for (auto js : tx.vJoinSplit) {
+        for (const JSDescription& js : tx.vJoinSplit) {
             sproutValue += js.vpub_old;
             sproutValue -= js.vpub_new;
         }
@@ -4147,17 +4499,18 @@ bool CheckBlock(const CBlock& block,
                 ProofVerifier& verifier,
                 bool fCheckPOW,
                 bool fCheckMerkleRoot,
-                bool fCheckTransactions)
+                bool fCheckTransactions,
+                CBlockProfile* pprofile)
 {
     // These are checks that are independent of context.
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
-    if (!CheckBlockHeader(block, state, chainparams, fCheckPOW))
+    if (!CheckBlockHeader(block, state, chainparams, fCheckPOW && !block.fCheckedPOW))
         return false;
 
     // Check the merkle root.
-    if (fCheckMerkleRoot) {
+    if (fCheckMerkleRoot && !block.fCheckedPOW) {
         bool mutated;
         uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
@@ -4172,6 +4525,11 @@ bool CheckBlock(const CBlock& block,
                              REJECT_INVALID, "bad-txns-duplicate", true);
     }
 
+    // Equihash and the merkle tree are the expensive part of the checks
+    // above; remember that they passed, for ConnectBlock and the like.
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fCheckedPOW = true;
+
     // All potential-corruption validation must be done before we do any
     // transaction validation, as otherwise we may mark the header as invalid
     // because we receive the wrong transactions for it.
@@ -4182,11 +4540,11 @@ bool CheckBlock(const CBlock& block,
                          REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock(): first tx is not coinbase"),
                          REJECT_INVALID, "bad-cb-missing");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, error("CheckBlock(): more than one coinbase"),
                              REJECT_INVALID, "bad-cb-multiple");
 
@@ -4194,13 +4552,26 @@ bool CheckBlock(const CBlock& block,
     if (!fCheckTransactions) return true;
 
     // Check transactions
-    for (const CTransaction& tx : block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+        // CheckTransaction, with only the proofs timed.
+        if (!tx.IsCoinBase()) {
+            transactionsValidated.increment();
+        }
+        if (!CheckTransactionWithoutProofVerification(tx, state))
             return error("CheckBlock(): CheckTransaction failed");
+        int64_t nTimeProofStart = GetTimeMicros();
+        if (!CheckTransactionProofs(tx, state, verifier))
+            return error("CheckBlock(): CheckTransaction failed");
+        if (pprofile && !tx.vJoinSplit.empty()) {
+            pprofile->AddProofTime(tx, GetTimeMicros() - nTimeProofStart);
+        }
+    }
 
     unsigned int nSigOps = 0;
-    for (const CTransaction& tx : block.vtx)
+    for (const CTransactionRef& ptx : block.vtx)
     {
+        const CTransaction& tx = *ptx;
         nSigOps += GetLegacySigOpCount(tx);
     }
     if (nSigOps > MAX_BLOCK_SIGOPS)
@@ -4295,19 +4666,29 @@ bool ContextualCheckBlockHeader(
 bool ContextualCheckBlock(
     const CBlock& block, CValidationState& state,
     const CChainParams& chainparams, CBlockIndex * const pindexPrev,
-    bool fCheckTransactions)
+    bool fCheckTransactions,
+    bool fCheckShieldedAuth,
+    CBlockProfile* pprofile)
 {
     const int nHeight = pindexPrev == NULL ? 0 : pindexPrev->nHeight + 1;
     const Consensus::Params& consensusParams = chainparams.GetConsensus();
 
     if (fCheckTransactions) {
+        const auto& txdata = GetBlockTxData(block);
+
         // Check that all transactions are finalized
-        for (const CTransaction& tx : block.vtx) {
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            const CTransaction& tx = *block.vtx[i];
 
             // Check transaction contextually against consensus rules at block height
-            if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, true)) {
+            int64_t nTimeTxStart = GetTimeMicros();
+            if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, true, IsInitialBlockDownload, fCheckShieldedAuth,
+                                            txdata[i].get())) {
                 return false; // Failure reason has been set in validation state object
             }
+            if (pprofile) {
+                pprofile->AddProofTime(tx, GetTimeMicros() - nTimeTxStart);
+            }
 
             int nLockTimeFlags = 0;
             int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
@@ -4327,8 +4708,8 @@ bool ContextualCheckBlock(
     if (nHeight > 0)
     {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s: block height mismatch in coinbase", __func__),
                              REJECT_INVALID, "bad-cb-height");
         }
@@ -4343,7 +4724,7 @@ bool ContextualCheckBlock(
         if ((nHeight > 0) && (nHeight <= consensusParams.GetLastFoundersRewardBlockHeight(nHeight))) {
             bool found = false;
 
-            for (const CTxOut& output : block.vtx[0].vout) {
+            for (const CTxOut& output : block.vtx[0]->vout) {
                 if (output.scriptPubKey == chainparams.GetFoundersRewardScriptAtHeight(nHeight)) {
                     if (output.nValue == (GetBlockSubsidy(nHeight, consensusParams) / 5)) {
                         found = true;
@@ -4360,7 +4741,7 @@ bool ContextualCheckBlock(
         // After YCash fork, the founders reward is 5% in perpetuity
         bool found = false;
 
-        for (const CTxOut& output : block.vtx[0].vout) {
+        for (const CTxOut& output : block.vtx[0]->vout) {
             if (output.scriptPubKey == chainparams.GetFoundersRewardScriptAtHeight(nHeight)) {
                 if (output.nValue == (GetBlockSubsidy(nHeight, consensusParams) / 20)) {
                     found = true;
@@ -4377,7 +4758,7 @@ bool ContextualCheckBlock(
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckedPOW=false)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -4394,7 +4775,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         return true;
     }
 
-    if (!CheckBlockHeader(block, state, chainparams))
+    if (!CheckBlockHeader(block, state, chainparams, !fCheckedPOW))
         return false;
 
     // Get prev block index
@@ -4434,7 +4815,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
 
     CBlockIndex *&pindex = *ppindex;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex))
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, block.fCheckedPOW))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -4461,14 +4842,21 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     // See method docstring for why this is always disabled.
     auto verifier = ProofVerifier::Disabled();
     bool fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
+    bool fCheckShieldedAuth = !IsAssumedValid(chainparams, pindex);
+    // Sapling proofs and JoinSplit signatures are checked here rather than in
+    // ConnectBlock, so their timings are kept until the block is connected.
+    CBlockProfile acceptedProfile;
+    acceptedProfile.hash = pindex->GetBlockHash();
+    acceptedProfile.nHeight = pindex->nHeight;
     if ((!CheckBlock(block, state, chainparams, verifier, true, true, fCheckTransactions)) ||
-         !ContextualCheckBlock(block, state, chainparams, pindex->pprev, fCheckTransactions)) {
+         !ContextualCheckBlock(block, state, chainparams, pindex->pprev, fCheckTransactions, fCheckShieldedAuth, &acceptedProfile)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
         }
         return false;
     }
+    blockProfiler.BlockAccepted(acceptedProfile);
 
     int nHeight = pindex->nHeight;
 
@@ -4857,6 +5245,11 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     if (fHavePruned)
         LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
+    // Check whether the chainstate was loaded from a snapshot
+    pblocktree->ReadFlag("chainstatesnapshot", fSnapshotChainstate);
+    if (fSnapshotChainstate)
+        LogPrintf("LoadBlockIndexDB(): Chainstate was loaded from a snapshot\n");
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
@@ -4882,6 +5275,14 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     else if (fLightWalletd) {
         fAddressIndex = true;
     }
+    // Indexes built in the background after the database was created
+    bool fBuilt = false;
+    if (pblocktree->ReadFlag("addressindex", fBuilt) && fBuilt)
+        fAddressIndex = true;
+    if (pblocktree->ReadFlag("spentindex", fBuilt) && fBuilt)
+        fSpentIndex = true;
+    if (pblocktree->ReadFlag("timestampindex", fBuilt) && fBuilt)
+        fTimestampIndex = true;
 
     // Fill in-memory data
     for (const std::pair<uint256, CBlockIndex*>& item : mapBlockIndex)
@@ -4956,6 +5357,14 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if ((fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) ||
+            (fSnapshotChainstate && !(pindex->nStatus & BLOCK_HAVE_UNDO))) {
+            // Only go back as far as we have data, on pruned nodes, and as far
+            // as we have undo data on those loaded from a snapshot: blocks
+            // below the snapshot are downloaded for validation without it.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (no data)\n", pindex->nHeight);
+            break;
+        }
 
         CBlock block;
         // check level 0: read from disk
@@ -5217,6 +5626,9 @@ void UnloadBlockIndex()
     }
     mapBlockIndex.clear();
     fHavePruned = false;
+    fSnapshotChainstate = false;
+    pindexSnapshotBase = NULL;
+    pindexSnapshotHistoryNext = NULL;
 }
 
 bool LoadBlockIndex()
@@ -5227,86 +5639,559 @@ bool LoadBlockIndex()
     return true;
 }
 
-bool InitBlockIndex(const CChainParams& chainparams)
+bool WriteChainstateSnapshot(const fs::path& path, CChainstateSnapshotInfo& info)
 {
-    LOCK(cs_main);
-
-    // Initialize global variables that cannot be constructed at startup.
-    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
-
-    // Check whether we're already initialized
-    if (chainActive.Genesis() != NULL)
-        return true;
+    // Write to a temporary file, so that an incomplete snapshot is never
+    // mistaken for a usable one.
+    fs::path pathTmp = path;
+    pathTmp += ".incomplete";
+    CAutoFile file(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+
+    const CChainParams& chainparams = Params();
+    CHashingWriter<CAutoFile> stream(&file);
+    boost::scoped_ptr<CDBIterator> pcursor;
+    {
+        LOCK(cs_main);
+        // Make the database match the tip, then take a cursor over it, which
+        // keeps seeing this state while later blocks are connected.
+        FlushStateToDisk();
+        CBlockIndex* pindexTip = chainActive.Tip();
+        info.hashBlock = pindexTip->GetBlockHash();
+        info.nHeight = pindexTip->nHeight;
+        pcursor.reset(pcoinsdbview->Cursor());
+
+        stream.write((const char*)chainparams.MessageStart(), MESSAGE_START_SIZE);
+        stream << CHAINSTATE_SNAPSHOT_VERSION << info.hashBlock << info.nHeight;
+
+        // Block headers and their index data (transaction counts, value pool
+        // deltas, commitment roots), without the positions of the block data.
+        for (int nHeight = 0; nHeight <= info.nHeight; nHeight++) {
+            CDiskBlockIndex diskindex(chainActive[nHeight]);
+            diskindex.nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO);
+            diskindex.nFile = 0;
+            diskindex.nDataPos = 0;
+            diskindex.nUndoPos = 0;
+            stream << diskindex;
+        }
+    }
+
+    if (!pcoinsdbview->WriteSnapshot(*pcursor, info.hashBlock, stream, info.stats))
+        return false;
 
-#ifdef YCASH_WR
-    // Use the hard-coded setting for -txindex in the new database
-    fTxIndex = true;
-#else
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
-#endif // YCASH_WR
-    pblocktree->WriteFlag("txindex", fTxIndex);
+    info.hashSnapshot = stream.GetHash();
+    file << info.hashSnapshot;
+    FileCommit(file.Get());
+    file.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("%s: failed to rename %s", __func__, pathTmp.string());
+    return true;
+}
 
-    // Use the provided setting for -insightexplorer or -lightwalletd in the new database
-    pblocktree->WriteFlag("insightexplorer", fExperimentalInsightExplorer);
-    pblocktree->WriteFlag("lightwalletd", fExperimentalLightWalletd);
-    if (fExperimentalInsightExplorer) {
-        fAddressIndex = true;
-        fSpentIndex = true;
-        fTimestampIndex = true;
-    }
-    else if (fExperimentalLightWalletd) {
-        fAddressIndex = true;
+/** Undo whatever an incomplete LoadChainstateSnapshot() wrote to the databases. */
+static bool UndoChainstateSnapshotLoad()
+{
+    LogPrintf("Removing an incomplete chainstate snapshot load\n");
+    if (!pcoinsdbview->EraseAll() ||
+        !pblocktree->EraseBlockIndex() ||
+        !pblocktree->WriteFlag("prunedblockfiles", false) ||
+        !pblocktree->WriteFlag("chainstatesnapshot", false) ||
+        !pblocktree->WriteFlag("snapshotloading", false)) {
+        return error("%s: failed to remove the incomplete load", __func__);
     }
+    return true;
+}
 
-    LogPrintf("Initializing databases...\n");
-
-    // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
-    if (!fReindex) {
-        try {
-            CBlock &block = const_cast<CBlock&>(chainparams.GenesisBlock());
-            // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
-            CDiskBlockPos blockPos;
-            CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime()))
-                return error("LoadBlockIndex(): FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
-                return error("LoadBlockIndex(): writing genesis block to disk failed");
-            CBlockIndex *pindex = AddToBlockIndex(block, chainparams.GetConsensus());
-            if (!ReceivedBlockTransactions(block, state, chainparams, pindex, blockPos))
-                return error("LoadBlockIndex(): genesis block not accepted");
-            if (!ActivateBestChain(state, chainparams, &block))
-                return error("LoadBlockIndex(): genesis block cannot be activated");
-            // Force a chainstate write so that when we VerifyDB in a moment, it doesn't check stale data
-            return FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS);
-        } catch (const std::runtime_error& e) {
-            return error("LoadBlockIndex(): failed to initialize block database: %s", e.what());
+/**
+ * Check the note commitment trees and history trees just read from a
+ * snapshot against the roots that its block headers commit to.
+ * mapHistoryCommitments holds, for the first block of each epoch after
+ * Heartwood's, the history tree root its header commits to.
+ */
+static bool CheckChainstateSnapshotRoots(const Consensus::Params& consensusParams, const CDiskBlockIndex& base,
+                                         const std::map<int, uint256>& mapHistoryCommitments)
+{
+    // No header commits to a Sprout root, so the Sprout tree can only be
+    // checked for consistency here; ThreadValidateSnapshotHistory rebuilds
+    // it from the blocks.
+    uint256 sproutRoot = pcoinsdbview->GetBestAnchor(SPROUT);
+    SproutMerkleTree sproutTree;
+    if (!pcoinsdbview->GetSproutAnchorAt(sproutRoot, sproutTree) || sproutTree.root() != sproutRoot ||
+        !pcoinsdbview->GetSproutAnchorAt(base.hashSproutAnchor, sproutTree)) {
+        return error("%s: snapshot Sprout tree is inconsistent", __func__);
+    }
+
+    // Before Heartwood the header commits to the Sapling root directly. From
+    // Heartwood on, the Sapling root is part of the block's history tree
+    // leaf, which the next block's header commits to.
+    uint256 saplingRoot = pcoinsdbview->GetBestAnchor(SAPLING);
+    SaplingMerkleTree saplingTree;
+    if (!pcoinsdbview->GetSaplingAnchorAt(saplingRoot, saplingTree) || saplingTree.root() != saplingRoot) {
+        return error("%s: snapshot Sapling tree is inconsistent", __func__);
+    }
+    if (consensusParams.NetworkUpgradeActive(base.nHeight, Consensus::UPGRADE_SAPLING) &&
+        saplingRoot != base.hashFinalSaplingRoot) {
+        return error("%s: snapshot Sapling tree does not match block %s", __func__, base.GetBlockHash().ToString());
+    }
+
+    // A block from Heartwood on commits to the history tree root as of its
+    // parent (ZIP 221). An epoch's tree is final once the next epoch starts,
+    // so the first block of each later epoch checks the previous epoch's
+    // tree. The base block checks its own epoch's tree without its leaf.
+    for (const std::pair<const int, uint256>& commitment : mapHistoryCommitments) {
+        uint32_t epochId = CurrentEpochBranchId(commitment.first - 1, consensusParams);
+        if (commitment.first < base.nHeight && pcoinsdbview->GetHistoryRoot(epochId) != commitment.second) {
+            return error("%s: snapshot history tree for epoch %08x does not match the block at height %d",
+                         __func__, epochId, commitment.first);
+        }
+    }
+    if (consensusParams.NetworkUpgradeActive(base.nHeight, Consensus::UPGRADE_HEARTWOOD) &&
+        !IsActivationHeight(base.nHeight, consensusParams, Consensus::UPGRADE_HEARTWOOD)) {
+        uint32_t epochId = CurrentEpochBranchId(base.nHeight, consensusParams);
+        if (pcoinsdbview->GetHistoryLength(epochId) == 0) {
+            return error("%s: snapshot history tree has no leaf for block %s", __func__, base.GetBlockHash().ToString());
+        }
+        CCoinsViewCache view(pcoinsdbview);
+        view.PopHistoryNode(epochId);
+        if (view.GetHistoryRoot(CurrentEpochBranchId(base.nHeight - 1, consensusParams)) != base.hashLightClientRoot) {
+            return error("%s: snapshot history tree does not match block %s", __func__, base.GetBlockHash().ToString());
         }
     }
-
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+/** Read a snapshot into the empty databases; see LoadChainstateSnapshot(). */
+static bool ReadChainstateSnapshot(const fs::path& path, const CChainParams& chainparams, const uint256& hashExpected, CChainstateSnapshotInfo& info)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: failed to open %s", __func__, path.string());
+
+    // Check the hash over the whole file before writing anything.
+    LogPrintf("Checking chainstate snapshot %s...\n", path.string());
+    uint64_t nSize = fs::file_size(path);
+    if (nSize < sizeof(uint256))
+        return error("%s: snapshot is truncated", __func__);
+    {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        std::vector<char> buf(1 << 20);
+        for (uint64_t nLeft = nSize - sizeof(uint256); nLeft > 0; ) {
+            boost::this_thread::interruption_point();
+            size_t nRead = std::min<uint64_t>(nLeft, buf.size());
+            file.read(buf.data(), nRead);
+            hasher.write(buf.data(), nRead);
+            nLeft -= nRead;
+        }
+        uint256 hashStored;
+        file >> hashStored;
+        info.hashSnapshot = hasher.GetHash();
+        if (info.hashSnapshot != hashStored)
+            return error("%s: snapshot hash mismatch, the file is corrupt", __func__);
+    }
+    rewind(file.Get());
 
-    int nLoaded = 0;
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    CDiskBlockIndex diskindexBase;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        size_t initialSize = nSizeReindexed;
-        while (!blkdat.eof()) {
+        CMessageHeader::MessageStartChars pchMessageStart;
+        file.read((char*)pchMessageStart, sizeof(pchMessageStart));
+        if (memcmp(pchMessageStart, chainparams.MessageStart(), sizeof(pchMessageStart)))
+            return error("%s: snapshot is for a different network", __func__);
+        int nVersion;
+        file >> nVersion;
+        if (nVersion != CHAINSTATE_SNAPSHOT_VERSION)
+            return error("%s: unsupported snapshot version %d", __func__, nVersion);
+        file >> info.hashBlock >> info.nHeight;
+        if (info.nHeight < 0)
+            return error("%s: invalid snapshot height %d", __func__, info.nHeight);
+
+        // The stored hash only shows that the file is intact. The chainstate
+        // is trusted as it is, so the snapshot must also be one we were told
+        // to expect, by -snapshothash or the chain parameters.
+        uint256 hashTrusted = hashExpected;
+        if (hashTrusted.IsNull()) {
+            MapAssumeutxo::const_iterator it = chainparams.Assumeutxo().find(info.nHeight);
+            if (it != chainparams.Assumeutxo().end() && it->second.hashBlock == info.hashBlock)
+                hashTrusted = it->second.hashSnapshot;
+        }
+        if (hashTrusted.IsNull())
+            return error("%s: no known hash for a snapshot of block %s at height %d, use -snapshothash", __func__, info.hashBlock.ToString(), info.nHeight);
+        if (info.hashSnapshot != hashTrusted)
+            return error("%s: snapshot hash is %s, expected %s", __func__, info.hashSnapshot.GetHex(), hashTrusted.GetHex());
+        LogPrintf("Loading chainstate snapshot of block %s at height %d\n", info.hashBlock.ToString(), info.nHeight);
+
+        // Only the linkage and proof-of-work targets of the headers are checked
+        // here; ThreadValidateSnapshotHistory checks their Equihash solutions.
+        std::vector<CDiskBlockIndex> vIndex;
+        uint256 hashPrev;
+        std::map<int, uint256> mapHistoryCommitments;
+        for (int nHeight = 0; nHeight <= info.nHeight; nHeight++) {
             boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex;
+            file >> diskindex;
+            uint256 hash = diskindex.GetBlockHash();
+            if (diskindex.nHeight != nHeight || diskindex.hashPrev != hashPrev ||
+                (nHeight == 0 && hash != consensusParams.hashGenesisBlock) ||
+                (diskindex.nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO | BLOCK_FAILED_MASK)) ||
+                !CheckProofOfWork(hash, diskindex.nBits, consensusParams)) {
+                return error("%s: invalid block header at height %d", __func__, nHeight);
+            }
+            hashPrev = hash;
+            if (IsActivationHeightForAnyUpgrade(nHeight, consensusParams) &&
+                consensusParams.NetworkUpgradeActive(nHeight, Consensus::UPGRADE_HEARTWOOD) &&
+                !IsActivationHeight(nHeight, consensusParams, Consensus::UPGRADE_HEARTWOOD)) {
+                mapHistoryCommitments[nHeight] = diskindex.hashLightClientRoot;
+            }
+            vIndex.push_back(diskindex);
+            if (vIndex.size() == 10000 || nHeight == info.nHeight) {
+                if (!pblocktree->WriteDiskBlockIndex(vIndex))
+                    return error("%s: failed to write the block index", __func__);
+                vIndex.clear();
+            }
+            if (nHeight == info.nHeight)
+                diskindexBase = diskindex;
+        }
+        if (hashPrev != info.hashBlock)
+            return error("%s: snapshot headers end at %s, expected %s", __func__, hashPrev.ToString(), info.hashBlock.ToString());
 
-            if (fReindex)
-               nSizeReindexed = initialSize + nRewind;
+        if (!pcoinsdbview->ReadSnapshot(file, info.hashBlock, info.stats))
+            return error("%s: failed to load the chainstate", __func__);
+        if (!CheckChainstateSnapshotRoots(consensusParams, diskindexBase, mapHistoryCommitments))
+            return false;
+    } catch (const std::exception& e) {
+        return error("%s: deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // Remember what ThreadValidateSnapshotHistory has to rebuild.
+    CChainstateSnapshotTarget target;
+    target.hashBlock = info.hashBlock;
+    target.nHeight = info.nHeight;
+    if (!pcoinsdbview->HashContents(target.hashContents) || !pblocktree->WriteSnapshotTarget(target))
+        return error("%s: failed to record the snapshot for validation", __func__);
+
+    // Until they are downloaded for validation, the blocks below the snapshot
+    // base are missing like those of a pruned node.
+    if (!pblocktree->WriteFlag("prunedblockfiles", true) ||
+        !pblocktree->WriteFlag("chainstatesnapshot", true) ||
+        !pblocktree->WriteFlag("snapshotloading", false))
+        return error("%s: failed to write database flags", __func__);
+
+    LogPrintf("Loaded chainstate snapshot: %u coins, %u Sprout anchors, %u Sapling anchors, %u nullifiers, %u history nodes\n",
+        info.stats.nCoins, info.stats.nSproutAnchors, info.stats.nSaplingAnchors, info.stats.nNullifiers, info.stats.nHistoryNodes);
+    return true;
+}
+
+bool LoadChainstateSnapshot(const fs::path& path, const CChainParams& chainparams, const uint256& hashExpected, CChainstateSnapshotInfo& info)
+{
+    // A load that failed or was interrupted is undone before trying again.
+    bool fLoading = false;
+    pblocktree->ReadFlag("snapshotloading", fLoading);
+    if (fLoading && !UndoChainstateSnapshotLoad())
+        return false;
+
+    if (!pcoinsdbview->GetBestBlock().IsNull()) {
+        LogPrintf("%s: a chainstate already exists, not loading %s\n", __func__, path.string());
+        return true;
+    }
+    int nLastFile;
+    if (pblocktree->ReadLastBlockFile(nLastFile))
+        return error("%s: the block index is not empty; loading a snapshot needs a new data directory", __func__);
+
+    if (!pblocktree->WriteFlag("snapshotloading", true))
+        return error("%s: failed to write database flags", __func__);
+    if (!ReadChainstateSnapshot(path, chainparams, hashExpected, info)) {
+        UndoChainstateSnapshotLoad();
+        return false;
+    }
+    return true;
+}
+
+void ThreadValidateSnapshotHistory(const CChainParams& chainparams)
+{
+    RenameThread("zcash-snapshot");
+
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    const std::string strInvalid = _("The chainstate snapshot is invalid. Start again with a new data directory.");
+    CChainstateSnapshotTarget target;
+    CBlockIndex* pindexBase;
+    bool fHeadersVerified = false;
+    {
+        LOCK(cs_main);
+        bool fValidated = false;
+        pblocktree->ReadFlag("snapshotvalidated", fValidated);
+        if (!fSnapshotChainstate || fValidated)
+            return;
+        BlockMap::iterator mi;
+        if (!pblocktree->ReadSnapshotTarget(target) || (mi = mapBlockIndex.find(target.hashBlock)) == mapBlockIndex.end()) {
+            AbortNode("The record of the chainstate snapshot to validate is missing", strInvalid);
+            return;
+        }
+        pindexBase = mi->second;
+        pblocktree->ReadFlag("snapshotheadersverified", fHeadersVerified);
+    }
+
+    if (!fHeadersVerified) {
+        LogPrintf("Verifying %u block headers from the chainstate snapshot\n", pindexBase->nHeight);
+        std::vector<CBlockIndex*> vHeaders(pindexBase->nHeight + 1);
+        for (CBlockIndex* pindex = pindexBase; pindex; pindex = pindex->pprev) {
+            vHeaders[pindex->nHeight] = pindex;
+        }
+        for (size_t i = 1; i < vHeaders.size(); i++) {
+            boost::this_thread::interruption_point();
+            // Header fields of a block index entry never change, so no lock is needed.
+            CBlockHeader header = vHeaders[i]->GetBlockHeader();
+            if (!CheckEquihashSolution(&header, consensusParams)) {
+                AbortNode(strprintf("Chainstate snapshot contains an invalid block header at height %d", i), strInvalid);
+                return;
+            }
+            if (i % 100000 == 0) {
+                LogPrintf("Verified %u of %u snapshot block headers\n", i, vHeaders.size());
+            }
+        }
+        LOCK(cs_main);
+        pblocktree->WriteFlag("snapshotheadersverified", true);
+        LogPrintf("Verified all block headers from the chainstate snapshot\n");
+    }
+
+    // Rebuild the chainstate up to the base from the blocks below it, in a
+    // database of its own so that progress survives a restart, and compare it
+    // with the snapshot.
+    {
+        std::unique_ptr<CCoinsViewDB> pviewdb(new CCoinsViewDB("snapshotvalidation", SNAPSHOT_VALIDATION_DB_CACHE));
+        CCoinsViewCache view(pviewdb.get());
+        int nHeight = 0;
+        {
+            LOCK(cs_main);
+            uint256 hashBest = view.GetBestBlock();
+            if (!hashBest.IsNull()) {
+                BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+                if (mi == mapBlockIndex.end() || pindexBase->GetAncestor(mi->second->nHeight) != mi->second) {
+                    AbortNode("The chainstate being rebuilt for the snapshot is not on the snapshot's chain", strInvalid);
+                    return;
+                }
+                nHeight = mi->second->nHeight + 1;
+            }
+            pindexSnapshotBase = pindexBase;
+        }
+        if (nHeight <= pindexBase->nHeight) {
+            LogPrintf("Validating the chainstate snapshot: rebuilding the chainstate from height %d to %d\n", nHeight, pindexBase->nHeight);
+        }
+
+        try {
+            // The genesis block's outputs are unspendable, so it only sets the best block.
+            if (nHeight == 0) {
+                view.SetBestBlock(consensusParams.hashGenesisBlock);
+                nHeight++;
+            }
+            while (nHeight <= pindexBase->nHeight) {
+                boost::this_thread::interruption_point();
+                CBlockIndex* pindex = pindexBase->GetAncestor(nHeight);
+                CDiskBlockPos pos;
+                {
+                    LOCK(cs_main);
+                    pindexSnapshotHistoryNext = pindex;
+                    if (pindex->nStatus & BLOCK_HAVE_DATA)
+                        pos = pindex->GetBlockPos();
+                }
+                CBlock block;
+                if (pos.IsNull() || !ReadBlockFromDisk(block, pos, consensusParams) || block.GetHash() != pindex->GetBlockHash()) {
+                    // Not downloaded yet, or pruned again before we got to it.
+                    MilliSleep(100);
+                    continue;
+                }
+
+                CValidationState state;
+                {
+                    LOCK(cs_main);
+                    if (!ConnectBlock(block, state, pindex, view, chainparams, true)) {
+                        AbortNode(strprintf("Block %s at height %d below the chainstate snapshot is invalid: %s",
+                                            pindex->GetBlockHash().ToString(), nHeight, state.GetRejectReason()), strInvalid);
+                        return;
+                    }
+                }
+                view.SetBestBlock(pindex->GetBlockHash());
+                if (view.DynamicMemoryUsage() > SNAPSHOT_VALIDATION_CACHE || nHeight == pindexBase->nHeight) {
+                    if (!view.Flush()) {
+                        AbortNode("Failed to write the chainstate being rebuilt for the snapshot");
+                        return;
+                    }
+                }
+                if (nHeight % 10000 == 0) {
+                    LogPrintf("Validated the chainstate snapshot's history up to height %d of %d\n", nHeight, pindexBase->nHeight);
+                }
+                nHeight++;
+            }
+        } catch (const boost::thread_interrupted&) {
+            // Keep the progress for the next start.
+            view.Flush();
+            throw;
+        }
+
+        uint256 hashContents;
+        if (!pviewdb->HashContents(hashContents)) {
+            AbortNode("Failed to read the chainstate rebuilt for the snapshot");
+            return;
+        }
+        if (pviewdb->GetBestBlock() != target.hashBlock || hashContents != target.hashContents) {
+            AbortNode(strprintf("The chainstate snapshot of block %s does not match the chainstate rebuilt from its history",
+                                target.hashBlock.ToString()), strInvalid);
+            return;
+        }
+    }
+
+    {
+        LOCK(cs_main);
+        pindexSnapshotHistoryNext = NULL;
+        pblocktree->WriteFlag("snapshotvalidated", true);
+    }
+    LogPrintf("Validated the chainstate snapshot of block %s against its history\n", target.hashBlock.ToString());
+    try {
+        fs::remove_all(GetDataDir() / "snapshotvalidation");
+    } catch (const fs::filesystem_error& e) {
+        LogPrintf("%s: failed to remove the rebuilt chainstate: %s\n", __func__, e.what());
+    }
+}
+
+bool InitBlockIndex(const CChainParams& chainparams)
+{
+    // ActivateBestChain() below needs cs_chainstate, which goes before cs_main.
+    LOCK2(cs_chainstate, cs_main);
+
+    // Initialize global variables that cannot be constructed at startup.
+    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+
+    // Check whether we're already initialized
+    if (chainActive.Genesis() != NULL)
+        return true;
+
+#ifdef YCASH_WR
+    // Use the hard-coded setting for -txindex in the new database
+    fTxIndex = true;
+#else
+    // Use the provided setting for -txindex in the new database
+    fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
+#endif // YCASH_WR
+    pblocktree->WriteFlag("txindex", fTxIndex);
 
-            blkdat.SetPos(nRewind);
+    // Use the provided setting for -insightexplorer or -lightwalletd in the new database
+    pblocktree->WriteFlag("insightexplorer", fExperimentalInsightExplorer);
+    pblocktree->WriteFlag("lightwalletd", fExperimentalLightWalletd);
+    if (fExperimentalInsightExplorer) {
+        fAddressIndex = true;
+        fSpentIndex = true;
+        fTimestampIndex = true;
+    }
+    else if (fExperimentalLightWalletd) {
+        fAddressIndex = true;
+    }
+
+    LogPrintf("Initializing databases...\n");
+
+    // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
+    if (!fReindex) {
+        try {
+            CBlock &block = const_cast<CBlock&>(chainparams.GenesisBlock());
+            // Start new block file
+            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            CDiskBlockPos blockPos;
+            CValidationState state;
+            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime()))
+                return error("LoadBlockIndex(): FindBlockPos failed");
+            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+                return error("LoadBlockIndex(): writing genesis block to disk failed");
+            CBlockIndex *pindex = AddToBlockIndex(block, chainparams.GetConsensus());
+            if (!ReceivedBlockTransactions(block, state, chainparams, pindex, blockPos))
+                return error("LoadBlockIndex(): genesis block not accepted");
+            if (!ActivateBestChain(state, chainparams, &block))
+                return error("LoadBlockIndex(): genesis block cannot be activated");
+            // Force a chainstate write so that when we VerifyDB in a moment, it doesn't check stale data
+            return FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS);
+        } catch (const std::runtime_error& e) {
+            return error("LoadBlockIndex(): failed to initialize block database: %s", e.what());
+        }
+    }
+
+    return true;
+}
+
+namespace {
+
+//! Raw block data the importer may hold ahead of the block being connected.
+static const uint64_t MAX_IMPORT_QUEUED_BYTES = 16 * MAX_BLOCK_SIZE;
+
+/** A block found in an external block file. */
+struct CImportBlock
+{
+    //! Where scanning resumes if the block fails to deserialize.
+    uint64_t nRewind;
+    uint64_t nBlockPos;
+    unsigned int nSize;
+    std::vector<char> vRaw;
+
+    //! Set by the check threads.
+    bool fDone = false;
+    bool fDeserialized = false;
+    //! Bytes the block took up, which can be fewer than nSize.
+    uint64_t nConsumed = 0;
+    std::string strError;
+    CBlock block;
+};
+typedef std::shared_ptr<CImportBlock> CImportBlockRef;
+
+/**
+ * Reads an external block file in three stages. A scan thread finds the
+ * blocks by their message start bytes, a pool of check threads deserializes
+ * them and checks their proof of work and merkle roots, and Next() hands
+ * them to the caller in file order. The caller can Rewind() the scan, which
+ * drops everything read ahead of that point.
+ */
+class CBlockFileImporter
+{
+private:
+    const CChainParams& chainparams;
+    //! Only used by the scan thread.
+    CBufferedFile blkdat;
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    //! Blocks in file order, waiting to be returned by Next().
+    std::deque<CImportBlockRef> queueBlocks;
+    //! Blocks waiting for a check thread.
+    std::deque<CImportBlockRef> queueToCheck;
+    uint64_t nBytesQueued = 0;
+    //! Bumped by Rewind(), so that a block scanned before it is dropped.
+    uint64_t nGeneration = 0;
+    bool fRewind = false;
+    uint64_t nRewindPos = 0;
+    bool fScanDone = false;
+    bool fStop = false;
+
+    boost::thread_group threads;
+
+    void Scan()
+    {
+        uint64_t nRewind = blkdat.GetPos();
+        while (true) {
+            uint64_t nScanGeneration;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && !fRewind && (fScanDone || nBytesQueued >= MAX_IMPORT_QUEUED_BYTES))
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                if (fRewind) {
+                    nRewind = nRewindPos;
+                    fRewind = false;
+                    fScanDone = false;
+                }
+                nScanGeneration = nGeneration;
+            }
+
+            if (!blkdat.SetPos(nRewind) && !blkdat.Seek(nRewind)) {
+                FinishScan(nScanGeneration);
+                continue;
+            }
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
@@ -5324,18 +6209,162 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     continue;
             } catch (const std::exception&) {
                 // no valid block header found; don't complain
-                break;
+                FinishScan(nScanGeneration);
+                continue;
             }
+            CImportBlockRef pblock = std::make_shared<CImportBlock>();
+            pblock->nRewind = nRewind;
+            pblock->nSize = nSize;
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                pblock->nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(pblock->nBlockPos + nSize);
+                pblock->vRaw.resize(nSize);
+                blkdat.read(pblock->vRaw.data(), nSize);
                 nRewind = blkdat.GetPos();
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", "LoadExternalBlockFile", e.what());
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (nScanGeneration != nGeneration)
+                continue;
+            queueBlocks.push_back(pblock);
+            queueToCheck.push_back(pblock);
+            nBytesQueued += nSize;
+            cond.notify_all();
+        }
+    }
+
+    void FinishScan(uint64_t nScanGeneration)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (nScanGeneration == nGeneration)
+            fScanDone = true;
+        cond.notify_all();
+    }
+
+    void Check()
+    {
+        while (true) {
+            CImportBlockRef pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && queueToCheck.empty())
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                pblock = queueToCheck.front();
+                queueToCheck.pop_front();
+            }
+
+            try {
+                CDataStream ss(pblock->vRaw, SER_DISK, CLIENT_VERSION);
+                ss >> pblock->block;
+                pblock->nConsumed = pblock->nSize - ss.size();
+                pblock->fDeserialized = true;
+                // Transactions are left to AcceptBlock, which knows whether
+                // they need checking at this height. If the proof of work and
+                // merkle root pass, the block remembers it, and AcceptBlock
+                // and ConnectBlock skip them.
+                CValidationState state;
+                auto verifier = ProofVerifier::Disabled();
+                CheckBlock(pblock->block, state, chainparams, verifier, true, true, false);
+            } catch (const std::exception& e) {
+                pblock->strError = e.what();
+            }
+            std::vector<char>().swap(pblock->vRaw);
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            pblock->fDone = true;
+            cond.notify_all();
+        }
+    }
+
+public:
+    //! Takes over fileIn, which is closed when the importer is destroyed.
+    CBlockFileImporter(const CChainParams& chainparamsIn, FILE* fileIn, int nCheckThreads) :
+        chainparams(chainparamsIn),
+        blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION)
+    {
+        threads.create_thread([this] { Scan(); });
+        for (int i = 0; i < nCheckThreads; i++)
+            threads.create_thread([this] { Check(); });
+    }
+
+    ~CBlockFileImporter()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+            cond.notify_all();
+        }
+        threads.join_all();
+    }
+
+    //! Wait for the next block in the file. Returns false at the end of it.
+    bool Next(CImportBlockRef& pblock)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (queueBlocks.empty() ? (!fScanDone || fRewind) : !queueBlocks.front()->fDone)
+            cond.wait(lock);
+        if (queueBlocks.empty())
+            return false;
+        pblock = queueBlocks.front();
+        queueBlocks.pop_front();
+        nBytesQueued -= pblock->nSize;
+        cond.notify_all();
+        return true;
+    }
+
+    //! Drop the blocks read ahead, and carry on scanning from nPos.
+    void Rewind(uint64_t nPos)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        queueBlocks.clear();
+        queueToCheck.clear();
+        nBytesQueued = 0;
+        nGeneration++;
+        fRewind = true;
+        nRewindPos = nPos;
+        cond.notify_all();
+    }
+};
+
+} // namespace
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        // Blocks are deserialized and checked on other threads; this one
+        // only connects them, in the order they appear in the file.
+        CBlockFileImporter importer(chainparams, fileIn, std::max(nScriptCheckThreads, 1));
+        size_t initialSize = nSizeReindexed;
+        CImportBlockRef pimport;
+        while (importer.Next(pimport)) {
+            boost::this_thread::interruption_point();
+
+            if (fReindex)
+               nSizeReindexed = initialSize + pimport->nBlockPos;
+
+            if (!pimport->fDeserialized) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, pimport->strError);
+                importer.Rewind(pimport->nRewind);
+                continue;
+            }
+            if (pimport->nConsumed < pimport->nSize) {
+                // There may be a block in the rest of the claimed size.
+                importer.Rewind(pimport->nBlockPos + pimport->nConsumed);
+            }
+            try {
+                if (dbp)
+                    dbp->nPos = pimport->nBlockPos;
+                CBlock& block = pimport->block;
 
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
@@ -5604,7 +6633,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -5613,6 +6643,83 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * Send a block a peer asked for with getdata. If hashContinueTip is set, it
+ * is announced right after the block so that the peer asks for the next batch
+ * of blocks. If fBulk is set, everything is queued behind the peer's other
+ * messages and paced by the upload rate limits. Does not require cs_main.
+ */
+static void SendBlock(CNode* pfrom, const CInv& inv, const CDiskBlockPos& pos, bool fCompact,
+                      const uint256& hashContinueTip, bool fBulk, const Consensus::Params& consensusParams)
+{
+    // A merkleblock and the transactions that follow it are replies that
+    // light clients expect in order, after their earlier requests.
+    bool fOrdered = inv.type == MSG_FILTERED_BLOCK;
+    auto push = [pfrom, fBulk, fOrdered](const char* pszCommand, const auto& obj) {
+        if (fBulk)
+            pfrom->PushBulkMessage(pszCommand, obj);
+        else if (fOrdered)
+            pfrom->PushOrderedMessage(pszCommand, obj);
+        else
+            pfrom->PushMessage(pszCommand, obj);
+    };
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pos, consensusParams) || block.GetHash() != inv.hash) {
+        // The block was pruned after the request was accepted.
+        LogPrintf("%s: cannot load block %s from disk, disconnecting peer=%d\n", __func__, inv.hash.ToString(), pfrom->id);
+        pfrom->fDisconnect = true;
+        return;
+    }
+    if (inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fCompact))
+        push("block", block);
+    else if (inv.type == MSG_CMPCT_BLOCK)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock(block);
+        pfrom->PushMessage("cmpctblock", cmpctblock);
+    }
+    else // MSG_FILTERED_BLOCK)
+    {
+        // Light clients tend to ask for the same recent blocks, so the
+        // elements their filters are matched against are kept.
+        static CBloomElementsCache bloomElementsCache(BLOOM_ELEMENTS_CACHE_BLOCKS);
+        bool send = false;
+        CMerkleBlock merkleBlock;
+        {
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter) {
+                send = true;
+                CBloomElementsCache::ElementsRef pElements = bloomElementsCache.Get(block);
+                merkleBlock = CMerkleBlock(block, *pElements, *pfrom->pfilter);
+            }
+        }
+        if (send) {
+            push("merkleblock", merkleBlock);
+            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+            // This avoids hurting performance by pointlessly requiring a round-trip
+            // Note that there is currently no way for a node to request any single transactions we didn't send here -
+            // they must either disconnect and retry or request the full block.
+            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+            // however we MUST always provide at least what the remote peer needs
+            typedef std::pair<unsigned int, uint256> PairType;
+            for (PairType& pair : merkleBlock.vMatchedTxn)
+                push("tx", block.vtx[pair.first]);
+        }
+        // else
+            // no response
+    }
+
+    if (!hashContinueTip.IsNull())
+    {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+        push("inv", vInv);
+    }
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     int currentHeight = GetHeight();
@@ -5625,7 +6732,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
+        if (pfrom->GetSendSizeNormal() >= SendBufferSize())
             break;
 
         const CInv &inv = *it;
@@ -5633,7 +6740,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -5654,133 +6761,309 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         }
                     }
                 }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
+                // Historical blocks go behind the peer's other messages, and
+                // are paced by -maxpeeruploadrate and what is left of
+                // -maxuploadtarget, so that syncing peers cannot hold up the
+                // relay of new blocks and transactions. Whitelisted peers are
+                // not limited.
                 static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(consensusParams.PoWTargetSpacing(currentHeight), true) && (
-                        (
-                            (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)
-                        ) || inv.type == MSG_FILTERED_BLOCK
-                    ) && !pfrom->fWhitelisted)
+                bool fBulk = send && !pfrom->fWhitelisted &&
+                    (pindexBestHeader != NULL) &&
+                    (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek);
+                // The bulk queue has its own send buffer; the request waits
+                // until the blocks ahead of it have been paced out.
+                if (fBulk && pfrom->nSendSizeBulk >= SendBufferSize()) {
+                    --it;
+                    break;
+                }
+                // Pruned nodes may have deleted the block, so check whether
+                // it's available before trying to send.
+                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                {
+                    // A peer asking for an old block is unlikely to have a
+                    // mempool that matches it, so send the full block.
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK &&
+                        mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    // Trigger the peer node to send a getblocks request for the next batch of inventory
+                    uint256 hashContinueTip;
+                    if (inv.hash == pfrom->hashContinue) {
+                        hashContinueTip = chainActive.Tip()->GetBlockHash();
+                        pfrom->hashContinue.SetNull();
+                    }
+                    CDiskBlockPos pos = mi->second->GetBlockPos();
+
+                    // Reading the block from disk and serializing it is the
+                    // expensive part, so leave it to a worker if we can.
+                    // Nothing else is read from this peer until it is sent.
+                    CInv invBlock = inv;
+                    auto sendBlock = [pfrom, invBlock, pos, fCompact, hashContinueTip, fBulk, &consensusParams]() {
+                        SendBlock(pfrom, invBlock, pos, fCompact, hashContinueTip, fBulk, consensusParams);
+                    };
+                    if (!QueueNodeWork(pfrom, sendBlock))
+                        sendBlock();
+                }
+            }
+            else if (inv.IsKnownType())
+            {
+                // Transactions are served from the mempool, unless they are
+                // expiring soon. Those we relayed that have left it are kept in
+                // mapRelay for a while.
+                bool pushed = false;
+                if (inv.type == MSG_TX) {
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        if (!IsExpiringSoonTx(*ptx, currentHeight + 1)) {
+                            pfrom->PushMessage("tx", *ptx);
+                            pushed = true;
+                        }
+                    } else {
+                        LOCK(cs_mapRelay);
+                        map<uint256, CTransactionRef>::iterator mi = mapRelay.find(inv.hash);
+                        if (mi != mapRelay.end()) {
+                            pfrom->PushMessage("tx", *mi->second);
+                            pushed = true;
+                        }
+                    }
+                }
+
+                if (!pushed) {
+                    vNotFound.push_back(inv);
+                }
+            }
+
+            // Track requests for our stuff.
+            GetMainSignals().Inventory(inv.hash);
+
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                break;
+        }
+    }
+
+    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+
+    if (!vNotFound.empty()) {
+        // Let the peer know that we didn't find what it asked for, so it doesn't
+        // have to wait around forever. Currently only SPV clients actually care
+        // about this message: it's needed when they are recursively walking the
+        // dependencies of relevant unconfirmed transactions. SPV clients want to
+        // do that because they want to know about (and store and rebroadcast and
+        // risk analyze) the dependencies of transactions relevant to them, without
+        // having to download the entire memory pool.
+        pfrom->PushOrderedMessage("notfound", vNotFound);
+    }
+}
+
+/**
+ * Complete a compact block with the transactions we were missing. Returns
+ * true if the block is ready to be processed; otherwise the peer has been
+ * punished, or the full block requested instead. Requires cs_main.
+ */
+static bool FillCompactBlock(CNode* pfrom, list<QueuedBlock>::iterator queuedBlockIt,
+                             const std::vector<CTransactionRef>& vtxMissing, CBlock& block)
+{
+    const uint256 hash = queuedBlockIt->hash;
+    // A partial block can only be filled once.
+    std::unique_ptr<PartiallyDownloadedBlock> partialBlock = std::move(queuedBlockIt->partialBlock);
+    ReadStatus status = partialBlock->FillBlock(block, vtxMissing);
+    if (status == READ_STATUS_INVALID) {
+        MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+        Misbehaving(pfrom->GetId(), 100);
+        LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+        return false;
+    } else if (status == READ_STATUS_FAILED) {
+        // Probably a short ID collision; the block stays in flight while we
+        // fetch it in full.
+        vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+        pfrom->PushMessage("getdata", vInv);
+        return false;
+    }
+    return true;
+}
+
+/** Process a block a peer sent us, either in full or as a compact block. */
+static void ProcessReceivedBlock(const CChainParams& chainparams, CNode* pfrom, const std::string& strCommand, const CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+    pfrom->AddInventoryKnown(inv);
+
+    bool fAlreadyHave;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        fAlreadyHave = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+    }
+
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network.
+    // Such an unrequested block may still be processed, subject to the
+    // conditions in AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams.GetConsensus());
+    ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else if (!fAlreadyHave && !IsInitialBlockDownload(chainparams.GetConsensus())) {
+        // This peer was the first to give us our new tip, so it is a good
+        // candidate for announcing the next one with a cmpctblock.
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == inv.hash) {
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+        }
+    }
+}
+
+/**
+ * Try to add a transaction a peer sent us to the mempool, along with any
+ * orphans it unblocks, and relay or reject it.
+ */
+static void ProcessTransaction(const CChainParams& chainparams, CNode* pfrom, const std::string& strCommand,
+                               const CTransaction& tx, const CTxPreVerification* pverified)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    CValidationState state;
+
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv);
+
+    if (!AlreadyHave(inv) && AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs, false, pverified))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
                 {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
-
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                else if (!fMissingInputs2)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        bool send = false;
-                        CMerkleBlock merkleBlock;
-                        {
-                            LOCK(pfrom->cs_filter);
-                            if (pfrom->pfilter) {
-                                send = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
-                            }
-                        }
-                        if (send) {
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            for (PairType& pair : merkleBlock.vMatchedTxn)
-                                pfrom->PushMessage("tx", block.vtx[pair.first]);
-                        }
-                        // else
-                            // no response
-                    }
-
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
                     {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue.SetNull();
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
                     }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
                 }
+                mempool.check(pcoinsTip);
             }
-            else if (inv.IsKnownType())
-            {
-                // Check the mempool to see if a transaction is expiring soon.  If so, do not send to peer.
-                // Note that a transaction enters the mempool first, before the serialized form is cached
-                // in mapRelay after a successful relay.
-                bool isExpiringSoon = false;
-                bool pushed = false;
-                CTransaction tx;
-                bool isInMempool = mempool.lookup(inv.hash, tx);
-                if (isInMempool) {
-                    isExpiringSoon = IsExpiringSoonTx(tx, currentHeight + 1);
-                }
+        }
 
-                if (!isExpiringSoon) {
-                    // Send stream from relay memory
-                    {
-                        LOCK(cs_mapRelay);
-                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                        if (mi != mapRelay.end()) {
-                            pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                            pushed = true;
-                        }
-                    }
-                    if (!pushed && inv.type == MSG_TX) {
-                        if (isInMempool) {
-                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                            ss.reserve(1000);
-                            ss << tx;
-                            pfrom->PushMessage("tx", ss);
-                            pushed = true;
-                        }
-                    }
-                }
+        for (uint256 hash : vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
+    else if (fMissingInputs &&
+             tx.vJoinSplit.empty() &&
+             tx.vShieldedSpend.empty() &&
+             tx.vShieldedOutput.empty())
+    {
+        AddOrphanTx(tx, pfrom->GetId());
 
-                if (!pushed) {
-                    vNotFound.push_back(inv);
-                }
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
             }
-
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
-
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
         }
     }
-
-    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
-
-    if (!vNotFound.empty()) {
-        // Let the peer know that we didn't find what it asked for, so it doesn't
-        // have to wait around forever. Currently only SPV clients actually care
-        // about this message: it's needed when they are recursively walking the
-        // dependencies of relevant unconfirmed transactions. SPV clients want to
-        // do that because they want to know about (and store and rebroadcast and
-        // risk analyze) the dependencies of transactions relevant to them, without
-        // having to download the entire memory pool.
-        pfrom->PushMessage("notfound", vNotFound);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
     }
 }
 
+/** Process a block a peer sent us on a message worker thread, if there is one. */
+static void QueueReceivedBlock(const CChainParams& chainparams, CNode* pfrom, const std::string& strCommand, CBlock&& block)
+{
+    auto pblock = std::make_shared<const CBlock>(std::move(block));
+    auto processBlock = [&chainparams, pfrom, strCommand, pblock]() {
+        ProcessReceivedBlock(chainparams, pfrom, strCommand, *pblock);
+    };
+    if (!QueueNodeWork(pfrom, processBlock))
+        processBlock();
+}
+
 bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -5964,6 +7247,43 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell our peer we prefer to receive headers rather than inv's.
+        // We send this to non-NODE_NETWORK peers as well, because even
+        // non-NODE_NETWORK peers can announce blocks (such as pruning
+        // nodes). Like sendcmpct below, this is negotiated by the message
+        // alone rather than by protocol version, whose values follow the
+        // network upgrades; peers that don't know it ignore it.
+        pfrom->PushMessage("sendheaders");
+        {
+            // Tell our peer we can provide version 1 compact blocks. We only
+            // ask for new blocks to be announced with cmpctblock messages once
+            // the peer has been the first to give us a new tip.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            nodestate->fProvidesHeaderAndIDs = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -6096,9 +7416,12 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
 
-                    if (chainActive.Tip()->GetBlockTime() > GetTime() - chainparams.GetConsensus().PoWTargetSpacing(pindexBestHeader->nHeight) * 20 &&
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        // A new block close to our tip is mostly made of
+                        // transactions already in our mempool, so ask for it
+                        // as a compact block if the peer can serve one.
+                        vToFetch.push_back(nodestate->fProvidesHeaderAndIDs ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -6117,9 +7440,9 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             // Track requests for our stuff
             GetMainSignals().Inventory(inv.hash);
 
-            if (pfrom->nSendSize > (SendBufferSize() * 2)) {
+            if (pfrom->GetSendSizeNormal() > (SendBufferSize() * 2)) {
                 Misbehaving(pfrom->GetId(), 50);
-                return error("send buffer size() = %u", pfrom->nSendSize);
+                return error("send buffer size() = %u", pfrom->GetSendSizeNormal());
             }
         }
 
@@ -6205,6 +7528,8 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
             return true;
         }
+
+        CNodeState *nodestate = State(pfrom->GetId());
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
@@ -6232,6 +7557,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -6246,134 +7576,32 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             return true;
         }
 
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        auto ptx = std::make_shared<CTransaction>();
+        vRecv >> *ptx;
 
-        CInv inv(MSG_TX, tx.GetHash());
+        CInv inv(MSG_TX, ptx->GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs))
+        bool fAlreadyHave;
+        int nNextHeight;
         {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(inv);
+            nNextHeight = chainActive.Height() + 1;
         }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vJoinSplit.empty() &&
-                 tx.vShieldedSpend.empty() &&
-                 tx.vShieldedOutput.empty())
-        {
-            AddOrphanTx(tx, pfrom->GetId());
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
+        // Verify proofs and signatures before taking cs_main, on a worker if
+        // we can, so that transactions from different peers are checked in
+        // parallel and AcceptToMemoryPool only does the stateful checks.
+        auto processTx = [&chainparams, pfrom, strCommand, ptx, fAlreadyHave, nNextHeight]() {
+            std::optional<CTxPreVerification> verified;
+            if (!fAlreadyHave) {
+                verified = PreVerifyTransaction(*ptx, chainparams, nNextHeight);
             }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+            ProcessTransaction(chainparams, pfrom, strCommand, *ptx, verified ? &*verified : nullptr);
+        };
+        if (!QueueNodeWork(pfrom, processTx))
+            processTx();
     }
 
 
@@ -6401,6 +7629,27 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // A peer announcing new blocks with headers may announce one whose
+        // parent we have not seen, for example after we missed an
+        // announcement. Ask for the headers in between, but penalize a peer
+        // that keeps sending headers that never connect.
+        if (nCount <= MAX_BLOCKS_TO_ANNOUNCE && mapBlockIndex.count(headers[0].hashPrevBlock) == 0) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s that doesn't connect, sending getheaders (%d) to peer=%d (nUnconnectingHeaders=%d)\n",
+                     headers[0].GetHash().ToString(), pindexBestHeader->nHeight, pfrom->id, nodestate->nUnconnectingHeaders);
+            // Remember the announced block, so that we can download it from
+            // this peer once the headers in between arrive from anyone.
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
+                Misbehaving(pfrom->GetId(), 20);
+            }
+            return true;
+        }
+
         // If we already know the last header in the message, then it contains
         // no new information for us.  In this case, we do not request
         // more headers later.  This prevents multiple chains of redundant
@@ -6430,6 +7679,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             }
         }
 
+        if (nodestate->nUnconnectingHeaders > 0) {
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        }
+        nodestate->nUnconnectingHeaders = 0;
+
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
@@ -6446,36 +7700,264 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
         }
 
+        // If this set of headers is valid and ends in a block with at least as
+        // much work as our tip, download as much as possible.
+        if (pindexLast && CanDirectFetch(chainparams.GetConsensus()) && pindexLast->IsValid(BLOCK_VALID_TREE) &&
+                chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex *> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                        !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at a
+            // very large reorg at a time we think we're close to caught up to
+            // the main chain -- this shouldn't really happen.  Bail out on the
+            // direct fetch and rely on parallel download instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                         pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                for (auto it = vToFetch.rbegin(); it != vToFetch.rend(); ++it) {
+                    CBlockIndex *pindex = *it;
+                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n", pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                             pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                }
+                if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1) {
+                        // A single new block on top of our tip is mostly made of
+                        // transactions we already have, so fetch it compactly.
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+            }
+        }
+
         CheckBlockIndex(chainparams.GetConsensus());
     }
 
-    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect (or is genesis); instead of DoSing in AcceptBlockHeader, request deeper headers.
+                if (!IsInitialBlockDownload(chainparams.GetConsensus()))
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                    return true;
+                }
+            }
+            if (pindex == NULL) {
+                return true;
+            }
+
+            const uint256 hash = pindex->GetBlockHash();
+            LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(hash);
+            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
+                    // We requested this block for some reason, but our mempool
+                    // will probably be useless, so just fetch the full block.
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            // If we're not close to the tip yet, let parallel block fetch do its job.
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
+
+            CNodeState *nodestate = State(pfrom->GetId());
+
+            // Only reconstruct blocks that are about to become our tip; for
+            // anything further ahead our mempool is unlikely to help.
+            if (pindex->nHeight <= chainActive.Height() + 2) {
+                if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                        (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                    list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                    if (!MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                        if (!(*queuedBlockIt)->partialBlock) {
+                            (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                        } else {
+                            // The block was already in flight using compact blocks from the same peer.
+                            LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                            return true;
+                        }
+                    }
+
+                    PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                    ReadStatus status = partialBlock.InitData(cmpctblock);
+                    if (status == READ_STATUS_INVALID) {
+                        MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                        return true;
+                    } else if (status == READ_STATUS_FAILED) {
+                        // Short ID collision; the block is in flight, so just request it in full.
+                        (*queuedBlockIt)->partialBlock.reset();
+                        vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                        pfrom->PushMessage("getdata", vInv);
+                        return true;
+                    }
+
+                    BlockTransactionsRequest req;
+                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                        if (!partialBlock.IsTxAvailable(i))
+                            req.indexes.push_back(i);
+                    }
+                    if (req.indexes.empty()) {
+                        // We had every transaction.
+                        fBlockReconstructed = FillCompactBlock(pfrom, *queuedBlockIt, std::vector<CTransactionRef>(), block);
+                    } else {
+                        req.blockhash = hash;
+                        pfrom->PushMessage("getblocktxn", req);
+                    }
+                }
+            } else if (fAlreadyInFlight) {
+                // We requested this block, but it is far ahead of our tip, so
+                // our mempool will probably be useless; fetch it normally.
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            // Otherwise the header is now known, and the block is fetched
+            // like any other announced block.
+        }
+
+        if (fBlockReconstructed) {
+            QueueReceivedBlock(chainparams, pfrom, strCommand, std::move(block));
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
     {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Answer requests for old blocks with the full block: the peer has
+            // to download everything we read from disk, which makes a flood of
+            // getblocktxn requests no cheaper for it than for us.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
         CBlock block;
-        vRecv >> block;
+        if (!ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
-        pfrom->AddInventoryKnown(inv);
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
 
-        CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network.
-        // Such an unrequested block may still be processed, subject to the
-        // conditions in AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams.GetConsensus());
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
             }
+
+            fBlockReconstructed = FillCompactBlock(pfrom, it->second.second, resp.txn, block);
         }
 
+        if (fBlockReconstructed) {
+            QueueReceivedBlock(chainparams, pfrom, strCommand, std::move(block));
+        }
+    }
+
+
+    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        // Deserialize and process the block on a worker if we can, so that
+        // other peers' messages are not held up while it is checked and
+        // connected.
+        auto pvRecv = std::make_shared<CDataStream>(std::move(vRecv));
+        auto processBlock = [&chainparams, pfrom, pvRecv, strCommand]() {
+            CBlock block;
+            try {
+                *pvRecv >> block;
+            } catch (const std::ios_base::failure& e) {
+                pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+                LogPrintf("%s: Exception '%s' caught parsing block from peer=%d\n", __func__, e.what(), pfrom->id);
+                return;
+            }
+            ProcessReceivedBlock(chainparams, pfrom, strCommand, block);
+        };
+        if (!QueueNodeWork(pfrom, processBlock))
+            processBlock();
     }
 
 
@@ -6557,7 +8039,7 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             // it, if the remote node sends a ping once per second and this node takes 5
             // seconds to respond to each, the 5th ping the remote sends would appear to
             // return very quickly.
-            pfrom->PushMessage("pong", nonce);
+            pfrom->PushOrderedMessage("pong", nonce);
         }
     }
 
@@ -6753,7 +8235,8 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         // message would be undesirable as we transmit it ourselves.
     }
 
-    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert")) {
+    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert" ||
+               strCommand == "cmpctblock" || strCommand == "blocktxn")) {
         // Ignore unknown commands for extensibility
         LogPrint("net", "Unknown command \"%s\" from peer=%d\n", SanitizeString(strCommand), pfrom->id);
     }
@@ -6787,8 +8270,10 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
+        // Don't bother if send buffer is too full to respond anyway. Queued
+        // historical blocks do not count, so that they do not hold up the
+        // peer's other messages.
+        if (pfrom->GetSendSizeNormal() >= SendBufferSize())
             break;
 
         // get next message
@@ -6884,7 +8369,7 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
 }
 
 
-bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle)
+bool SendMessages(const Consensus::Params& params, CNode* pto)
 {
     {
         // Don't send anything until we get its version message
@@ -6942,11 +8427,14 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
                 nLastRebroadcast = GetTime();
         }
 
+        int64_t nNow = GetTimeMicros();
+
         //
         // Message: addr
         //
-        if (fSendTrickle)
+        if (pto->nNextAddrSend < nNow)
         {
+            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -7021,53 +8509,197 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
         }
 
         //
-        // Message: inventory
+        // Try sending block announcements via headers
         //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            for (const CInv& inv : pto->vInventoryToSend)
-            {
-                if (inv.type == MSG_TX && pto->filterInventoryKnown.contains(inv.hash))
-                    continue;
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                for (const uint256 &hash : pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other, which can happen when
+                        // invalidateblock / reconsiderblock is used repeatedly
+                        // on the tip. Robustly deal with this rare situation
+                        // by reverting to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        // add this to the headers message
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Peer doesn't have this header or the prior one -- nothing will
+                        // connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                                 hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
+                    // If the peer announced this block to us, don't inv it back.
+                    // (Since block announcements may not be via inv's, we can't solely rely on
+                    // filterInventoryKnown to track this.)
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                                 pto->id, hashToAnnounce.ToString());
                     }
                 }
+            } else if (!vHeaders.empty()) {
+                if (vHeaders.size() > 1) {
+                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                             vHeaders.size(),
+                             vHeaders.front().GetHash().ToString(),
+                             vHeaders.back().GetHash().ToString(), pto->id);
+                } else {
+                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                             vHeaders.front().GetHash().ToString(), pto->id);
+                }
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
 
-                pto->filterInventoryKnown.insert(inv.hash);
+        //
+        // Message: inventory
+        //
+        vector<CInv> vInv;
+        {
+            LOCK(pto->cs_inventory);
+            vInv.reserve(std::max<size_t>(pto->vInventoryToSend.size(), INVENTORY_BROADCAST_MAX));
 
+            // Add blocks
+            for (const CInv& inv : pto->vInventoryToSend) {
+                pto->filterInventoryKnown.insert(inv.hash);
                 vInv.push_back(inv);
-                if (vInv.size() >= 1000)
-                {
+                if (vInv.size() == MAX_INV_SZ) {
+                    pto->nInvBytesSent += ::GetSerializeSize(vInv, SER_NETWORK, PROTOCOL_VERSION);
                     pto->PushMessage("inv", vInv);
                     vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
+
+            // Transactions are announced in batches, at times drawn independently
+            // for each peer, so that the order in which peers hear about a
+            // transaction says little about where it came from. Whitelisted
+            // peers get them right away.
+            bool fSendTrickle = pto->fWhitelisted;
+            if (pto->nNextInvSend < nNow) {
+                fSendTrickle = true;
+                // Use half the delay for outbound peers, as there is less privacy concern for them.
+                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+            }
+            if (fSendTrickle && !pto->setInventoryTxToSend.empty()) {
+                LOCK(pto->cs_filter);
+                if (!pto->fRelayTxes) {
+                    // The peer asked us not to relay transactions to it.
+                    pto->setInventoryTxToSend.clear();
+                }
+
+                // Parents go before their children, so that a peer never
+                // hears about a transaction it cannot accept yet; otherwise the
+                // best paying transactions go first. Only the transactions
+                // sent are taken from the heap.
+                vector<uint256> vQueued(pto->setInventoryTxToSend.begin(), pto->setInventoryTxToSend.end());
+                vector<RelayOrderEntry> vInvTx = mempool.MakeRelayHeap(vQueued);
+
+                unsigned int nRelayedTransactions = 0;
+                unsigned int nFilteredTransactions = 0;
+                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                    std::pop_heap(vInvTx.begin(), vInvTx.end(), CompareRelayOrder());
+                    const uint256 hash = vInvTx.back().hash;
+                    vInvTx.pop_back();
+                    pto->setInventoryTxToSend.erase(hash);
+                    // Check again, the peer may have told us about it since it was queued.
+                    if (pto->filterInventoryKnown.contains(hash)) {
+                        nFilteredTransactions++;
+                        continue;
+                    }
+                    // Transactions that have left the mempool are still announced
+                    // while we can serve them from mapRelay.
+                    CTransactionRef ptx = mempool.get(hash);
+                    if (!ptx) {
+                        LOCK(cs_mapRelay);
+                        map<uint256, CTransactionRef>::iterator mi = mapRelay.find(hash);
+                        if (mi != mapRelay.end())
+                            ptx = mi->second;
+                    }
+                    if (!ptx || (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*ptx))) {
+                        nFilteredTransactions++;
+                        continue;
+                    }
+                    pto->filterInventoryKnown.insert(hash);
+                    vInv.push_back(CInv(MSG_TX, hash));
+                    nRelayedTransactions++;
+                    if (vInv.size() == MAX_INV_SZ) {
+                        pto->nInvBytesSent += ::GetSerializeSize(vInv, SER_NETWORK, PROTOCOL_VERSION);
+                        pto->PushMessage("inv", vInv);
+                        vInv.clear();
+                    }
+                }
+                pto->nTxInvSent += nRelayedTransactions;
+                pto->nTxInvFiltered += nFilteredTransactions;
+                MetricsCounter("zcash.net.out.inv.tx.sent", nRelayedTransactions);
+                MetricsCounter("zcash.net.out.inv.tx.filtered", nFilteredTransactions);
+            }
         }
-        if (!vInv.empty())
+        if (!vInv.empty()) {
+            pto->nInvBytesSent += ::GetSerializeSize(vInv, SER_NETWORK, PROTOCOL_VERSION);
             pto->PushMessage("inv", vInv);
+        }
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -7119,6 +8751,17 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
                 }
             }
         }
+        // Blocks below a chainstate snapshot, once the tip is synced
+        if (!pto->fDisconnect && !pto->fClient && !IsInitialBlockDownload(params) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            vector<CBlockIndex*> vToDownload;
+            FindSnapshotBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload);
+            for (CBlockIndex *pindex : vToDownload) {
+                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), params, pindex);
+                LogPrint("net", "Requesting snapshot history block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
+                    pindex->nHeight, pto->id);
+            }
+        }
 
         //
         // Message: getdata (non-blocks)
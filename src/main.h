@@ -15,6 +15,7 @@
 #include "chainparams.h"
 #include "coins.h"
 #include "consensus/upgrades.h"
+#include "consensus/validation.h"
 #include "fs.h"
 #include "net.h"
 #include "primitives/block.h"
@@ -46,13 +47,17 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewDB;
+class CCoinsViewFlusher;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
-class PrecomputedTransactionData;
+struct CBlockProfile;
+struct PrecomputedTransactionData;
 
 struct CNodeStateStats;
 
@@ -102,6 +107,27 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular block message is sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we're willing to respond to getblocktxn requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers we ask to announce new blocks to us with cmpctblock messages. */
+static const unsigned int MAX_HB_CMPCTBLOCK_PEERS = 3;
+/** Maximum number of headers to announce when relaying blocks with headers message.*/
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Maximum number of unconnecting headers announcements before a peer is penalized. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Number of recently filtered blocks whose bloom filter elements are kept for other light clients. */
+static const unsigned int BLOOM_ELEMENTS_CACHE_BLOCKS = 16;
+/** Average delay between trickled inventory transmissions in seconds.
+ *  Blocks and whitelisted receivers bypass this, outbound peers get half this delay. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of inventory items to send per transmission.
+ *  Limits the impact of low-fee transaction floods. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Average delay between peer address broadcasts in seconds. */
+static const unsigned int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -176,6 +202,8 @@ extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern bool fIBDSkipTxVerification;
+/** Block hash whose ancestors we will assume to have valid proofs and signatures (see -assumevalid) */
+extern uint256 hashAssumeValid;
 // TODO: remove this flag by structuring our code such that
 // it is unneeded for testing
 extern bool fCoinbaseEnforcedShieldingEnabled;
@@ -199,6 +227,8 @@ static const uint64_t nMinDiskSpace = 52428800;
 extern bool fHavePruned;
 /** True if we're running in -prune mode. */
 extern bool fPruneMode;
+/** True if the chainstate was loaded from a snapshot, so blocks below its base were never downloaded. */
+extern bool fSnapshotChainstate;
 /** Number of MiB of block files that we're trying to stay below. */
 extern uint64_t nPruneTarget;
 /** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
@@ -258,9 +288,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
  *
  * @param[in]   params          Active chain parameters.
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
-bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle);
+bool SendMessages(const Consensus::Params& params, CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -303,14 +332,76 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+
+/** Version of the chainstate snapshot format (see dumptxoutset and -loadsnapshot) */
+static const int CHAINSTATE_SNAPSHOT_VERSION = 1;
+/** Database cache for the chainstate rebuilt below a snapshot, in bytes */
+static const size_t SNAPSHOT_VALIDATION_DB_CACHE = 8 << 20;
+/** Coins cache for the chainstate rebuilt below a snapshot, in bytes */
+static const size_t SNAPSHOT_VALIDATION_CACHE = 100 << 20;
+
+/** Summary of a chainstate snapshot */
+struct CChainstateSnapshotInfo
+{
+    uint256 hashBlock;
+    int nHeight = -1;
+    //! Double-SHA256 of everything in the snapshot file before the hash itself
+    uint256 hashSnapshot;
+    CChainstateSnapshotStats stats;
+};
+
+/** Write the block headers and chainstate as of the current tip to a snapshot file. */
+bool WriteChainstateSnapshot(const fs::path& path, CChainstateSnapshotInfo& info);
+/**
+ * Load a snapshot into an empty block index and chainstate. Must be called
+ * before LoadBlockIndex(). Does nothing if a chainstate already exists. A
+ * load that fails, or that was interrupted earlier, is undone, so the call
+ * can be repeated.
+ * The snapshot's hash must match hashExpected or, if that is null, the hash
+ * compiled into the chain parameters for its block.
+ */
+bool LoadChainstateSnapshot(const fs::path& path, const CChainParams& chainparams, const uint256& hashExpected, CChainstateSnapshotInfo& info);
+/**
+ * Validate the history below a chainstate loaded from a snapshot: check the
+ * Equihash solutions of its block headers, then rebuild the chainstate from
+ * the blocks below the snapshot, downloading them as needed, and compare it
+ * with the snapshot.
+ */
+void ThreadValidateSnapshotHistory(const CChainParams& chainparams);
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/**
+ * The result of the checks of a transaction that need neither chain state nor
+ * locks: CheckTransaction, and ContextualCheckTransaction (including proofs
+ * and shielded signatures) for a block at nHeight.
+ */
+struct CTxPreVerification
+{
+    int nHeight = -1;
+    bool fValid = false;
+    CValidationState state;
+    std::shared_ptr<const PrecomputedTransactionData> txdata;
+};
+
+/**
+ * Check a transaction for a block at nHeight ahead of AcceptToMemoryPool,
+ * without holding cs_main, so that proofs of transactions from different
+ * peers can be verified in parallel.
+ */
+CTxPreVerification PreVerifyTransaction(const CTransaction& tx, const CChainParams& chainparams, int nHeight);
+
+/**
+ * (try to) add transaction to memory pool
+ *
+ * If pverified holds the result of PreVerifyTransaction for the next block,
+ * its checks are not repeated; otherwise they are done here under the locks.
+ **/
 bool AcceptToMemoryPool(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+        bool* pfMissingInputs, bool fRejectAbsurdFee=false,
+        const CTxPreVerification* pverified=nullptr);
 
 
 struct CNodeStateStats {
@@ -347,14 +438,28 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
  * instead of being performed inline.
  */
 bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                           unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata,
+                           unsigned int flags, bool cacheStore, const PrecomputedTransactionData& txdata,
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
+/**
+ * Return the signature hash midstates for a transaction, reusing the copy
+ * computed at mempool admission when the transaction is in the mempool.
+ */
+std::shared_ptr<const PrecomputedTransactionData> GetPrecomputedTxData(const CTransaction& tx);
+
+/**
+ * Return the signature hash midstates for every transaction in a block,
+ * computing them on first use and caching them on the block.
+ */
+const std::vector<std::shared_ptr<const PrecomputedTransactionData>>& GetBlockTxData(const CBlock& block);
+
 /** Check a transaction contextually against a set of consensus rules */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state,
                                 const CChainParams& chainparams, int nHeight, bool isMined,
-                                bool (*isInitBlockDownload)(const Consensus::Params&) = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)(const Consensus::Params&) = IsInitialBlockDownload,
+                                bool fCheckShieldedAuth = true,
+                                const PrecomputedTransactionData* txdata = nullptr);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -364,6 +469,8 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
 /** Context-independent validity checks */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state, ProofVerifier& verifier);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
+/** The JoinSplit proof checks of CheckTransaction; Sapling proofs are checked by ContextualCheckTransaction */
+bool CheckTransactionProofs(const CTransaction& tx, CValidationState &state, ProofVerifier& verifier);
 
 namespace Consensus {
 
@@ -418,12 +525,12 @@ private:
     bool cacheStore;
     uint32_t consensusBranchId;
     ScriptError error;
-    PrecomputedTransactionData *txdata;
+    const PrecomputedTransactionData *txdata;
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, const PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -456,6 +563,7 @@ bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -470,23 +578,33 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
                 ProofVerifier& verifier,
                 bool fCheckPOW,
                 bool fCheckMerkleRoot,
-                bool fCheckTransactions);
+                bool fCheckTransactions,
+                CBlockProfile* pprofile = nullptr);
 
 /** Context-dependent validity checks.
  *  By "context", we mean only the previous block headers, but not the UTXO
  *  set; UTXO-related validity checks are done in ConnectBlock(). */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state,
                                 const CChainParams& chainparams, CBlockIndex *pindexPrev);
+/**
+ * Whether a block is an ancestor of the -assumevalid block, buried deep enough
+ * under our best header to skip its proofs and signatures (requires cs_main).
+ */
+bool IsAssumedValid(const CChainParams& chainparams, const CBlockIndex* pindex);
+
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state,
                           const CChainParams& chainparams,
                           CBlockIndex *pindexPrev,
-                          bool fCheckTransactions);
+                          bool fCheckTransactions,
+                          bool fCheckShieldedAuth = true,
+                          CBlockProfile* pprofile = nullptr);
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
  *  can fail if those validity checks fail (among other reasons). */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
-                  const CChainParams& chainparams, bool fJustCheck = false);
+                  const CChainParams& chainparams, bool fJustCheck = false,
+                  CBlockProfile* pprofile = nullptr);
 
 /**
  * Check a block is completely valid from start to finish (only works on top
@@ -531,6 +649,12 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Global variable that points to the background chainstate writer, if any (protected by cs_main) */
+extern CCoinsViewFlusher *pcoinsflusher;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
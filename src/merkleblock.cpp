@@ -21,8 +21,8 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const uint256& hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i]))
+        const uint256& hash = block.vtx[i]->GetHash();
+        if (filter.IsRelevantAndUpdate(*block.vtx[i]))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(std::make_pair(i, hash));
@@ -35,6 +35,65 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CBlock& block, const std::vector<CBloomElements>& vElements, CBloomFilter& filter)
+{
+    assert(vElements.size() == block.vtx.size());
+    header = block.GetBlockHeader();
+
+    std::vector<bool> vMatch;
+    std::vector<uint256> vHashes;
+
+    vMatch.reserve(vElements.size());
+    vHashes.reserve(vElements.size());
+
+    for (unsigned int i = 0; i < vElements.size(); i++)
+    {
+        const uint256& hash = vElements[i].hash;
+        if (filter.IsRelevantAndUpdate(vElements[i]))
+        {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(std::make_pair(i, hash));
+        }
+        else
+            vMatch.push_back(false);
+        vHashes.push_back(hash);
+    }
+
+    txn = CPartialMerkleTree(vHashes, vMatch);
+}
+
+CBloomElementsCache::ElementsRef CBloomElementsCache::Get(const CBlock& block)
+{
+    const uint256 hash = block.GetHash();
+    {
+        LOCK(cs);
+        auto it = mapBlocks.find(hash);
+        if (it != mapBlocks.end()) {
+            listBlocks.splice(listBlocks.begin(), listBlocks, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Extract without the lock; if another thread got there first, keep
+    // whichever was cached.
+    std::shared_ptr<std::vector<CBloomElements>> pElements = std::make_shared<std::vector<CBloomElements>>();
+    pElements->reserve(block.vtx.size());
+    for (const CTransactionRef& tx : block.vtx)
+        pElements->emplace_back(*tx);
+
+    LOCK(cs);
+    auto it = mapBlocks.find(hash);
+    if (it != mapBlocks.end())
+        return it->second->second;
+    listBlocks.emplace_front(hash, pElements);
+    mapBlocks[hash] = listBlocks.begin();
+    while (listBlocks.size() > nMaxBlocks) {
+        mapBlocks.erase(listBlocks.back().first);
+        listBlocks.pop_back();
+    }
+    return pElements;
+}
+
 CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
 {
     header = block.GetBlockHeader();
@@ -47,7 +106,7 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const uint256& hash = block.vtx[i].GetHash();
+        const uint256& hash = block.vtx[i]->GetHash();
         if (txids.count(hash))
             vMatch.push_back(true);
         else
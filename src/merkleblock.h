@@ -7,10 +7,14 @@
 #define BITCOIN_MERKLEBLOCK_H
 
 #include "serialize.h"
+#include "sync.h"
 #include "uint256.h"
 #include "primitives/block.h"
 #include "bloom.h"
 
+#include <list>
+#include <map>
+#include <memory>
 #include <vector>
 
 /** Data structure that represents a partial merkle tree.
@@ -139,6 +143,12 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    /**
+     * The same, with the bloom filter elements of each of the block's
+     * transactions already extracted.
+     */
+    CMerkleBlock(const CBlock& block, const std::vector<CBloomElements>& vElements, CBloomFilter& filter);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
@@ -153,4 +163,28 @@ public:
     }
 };
 
+/**
+ * The bloom filter elements of the transactions in recently filtered blocks,
+ * so that serving the same block to many light clients extracts them once.
+ * Thread safe.
+ */
+class CBloomElementsCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<CBloomElements>> ElementsRef;
+
+    explicit CBloomElementsCache(size_t nMaxBlocksIn) : nMaxBlocks(nMaxBlocksIn) {}
+
+    //! The elements of block's transactions, extracting them if they are not cached.
+    ElementsRef Get(const CBlock& block);
+
+private:
+    const size_t nMaxBlocks;
+
+    CCriticalSection cs;
+    //! Most recently used first.
+    std::list<std::pair<uint256, ElementsRef>> listBlocks;
+    std::map<uint256, std::list<std::pair<uint256, ElementsRef>>::iterator> mapBlocks;
+};
+
 #endif // BITCOIN_MERKLEBLOCK_H
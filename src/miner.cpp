@@ -61,12 +61,12 @@ using namespace std;
 class COrphan
 {
 public:
-    const CTransaction* ptx;
+    CTransactionRef ptx;
     set<uint256> setDependsOn;
     CFeeRate feeRate;
     double dPriority;
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    COrphan(const CTransactionRef& ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
     {
     }
 };
@@ -75,7 +75,7 @@ uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
+typedef boost::tuple<double, CFeeRate, CTransactionRef> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -329,7 +329,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
         pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
     // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
+    pblock->vtx.push_back(MakeTransactionRef());
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
@@ -394,7 +394,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
                 for (const CTxIn& txin : tx.vin)
                 {
                     // Read prev transaction
-                    if (!view.HaveCoins(txin.prevout.hash))
+                    if (!view.HaveCoin(txin.prevout))
                     {
                         // This should never happen; all transactions in the memory
                         // pool should connect to either transactions in the chain
@@ -413,7 +413,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
                         if (!porphan)
                         {
                             // Use list for automatic deletion
-                            vOrphan.push_back(COrphan(&tx));
+                            vOrphan.push_back(COrphan(mi->GetSharedTx()));
                             porphan = &vOrphan.back();
                         }
                         mapDependers[txin.prevout.hash].push_back(porphan);
@@ -421,13 +421,13 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
                         nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
                         continue;
                     }
-                    const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                    assert(coins);
+                    const Coin& coin = view.AccessCoin(txin.prevout);
+                    assert(!coin.IsSpent());
 
-                    CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
+                    CAmount nValueIn = coin.out.nValue;
                     nTotalIn += nValueIn;
 
-                    int nConf = nHeight - coins->nHeight;
+                    int nConf = nHeight - coin.nHeight;
 
                     dPriority += (double)nValueIn * nConf;
                 }
@@ -436,7 +436,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
                 if (fMissingInputs) continue;
 
                 // Priority is sum(valuein * age) / modified_txsize
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+                unsigned int nTxSize = tx.GetTotalSize();
                 dPriority = tx.ComputePriority(dPriority, nTxSize);
 
                 uint256 hash = tx.GetHash();
@@ -450,7 +450,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
                     porphan->feeRate = feeRate;
                 }
                 else
-                    vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
+                    vecPriority.push_back(TxPriority(dPriority, feeRate, mi->GetSharedTx()));
             }
         }
 
@@ -490,13 +490,14 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
             CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+            CTransactionRef ptx = vecPriority.front().get<2>();
+            const CTransaction& tx = *ptx;
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = tx.GetTotalSize();
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
@@ -536,8 +537,8 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
             // policy here, but we still have to ensure that the block we
             // create only contains transactions that are valid in new blocks.
             CValidationState state;
-            PrecomputedTransactionData txdata(tx);
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+            auto txdata = GetPrecomputedTxData(tx);
+            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, *txdata, chainparams.GetConsensus(), consensusBranchId))
                 continue;
 
             if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
@@ -569,7 +570,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
             UpdateCoins(tx, view, nHeight);
 
             // Added
-            pblock->vtx.push_back(tx);
+            pblock->vtx.push_back(ptx);
             pblocktemplate->vTxFees.push_back(nTxFees);
             pblocktemplate->vTxSigOps.push_back(nTxSigOps);
             nBlockSize += nTxSize;
@@ -607,14 +608,15 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
 
         // Create coinbase tx
         if (next_cb_mtx) {
-            pblock->vtx[0] = *next_cb_mtx;
+            pblock->vtx[0] = MakeTransactionRef(*next_cb_mtx);
         } else {
-            pblock->vtx[0] = CreateCoinbaseTransaction(chainparams, nFees, minerAddress, nHeight);
+            pblock->vtx[0] = MakeTransactionRef(CreateCoinbaseTransaction(chainparams, nFees, minerAddress, nHeight));
         }
         pblocktemplate->vTxFees[0] = -nFees;
 
         // Update the Sapling commitment tree.
-        for (const CTransaction& tx : pblock->vtx) {
+        for (const CTransactionRef& ptx : pblock->vtx) {
+            const CTransaction& tx = *ptx;
             for (const OutputDescription& odesc : tx.vShieldedOutput) {
                 sapling_tree.append(odesc.cmu);
             }
@@ -641,7 +643,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
         UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
         pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
         pblock->nSolution.clear();
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(*pblock->vtx[0]);
 
         CValidationState state;
         if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false))
@@ -703,18 +705,18 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     // Found a solution
     {
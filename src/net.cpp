@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #endif
 
+#include <math.h>
+
 #include <boost/thread.hpp>
 
 #include <rust/metrics.h>
@@ -71,8 +73,8 @@ std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
+map<uint256, CTransactionRef> mapRelay;
+multimap<int64_t, uint256> mapRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
@@ -317,6 +319,10 @@ uint64_t CNode::nMaxOutboundLimit = 0;
 uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
 uint64_t CNode::nMaxOutboundTimeframe = 60*60*24; //1 day
 uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundTargetSpacing = 0;
+CTokenBucket CNode::historicalBucket;
+uint64_t CNode::nTotalBulkBytesSent = 0;
+uint64_t CNode::nMaxPeerUploadRate = 0;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -678,12 +684,32 @@ void CNode::copyStats(CNodeStats &stats)
     {
         LOCK(cs_vSend);
         stats.nSendBytes = nSendBytes;
+        stats.nBulkBytesSent = nSendBytesBulk;
+        stats.nBulkBytesQueued = nSendSizeBulk;
+        stats.dBulkWait = 0;
+        if (!vSendMsgBulk.empty() && !fSendingBulk) {
+            int64_t nNow = GetTimeMicros();
+            int64_t nWait = bulkBucket.TimeUntilAvailable(nNow);
+            if (nWait >= 0) {
+                LOCK(cs_totalBytesSent);
+                UpdateHistoricalRate(nNow);
+                int64_t nWaitTotal = historicalBucket.TimeUntilAvailable(nNow);
+                nWait = nWaitTotal < 0 ? -1 : std::max(nWait, nWaitTotal);
+            }
+            stats.dBulkWait = nWait < 0 ? -1 : ((double)nWait) / 1e6;
+        }
     }
     {
         LOCK(cs_vRecv);
         stats.nRecvBytes = nRecvBytes;
     }
     stats.fWhitelisted = fWhitelisted;
+    stats.nRecvQueue = nRecvQueue;
+    stats.nGetDataQueue = nGetDataQueue;
+    stats.nPendingWork = nPendingWork;
+    stats.nTxInvSent = nTxInvSent;
+    stats.nTxInvFiltered = nTxInvFiltered;
+    stats.nInvBytesSent = nInvBytesSent;
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -807,10 +833,21 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    int64_t nNow = GetTimeMicros();
+
+    while (true) {
+        // Finish the message being sent, then send everything in vSendMsg
+        // before any historical blocks, which also have to wait for the
+        // upload rate limits.
+        std::deque<CSerializeData>* pqueue;
+        if (pnode->fSendingBulk || (pnode->vSendMsg.empty() && !pnode->vSendMsgBulk.empty() && pnode->CanSendBulk(nNow)))
+            pqueue = &pnode->vSendMsgBulk;
+        else if (!pnode->vSendMsg.empty())
+            pqueue = &pnode->vSendMsg;
+        else
+            break;
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = pqueue->front();
         assert(data.size() > pnode->nSendOffset);
         int nBytes = 0;
         {
@@ -827,10 +864,18 @@ void SocketSendData(CNode *pnode)
             }
             pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
+            if (pqueue == &pnode->vSendMsgBulk) {
+                pnode->RecordBulkBytesSent(nBytes, nNow);
+                pnode->fSendingBulk = true;
+            }
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
+                if (pnode->fSendingBulk) {
+                    pnode->nSendSizeBulk -= data.size();
+                    pnode->fSendingBulk = false;
+                }
+                pqueue->pop_front();
             } else {
                 // could not send full message; stop sending more
                 break;
@@ -850,11 +895,10 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty() && pnode->vSendMsgBulk.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -1202,7 +1246,8 @@ void ThreadSocketHandler()
                 bool select_send;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    select_send = lockSend && !pnode->vSendMsg.empty();
+                    select_send = lockSend && (!pnode->vSendMsg.empty() || pnode->fSendingBulk ||
+                        (!pnode->vSendMsgBulk.empty() && pnode->CanSendBulk(GetTimeMicros())));
                 }
 
                 bool select_recv;
@@ -1439,12 +1484,22 @@ void ThreadDNSAddressSeed()
 
 
 
+//! addrman.GetChangeCount() as of the last successful write of peers.dat
+static std::atomic<uint64_t> nAddrDumpChanges(0);
+
 void DumpAddresses()
 {
+    // Rewriting a large table that nothing has touched is a waste of a
+    // serialization pass under the addrman lock and of an fsync.
+    uint64_t nChanges = addrman.GetChangeCount();
+    if (nChanges == nAddrDumpChanges)
+        return;
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+        nAddrDumpChanges = nChanges;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1693,10 +1748,6 @@ void ThreadMessageHandler()
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         for (CNode* pnode : vNodesCopy)
@@ -1711,16 +1762,24 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
-                    if (!g_signals.ProcessMessages(chainparams, pnode))
-                        pnode->CloseSocketDisconnect();
+                    // Leave the peer alone while work queued for it is still
+                    // running; the worker wakes us up when it is done.
+                    if (pnode->nPendingWork == 0) {
+                        if (!g_signals.ProcessMessages(chainparams, pnode))
+                            pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (pnode->nSendSize < SendBufferSize())
                         {
-                            fSleep = false;
+                            if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                            {
+                                fSleep = false;
+                            }
                         }
                     }
+
+                    pnode->nRecvQueue = std::count_if(pnode->vRecvMsg.begin(), pnode->vRecvMsg.end(),
+                                                      [](const CNetMessage& msg) { return msg.complete(); });
+                    pnode->nGetDataQueue = pnode->vRecvGetData.size();
                 }
             }
             boost::this_thread::interruption_point();
@@ -1729,7 +1788,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(chainparams.GetConsensus(), pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(chainparams.GetConsensus(), pnode);
             }
             boost::this_thread::interruption_point();
         }
@@ -1745,6 +1804,65 @@ void ThreadMessageHandler()
     }
 }
 
+/**
+ * Work queued by the message handler to run on the message worker threads:
+ * serving blocks and handling received ones, which would otherwise hold up
+ * every other peer.
+ */
+static boost::mutex csNodeWork;
+static boost::condition_variable condNodeWork;
+static std::deque<std::pair<CNode*, std::function<void()>>> queueNodeWork;
+static int nNodeWorkers = 0;
+
+bool QueueNodeWork(CNode* pnode, std::function<void()> fn)
+{
+    boost::unique_lock<boost::mutex> lock(csNodeWork);
+    if (nNodeWorkers == 0) {
+        return false;
+    }
+    // Keep the node alive until the work is done; the counter holds back the
+    // peer's later messages.
+    pnode->AddRef();
+    pnode->nPendingWork++;
+    queueNodeWork.emplace_back(pnode, std::move(fn));
+    MetricsGauge("zcash.net.msgwork.queued", queueNodeWork.size());
+    condNodeWork.notify_one();
+    return true;
+}
+
+void ThreadNodeWork()
+{
+    while (true) {
+        std::pair<CNode*, std::function<void()>> work;
+        {
+            boost::unique_lock<boost::mutex> lock(csNodeWork);
+            while (queueNodeWork.empty()) {
+                condNodeWork.wait(lock);
+            }
+            work = std::move(queueNodeWork.front());
+            queueNodeWork.pop_front();
+            MetricsGauge("zcash.net.msgwork.queued", queueNodeWork.size());
+        }
+
+        CNode* pnode = work.first;
+        if (!pnode->fDisconnect) {
+            auto spanGuard = pnode->span.Enter();
+            try {
+                work.second();
+            } catch (const boost::thread_interrupted&) {
+                throw;
+            } catch (const std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadNodeWork()");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "ThreadNodeWork()");
+            }
+        }
+        pnode->nPendingWork--;
+        pnode->Release();
+        messageHandlerCondition.notify_one();
+    }
+}
+
 
 
 
@@ -1899,6 +2017,33 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
+static void ExpireRelayCache(int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs_mapRelay)
+{
+    while (!mapRelayExpiration.empty() && mapRelayExpiration.begin()->first < nNow) {
+        mapRelay.erase(mapRelayExpiration.begin()->second);
+        mapRelayExpiration.erase(mapRelayExpiration.begin());
+    }
+}
+
+/**
+ * Peers may still ask for a transaction we announced shortly before it left
+ * the mempool, typically because it was mined, so keep recently accepted
+ * transactions for a little while after they are removed. Called with
+ * mempool.cs held.
+ */
+static void RelayCacheEntryRemoved(const CTxMemPoolEntry& entry)
+{
+    int64_t nNow = GetTime();
+    if (entry.GetTime() + RELAY_TX_CACHE_TIME < nNow)
+        return;
+
+    const uint256& hash = entry.GetTx().GetHash();
+    LOCK(cs_mapRelay);
+    ExpireRelayCache(nNow);
+    if (mapRelay.insert(std::make_pair(hash, entry.GetSharedTx())).second)
+        mapRelayExpiration.insert(std::make_pair(nNow + RELAY_TX_REMOVED_CACHE_TIME, hash));
+}
+
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 {
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -1970,13 +2115,24 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
+    // Serve and handle blocks off the message handler thread
+    {
+        boost::unique_lock<boost::mutex> lock(csNodeWork);
+        nNodeWorkers = std::max(0, std::min((int)GetArg("-msghandworkers", DEFAULT_MSGHAND_WORKERS), MAX_MSGHAND_WORKERS));
+    }
+    for (int i = 0; i < nNodeWorkers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadNodeWork));
+
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
+
+    mempool.NotifyEntryRemoved.connect(&RelayCacheEntryRemoved);
 }
 
 bool StopNode()
 {
     LogPrintf("StopNode()\n");
+    mempool.NotifyEntryRemoved.disconnect(&RelayCacheEntryRemoved);
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
@@ -1987,6 +2143,17 @@ bool StopNode()
         fAddressesInitialized = false;
     }
 
+    // The worker threads have been stopped; drop the work they did not get to.
+    {
+        boost::unique_lock<boost::mutex> lock(csNodeWork);
+        nNodeWorkers = 0;
+        for (auto& work : queueNodeWork) {
+            work.first->nPendingWork--;
+            work.first->Release();
+        }
+        queueNodeWork.clear();
+    }
+
     return true;
 }
 
@@ -2037,14 +2204,19 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    
+    // Share the mempool's copy of the transaction rather than making another.
+    CTransactionRef ptx = mempool.get(tx.GetHash());
+    RelayTransaction(ptx ? ptx : MakeTransactionRef(tx));
+}
+
+void RelayTransaction(const CTransactionRef& ptx)
+{
+    const CTransaction& tx = *ptx;
+
     // Prevent realying transactions that are really big, because this may be a spam 
     // attack.
     int maxRelaySize = GetArg("-maxtxrelaysize", MAX_TX_RELAY_SIZE);
-    if (ss.size() > maxRelaySize) {
+    if (tx.GetTotalSize() > maxRelaySize) {
         LogPrint("net", "Not relaying Tx since it is too big: %s", tx.GetHash().ToString());
         return;
     }
@@ -2059,47 +2231,37 @@ void RelayTransaction(const CTransaction& tx)
         return;
     }
 
-    RelayTransaction(tx, ss);
-}
-
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
-{
     LogPrint("wr", "RelayTransaction() enter\n");
     uint64_t nTime1 = GetTimeMicros();
 
     CInv inv(MSG_TX, tx.GetHash());
-    {
+    // Transactions in the mempool are served from there. Keep the others,
+    // such as those force relayed for whitelisted peers, for a while.
+    if (!mempool.exists(inv.hash)) {
         LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        int64_t nNow = GetTime();
+        ExpireRelayCache(nNow);
+        if (mapRelay.insert(std::make_pair(inv.hash, ptx)).second)
+            mapRelayExpiration.insert(std::make_pair(nNow + RELAY_TX_CACHE_TIME, inv.hash));
     }
+    // Bloom filters are checked when the batch is sent, see SendMessages.
     LOCK(cs_vNodes);
     for (CNode* pnode : vNodes)
     {
         if(!pnode->fRelayTxes)
             continue;
-        LOCK(pnode->cs_filter);
-        auto spanGuard = pnode->span.Enter();
-        if (pnode->pfilter)
-        {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
-        } else
-            pnode->PushInventory(inv);
+        pnode->PushInventory(inv);
     }
 
     uint64_t nTime2 = GetTimeMicros();
     LogPrint("wr", "RelayTransaction() leave after %.2f ms\n", (nTime2 - nTime1) * 0.001);
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -2119,17 +2281,92 @@ void CNode::RecordBytesSent(uint64_t bytes)
         // timeframe expired, reset cycle
         nMaxOutboundCycleStartTime = now;
         nMaxOutboundTotalBytesSentInCycle = 0;
+        // Historical blocks start the new cycle with a full bucket, rather
+        // than paying back what the last one overdrew.
+        historicalBucket.SetUnlimited();
     }
 
     // TODO, exclude whitebind peers
     nMaxOutboundTotalBytesSentInCycle += bytes;
 }
 
+void CNode::RecordBulkBytesSent(uint64_t bytes, int64_t nNow)
+{
+    bulkBucket.Spend(bytes, nNow);
+    nSendBytesBulk += bytes;
+
+    LOCK(cs_totalBytesSent);
+    historicalBucket.Spend(bytes, nNow);
+    nTotalBulkBytesSent += bytes;
+    MetricsCounter("zcash.net.out.bulk.bytes", bytes);
+}
+
+bool CNode::CanSendBulk(int64_t nNow)
+{
+    if (!bulkBucket.CanSpend(nNow))
+        return false;
+
+    LOCK(cs_totalBytesSent);
+    UpdateHistoricalRate(nNow);
+    return historicalBucket.CanSpend(nNow);
+}
+
+void CNode::UpdateHistoricalRate(int64_t nNow)
+{
+    AssertLockHeld(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0) {
+        historicalBucket.SetUnlimited();
+        return;
+    }
+
+    // Rather than stopping once the target is near, spread what is left of
+    // it, after keeping enough to relay each new block once, over the rest
+    // of the cycle.
+    uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+    uint64_t buffer = nMaxOutboundTargetSpacing ? timeLeftInCycle / nMaxOutboundTargetSpacing * MAX_BLOCK_SIZE : 0;
+    uint64_t bytesLeft = 0;
+    if (nMaxOutboundTotalBytesSentInCycle + buffer < nMaxOutboundLimit)
+        bytesLeft = nMaxOutboundLimit - buffer - nMaxOutboundTotalBytesSentInCycle;
+    // Never round a non-zero allowance down to a rate of zero. With nothing
+    // left, the queued blocks wait until the buffer kept for new blocks has
+    // gone unused or the next cycle starts.
+    uint64_t rate = bytesLeft / std::max<uint64_t>(timeLeftInCycle, 1);
+    if (bytesLeft > 0 && rate == 0)
+        rate = 1;
+    historicalBucket.SetRate(rate, MAX_BLOCK_SIZE, nNow);
+}
+
+void CNode::SetMaxPeerUploadRate(uint64_t rate)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxPeerUploadRate = rate;
+}
+
+uint64_t CNode::GetMaxPeerUploadRate()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxPeerUploadRate;
+}
+
+int64_t CNode::GetHistoricalUploadRate()
+{
+    LOCK(cs_totalBytesSent);
+    UpdateHistoricalRate(GetTimeMicros());
+    return historicalBucket.IsLimited() ? historicalBucket.GetRate() : -1;
+}
+
+uint64_t CNode::GetTotalBulkBytesSent()
+{
+    LOCK(cs_totalBytesSent);
+    return nTotalBulkBytesSent;
+}
+
 void CNode::SetMaxOutboundTarget(uint64_t targetSpacing, uint64_t limit)
 {
     LOCK(cs_totalBytesSent);
     uint64_t recommendedMinimum = (nMaxOutboundTimeframe / targetSpacing) * MAX_BLOCK_SIZE;
     nMaxOutboundLimit = limit;
+    nMaxOutboundTargetSpacing = targetSpacing;
 
     if (limit > 0 && limit < recommendedMinimum)
         LogPrintf("Max outbound target is very small (%s bytes) and will be overshot. Recommended minimum is %s bytes.\n", nMaxOutboundLimit, recommendedMinimum);
@@ -2277,8 +2514,22 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fSuccessfullyConnected = false;
     fDisconnect = false;
     nRefCount = 0;
+    nRecvQueue = 0;
+    nGetDataQueue = 0;
+    nPendingWork = 0;
+    nNextInvSend = 0;
+    nNextAddrSend = 0;
+    nTxInvSent = 0;
+    nTxInvFiltered = 0;
+    nInvBytesSent = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fSendingBulk = false;
+    nSendSizeBulk = 0;
+    nSendBytesBulk = 0;
+    uint64_t nPeerUploadRate = GetMaxPeerUploadRate();
+    if (nPeerUploadRate > 0)
+        bulkBucket.SetRate(nPeerUploadRate, std::max<uint64_t>(nPeerUploadRate, MAX_BLOCK_SIZE), GetTimeMicros());
     hashContinue = uint256();
     nStartingHeight = -1;
     filterInventoryKnown.reset();
@@ -2386,7 +2637,7 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
     LogPrint("net", "(aborted)\n");
 }
 
-void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
+void CNode::EndMessage(bool fBulk) UNLOCK_FUNCTION(cs_vSend)
 {
     MetricsIncrementCounter("zcash.net.out.messages", "command", strSendCommand.c_str());
     // The -*messagestest options are intentionally not documented in the help message,
@@ -2419,16 +2670,19 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
+    std::deque<CSerializeData>& queue = fBulk ? vSendMsgBulk : vSendMsg;
+    std::deque<CSerializeData>::iterator it = queue.insert(queue.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
+    if (fBulk)
+        nSendSizeBulk += (*it).size();
     MetricsCounter(
         "zcash.net.out.bytes", (*it).size(),
         "command", strSendCommand.c_str());
     strSendCommand.clear();
 
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    // If nothing is queued ahead of this message, attempt "optimistic write"
+    if (nSendOffset == 0 && it == queue.begin() && (!fBulk || vSendMsg.empty()))
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
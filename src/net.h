@@ -12,15 +12,18 @@
 #include "fs.h"
 #include "limitedmap.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
+#include "tokenbucket.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 #include "chainparams.h"
 
 #include <deque>
+#include <functional>
 #include <stdint.h>
 #include <atomic>
 
@@ -45,6 +48,10 @@ namespace boost {
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Seconds to keep relayed transactions that are not in the mempool, to serve getdata requests. */
+static const int64_t RELAY_TX_CACHE_TIME = 15 * 60;
+/** Seconds to keep transactions that leave the mempool within RELAY_TX_CACHE_TIME of being accepted. */
+static const int64_t RELAY_TX_REMOVED_CACHE_TIME = 2 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
@@ -63,6 +70,8 @@ static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The default for -maxpeeruploadrate, in KB/s. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_PEER_UPLOAD_RATE = 0;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
 /**
@@ -74,6 +83,10 @@ static const int NETWORK_UPGRADE_PEER_PREFERENCE_BLOCK_PERIOD = 1728;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default for -msghandworkers, the number of threads handling expensive messages off the message handler thread. */
+static const int DEFAULT_MSGHAND_WORKERS = 2;
+/** Maximum for -msghandworkers. */
+static const int MAX_MSGHAND_WORKERS = 16;
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
@@ -93,6 +106,13 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
+
+/**
+ * Run fn for a peer on a message worker thread. The peer's later messages are
+ * not processed until fn has finished, so its requests are still answered in
+ * order. Returns false, without running fn, if there are no worker threads.
+ */
+bool QueueNodeWork(CNode* pnode, std::function<void()> fn);
 void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
@@ -117,7 +137,7 @@ struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
     boost::signals2::signal<bool (const CChainParams&, CNode*), CombinerAll> ProcessMessages;
-    boost::signals2::signal<bool (const Consensus::Params&, CNode*, bool), CombinerAll> SendMessages;
+    boost::signals2::signal<bool (const Consensus::Params&, CNode*), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
 };
@@ -164,8 +184,9 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
+/** Relayed transactions that can no longer be served from the mempool. */
+extern std::map<uint256, CTransactionRef> mapRelay;
+extern std::multimap<int64_t, uint256> mapRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
@@ -207,6 +228,15 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    size_t nRecvQueue;
+    size_t nGetDataQueue;
+    int nPendingWork;
+    uint64_t nTxInvSent;
+    uint64_t nTxInvFiltered;
+    uint64_t nInvBytesSent;
+    uint64_t nBulkBytesSent;
+    uint64_t nBulkBytesQueued;
+    double dBulkWait;
 };
 
 
@@ -260,10 +290,19 @@ public:
     SOCKET hSocket;
     CDataStream ssSend;
     std::string strSendCommand; // Current command being assembled in ssSend
-    size_t nSendSize; // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendSize; // total size of all vSendMsg and vSendMsgBulk entries
+    size_t nSendOffset; // offset inside the message being sent
     uint64_t nSendBytes;
     std::deque<CSerializeData> vSendMsg;
+    // Historical blocks, sent once vSendMsg is empty, as fast as the upload
+    // rate limits allow.
+    std::deque<CSerializeData> vSendMsgBulk;
+    // Whether the message being sent is the first of vSendMsgBulk.
+    bool fSendingBulk;
+    size_t nSendSizeBulk;
+    uint64_t nSendBytesBulk;
+    // Paces vSendMsgBulk to -maxpeeruploadrate; protected by cs_vSend.
+    CTokenBucket bulkBucket;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -271,6 +310,12 @@ public:
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Complete messages and getdata requests waiting to be processed, as of
+    // the last message handler pass; for getpeerinfo.
+    std::atomic<size_t> nRecvQueue;
+    std::atomic<size_t> nGetDataQueue;
+    // Work queued for this peer on the message worker threads.
+    std::atomic<int> nPendingWork;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -339,10 +384,25 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
+    // Non-transaction inventory, announced on the next SendMessages.
     std::vector<CInv> vInventoryToSend;
+    // Transactions to announce in the next batch; protected by cs_inventory.
+    std::set<uint256> setInventoryTxToSend;
+    // Blocks to announce with headers or inv, in chain order; protected by cs_inventory.
+    std::vector<uint256> vBlockHashesToAnnounce;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
+    // When (in usec) to next announce a batch of transactions and addresses.
+    int64_t nNextInvSend;
+    int64_t nNextAddrSend;
+    // Transaction announcements sent to this peer, and the queued ones that
+    // were dropped because the peer knew them, they had left the mempool or
+    // they did not match its bloom filter.
+    std::atomic<uint64_t> nTxInvSent;
+    std::atomic<uint64_t> nTxInvFiltered;
+    // Bytes of inv messages sent to this peer.
+    std::atomic<uint64_t> nInvBytesSent;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -371,6 +431,15 @@ private:
     static uint64_t nMaxOutboundCycleStartTime;
     static uint64_t nMaxOutboundLimit;
     static uint64_t nMaxOutboundTimeframe;
+    static uint64_t nMaxOutboundTargetSpacing;
+
+    // Historical block serving to all peers together is paced to what is
+    // left of the outbound target.
+    static CTokenBucket historicalBucket;
+    static uint64_t nTotalBulkBytesSent;
+    static uint64_t nMaxPeerUploadRate;
+
+    static void UpdateHistoricalRate(int64_t nNow);
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -399,6 +468,13 @@ public:
         return nRefCount;
     }
 
+    // Bytes waiting in vSendMsg; the historical blocks of vSendMsgBulk are
+    // limited separately.
+    size_t GetSendSizeNormal() const
+    {
+        return nSendSize - nSendSizeBulk;
+    }
+
     // requires LOCK(cs_vRecvMsg)
     unsigned int GetTotalRecvSize()
     {
@@ -466,14 +542,23 @@ public:
 
     void PushInventory(const CInv& inv)
     {
-        {
-            LOCK(cs_inventory);
-            if (inv.type == MSG_TX && filterInventoryKnown.contains(inv.hash))
-                return;
+        LOCK(cs_inventory);
+        if (inv.type == MSG_TX) {
+            // Sent in batches by SendMessages, which checks filterInventoryKnown
+            // again for transactions the peer told us about in the meantime.
+            if (!filterInventoryKnown.contains(inv.hash))
+                setInventoryTxToSend.insert(inv.hash);
+        } else {
             vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -483,7 +568,8 @@ public:
     void AbortMessage() UNLOCK_FUNCTION(cs_vSend);
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
-    void EndMessage() UNLOCK_FUNCTION(cs_vSend);
+    // If fBulk is set, the message is queued in vSendMsgBulk.
+    void EndMessage(bool fBulk = false) UNLOCK_FUNCTION(cs_vSend);
 
     void PushVersion();
 
@@ -502,6 +588,48 @@ public:
         }
     }
 
+    /**
+     * Queue a message behind all other messages, to be sent as the upload
+     * rate limits for historical blocks allow. Bulk messages are sent in the
+     * order they were queued.
+     */
+    template<typename T1>
+    void PushBulkMessage(const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend << a1;
+            EndMessage(true);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
+    /**
+     * Queue a reply that must not overtake the historical blocks requested
+     * before it, such as a pong or notfound: behind them in the bulk queue
+     * while any are waiting, otherwise as a normal message.
+     */
+    template<typename T1>
+    void PushOrderedMessage(const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend << a1;
+            EndMessage(nSendSizeBulk > 0);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -687,6 +815,10 @@ public:
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
+    //! Requires cs_vSend.
+    void RecordBulkBytesSent(uint64_t bytes, int64_t nNow);
+    //! Whether the next message of vSendMsgBulk may be sent now. Requires cs_vSend.
+    bool CanSendBulk(int64_t nNow);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
@@ -711,6 +843,15 @@ public:
     //!response the time in seconds left in the current max outbound cycle
     // in case of no limit, it will always respond with 0
     static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    //!set the upload rate limit for historical blocks to each peer, in bytes per second, 0 = no limit
+    static void SetMaxPeerUploadRate(uint64_t rate);
+    static uint64_t GetMaxPeerUploadRate();
+
+    //!response the rate in bytes per second that historical blocks are currently
+    // paced to across all peers, to stay within the outbound target; -1 if not limited
+    static int64_t GetHistoricalUploadRate();
+    static uint64_t GetTotalBulkBytesSent();
     std::string GetAddrName() const;
     //! Sets the addrName only if it was not previously set
     void MaybeSetAddrName(const std::string& addrNameIn);
@@ -718,9 +859,11 @@ public:
 
 
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
+
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 
 
 #endif // BITCOIN_NET_H
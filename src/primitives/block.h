@@ -10,6 +10,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+struct PrecomputedTransactionData;
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -81,11 +83,21 @@ class CBlock : public CBlockHeader
 {
 public:
     // network and disk
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only; set once CheckBlock() has passed the proof of work and
+    // merkle root, so that later calls on the same block skip them.
+    mutable bool fCheckedPOW;
+
+    // memory only; signature hash midstates for vtx, shared by
+    // ContextualCheckBlock() and ConnectBlock(). Valid while the merkle
+    // root matches hashTxDataRoot.
+    mutable std::vector<std::shared_ptr<const PrecomputedTransactionData>> vTxData;
+    mutable uint256 hashTxDataRoot;
+
     CBlock()
     {
         SetNull();
@@ -110,6 +122,9 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fCheckedPOW = false;
+        vTxData.clear();
+        hashTxDataRoot.SetNull();
     }
 
     CBlockHeader GetBlockHeader() const
@@ -137,6 +152,24 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * Deserialize a block, allocating each transaction together with its
+ * shared_ptr control block from alloc. With an arena_allocator the
+ * transactions share a few arena chunks instead of one heap allocation each,
+ * and keep the arena alive until the last of them is freed; use that for
+ * blocks whose transactions are dropped together. The vectors inside each
+ * transaction still use the default allocator.
+ */
+template <typename Stream, typename Alloc>
+void UnserializeBlock(Stream& s, CBlock& block, const Alloc& alloc)
+{
+    block.SetNull();
+    s >> *(CBlockHeader*)&block;
+    uint64_t nTx = ReadCompactSize(s);
+    for (uint64_t i = 0; i < nTx; i++) {
+        block.vtx.push_back(std::allocate_shared<const CTransaction>(alloc, deserialize, s));
+    }
+}
 
 /**
  * Custom serializer for CBlockHeader that omits the nonce and solution, for use
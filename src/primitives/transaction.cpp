@@ -79,9 +79,40 @@ uint256 CMutableTransaction::GetHash() const
     return SerializeHash(*this);
 }
 
+namespace {
+
+/** A CHashWriter that also counts the bytes written to it. */
+class CSizingHashWriter : public CHashWriter
+{
+private:
+    size_t nSize;
+
+public:
+    CSizingHashWriter(int nTypeIn, int nVersionIn) : CHashWriter(nTypeIn, nVersionIn), nSize(0) {}
+
+    void write(const char *pch, size_t size) {
+        nSize += size;
+        CHashWriter::write(pch, size);
+    }
+
+    size_t size() const { return nSize; }
+
+    template<typename T>
+    CSizingHashWriter& operator<<(const T& obj) {
+        ::Serialize(*this, obj);
+        return (*this);
+    }
+};
+
+} // anon namespace
+
 void CTransaction::UpdateHash() const
 {
-    *const_cast<uint256*>(&hash) = SerializeHash(*this);
+    // Hash and measure the transaction in a single serialization pass.
+    CSizingHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << *this;
+    *const_cast<size_t*>(&nTotalSize) = ss.size();
+    *const_cast<uint256*>(&hash) = ss.GetHash();
 }
 
 CTransaction::CTransaction() : nVersion(CTransaction::SPROUT_MIN_CURRENT_VERSION),
@@ -89,7 +120,10 @@ CTransaction::CTransaction() : nVersion(CTransaction::SPROUT_MIN_CURRENT_VERSION
                                vin(), vout(), nLockTime(0),
                                valueBalance(0), vShieldedSpend(), vShieldedOutput(),
                                vJoinSplit(), joinSplitPubKey(), joinSplitSig(),
-                               bindingSig() { }
+                               bindingSig()
+{
+    *const_cast<size_t*>(&nTotalSize) = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+}
 
 CTransaction::CTransaction(const CMutableTransaction &tx) : nVersion(tx.nVersion), fOverwintered(tx.fOverwintered), nVersionGroupId(tx.nVersionGroupId), nExpiryHeight(tx.nExpiryHeight),
                                                             vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime),
@@ -111,6 +145,7 @@ CTransaction::CTransaction(
                               bindingSig(tx.bindingSig)
 {
     assert(evilDeveloperFlag);
+    *const_cast<size_t*>(&nTotalSize) = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
 }
 
 CTransaction::CTransaction(CMutableTransaction &&tx) : nVersion(tx.nVersion),
@@ -142,6 +177,7 @@ CTransaction& CTransaction::operator=(const CTransaction &tx) {
     *const_cast<Ed25519Signature*>(&joinSplitSig) = tx.joinSplitSig;
     *const_cast<binding_sig_t*>(&bindingSig) = tx.bindingSig;
     *const_cast<uint256*>(&hash) = tx.hash;
+    *const_cast<size_t*>(&nTotalSize) = tx.nTotalSize;
     return *this;
 }
 
@@ -216,7 +252,7 @@ unsigned int CTransaction::CalculateModifiedSize(unsigned int nTxSize) const
     // Providing any more cleanup incentive than making additional inputs free would
     // risk encouraging people to create junk outputs to redeem later.
     if (nTxSize == 0)
-        nTxSize = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+        nTxSize = GetTotalSize();
     for (std::vector<CTxIn>::const_iterator it(vin.begin()); it != vin.end(); ++it)
     {
         unsigned int offset = 41U + std::min(110U, (unsigned int)it->scriptSig.size());
@@ -16,6 +16,7 @@
 #include "consensus/upgrades.h"
 
 #include <array>
+#include <memory>
 #include <variant>
 
 #include "zcash/NoteEncryption.hpp"
@@ -527,6 +528,7 @@ class CTransaction
 private:
     /** Memory only. */
     const uint256 hash;
+    const size_t nTotalSize = 0;
     void UpdateHash() const;
 
 protected:
@@ -673,6 +675,14 @@ public:
         return hash;
     }
 
+    /**
+     * Serialized size of the transaction. This is computed together with the
+     * hash, so it is always available without re-serializing.
+     */
+    size_t GetTotalSize() const {
+        return nTotalSize;
+    }
+
     uint32_t GetHeader() const {
         // When serializing v1 and v2, the 4 byte header is nVersion
         uint32_t header = this->nVersion;
@@ -821,4 +831,12 @@ struct CMutableTransaction
     uint256 GetHash() const;
 };
 
+/**
+ * An immutable, shared transaction. Blocks, the mempool and relay hold
+ * transactions through these so that each exists once in memory.
+ */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
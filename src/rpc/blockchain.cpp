@@ -4,11 +4,13 @@
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
 #include "amount.h"
+#include "blockprofile.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
 #include "experimental_features.h"
+#include "indexbuilder.h"
 #include "key_io.h"
 #include "main.h"
 #include "metrics.h"
@@ -16,6 +18,7 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -148,7 +151,7 @@ UniValue blockToDeltasJSON(const CBlock& block, const CBlockIndex* blockindex)
     KeyIO keyIO(Params());
     UniValue deltas(UniValue::VARR);
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         const uint256 txhash = tx.GetHash();
 
         UniValue entry(UniValue::VOBJ);
@@ -236,8 +239,9 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.pushKV("finalsaplingroot", blockindex->hashFinalSaplingRoot.GetHex());
     result.pushKV("chainhistoryroot", blockindex->hashChainHistoryRoot.GetHex());
     UniValue txs(UniValue::VARR);
-    for (const CTransaction&tx : block.vtx)
+    for (const CTransactionRef& ptx : block.vtx)
     {
+        const CTransaction& tx = *ptx;
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
@@ -815,6 +819,325 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+static UniValue DBStatsToJSON(const CDBWrapper& db)
+{
+    const CDBProfile& profile = db.GetProfile();
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("compression", db.IsCompressed());
+    obj.pushKV("block_size", (uint64_t)profile.nBlockSize);
+    obj.pushKV("bloom_bits", profile.nBloomBits);
+    obj.pushKV("max_open_files", db.GetMaxOpenFiles());
+
+    std::string strValue;
+    if (db.GetProperty("leveldb.approximate-memory-usage", strValue)) {
+        obj.pushKV("memory_usage", atoi64(strValue));
+    }
+
+    // LevelDB reports compaction statistics as a text table with one row per
+    // non-empty level; the header lines do not parse as numbers.
+    UniValue levels(UniValue::VARR);
+    if (db.GetProperty("leveldb.stats", strValue)) {
+        std::istringstream stream(strValue);
+        std::string line;
+        while (std::getline(stream, line)) {
+            int level, files;
+            double size, time, read, written;
+            if (sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &level, &files, &size, &time, &read, &written) != 6) {
+                continue;
+            }
+            UniValue entry(UniValue::VOBJ);
+            entry.pushKV("level", level);
+            entry.pushKV("files", files);
+            entry.pushKV("size_mb", size);
+            entry.pushKV("compaction_seconds", time);
+            entry.pushKV("compaction_read_mb", read);
+            entry.pushKV("compaction_write_mb", written);
+            levels.push_back(entry);
+        }
+    }
+    obj.pushKV("levels", levels);
+    return obj;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns LevelDB tuning and compaction statistics for the block index and chainstate databases.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"index\": {                   (json object) the block index database (blocks/index)\n"
+            "    \"compression\": true|false,  (boolean) whether table blocks are Snappy-compressed; false if LevelDB lacks Snappy\n"
+            "    \"block_size\": n,            (numeric) the target table block size in bytes\n"
+            "    \"bloom_bits\": n,            (numeric) bloom filter bits per key\n"
+            "    \"max_open_files\": n,        (numeric) the number of table files that may be kept open\n"
+            "    \"memory_usage\": n,          (numeric) approximate memory used by the database in bytes\n"
+            "    \"levels\": [                 (array) one entry per non-empty level\n"
+            "      {\n"
+            "        \"level\": n,             (numeric) the level\n"
+            "        \"files\": n,             (numeric) number of table files in the level\n"
+            "        \"size_mb\": n,           (numeric) size of the level in MiB\n"
+            "        \"compaction_seconds\": n,  (numeric) time spent compacting into the level\n"
+            "        \"compaction_read_mb\": n,  (numeric) MiB read by compactions into the level\n"
+            "        \"compaction_write_mb\": n  (numeric) MiB written by compactions into the level\n"
+            "      }, ...\n"
+            "    ]\n"
+            "  },\n"
+            "  \"chainstate\": { ... },         (json object) the chainstate database, same fields\n"
+            "  \"chainstate_writes\": {         (json object) background writes of the coins cache to the chainstate\n"
+            "    \"count\": n,                 (numeric) number of completed writes\n"
+            "    \"in_progress\": true|false,  (boolean) whether a write is running now\n"
+            "    \"pending_memory\": n,        (numeric) approximate memory held by the write in progress, in bytes\n"
+            "    \"last_duration_ms\": n,      (numeric) duration of the last write\n"
+            "    \"last_bytes\": n,            (numeric) approximate size of the last write\n"
+            "    \"total_duration_ms\": n,     (numeric) total duration of all writes\n"
+            "    \"total_bytes\": n,           (numeric) approximate size of all writes\n"
+            "    \"total_wait_ms\": n          (numeric) time validation spent waiting for a previous write\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    LOCK(cs_main);
+
+    UniValue ret(UniValue::VOBJ);
+    if (pblocktree) {
+        ret.pushKV("index", DBStatsToJSON(*pblocktree));
+    }
+    if (pcoinsdbview) {
+        ret.pushKV("chainstate", DBStatsToJSON(pcoinsdbview->GetDB()));
+    }
+    if (pcoinsflusher) {
+        CCoinsFlushStats stats = pcoinsflusher->GetFlushStats();
+        UniValue writes(UniValue::VOBJ);
+        writes.pushKV("count", stats.nFlushes);
+        writes.pushKV("in_progress", stats.fInProgress);
+        writes.pushKV("pending_memory", (uint64_t)pcoinsflusher->PendingMemoryUsage());
+        writes.pushKV("last_duration_ms", stats.nLastDurationMicros / 1000);
+        writes.pushKV("last_bytes", (uint64_t)stats.nLastBytes);
+        writes.pushKV("total_duration_ms", stats.nTotalDurationMicros / 1000);
+        writes.pushKV("total_bytes", stats.nTotalBytes);
+        writes.pushKV("total_wait_ms", stats.nTotalWaitMicros / 1000);
+        ret.pushKV("chainstate_writes", writes);
+    }
+    return ret;
+}
+
+static UniValue IndexInfoToJSON(bool fSynced, int nBestHeight, int nChainHeight)
+{
+    UniValue info(UniValue::VOBJ);
+    info.pushKV("synced", fSynced);
+    info.pushKV("best_block_height", nBestHeight);
+    info.pushKV("progress", nChainHeight > 0 ? std::min(1.0, std::max(0, nBestHeight) / (double)nChainHeight) : 1.0);
+    return info;
+}
+
+UniValue getindexinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getindexinfo\n"
+            "\nReturns the state of the optional indexes. Indexes enabled after the block database was created\n"
+            "are built in the background, and the RPC methods that use them become available once they are synced.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {                  (json object) one entry per enabled index, such as txindex,\n"
+            "                                addressindex, spentindex, timestampindex or txheightindex\n"
+            "    \"synced\": true|false,     (boolean) whether the index has caught up with the active chain\n"
+            "    \"best_block_height\": n,   (numeric) the height of the last block indexed\n"
+            "    \"progress\": x.xxx         (numeric) best_block_height as a fraction of the chain height\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getindexinfo", "")
+            + HelpExampleRpc("getindexinfo", "")
+        );
+
+    LOCK(cs_main);
+
+    UniValue ret(UniValue::VOBJ);
+    int nChainHeight = chainActive.Height();
+    for (const CBaseIndex* pindex : GetIndexes()) {
+        ret.pushKV(pindex->GetName(), IndexInfoToJSON(pindex->IsSynced(), pindex->GetBestHeight(), nChainHeight));
+    }
+    // Indexes kept up to date with each block, including those whose
+    // background build has finished.
+    for (BlockTreeIndex index : {TX_INDEX, ADDRESS_INDEX, SPENT_INDEX, TIMESTAMP_INDEX}) {
+        if (IsBlockTreeIndexEnabled(index)) {
+            ret.pushKV(GetBlockTreeIndexName(index), IndexInfoToJSON(true, nChainHeight, nChainHeight));
+        }
+    }
+    return ret;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrites a snapshot of the chainstate at the current tip to a file in the -exportdir directory.\n"
+            "The snapshot holds the block headers up to the tip, the unspent transaction outputs, the Sprout\n"
+            "and Sapling commitment trees and nullifiers, and the history trees. A new node can start from it\n"
+            "with -loadsnapshot. Block processing pauses while the block headers are written.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The filename, saved in the folder set by the -exportdir option\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",           (string) the full path of the snapshot file\n"
+            "  \"base_hash\": \"hash\",      (string) the hash of the block the snapshot was taken at\n"
+            "  \"base_height\": n,         (numeric) the height of that block\n"
+            "  \"snapshot_hash\": \"hash\",  (string) the hash of the snapshot, for -snapshothash\n"
+            "  \"coins\": n,               (numeric) the number of unspent transaction outputs\n"
+            "  \"sprout_anchors\": n,      (numeric) the number of Sprout commitment trees\n"
+            "  \"sapling_anchors\": n,     (numeric) the number of Sapling commitment trees\n"
+            "  \"nullifiers\": n,          (numeric) the number of Sprout and Sapling nullifiers\n"
+            "  \"history_nodes\": n        (numeric) the number of history tree nodes\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"snapshot\"")
+            + HelpExampleRpc("dumptxoutset", "\"snapshot\"")
+        );
+
+    fs::path exportdir;
+    try {
+        exportdir = GetExportDir();
+    } catch (const std::runtime_error& e) {
+        throw JSONRPCError(RPC_INTERNAL_ERROR, e.what());
+    }
+    if (exportdir.empty()) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot write a snapshot until the zcashd -exportdir option has been set");
+    }
+    std::string unclean = params[0].get_str();
+    std::string clean = SanitizeFilename(unclean);
+    if (clean.compare(unclean) != 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Filename is invalid as only alphanumeric characters are allowed.  Try '%s' instead.", clean));
+    }
+    fs::path exportfilepath = exportdir / clean;
+    if (fs::exists(exportfilepath)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot overwrite existing file " + exportfilepath.string());
+    }
+
+    CChainstateSnapshotInfo info;
+    if (!WriteChainstateSnapshot(exportfilepath, info)) {
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Failed to write the snapshot, see debug.log");
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("path", exportfilepath.string());
+    ret.pushKV("base_hash", info.hashBlock.GetHex());
+    ret.pushKV("base_height", info.nHeight);
+    ret.pushKV("snapshot_hash", info.hashSnapshot.GetHex());
+    ret.pushKV("coins", info.stats.nCoins);
+    ret.pushKV("sprout_anchors", info.stats.nSproutAnchors);
+    ret.pushKV("sapling_anchors", info.stats.nSaplingAnchors);
+    ret.pushKV("nullifiers", info.stats.nNullifiers);
+    ret.pushKV("history_nodes", info.stats.nHistoryNodes);
+    return ret;
+}
+
+static UniValue BlockProfileToJSON(const CBlockProfile& profile)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("hash", profile.hash.GetHex());
+    obj.pushKV("height", profile.nHeight);
+    obj.pushKV("time", profile.nTimeConnected);
+
+    UniValue txs(UniValue::VOBJ);
+    for (int i = 0; i < PROFILE_TX_TYPES; i++) {
+        UniValue type(UniValue::VOBJ);
+        type.pushKV("count", (uint64_t)profile.nTx[i]);
+        type.pushKV("time_us", profile.nTimeByType[i]);
+        txs.pushKV(BlockProfileTxTypeName((BlockProfileTxType)i), type);
+    }
+    obj.pushKV("transactions", txs);
+    obj.pushKV("inputs", (uint64_t)profile.nInputs);
+    obj.pushKV("joinsplits", (uint64_t)profile.nJoinSplits);
+    obj.pushKV("sapling_spends", (uint64_t)profile.nSaplingSpends);
+    obj.pushKV("sapling_outputs", (uint64_t)profile.nSaplingOutputs);
+
+    UniValue phases(UniValue::VOBJ);
+    phases.pushKV("sapling_proofs", profile.nTimeSaplingProofs);
+    phases.pushKV("joinsplit_proofs", profile.nTimeJoinSplitProofs);
+    phases.pushKV("scripts", profile.nTimeScripts);
+    phases.pushKV("utxo", profile.nTimeUtxo);
+    phases.pushKV("trees", profile.nTimeTrees);
+    phases.pushKV("history", profile.nTimeHistory);
+    phases.pushKV("index", profile.nTimeIndex);
+    phases.pushKV("connect", profile.nTimeConnect);
+    phases.pushKV("flush", profile.nTimeFlush);
+    phases.pushKV("chainstate", profile.nTimeChainState);
+    phases.pushKV("postconnect", profile.nTimePostConnect);
+    phases.pushKV("total", profile.nTimeTotal);
+    obj.pushKV("phases_us", phases);
+    return obj;
+}
+
+UniValue getblockprofile(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getblockprofile ( \"blockhash\" )\n"
+            "\nReturns where the time went while a recently connected block was checked and connected.\n"
+            "Profiles are kept for the last -blockprofiles blocks. Without a block hash, returns all of\n"
+            "them, most recently connected first. Times are in microseconds.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"          (string, optional) The block hash\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"hash\": \"hash\",           (string) the block hash\n"
+            "  \"height\": n,              (numeric) the block height\n"
+            "  \"time\": n,                (numeric) when the block was connected, in seconds since the epoch\n"
+            "  \"transactions\": {         (json object) the block's transactions by kind\n"
+            "    \"transparent\": {        (json object) transactions without JoinSplits or Sapling spends and outputs\n"
+            "      \"count\": n,           (numeric) the number of transactions\n"
+            "      \"time_us\": n          (numeric) time spent on their proofs, scripts and coins, excluding script check threads\n"
+            "    },\n"
+            "    \"sprout\": { ... },      (json object) transactions with JoinSplits\n"
+            "    \"sapling\": { ... }      (json object) transactions with Sapling spends or outputs and no JoinSplits\n"
+            "  },\n"
+            "  \"inputs\": n,              (numeric) the number of transparent inputs\n"
+            "  \"joinsplits\": n,          (numeric) the number of JoinSplits\n"
+            "  \"sapling_spends\": n,      (numeric) the number of Sapling spends\n"
+            "  \"sapling_outputs\": n,     (numeric) the number of Sapling outputs\n"
+            "  \"phases_us\": {\n"
+            "    \"sapling_proofs\": n,    (numeric) Sapling proofs and signatures, checked when the block was accepted\n"
+            "    \"joinsplit_proofs\": n,  (numeric) JoinSplit proofs and signatures\n"
+            "    \"scripts\": n,           (numeric) transparent scripts, including waiting for the script check threads\n"
+            "    \"utxo\": n,              (numeric) coin and nullifier lookups and coin updates\n"
+            "    \"trees\": n,             (numeric) appending note commitments to the Sprout and Sapling trees\n"
+            "    \"history\": n,           (numeric) checking the light client root and updating the history tree\n"
+            "    \"index\": n,             (numeric) writing undo data and indexes\n"
+            "    \"connect\": n,           (numeric) all of block connection, excluding checks done on acceptance\n"
+            "    \"flush\": n,             (numeric) flushing the block's coins into the coins cache\n"
+            "    \"chainstate\": n,        (numeric) writing the chainstate to disk, if that was needed\n"
+            "    \"postconnect\": n,       (numeric) mempool updates and notifications\n"
+            "    \"total\": n              (numeric) the whole of connecting the block to the tip\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockprofile", "\"00000000febc373a1da2bd9f887b105ad79ddc26ac26c2b28652d64e5207c5b5\"")
+            + HelpExampleRpc("getblockprofile", "\"00000000febc373a1da2bd9f887b105ad79ddc26ac26c2b28652d64e5207c5b5\"")
+        );
+
+    if (params.size() == 0) {
+        UniValue ret(UniValue::VARR);
+        for (const CBlockProfile& profile : blockProfiler.GetRecent()) {
+            ret.push_back(BlockProfileToJSON(profile));
+        }
+        return ret;
+    }
+
+    uint256 hash(ParseHashV(params[0], "blockhash"));
+    auto profile = blockProfiler.Get(hash);
+    if (!profile) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No profile for this block; only the last -blockprofiles connected blocks are kept");
+    }
+    return BlockProfileToJSON(*profile);
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -840,7 +1163,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -864,33 +1186,35 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) { // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        }
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin)) {
             return NullUniValue;
+        }
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.pushKV("bestblock", pindex->GetBlockHash().GetHex());
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.pushKV("confirmations", 0);
     else
-        ret.pushKV("confirmations", pindex->nHeight - coins.nHeight + 1);
-    ret.pushKV("value", ValueFromAmount(coins.vout[n].nValue));
+        ret.pushKV("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1));
+    ret.pushKV("value", ValueFromAmount(coin.out.nValue));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.pushKV("scriptPubKey", o);
-    ret.pushKV("version", coins.nVersion);
-    ret.pushKV("coinbase", coins.fCoinBase);
+    ret.pushKV("coinbase", (bool)coin.fCoinBase);
 
     return ret;
 }
@@ -1516,6 +1840,10 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
+    { "blockchain",         "getindexinfo",           &getindexinfo,           true  },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
+    { "blockchain",         "getblockprofile",        &getblockprofile,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
     { "blockchain",         "exportchain",            &exportchain,            true  },
 
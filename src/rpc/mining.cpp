@@ -700,7 +700,8 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue transactions(UniValue::VARR);
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    for (const CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
 
@@ -763,7 +764,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         result.pushKV("coinbasetxn", txCoinbase);
     } else {
         result.pushKV("coinbaseaux", aux);
-        result.pushKV("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue);
+        result.pushKV("coinbasevalue", (int64_t)pblock->vtx[0]->vout[0].nValue);
     }
     result.pushKV("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast));
     result.pushKV("target", hashTarget.GetHex());
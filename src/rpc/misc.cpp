@@ -4,6 +4,7 @@
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "init.h"
 #include "key_io.h"
 #include "experimental_features.h"
@@ -1148,6 +1149,34 @@ static UniValue RPCLockedMemoryInfo()
     return obj;
 }
 
+static UniValue RPCTransactionMemoryInfo()
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("mempool_txs", (uint64_t)mempool.size());
+    obj.pushKV("mempool_usage", (uint64_t)mempool.DynamicMemoryUsage());
+
+    // Relayed transactions are served from the mempool; the relay cache only
+    // holds those that have left it, or never entered it. They may still be
+    // shared with a block or the wallet.
+    uint64_t nRelayShared = 0;
+    uint64_t nRelaySharedBytes = 0;
+    uint64_t nRelayUsage = 0;
+    LOCK(cs_mapRelay);
+    for (const auto& entry : mapRelay) {
+        size_t nUsage = RecursiveDynamicUsage(entry.second);
+        nRelayUsage += nUsage;
+        if (entry.second.use_count() > 1) {
+            nRelayShared++;
+            nRelaySharedBytes += nUsage;
+        }
+    }
+    obj.pushKV("relay_txs", (uint64_t)mapRelay.size());
+    obj.pushKV("relay_usage", nRelayUsage);
+    obj.pushKV("relay_shared_txs", nRelayShared);
+    obj.pushKV("relay_shared_bytes", nRelaySharedBytes);
+    return obj;
+}
+
 UniValue getmemoryinfo(const UniValue& params, bool fHelp)
 {
     /* Please, avoid using the word "pool" here in the RPC interface or help,
@@ -1166,6 +1195,14 @@ UniValue getmemoryinfo(const UniValue& params, bool fHelp)
             "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
             "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
             "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  },\n"
+            "  \"transactions\": {         (json object) Information about in-memory transactions\n"
+            "    \"mempool_txs\": xxxxx,        (numeric) Number of transactions in the mempool\n"
+            "    \"mempool_usage\": xxxxx,      (numeric) Bytes used by the mempool\n"
+            "    \"relay_txs\": xxxxx,          (numeric) Number of relayed transactions kept outside the mempool, to serve requests for them\n"
+            "    \"relay_usage\": xxxxx,        (numeric) Bytes used by transactions in the relay cache\n"
+            "    \"relay_shared_txs\": xxxxx,   (numeric) Relay cache transactions also held elsewhere, such as by a block\n"
+            "    \"relay_shared_bytes\": xxxxx, (numeric) Bytes of those shared transactions, which are not duplicated\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -1174,6 +1211,7 @@ UniValue getmemoryinfo(const UniValue& params, bool fHelp)
         );
     UniValue obj(UniValue::VOBJ);
     obj.pushKV("locked", RPCLockedMemoryInfo());
+    obj.pushKV("transactions", RPCTransactionMemoryInfo());
     return obj;
 }
 
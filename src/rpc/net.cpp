@@ -106,6 +106,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"recvqueue\": n,            (numeric) Received messages waiting to be processed\n"
+            "    \"getdataqueue\": n,         (numeric) Requested inventory waiting to be served\n"
+            "    \"pendingwork\": n,          (numeric) Messages from this peer being handled on the message worker threads\n"
+            "    \"txinvsent\": n,            (numeric) Transactions announced to this peer\n"
+            "    \"txinvfiltered\": n,        (numeric) Queued transaction announcements dropped as already known, no longer available or not matching the peer's bloom filter\n"
+            "    \"invbytessent\": n,         (numeric) Bytes of inv messages sent to this peer\n"
+            "    \"bulkbytessent\": n,        (numeric) Bytes of historical blocks sent to this peer, which are paced by the upload limits\n"
+            "    \"bulkbytesqueued\": n,      (numeric) Bytes of historical blocks waiting to be sent to this peer\n"
+            "    \"bulkwait\": n,             (numeric) Seconds until the upload limits allow sending the next queued historical block, -1 if not within the current upload target cycle\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -158,6 +167,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.pushKV("inflight", heights);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
+        obj.pushKV("recvqueue", (uint64_t)stats.nRecvQueue);
+        obj.pushKV("getdataqueue", (uint64_t)stats.nGetDataQueue);
+        obj.pushKV("pendingwork", stats.nPendingWork);
+        obj.pushKV("txinvsent", stats.nTxInvSent);
+        obj.pushKV("txinvfiltered", stats.nTxInvFiltered);
+        obj.pushKV("invbytessent", stats.nInvBytesSent);
+        obj.pushKV("bulkbytessent", stats.nBulkBytesSent);
+        obj.pushKV("bulkbytesqueued", stats.nBulkBytesQueued);
+        obj.pushKV("bulkwait", stats.dBulkWait);
 
         ret.push_back(obj);
     }
@@ -373,6 +391,12 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"shaping\":\n"
+            "  {\n"
+            "    \"peer_upload_rate\": n,                  (numeric) Limit on the rate historical blocks are sent to each peer in bytes per second, 0 if not limited\n"
+            "    \"historical_upload_rate\": n,            (numeric) Rate historical blocks to all peers are currently paced to, to stay within the upload target, in bytes per second, -1 if not limited\n"
+            "    \"bulk_bytes_sent\": n,                   (numeric) Total bytes of historical blocks sent\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -399,6 +423,12 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     outboundLimit.pushKV("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft());
     outboundLimit.pushKV("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle());
     obj.pushKV("uploadtarget", outboundLimit);
+
+    UniValue shaping(UniValue::VOBJ);
+    shaping.pushKV("peer_upload_rate", CNode::GetMaxPeerUploadRate());
+    shaping.pushKV("historical_upload_rate", CNode::GetHistoricalUploadRate());
+    shaping.pushKV("bulk_bytes_sent", CNode::GetTotalBulkBytesSent());
+    obj.pushKV("shaping", shaping);
     return obj;
 }
 
@@ -114,6 +114,16 @@ isminetype IsMineInner(const CKeyStore& keystore, const CScript& scriptPubKey, I
 
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey)
 {
+    // Most outputs pay to a public key hash, and are answered from the
+    // keystore's ownership table without solving the script. Watch-only
+    // scripts still go through Solver to find out whether they are solvable.
+    ScriptOwnership ownership;
+    if (keystore.GetScriptOwnership(scriptPubKey, ownership)) {
+        if (ownership == ScriptOwnership::SPENDABLE)
+            return ISMINE_SPENDABLE;
+        if (ownership == ScriptOwnership::NONE)
+            return ISMINE_NO;
+    }
     return IsMineInner(keystore, scriptPubKey, IsMineSigVersion::TOP);
 }
 
@@ -0,0 +1,112 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
+#define BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * A bump allocator for objects that are created together and freed together,
+ * such as the transactions of a deserialized block. Memory is taken from the
+ * heap in chunks and only returned when the arena is destroyed; freeing a
+ * single object is a no-op. Not thread safe: allocate from one thread only.
+ */
+class MonotonicArena
+{
+public:
+    static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    explicit MonotonicArena(size_t nChunkSizeIn = DEFAULT_CHUNK_SIZE) : nChunkSize(nChunkSizeIn) {}
+    ~MonotonicArena()
+    {
+        for (char* chunk : vChunks) {
+            ::operator delete(chunk);
+        }
+    }
+
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+
+    void* Allocate(size_t nSize, size_t nAlign)
+    {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(pNext) + nAlign - 1) & ~(uintptr_t)(nAlign - 1);
+        if (pNext == nullptr || p + nSize > reinterpret_cast<uintptr_t>(pEnd)) {
+            // Objects larger than a chunk get a chunk of their own.
+            size_t nNew = std::max(nChunkSize, nSize + nAlign);
+            char* chunk = static_cast<char*>(::operator new(nNew));
+            vChunks.push_back(chunk);
+            nChunkBytes += nNew;
+            pEnd = chunk + nNew;
+            p = (reinterpret_cast<uintptr_t>(chunk) + nAlign - 1) & ~(uintptr_t)(nAlign - 1);
+        }
+        pNext = reinterpret_cast<char*>(p + nSize);
+        nAllocations++;
+        nBytes += nSize;
+        return reinterpret_cast<void*>(p);
+    }
+
+    /** Number of objects allocated from the arena. */
+    size_t GetAllocations() const { return nAllocations; }
+    /** Bytes handed out to those objects, excluding alignment padding. */
+    size_t GetBytes() const { return nBytes; }
+    /** Number of heap allocations made by the arena itself. */
+    size_t GetChunks() const { return vChunks.size(); }
+    /** Heap bytes held by the arena. */
+    size_t GetChunkBytes() const { return nChunkBytes; }
+
+private:
+    const size_t nChunkSize;
+    std::vector<char*> vChunks;
+    char* pNext = nullptr;
+    char* pEnd = nullptr;
+    size_t nAllocations = 0;
+    size_t nBytes = 0;
+    size_t nChunkBytes = 0;
+};
+
+/**
+ * Allocator that takes its memory from a MonotonicArena. Every copy holds a
+ * reference to the arena, so containers and shared_ptrs created with it keep
+ * the arena alive until the last of them is destroyed.
+ */
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+
+    std::shared_ptr<MonotonicArena> arena;
+
+    explicit arena_allocator(std::shared_ptr<MonotonicArena> arenaIn) : arena(std::move(arenaIn)) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& a) : arena(a.arena) {}
+    template <typename U>
+    struct rebind {
+        typedef arena_allocator<U> other;
+    };
+
+    T* allocate(std::size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        // Memory is returned when the arena is destroyed.
+    }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& a) const { return arena == a.arena; }
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& a) const { return arena != a.arena; }
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
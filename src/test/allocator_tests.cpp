@@ -4,7 +4,11 @@
 
 #include "util.h"
 
+#include "primitives/block.h"
+#include "streams.h"
+#include "support/allocators/arena.h"
 #include "support/allocators/secure.h"
+#include "version.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
@@ -225,4 +229,67 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
     pool.free(nullptr);
 }
 
+BOOST_AUTO_TEST_CASE(monotonic_arena_tests)
+{
+    MonotonicArena arena(1024);
+    void *a0 = arena.Allocate(100, 8);
+    void *a1 = arena.Allocate(1, 1);
+    void *a2 = arena.Allocate(16, 16);
+    BOOST_CHECK(reinterpret_cast<uintptr_t>(a0) % 8 == 0);
+    BOOST_CHECK(reinterpret_cast<uintptr_t>(a2) % 16 == 0);
+    BOOST_CHECK(static_cast<char*>(a1) >= static_cast<char*>(a0) + 100);
+    BOOST_CHECK(static_cast<char*>(a2) > static_cast<char*>(a1));
+    BOOST_CHECK_EQUAL(arena.GetAllocations(), 3U);
+    BOOST_CHECK_EQUAL(arena.GetBytes(), 117U);
+    BOOST_CHECK_EQUAL(arena.GetChunks(), 1U);
+
+    // Filling the chunk starts a new one; an oversized object gets its own.
+    arena.Allocate(1000, 8);
+    BOOST_CHECK_EQUAL(arena.GetChunks(), 2U);
+    arena.Allocate(4096, 8);
+    BOOST_CHECK_EQUAL(arena.GetChunks(), 3U);
+    BOOST_CHECK(arena.GetChunkBytes() >= 2 * 1024 + 4096);
+}
+
+BOOST_AUTO_TEST_CASE(arena_block_deserialization)
+{
+    CBlock block;
+    for (int i = 0; i < 10; i++) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(uint256S("0x" + std::to_string(i + 1)), 0);
+        mtx.vout.resize(1);
+        mtx.vout[0].nValue = i;
+        block.vtx.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+
+    std::weak_ptr<MonotonicArena> weak;
+    {
+        auto arena = std::make_shared<MonotonicArena>();
+        weak = arena;
+        CBlock copy;
+        UnserializeBlock(ss, copy, arena_allocator<CTransaction>(arena));
+        BOOST_CHECK(ss.empty());
+        BOOST_CHECK(copy.GetHash() == block.GetHash());
+        BOOST_CHECK_EQUAL(copy.vtx.size(), block.vtx.size());
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            BOOST_CHECK(copy.vtx[i]->GetHash() == block.vtx[i]->GetHash());
+        }
+        BOOST_CHECK(copy.BuildMerkleTree() == block.hashMerkleRoot);
+        BOOST_CHECK_EQUAL(arena->GetAllocations(), block.vtx.size());
+        BOOST_CHECK_EQUAL(arena->GetChunks(), 1U);
+
+        // A transaction outliving the block keeps the arena alive.
+        CTransactionRef tx = copy.vtx[3];
+        arena.reset();
+        copy.SetNull();
+        BOOST_CHECK(!weak.expired());
+        BOOST_CHECK(tx->vout[0].nValue == 3);
+    }
+    BOOST_CHECK(weak.expired());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+#ifdef ENABLE_MINING
+
+// A block file record: message start, size, then the block itself.
+static CDataStream Record(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.write((const char*)Params().MessageStart(), MESSAGE_START_SIZE);
+    ss << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return ss;
+}
+
+static CDataStream Serialize(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return ss;
+}
+
+// Write the data to a temporary file and import it; the importer closes it.
+static bool Import(const CDataStream& data)
+{
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(&data[0], 1, data.size(), file), data.size());
+    rewind(file);
+    return LoadExternalBlockFile(Params(), file);
+}
+
+static int Height()
+{
+    LOCK(cs_main);
+    return chainActive.Height();
+}
+
+BOOST_AUTO_TEST_CASE(import_recovers_from_bad_records)
+{
+    std::vector<CBlock> blocks;
+    {
+        TestChain100Setup chain;
+        LOCK(cs_main);
+        for (int i = 1; i <= 8; i++) {
+            CBlock block;
+            BOOST_REQUIRE(ReadBlockFromDisk(block, chainActive[i], Params().GetConsensus()));
+            blocks.push_back(block);
+        }
+    }
+
+    // Import into a chain that only has the genesis block.
+    TestingSetup setup(CBaseChainParams::REGTEST);
+    BOOST_CHECK_EQUAL(Height(), 0);
+
+    // Junk ahead of the first record is skipped.
+    {
+        std::vector<char> junk(100, 0x42);
+        CDataStream data(SER_DISK, CLIENT_VERSION);
+        data.write(junk.data(), junk.size());
+        data += Record(blocks[0]);
+        data += Record(blocks[1]);
+        BOOST_CHECK(Import(data));
+        BOOST_CHECK_EQUAL(Height(), 2);
+    }
+
+    // A record that does not deserialize, and whose size covers the next
+    // record. The scan rewinds to just after its message start, and finds the
+    // next record inside it.
+    {
+        // A header of zeroes followed by an oversized Equihash solution length.
+        std::vector<char> junk(CBlockHeader::HEADER_SIZE, 0x00);
+        junk.insert(junk.end(), 9, (char)0xff);
+        CDataStream next = Record(blocks[2]);
+
+        CDataStream data(SER_DISK, CLIENT_VERSION);
+        data.write((const char*)Params().MessageStart(), MESSAGE_START_SIZE);
+        data << (unsigned int)(junk.size() + next.size());
+        data.write(junk.data(), junk.size());
+        data += next;
+        data += Record(blocks[3]);
+        BOOST_CHECK(Import(data));
+        BOOST_CHECK_EQUAL(Height(), 4);
+    }
+
+    // A record whose size is larger than its block. The scan resumes right
+    // after the block, and finds the record it overlapped.
+    {
+        CDataStream block = Serialize(blocks[4]);
+        CDataStream next = Record(blocks[5]);
+
+        CDataStream data(SER_DISK, CLIENT_VERSION);
+        data.write((const char*)Params().MessageStart(), MESSAGE_START_SIZE);
+        data << (unsigned int)(block.size() + next.size());
+        data += block;
+        data += next;
+        BOOST_CHECK(Import(data));
+        BOOST_CHECK_EQUAL(Height(), 6);
+    }
+
+    // A file cut off in the middle of its last block.
+    {
+        CDataStream last = Record(blocks[7]);
+        last.resize(last.size() / 2);
+
+        CDataStream data(SER_DISK, CLIENT_VERSION);
+        data += Record(blocks[6]);
+        data += last;
+        BOOST_CHECK(Import(data));
+        BOOST_CHECK_EQUAL(Height(), 7);
+    }
+
+    // Nothing new to connect.
+    BOOST_CHECK(!Import(Record(blocks[6])));
+    BOOST_CHECK_EQUAL(Height(), 7);
+}
+
+#endif // ENABLE_MINING
+
+BOOST_AUTO_TEST_SUITE_END()
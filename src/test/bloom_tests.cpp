@@ -457,6 +457,52 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256S("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(merkle_block_cached_elements)
+{
+    // A transaction paying to a key, and one spending it, in the same block.
+    std::vector<unsigned char> vchKeyHash = ParseHex("b6efd80d99179f4f4ff6f4dd0a007d018c385d21");
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    CMutableTransaction pay;
+    pay.vin.resize(1);
+    pay.vin[0].prevout = COutPoint(uint256S("0x01"), 0);
+    pay.vout.resize(1);
+    pay.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vchKeyHash << OP_EQUALVERIFY << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(pay.GetHash(), 0);
+    spend.vout.resize(1);
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    block.vtx.push_back(MakeTransactionRef(pay));
+    block.vtx.push_back(MakeTransactionRef(spend));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBloomElementsCache cache(1);
+    CBloomElementsCache::ElementsRef pElements = cache.Get(block);
+    BOOST_CHECK_EQUAL(pElements->size(), block.vtx.size());
+    BOOST_CHECK(cache.Get(block) == pElements);
+
+    // The spend is matched through the outpoint the filter added for the payment.
+    CBloomFilter filter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(vchKeyHash);
+    CBloomFilter filterCopy = filter;
+    CMerkleBlock merkleBlock(block, *pElements, filter);
+    CMerkleBlock merkleBlockUncached(block, filterCopy);
+    BOOST_CHECK(merkleBlock.vMatchedTxn == merkleBlockUncached.vMatchedTxn);
+    BOOST_CHECK_EQUAL(merkleBlock.vMatchedTxn.size(), 2);
+    BOOST_CHECK(merkleBlock.vMatchedTxn[1].second == spend.GetHash());
+    BOOST_CHECK(filter.contains(COutPoint(pay.GetHash(), 0)));
+
+    // A second block evicts the first.
+    CBlock block2 = block;
+    block2.nNonce = uint256S("0x01");
+    BOOST_CHECK(cache.Get(block2) != pElements);
+    BOOST_CHECK(cache.Get(block) != pElements);
+}
+
 static std::vector<unsigned char> RandomData()
 {
     uint256 r = GetRandHash();
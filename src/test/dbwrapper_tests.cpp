@@ -43,6 +43,37 @@ BOOST_AUTO_TEST_CASE(dbwrapper)
     }
 }
 
+// Test that databases opened with each profile work and report statistics
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    CDBProfile profiles[] = {CDBProfile::Chainstate(), CDBProfile::Index(), CDBProfile::Index(256, false)};
+    for (const CDBProfile& profile : profiles) {
+        path ph = temp_directory_path() / unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, profile);
+        BOOST_CHECK_EQUAL(dbw.GetProfile().strName, profile.strName);
+        BOOST_CHECK_EQUAL(dbw.GetProfile().fCompression, profile.fCompression);
+        BOOST_CHECK_EQUAL(dbw.GetProfile().nMaxOpenFiles, profile.nMaxOpenFiles);
+        BOOST_CHECK_EQUAL(dbw.IsCompressed(), profile.fCompression && IsDBCompressionSupported());
+        BOOST_CHECK_EQUAL(dbw.GetMaxOpenFiles(), std::max(profile.nMaxOpenFiles, DB_MIN_OPEN_FILES));
+
+        for (char key = 'a'; key <= 'z'; key++) {
+            uint256 in = GetRandHash();
+            uint256 res;
+            BOOST_CHECK(dbw.Write(key, in));
+            BOOST_CHECK(dbw.Read(key, res));
+            BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+        }
+
+        std::string value;
+        BOOST_CHECK(dbw.GetProperty("leveldb.stats", value));
+        BOOST_CHECK(value.find("Compactions") != std::string::npos);
+        BOOST_CHECK(dbw.GetProperty("leveldb.num-files-at-level0", value));
+        BOOST_CHECK(!dbw.GetProperty("leveldb.no-such-property", value));
+    }
+    BOOST_CHECK(CDBProfile::Index().fCompression);
+    BOOST_CHECK(!CDBProfile::Chainstate().fCompression);
+}
+
 // Test batch operations
 BOOST_AUTO_TEST_CASE(dbwrapper_batch)
 {
@@ -4,6 +4,7 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "pow.h"
 
 #include "test/test_bitcoin.h"
 
@@ -124,4 +125,78 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(assumevalid_ancestors_only)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const CChainParams& chainparams = Params();
+    LOCK(cs_main);
+
+    // A main chain of 10000 blocks, about 17 days of work at 150 seconds
+    // per block, and a branch off it at height 500.
+    const int nMainLength = 10000;
+    const int nForkHeight = 500;
+    const int nForkLength = 1000;
+    std::vector<uint256> vHashes(nMainLength + nForkLength);
+    std::vector<CBlockIndex> vMain(nMainLength), vFork(nForkLength);
+    for (int i = 0; i < nMainLength + nForkLength; i++) {
+        bool fFork = i >= nMainLength;
+        CBlockIndex& block = fFork ? vFork[i - nMainLength] : vMain[i];
+        CBlockIndex* pprev = fFork ? (i == nMainLength ? &vMain[nForkHeight] : &vFork[i - nMainLength - 1]) : (i ? &vMain[i - 1] : NULL);
+        vHashes[i] = ArithToUint256(arith_uint256(i + 1));
+        block.phashBlock = &vHashes[i];
+        block.pprev = pprev;
+        block.nHeight = pprev ? pprev->nHeight + 1 : 0;
+        block.nBits = 0x207fffff;
+        block.nChainWork = pprev ? pprev->nChainWork + GetBlockProof(*pprev) : arith_uint256(0);
+        block.BuildSkip();
+    }
+
+    CBlockIndex* pindexBestHeaderOld = pindexBestHeader;
+    pindexBestHeader = &vMain.back();
+    const int nAssumeValidHeight = 1000;
+    CBlockIndex* pindexAssumeValid = &vMain[nAssumeValidHeight];
+    mapBlockIndex[pindexAssumeValid->GetBlockHash()] = pindexAssumeValid;
+
+    // Nothing is assumed valid without -assumevalid, or with an unknown block.
+    hashAssumeValid.SetNull();
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain[0]));
+    hashAssumeValid = ArithToUint256(arith_uint256(nMainLength + nForkLength + 1));
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain[0]));
+
+    // Script checks are skipped for the assume-valid block and its ancestors...
+    hashAssumeValid = pindexAssumeValid->GetBlockHash();
+    BOOST_CHECK(IsAssumedValid(chainparams, &vMain[0]));
+    BOOST_CHECK(IsAssumedValid(chainparams, &vMain[nForkHeight]));
+    BOOST_CHECK(IsAssumedValid(chainparams, &vMain[nAssumeValidHeight - 1]));
+    BOOST_CHECK(IsAssumedValid(chainparams, pindexAssumeValid));
+
+    // ... but run in full for its descendants and for other branches, even
+    // below the height of the assume-valid block.
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain[nAssumeValidHeight + 1]));
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain.back()));
+    for (const CBlockIndex& block : vFork) {
+        BOOST_CHECK(!IsAssumedValid(chainparams, &block));
+    }
+
+    // Nor is anything skipped when the best header is on another branch.
+    pindexBestHeader = &vFork.back();
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain[0]));
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain[nAssumeValidHeight - 1]));
+    pindexBestHeader = &vMain.back();
+
+    // Ancestors less than two weeks of work below the best header are
+    // always checked.
+    CBlockIndex* pindexRecent = &vMain[nMainLength - 10];
+    mapBlockIndex[pindexRecent->GetBlockHash()] = pindexRecent;
+    hashAssumeValid = pindexRecent->GetBlockHash();
+    BOOST_CHECK(!IsAssumedValid(chainparams, &vMain[nMainLength - 20]));
+    BOOST_CHECK(IsAssumedValid(chainparams, &vMain[nAssumeValidHeight]));
+
+    mapBlockIndex.erase(pindexRecent->GetBlockHash());
+    mapBlockIndex.erase(pindexAssumeValid->GetBlockHash());
+    hashAssumeValid.SetNull();
+    pindexBestHeader = pindexBestHeaderOld;
+    SelectParams(CBaseChainParams::MAIN);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,8 @@
 
 #include "consensus/upgrades.h"
 #include "main.h"
+#include "random.h"
+#include "script/interpreter.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -212,6 +214,138 @@ BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     BOOST_CHECK_EQUAL(pool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(SharedTxAndPrecomputedData) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    CMutableTransaction tx = CMutableTransaction();
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+
+    // Not in the pool yet.
+    BOOST_CHECK(!pool.GetTxData(tx.GetHash()));
+
+    pool.addUnchecked(tx.GetHash(), entry.Fee(10000LL).FromTx(tx));
+    auto txdata = pool.GetTxData(tx.GetHash());
+    BOOST_REQUIRE(txdata);
+
+    // The entry computes the same midstates as a fresh computation.
+    PrecomputedTransactionData expected(tx);
+    BOOST_CHECK(txdata->hashPrevouts == expected.hashPrevouts);
+    BOOST_CHECK(txdata->hashSequence == expected.hashSequence);
+    BOOST_CHECK(txdata->hashOutputs == expected.hashOutputs);
+
+    // The pool hands out its own copy of the transaction rather than a new one.
+    CTransactionRef ptx = pool.get(tx.GetHash());
+    BOOST_REQUIRE(ptx);
+    BOOST_CHECK(ptx.get() == &pool.mapTx.find(tx.GetHash())->GetTx());
+
+    // The shared copies survive removal from the pool.
+    std::list<CTransaction> removed;
+    pool.remove(tx, removed, true);
+    BOOST_CHECK(!pool.GetTxData(tx.GetHash()));
+    BOOST_CHECK(!pool.get(tx.GetHash()));
+    BOOST_CHECK(txdata->hashOutputs == expected.hashOutputs);
+    BOOST_CHECK(ptx->GetHash() == tx.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(NotifyEntryRemoved) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx = CMutableTransaction();
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx.GetHash(), entry.Fee(10000LL).Time(42).FromTx(tx));
+    CTransactionRef ptx = pool.get(tx.GetHash());
+
+    std::vector<CTransactionRef> vRemoved;
+    std::vector<int64_t> vTimes;
+    boost::signals2::scoped_connection conn = pool.NotifyEntryRemoved.connect([&](const CTxMemPoolEntry& e) {
+        vRemoved.push_back(e.GetSharedTx());
+        vTimes.push_back(e.GetTime());
+    });
+
+    // The listener gets the pool's own copy of the transaction.
+    std::list<CTransaction> removed;
+    pool.remove(tx, removed, true);
+    BOOST_REQUIRE_EQUAL(vRemoved.size(), 1);
+    BOOST_CHECK(vRemoved[0] == ptx);
+    BOOST_CHECK_EQUAL(vTimes[0], 42);
+
+    // Nothing is reported for transactions that were not in the pool.
+    pool.remove(tx, removed, true);
+    BOOST_CHECK_EQUAL(vRemoved.size(), 1);
+}
+
+// Pop the whole relay heap, in announcement order.
+static std::vector<uint256> RelayOrder(const CTxMemPool& pool, const std::vector<uint256>& vtxid)
+{
+    std::vector<RelayOrderEntry> vHeap = pool.MakeRelayHeap(vtxid);
+    std::vector<uint256> vOrder;
+    while (!vHeap.empty()) {
+        std::pop_heap(vHeap.begin(), vHeap.end(), CompareRelayOrder());
+        vOrder.push_back(vHeap.back().hash);
+        vHeap.pop_back();
+    }
+    return vOrder;
+}
+
+BOOST_AUTO_TEST_CASE(RelayHeap) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    /* lowest fee, parent of child */
+    CMutableTransaction parent = CMutableTransaction();
+    parent.vin.resize(1);
+    parent.vin[0].scriptSig = CScript() << OP_11;
+    parent.vout.resize(1);
+    parent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    parent.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(parent.GetHash(), entry.Fee(1000LL).FromTx(parent));
+
+    /* highest fee, spends parent */
+    CMutableTransaction child = CMutableTransaction();
+    child.vin.resize(1);
+    child.vin[0].prevout = COutPoint(parent.GetHash(), 0);
+    child.vin[0].scriptSig = CScript() << OP_11;
+    child.vout.resize(1);
+    child.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    child.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(child.GetHash(), entry.Fee(30000LL).FromTx(child));
+
+    /* unrelated, middle fee */
+    CMutableTransaction other = CMutableTransaction();
+    other.vin.resize(1);
+    other.vin[0].scriptSig = CScript() << OP_12;
+    other.vout.resize(1);
+    other.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    other.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(other.GetHash(), entry.Fee(10000LL).FromTx(other));
+
+    uint256 missing = GetRandHash();
+
+    // Parents go first, then the highest feerate, then what is not in the pool.
+    std::vector<uint256> vtxid = RelayOrder(pool, {missing, child.GetHash(), other.GetHash(), parent.GetHash()});
+    BOOST_REQUIRE_EQUAL(vtxid.size(), 4);
+    BOOST_CHECK_EQUAL(vtxid[0].ToString(), other.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vtxid[1].ToString(), parent.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vtxid[2].ToString(), child.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vtxid[3].ToString(), missing.ToString());
+
+    // Without its parent in the batch, the child is ordered by feerate alone.
+    vtxid = RelayOrder(pool, {other.GetHash(), child.GetHash()});
+    BOOST_CHECK_EQUAL(vtxid[0].ToString(), child.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vtxid[1].ToString(), other.GetHash().ToString());
+}
+
 // Test that nCheckFrequency is set correctly when calling setSanityCheck().
 // https://github.com/zcash/zcash/issues/3134
 BOOST_AUTO_TEST_CASE(SetSanityCheck) {
@@ -0,0 +1,67 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "tokenbucket.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(tokenbucket_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(unlimited)
+{
+    CTokenBucket bucket;
+    BOOST_CHECK(!bucket.IsLimited());
+    bucket.Spend(1000000000, 0);
+    BOOST_CHECK(bucket.CanSpend(0));
+    BOOST_CHECK_EQUAL(bucket.TimeUntilAvailable(0), 0);
+    BOOST_CHECK_EQUAL(bucket.GetRate(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(pacing)
+{
+    // 1000 bytes per second, bursts of 500 bytes.
+    CTokenBucket bucket;
+    bucket.SetRate(1000, 500, 0);
+    BOOST_CHECK(bucket.IsLimited());
+    BOOST_CHECK_EQUAL(bucket.GetRate(), 1000);
+
+    // The bucket starts full, and a message larger than it still goes out.
+    BOOST_CHECK(bucket.CanSpend(0));
+    bucket.Spend(1500, 0);
+    BOOST_CHECK(!bucket.CanSpend(0));
+
+    // The 1000 byte deficit takes a second to pay back.
+    BOOST_CHECK_EQUAL(bucket.TimeUntilAvailable(0), 1000001);
+    BOOST_CHECK(!bucket.CanSpend(999999));
+    BOOST_CHECK(bucket.CanSpend(1000001));
+
+    // Idle time does not build up more than one burst.
+    bucket.Spend(1, 1000001);
+    BOOST_CHECK(bucket.CanSpend(60000000));
+    bucket.Spend(500, 60000000);
+    BOOST_CHECK(!bucket.CanSpend(60000000));
+}
+
+BOOST_AUTO_TEST_CASE(rate_changes)
+{
+    CTokenBucket bucket;
+    bucket.SetRate(1000, 1000, 0);
+    bucket.Spend(2000, 0);
+
+    // A zero rate lets nothing more through.
+    bucket.SetRate(0, 1000, 0);
+    BOOST_CHECK(!bucket.CanSpend(1000000000));
+    BOOST_CHECK_EQUAL(bucket.TimeUntilAvailable(1000000000), -1);
+
+    // Changing the rate keeps the deficit.
+    bucket.SetRate(2000, 1000, 1000000000);
+    BOOST_CHECK_EQUAL(bucket.TimeUntilAvailable(1000000000), 500001);
+
+    bucket.SetUnlimited();
+    BOOST_CHECK(bucket.CanSpend(1000000000));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,101 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "txheightindex.h"
+
+#include "chain.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "undo.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CBlock MakeBlock(unsigned int nFirstLockTime, size_t nTx)
+{
+    CBlock block;
+    for (size_t i = 0; i < nTx; i++) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vout.resize(i + 1);
+        mtx.nLockTime = nFirstLockTime + i;
+        block.vtx.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+    return block;
+}
+
+BOOST_FIXTURE_TEST_SUITE(txheightindex_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(connect_find_disconnect)
+{
+    CTxHeightIndex index(1 << 20, true, true);
+    BOOST_CHECK_EQUAL(index.GetBestHeight(), -1);
+
+    CBlock block = MakeBlock(0, 5);
+    uint256 hash = block.GetHash();
+    CBlockIndex blockindex;
+    blockindex.phashBlock = &hash;
+    blockindex.nHeight = 7;
+    BOOST_CHECK(index.ConnectBlock(block, &blockindex, CBlockUndo()));
+    BOOST_CHECK_EQUAL(index.GetBestHeight(), 7);
+    BOOST_CHECK(index.GetBestBlock() == hash);
+
+    // Each offset, counted from the end of the header, locates the
+    // transaction in the serialized block.
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    size_t nHeaderSize = ::GetSerializeSize(CBlockHeader(block), SER_DISK, CLIENT_VERSION);
+    for (const CTransactionRef& ptx : block.vtx) {
+        std::vector<CTxHeightIndexEntry> vEntries = index.Find(ptx->GetHash());
+        BOOST_REQUIRE_EQUAL(vEntries.size(), 1U);
+        BOOST_CHECK_EQUAL(vEntries[0].nHeight, 7);
+        CDataStream ssTx(ss.begin() + nHeaderSize + vEntries[0].nTxOffset, ss.end(), SER_DISK, CLIENT_VERSION);
+        CTransaction tx;
+        ssTx >> tx;
+        BOOST_CHECK(tx.GetHash() == ptx->GetHash());
+    }
+
+    BOOST_CHECK(index.Find(uint256S("1234")).empty());
+
+    BOOST_CHECK(index.DisconnectBlock(block, &blockindex, CBlockUndo()));
+    BOOST_CHECK_EQUAL(index.GetBestHeight(), 6);
+    for (const CTransactionRef& ptx : block.vtx)
+        BOOST_CHECK(index.Find(ptx->GetHash()).empty());
+}
+
+BOOST_AUTO_TEST_CASE(shared_prefix)
+{
+    CTxHeightIndex index(1 << 20, true, true);
+
+    CBlock block1 = MakeBlock(0, 2);
+    CBlock block2 = MakeBlock(0, 1);
+    uint256 hash1 = block1.GetHash(), hash2 = block2.GetHash();
+    CBlockIndex blockindex1, blockindex2;
+    blockindex1.phashBlock = &hash1;
+    blockindex1.nHeight = 300;
+    blockindex2.phashBlock = &hash2;
+    blockindex2.nHeight = 2;
+    BOOST_CHECK(index.ConnectBlock(block1, &blockindex1, CBlockUndo()));
+    BOOST_CHECK(index.ConnectBlock(block2, &blockindex2, CBlockUndo()));
+
+    // The same transaction at two heights comes back in height order.
+    std::vector<CTxHeightIndexEntry> vEntries = index.Find(block1.vtx[0]->GetHash());
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 2U);
+    BOOST_CHECK_EQUAL(vEntries[0].nHeight, 2);
+    BOOST_CHECK_EQUAL(vEntries[1].nHeight, 300);
+
+    // A different txid with the same prefix is a candidate too; the caller
+    // has to check what it reads.
+    uint256 txid = block1.vtx[1]->GetHash();
+    *(txid.end() - 1) ^= 1;
+    vEntries = index.Find(txid);
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 1U);
+    BOOST_CHECK_EQUAL(vEntries[0].nHeight, 300);
+
+    // But a different prefix is not.
+    *txid.begin() ^= 1;
+    BOOST_CHECK(index.Find(txid).empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
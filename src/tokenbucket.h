@@ -0,0 +1,95 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_TOKENBUCKET_H
+#define BITCOIN_TOKENBUCKET_H
+
+#include <algorithm>
+#include <stdint.h>
+
+/**
+ * Paces a byte stream to an average rate, allowing bursts of up to the
+ * bucket size. Sending may overdraw the bucket, so that a message larger
+ * than the bucket is not held back forever; the deficit has to be paid back
+ * before anything more can be sent.
+ *
+ * Times are in microseconds. A new bucket is unlimited. Not thread safe.
+ */
+class CTokenBucket
+{
+private:
+    bool fLimited;
+    //! Bytes per second.
+    double dRate;
+    double dBurst;
+    double dTokens;
+    int64_t nLastRefill;
+
+    void Refill(int64_t nNow)
+    {
+        if (nNow > nLastRefill) {
+            dTokens = std::min(dBurst, dTokens + (nNow - nLastRefill) * dRate / 1000000.0);
+            nLastRefill = nNow;
+        }
+    }
+
+public:
+    CTokenBucket() : fLimited(false), dRate(0), dBurst(0), dTokens(0), nLastRefill(0) {}
+
+    /**
+     * Limit to nRate bytes per second, with bursts of up to nBurst bytes.
+     * A rate of zero lets nothing through beyond what is already in the
+     * bucket.
+     */
+    void SetRate(uint64_t nRate, uint64_t nBurst, int64_t nNow)
+    {
+        if (fLimited) {
+            Refill(nNow);
+        } else {
+            // Start full, so that the first messages go out right away.
+            dTokens = nBurst;
+            nLastRefill = nNow;
+        }
+        fLimited = true;
+        dRate = nRate;
+        dBurst = nBurst;
+        dTokens = std::min(dTokens, dBurst);
+    }
+
+    void SetUnlimited() { fLimited = false; }
+
+    bool IsLimited() const { return fLimited; }
+
+    uint64_t GetRate() const { return fLimited ? dRate : 0; }
+
+    /** Whether anything may be sent at nNow. */
+    bool CanSpend(int64_t nNow)
+    {
+        if (!fLimited)
+            return true;
+        Refill(nNow);
+        return dTokens > 0;
+    }
+
+    /** Account for nBytes sent at nNow. */
+    void Spend(uint64_t nBytes, int64_t nNow)
+    {
+        if (!fLimited)
+            return;
+        Refill(nNow);
+        dTokens -= nBytes;
+    }
+
+    /** Microseconds from nNow until CanSpend returns true, or -1 if never. */
+    int64_t TimeUntilAvailable(int64_t nNow)
+    {
+        if (CanSpend(nNow))
+            return 0;
+        if (dRate <= 0)
+            return -1;
+        return (int64_t)((-dTokens / dRate) * 1000000.0) + 1;
+    }
+};
+
+#endif // BITCOIN_TOKENBUCKET_H
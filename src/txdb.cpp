@@ -8,8 +8,11 @@
 #include "chainparams.h"
 #include "hash.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
 #include "uint256.h"
+#include "ui_interface.h"
+#include "init.h"
 
 #include <stdint.h>
 
@@ -23,6 +26,7 @@ static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -34,6 +38,8 @@ static const char DB_BEST_SAPLING_ANCHOR = 'z';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_BEST_BLOCK = 'I';
+static const char DB_SNAPSHOT_TARGET = 'N';
 
 static const char DB_MMR_LENGTH = 'M';
 static const char DB_MMR_NODE = 'm';
@@ -46,10 +52,97 @@ static const char DB_SPENTINDEX = 'p';
 static const char DB_TIMESTAMPINDEX = 'T';
 static const char DB_BLOCKHASHINDEX = 'h';
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+/**
+ * Legacy per-transaction UTXO record, as stored under DB_COINS by earlier
+ * versions. Only used to read records during the chainstate upgrade.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 1: IsCoinBase()
+ * - bit 2: vout[0] is not spent
+ * - bit 4: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CCoins
+{
+public:
+    bool fCoinBase;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) 
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe, profile), nLastBatchSize(0) {
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, profile), nLastBatchSize(0)
 {
 }
 
@@ -94,12 +187,12 @@ bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -128,23 +221,72 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     return hashBestAnchor;
 }
 
-HistoryIndex CCoinsViewDB::GetHistoryLength(uint32_t epochId) const {
-    HistoryIndex historyLength;
-    if (!db.Read(make_pair(DB_MMR_LENGTH, epochId), historyLength)) {
+CCoinsViewDB::HistoryTreeState& CCoinsViewDB::LoadHistoryTree(uint32_t epochId) const {
+    auto it = historyTrees.find(epochId);
+    if (it != historyTrees.end()) {
+        return it->second;
+    }
+
+    HistoryTreeState& tree = historyTrees[epochId];
+    if (!db.Read(make_pair(DB_MMR_LENGTH, epochId), tree.length)) {
         // Starting new history
-        historyLength = 0;
+        tree.length = 0;
     }
+    if (!db.Read(make_pair(DB_MMR_ROOT, epochId), tree.root)) {
+        tree.root = uint256();
+    }
+    return tree;
+}
 
-    return historyLength;
+void CCoinsViewDB::UpdateHistoryTrees(const CHistoryCacheMap& historyCacheMap) {
+    std::lock_guard<std::mutex> lock(cs_historyTrees);
+    for (const auto& entry : historyCacheMap) {
+        const HistoryCache& historyCache = entry.second;
+        HistoryTreeState& tree = historyTrees[entry.first];
+
+        // Nodes from updateDepth onwards were replaced or truncated.
+        tree.nodes.erase(tree.nodes.lower_bound(historyCache.updateDepth), tree.nodes.end());
+        for (const auto& append : historyCache.appends) {
+            tree.nodes[append.first] = append.second;
+        }
+        tree.length = historyCache.length;
+        tree.root = historyCache.root;
+
+        // Keep only the nodes the next append or pop will ask for.
+        std::map<HistoryIndex, HistoryNode> kept;
+        if (tree.length > 0) {
+            std::vector<std::pair<uint32_t, uint32_t>> positions;
+            libzcash::GetPeakPositions(tree.length, true, positions);
+            for (const auto& position : positions) {
+                auto node = tree.nodes.find(position.first);
+                if (node != tree.nodes.end()) {
+                    kept.insert(*node);
+                }
+            }
+        }
+        tree.nodes.swap(kept);
+    }
+}
+
+HistoryIndex CCoinsViewDB::GetHistoryLength(uint32_t epochId) const {
+    std::lock_guard<std::mutex> lock(cs_historyTrees);
+    return LoadHistoryTree(epochId).length;
 }
 
 HistoryNode CCoinsViewDB::GetHistoryAt(uint32_t epochId, HistoryIndex index) const {
     HistoryNode mmrNode = {};
 
-    if (index >= GetHistoryLength(epochId)) {
+    std::lock_guard<std::mutex> lock(cs_historyTrees);
+    HistoryTreeState& tree = LoadHistoryTree(epochId);
+    if (index >= tree.length) {
         throw runtime_error("History data inconsistent - reindex?");
     }
 
+    auto it = tree.nodes.find(index);
+    if (it != tree.nodes.end()) {
+        return it->second;
+    }
+
     // Read mmrNode into tmp std::array
     std::array<unsigned char, NODE_SERIALIZED_LENGTH> tmpMmrNode;
 
@@ -154,21 +296,21 @@ HistoryNode CCoinsViewDB::GetHistoryAt(uint32_t epochId, HistoryIndex index) con
 
     std::copy(std::begin(tmpMmrNode), std::end(tmpMmrNode), mmrNode.bytes);
 
+    if (tree.nodes.size() < MAX_CACHED_HISTORY_NODES) {
+        tree.nodes[index] = mmrNode;
+    }
+
     return mmrNode;
 }
 
 uint256 CCoinsViewDB::GetHistoryRoot(uint32_t epochId) const {
-    uint256 root;
-    if (!db.Read(make_pair(DB_MMR_ROOT, epochId), root))
-    {
-        root = uint256();
-    }
-    return root;
+    std::lock_guard<std::mutex> lock(cs_historyTrees);
+    return LoadHistoryTree(epochId).root;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, const CNullifiersMap& mapToUse, const char& dbChar)
 {
-    for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (CNullifiersMap::const_iterator it = mapToUse.begin(); it != mapToUse.end(); it++) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -176,14 +318,13 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
                 batch.Write(make_pair(dbChar, it->first), true);
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
-        it = mapToUse.erase(it);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, const Map& mapToUse, const char& dbChar)
 {
-    for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (MapIterator it = mapToUse.begin(); it != mapToUse.end(); it++) {
         if (it->second.flags & MapEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -194,13 +335,12 @@ void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
             }
             // TODO: changed++?
         }
-        it = mapToUse.erase(it);
     }
 }
 
-void BatchWriteHistory(CDBBatch& batch, CHistoryCacheMap& historyCacheMap) {
+void BatchWriteHistory(CDBBatch& batch, const CHistoryCacheMap& historyCacheMap) {
     for (auto nextHistoryCache = historyCacheMap.begin(); nextHistoryCache != historyCacheMap.end(); nextHistoryCache++) {
-        auto historyCache = nextHistoryCache->second;
+        const HistoryCache& historyCache = nextHistoryCache->second;
         auto epochId = nextHistoryCache->first;
 
         // delete old entries since updateDepth
@@ -233,23 +373,25 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               CNullifiersMap &mapSproutNullifiers,
                               CNullifiersMap &mapSaplingNullifiers,
                               CHistoryCacheMap &historyCacheMap) {
+    // The maps are only read here, never modified: CCoinsViewFlusher relies on
+    // that to keep serving lookups from them while this write is in progress.
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        it = mapCoins.erase(it);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::const_iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::const_iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
 
     ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
     ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
@@ -263,11 +405,284 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     if (!hashSaplingAnchor.IsNull())
         batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    nLastBatchSize = batch.SizeEstimate();
+    if (!db.WriteBatch(batch))
+        return false;
+    // Only move the cached peaks once they match what is on disk.
+    UpdateHistoryTrees(historyCacheMap);
+    return true;
+}
+
+CCoinsViewFlusher::CCoinsViewFlusher(CCoinsViewDB* dbIn) : CCoinsViewBacked(dbIn), db(dbIn), fFailed(false), fStop(false)
+{
+    writer = std::thread(&CCoinsViewFlusher::ThreadWrite, this);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CCoinsViewFlusher::~CCoinsViewFlusher()
+{
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        WaitIdle(lock);
+        fStop = true;
+    }
+    cond.notify_all();
+    writer.join();
+}
+
+void CCoinsViewFlusher::ThreadWrite()
+{
+    RenameThread("zcash-coinsflush");
+    std::unique_lock<std::mutex> lock(cs);
+    while (true) {
+        cond.wait(lock, [this] { return fStop || (stats.fInProgress && !fFailed); });
+        if (!stats.fInProgress || fFailed) {
+            // Stopping, and nothing is left to write.
+            break;
+        }
+
+        // Readers only look up entries in the pending write, and
+        // CCoinsViewDB::BatchWrite does not modify it, so the commit can
+        // proceed without holding the lock.
+        PendingWrite* p = pending.get();
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = db->BatchWrite(p->mapCoins, p->hashBlock, p->hashSproutAnchor, p->hashSaplingAnchor,
+                                 p->mapSproutAnchors, p->mapSaplingAnchors,
+                                 p->mapSproutNullifiers, p->mapSaplingNullifiers,
+                                 p->historyCacheMap);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: error writing to coin database: %s\n", __func__, e.what());
+        }
+        int64_t nDuration = GetTimeMicros() - nStart;
+        size_t nBytes = db->GetLastBatchSize();
+        lock.lock();
+
+        if (fOk) {
+            pending.reset();
+            stats.nFlushes++;
+            stats.nLastDurationMicros = nDuration;
+            stats.nLastBytes = nBytes;
+            stats.nTotalDurationMicros += nDuration;
+            stats.nTotalBytes += nBytes;
+            LogPrint("coindb", "Wrote %.1fMiB to coin database in %.2fs\n", nBytes * (1.0 / 1024 / 1024), nDuration * 0.000001);
+        } else {
+            // Keep the pending write around so lookups stay consistent until
+            // the caller notices the failure and shuts down.
+            fFailed = true;
+        }
+        stats.fInProgress = false;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewFlusher::WaitIdle(std::unique_lock<std::mutex>& lock) const
+{
+    cond.wait(lock, [this] { return !stats.fInProgress; });
+    return !fFailed;
+}
+
+bool CCoinsViewFlusher::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        CAnchorsSproutMap::const_iterator it = pending->mapSproutAnchors.find(rt);
+        if (it != pending->mapSproutAnchors.end()) {
+            if (it->second.entered) {
+                tree = it->second.tree;
+            }
+            return it->second.entered;
+        }
+    }
+    return base->GetSproutAnchorAt(rt, tree);
+}
+
+bool CCoinsViewFlusher::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        CAnchorsSaplingMap::const_iterator it = pending->mapSaplingAnchors.find(rt);
+        if (it != pending->mapSaplingAnchors.end()) {
+            if (it->second.entered) {
+                tree = it->second.tree;
+            }
+            return it->second.entered;
+        }
+    }
+    return base->GetSaplingAnchorAt(rt, tree);
+}
+
+bool CCoinsViewFlusher::GetNullifier(const uint256 &nullifier, ShieldedType type) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        const CNullifiersMap* mapToUse;
+        switch (type) {
+            case SPROUT:
+                mapToUse = &pending->mapSproutNullifiers;
+                break;
+            case SAPLING:
+                mapToUse = &pending->mapSaplingNullifiers;
+                break;
+            default:
+                throw runtime_error("Unknown shielded type");
+        }
+        CNullifiersMap::const_iterator it = mapToUse->find(nullifier);
+        if (it != mapToUse->end()) {
+            return it->second.entered;
+        }
+    }
+    return base->GetNullifier(nullifier, type);
+}
+
+bool CCoinsViewFlusher::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        CCoinsMap::const_iterator it = pending->mapCoins.find(outpoint);
+        if (it != pending->mapCoins.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewFlusher::HaveCoin(const COutPoint &outpoint) const {
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
+
+uint256 CCoinsViewFlusher::GetBestBlock() const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending && !pending->hashBlock.IsNull()) {
+        return pending->hashBlock;
+    }
+    return base->GetBestBlock();
+}
+
+uint256 CCoinsViewFlusher::GetBestAnchor(ShieldedType type) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        switch (type) {
+            case SPROUT:
+                if (!pending->hashSproutAnchor.IsNull())
+                    return pending->hashSproutAnchor;
+                break;
+            case SAPLING:
+                if (!pending->hashSaplingAnchor.IsNull())
+                    return pending->hashSaplingAnchor;
+                break;
+            default:
+                throw runtime_error("Unknown shielded type");
+        }
+    }
+    return base->GetBestAnchor(type);
+}
+
+HistoryIndex CCoinsViewFlusher::GetHistoryLength(uint32_t epochId) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        CHistoryCacheMap::const_iterator it = pending->historyCacheMap.find(epochId);
+        if (it != pending->historyCacheMap.end()) {
+            return it->second.length;
+        }
+    }
+    return base->GetHistoryLength(epochId);
+}
+
+HistoryNode CCoinsViewFlusher::GetHistoryAt(uint32_t epochId, HistoryIndex index) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        CHistoryCacheMap::const_iterator it = pending->historyCacheMap.find(epochId);
+        if (it != pending->historyCacheMap.end() && index >= it->second.updateDepth) {
+            auto node = it->second.appends.find(index);
+            if (index >= it->second.length || node == it->second.appends.end()) {
+                throw runtime_error("Invalid history request");
+            }
+            return node->second;
+        }
+    }
+    return base->GetHistoryAt(epochId, index);
+}
+
+uint256 CCoinsViewFlusher::GetHistoryRoot(uint32_t epochId) const {
+    std::lock_guard<std::mutex> lock(cs);
+    if (pending) {
+        CHistoryCacheMap::const_iterator it = pending->historyCacheMap.find(epochId);
+        if (it != pending->historyCacheMap.end()) {
+            return it->second.root;
+        }
+    }
+    return base->GetHistoryRoot(epochId);
+}
+
+bool CCoinsViewFlusher::BatchWrite(CCoinsMap &mapCoins,
+                                   const uint256 &hashBlock,
+                                   const uint256 &hashSproutAnchor,
+                                   const uint256 &hashSaplingAnchor,
+                                   CAnchorsSproutMap &mapSproutAnchors,
+                                   CAnchorsSaplingMap &mapSaplingAnchors,
+                                   CNullifiersMap &mapSproutNullifiers,
+                                   CNullifiersMap &mapSaplingNullifiers,
+                                   CHistoryCacheMap &historyCacheMap) {
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        int64_t nWaitStart = GetTimeMicros();
+        bool fOk = WaitIdle(lock);
+        stats.nTotalWaitMicros += GetTimeMicros() - nWaitStart;
+        if (!fOk) {
+            return false;
+        }
+
+        // Take the maps over rather than copying them; the caller clears its
+        // own (now empty) maps afterwards.
+        pending.reset(new PendingWrite());
+        pending->mapCoins.swap(mapCoins);
+        pending->hashBlock = hashBlock;
+        pending->hashSproutAnchor = hashSproutAnchor;
+        pending->hashSaplingAnchor = hashSaplingAnchor;
+        pending->mapSproutAnchors.swap(mapSproutAnchors);
+        pending->mapSaplingAnchors.swap(mapSaplingAnchors);
+        pending->mapSproutNullifiers.swap(mapSproutNullifiers);
+        pending->mapSaplingNullifiers.swap(mapSaplingNullifiers);
+        pending->historyCacheMap.swap(historyCacheMap);
+        // Scripts stored out of line are not counted; typical outputs fit inline.
+        pending->nMemoryUsage = memusage::DynamicUsage(pending->mapCoins) +
+                                memusage::DynamicUsage(pending->mapSproutAnchors) +
+                                memusage::DynamicUsage(pending->mapSaplingAnchors) +
+                                memusage::DynamicUsage(pending->mapSproutNullifiers) +
+                                memusage::DynamicUsage(pending->mapSaplingNullifiers) +
+                                memusage::DynamicUsage(pending->historyCacheMap);
+        stats.fInProgress = true;
+    }
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewFlusher::GetStats(CCoinsStats &stats) const {
+    std::unique_lock<std::mutex> lock(cs);
+    WaitIdle(lock);
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewFlusher::Sync()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    return WaitIdle(lock);
+}
+
+size_t CCoinsViewFlusher::PendingMemoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return pending ? pending->nMemoryUsage : 0;
+}
+
+CCoinsFlushStats CCoinsViewFlusher::GetFlushStats() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return stats;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, profile) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -290,35 +705,47 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (const auto& output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += output.second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint key;
+        CoinEntry entry(&key);
+        Coin coin;
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (!outputs.empty() && key.hash != prevkey) {
+                    ApplyStats(stats, ss, prevkey, outputs);
+                    outputs.clear();
                 }
+                prevkey = key.hash;
+                outputs[key.n] = std::move(coin);
                 stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -327,12 +754,399 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model (0.8..4.x) to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prev_key = std::make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. 10 times
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(std::make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+namespace {
+
+/**
+ * Copy the records under one key prefix to a snapshot. Each record is written
+ * as the prefix, the rest of its key and its value.
+ */
+template<typename Key, typename Value>
+uint64_t WriteSnapshotRecords(CDBIterator& cursor, char prefix, CHashingWriter<CAutoFile>& stream)
+{
+    uint64_t count = 0;
+    std::pair<char, Key> key;
+    Value value;
+    for (cursor.Seek(prefix); cursor.Valid(); cursor.Next()) {
+        boost::this_thread::interruption_point();
+        if (!cursor.GetKey(key) || key.first != prefix) {
+            break;
+        }
+        if (!cursor.GetValue(value)) {
+            throw std::runtime_error(strprintf("unable to read chainstate record of type '%c'", prefix));
+        }
+        stream << prefix << key.second << value;
+        count++;
+    }
+    return count;
+}
+
+template<typename Value>
+bool ReadSingleRecord(CDBIterator& cursor, char keyIn, Value& value)
+{
+    char key;
+    cursor.Seek(keyIn);
+    return cursor.Valid() && cursor.GetKey(key) && key == keyIn && cursor.GetValue(value);
+}
+
+/** Erase the records under one key prefix, syncing the last write. */
+template<typename Key>
+bool EraseRecords(CDBWrapper& db, char prefix)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    CDBBatch batch(db);
+    std::pair<char, Key> key;
+    for (pcursor->Seek(prefix); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(key) || key.first != prefix) {
+            break;
+        }
+        batch.Erase(key);
+        if (batch.SizeEstimate() > (1 << 24)) {
+            if (!db.WriteBatch(batch)) {
+                return false;
+            }
+            batch.Clear();
+        }
+    }
+    return db.WriteBatch(batch, true);
+}
+
+/** Hash the keys of the records under one key prefix. */
+template<typename Key>
+void HashRecordKeys(CDBIterator& cursor, char prefix, CHashWriter& ss)
+{
+    std::pair<char, Key> key;
+    for (cursor.Seek(prefix); cursor.Valid(); cursor.Next()) {
+        boost::this_thread::interruption_point();
+        if (!cursor.GetKey(key) || key.first != prefix) {
+            break;
+        }
+        ss << key;
+    }
+}
+
+}
+
+bool CCoinsViewDB::WriteSnapshot(CDBIterator& cursor, const uint256& hashBlock, CHashingWriter<CAutoFile>& stream, CChainstateSnapshotStats& stats) const
+{
+    uint256 hashBestChain;
+    if (!ReadSingleRecord(cursor, DB_BEST_BLOCK, hashBestChain) || hashBestChain != hashBlock) {
+        return error("%s: chainstate is not at block %s", __func__, hashBlock.ToString());
+    }
+
+    try {
+        COutPoint outpoint;
+        CoinEntry entry(&outpoint);
+        Coin coin;
+        for (cursor.Seek(DB_COIN); cursor.Valid(); cursor.Next()) {
+            boost::this_thread::interruption_point();
+            if (!cursor.GetKey(entry) || entry.key != DB_COIN) {
+                break;
+            }
+            if (!cursor.GetValue(coin)) {
+                return error("%s: unable to read coin", __func__);
+            }
+            stream << DB_COIN << outpoint << coin;
+            stats.nCoins++;
+        }
+
+        typedef std::array<unsigned char, NODE_SERIALIZED_LENGTH> SerializedHistoryNode;
+        stats.nSproutAnchors = WriteSnapshotRecords<uint256, SproutMerkleTree>(cursor, DB_SPROUT_ANCHOR, stream);
+        stats.nSaplingAnchors = WriteSnapshotRecords<uint256, SaplingMerkleTree>(cursor, DB_SAPLING_ANCHOR, stream);
+        stats.nNullifiers = WriteSnapshotRecords<uint256, bool>(cursor, DB_NULLIFIER, stream);
+        stats.nNullifiers += WriteSnapshotRecords<uint256, bool>(cursor, DB_SAPLING_NULLIFIER, stream);
+        WriteSnapshotRecords<uint32_t, HistoryIndex>(cursor, DB_MMR_LENGTH, stream);
+        WriteSnapshotRecords<uint32_t, uint256>(cursor, DB_MMR_ROOT, stream);
+        stats.nHistoryNodes = WriteSnapshotRecords<std::pair<uint32_t, HistoryIndex>, SerializedHistoryNode>(cursor, DB_MMR_NODE, stream);
+
+        uint256 hashAnchor;
+        if (ReadSingleRecord(cursor, DB_BEST_SPROUT_ANCHOR, hashAnchor)) {
+            stream << DB_BEST_SPROUT_ANCHOR << hashAnchor;
+        }
+        if (ReadSingleRecord(cursor, DB_BEST_SAPLING_ANCHOR, hashAnchor)) {
+            stream << DB_BEST_SAPLING_ANCHOR << hashAnchor;
+        }
+
+        // The best block comes last and ends the records.
+        stream << DB_BEST_BLOCK << hashBestChain;
+    } catch (const std::runtime_error& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CCoinsViewDB::ReadSnapshot(CAutoFile& stream, const uint256& hashBlock, CChainstateSnapshotStats& stats)
+{
+    // A load that was interrupted leaves coins without a best block.
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(DB_COIN);
+    COutPoint firstOutpoint;
+    CoinEntry firstEntry(&firstOutpoint);
+    if (!GetBestBlock().IsNull() || (pcursor->Valid() && pcursor->GetKey(firstEntry) && firstEntry.key == DB_COIN)) {
+        return error("%s: chainstate database is not empty", __func__);
+    }
+
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    while (true) {
+        boost::this_thread::interruption_point();
+        char type;
+        stream >> type;
+        switch (type) {
+        case DB_COIN: {
+            COutPoint outpoint;
+            Coin coin;
+            stream >> outpoint >> coin;
+            batch.Write(CoinEntry(&outpoint), coin);
+            stats.nCoins++;
+            break;
+        }
+        case DB_SPROUT_ANCHOR: {
+            uint256 root;
+            SproutMerkleTree tree;
+            stream >> root >> tree;
+            batch.Write(make_pair(DB_SPROUT_ANCHOR, root), tree);
+            stats.nSproutAnchors++;
+            break;
+        }
+        case DB_SAPLING_ANCHOR: {
+            uint256 root;
+            SaplingMerkleTree tree;
+            stream >> root >> tree;
+            batch.Write(make_pair(DB_SAPLING_ANCHOR, root), tree);
+            stats.nSaplingAnchors++;
+            break;
+        }
+        case DB_NULLIFIER:
+        case DB_SAPLING_NULLIFIER: {
+            uint256 nf;
+            bool entered;
+            stream >> nf >> entered;
+            batch.Write(make_pair(type, nf), entered);
+            stats.nNullifiers++;
+            break;
+        }
+        case DB_MMR_LENGTH: {
+            uint32_t epochId;
+            HistoryIndex length;
+            stream >> epochId >> length;
+            batch.Write(make_pair(DB_MMR_LENGTH, epochId), length);
+            break;
+        }
+        case DB_MMR_ROOT: {
+            uint32_t epochId;
+            uint256 root;
+            stream >> epochId >> root;
+            batch.Write(make_pair(DB_MMR_ROOT, epochId), root);
+            break;
+        }
+        case DB_MMR_NODE: {
+            std::pair<uint32_t, HistoryIndex> position;
+            std::array<unsigned char, NODE_SERIALIZED_LENGTH> node;
+            stream >> position >> node;
+            batch.Write(make_pair(DB_MMR_NODE, position), node);
+            stats.nHistoryNodes++;
+            break;
+        }
+        case DB_BEST_SPROUT_ANCHOR:
+        case DB_BEST_SAPLING_ANCHOR: {
+            uint256 hashAnchor;
+            stream >> hashAnchor;
+            batch.Write(type, hashAnchor);
+            break;
+        }
+        case DB_BEST_BLOCK: {
+            uint256 hashBestChain;
+            stream >> hashBestChain;
+            if (hashBestChain != hashBlock) {
+                return error("%s: snapshot records end at block %s, expected %s", __func__, hashBestChain.ToString(), hashBlock.ToString());
+            }
+            // Writing the best block last means that an interrupted load
+            // leaves a database that is not mistaken for a usable chainstate.
+            batch.Write(DB_BEST_BLOCK, hashBestChain);
+            if (!db.WriteBatch(batch, true)) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(cs_historyTrees);
+            historyTrees.clear();
+            return true;
+        }
+        default:
+            return error("%s: unknown snapshot record type %d", __func__, type);
+        }
+
+        if (batch.SizeEstimate() > batch_size) {
+            if (!db.WriteBatch(batch)) {
+                return false;
+            }
+            batch.Clear();
+        }
+    }
+}
+
+bool CCoinsViewDB::EraseAll()
+{
+    // The best block goes first, so that a database left half erased is not
+    // mistaken for a usable chainstate.
+    if (!db.Erase(DB_BEST_BLOCK, true)) {
+        return false;
+    }
+
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    CDBBatch batch(db);
+    COutPoint outpoint;
+    CoinEntry entry(&outpoint);
+    for (pcursor->Seek(DB_COIN); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(entry) || entry.key != DB_COIN) {
+            break;
+        }
+        batch.Erase(entry);
+        if (batch.SizeEstimate() > (1 << 24)) {
+            if (!db.WriteBatch(batch)) {
+                return false;
+            }
+            batch.Clear();
+        }
+    }
+    batch.Erase(DB_BEST_SPROUT_ANCHOR);
+    batch.Erase(DB_BEST_SAPLING_ANCHOR);
+    if (!db.WriteBatch(batch, true) ||
+        !EraseRecords<uint256>(db, DB_SPROUT_ANCHOR) ||
+        !EraseRecords<uint256>(db, DB_SAPLING_ANCHOR) ||
+        !EraseRecords<uint256>(db, DB_NULLIFIER) ||
+        !EraseRecords<uint256>(db, DB_SAPLING_NULLIFIER) ||
+        !EraseRecords<uint32_t>(db, DB_MMR_LENGTH) ||
+        !EraseRecords<uint32_t>(db, DB_MMR_ROOT) ||
+        !EraseRecords<std::pair<uint32_t, HistoryIndex>>(db, DB_MMR_NODE)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(cs_historyTrees);
+    historyTrees.clear();
+    return true;
+}
+
+bool CCoinsViewDB::HashContents(uint256& hash) const
+{
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+
+    COutPoint outpoint;
+    CoinEntry entry(&outpoint);
+    Coin coin;
+    for (pcursor->Seek(DB_COIN); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(entry) || entry.key != DB_COIN) {
+            break;
+        }
+        if (!pcursor->GetValue(coin)) {
+            return error("%s: unable to read coin", __func__);
+        }
+        ss << outpoint << coin;
+    }
+
+    // An anchor's key is the root of its tree, and a nullifier's key is the
+    // nullifier, so the keys are enough.
+    HashRecordKeys<uint256>(*pcursor, DB_SPROUT_ANCHOR, ss);
+    HashRecordKeys<uint256>(*pcursor, DB_SAPLING_ANCHOR, ss);
+    HashRecordKeys<uint256>(*pcursor, DB_NULLIFIER, ss);
+    HashRecordKeys<uint256>(*pcursor, DB_SAPLING_NULLIFIER, ss);
+    ss << GetBestAnchor(SPROUT) << GetBestAnchor(SAPLING);
+
+    std::pair<char, uint32_t> key;
+    HistoryIndex length;
+    for (pcursor->Seek(DB_MMR_LENGTH); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(key) || key.first != DB_MMR_LENGTH) {
+            break;
+        }
+        if (!pcursor->GetValue(length)) {
+            return error("%s: unable to read history tree length", __func__);
+        }
+        ss << key.second << length << GetHistoryRoot(key.second);
+    }
+
+    hash = ss.GetHash();
     return true;
 }
 
@@ -348,6 +1162,14 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::WriteDiskBlockIndex(const std::vector<CDiskBlockIndex>& vIndex) {
+    CDBBatch batch(*this);
+    for (const CDiskBlockIndex& diskindex : vIndex) {
+        batch.Write(make_pair(DB_BLOCK_INDEX, diskindex.GetBlockHash()), diskindex);
+    }
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
@@ -356,6 +1178,10 @@ bool CBlockTreeDB::EraseBatchSync(const std::vector<const CBlockIndex*>& blockin
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::EraseBlockIndex() {
+    return EraseRecords<uint256>(*this, DB_BLOCK_INDEX);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
@@ -524,6 +1350,31 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteIndexBestBlock(const std::string &name, const uint256 &hash, int nHeight) {
+    return Write(std::make_pair(DB_INDEX_BEST_BLOCK, name), std::make_pair(hash, nHeight));
+}
+
+bool CBlockTreeDB::ReadIndexBestBlock(const std::string &name, uint256 &hash, int &nHeight) {
+    std::pair<uint256, int> best;
+    if (!Read(std::make_pair(DB_INDEX_BEST_BLOCK, name), best))
+        return false;
+    hash = best.first;
+    nHeight = best.second;
+    return true;
+}
+
+bool CBlockTreeDB::EraseIndexBestBlock(const std::string &name) {
+    return Erase(std::make_pair(DB_INDEX_BEST_BLOCK, name));
+}
+
+bool CBlockTreeDB::WriteSnapshotTarget(const CChainstateSnapshotTarget &target) {
+    return Write(DB_SNAPSHOT_TARGET, target, true);
+}
+
+bool CBlockTreeDB::ReadSnapshotTarget(CChainstateSnapshotTarget &target) {
+    return Read(DB_SNAPSHOT_TARGET, target);
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(
     std::function<CBlockIndex*(const uint256&)> insertBlockIndex,
     const CChainParams& chainParams)
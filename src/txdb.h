@@ -9,9 +9,15 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "hash.h"
+#include "streams.h"
 
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -72,20 +78,193 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+//! Number of history tree nodes per epoch CCoinsViewDB caches between writes
+static const size_t MAX_CACHED_HISTORY_NODES = 256;
+
+/** Number of records of each kind in a chainstate snapshot */
+struct CChainstateSnapshotStats
+{
+    uint64_t nCoins = 0;
+    uint64_t nSproutAnchors = 0;
+    uint64_t nSaplingAnchors = 0;
+    uint64_t nNullifiers = 0;
+    uint64_t nHistoryNodes = 0;
+};
+
+/**
+ * What the background validation of a chainstate snapshot has to rebuild from
+ * the blocks below it: the snapshot's block and the hash of its chainstate's
+ * contents (see CCoinsViewDB::HashContents).
+ */
+struct CChainstateSnapshotTarget
+{
+    uint256 hashBlock;
+    int nHeight = -1;
+    uint256 hashContents;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(hashContents);
+    }
+};
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
+private:
+    /**
+     * In-memory copy of a history tree's length, root and the nodes that the
+     * next append or pop needs (its peaks and the right slope of the last
+     * peak). It outlives the CCoinsViewCache instances created per block, so
+     * connecting a block usually needs no history reads from the database.
+     */
+    struct HistoryTreeState
+    {
+        HistoryIndex length;
+        uint256 root;
+        std::map<HistoryIndex, HistoryNode> nodes;
+    };
+
+    mutable std::mutex cs_historyTrees;
+    mutable std::map<uint32_t, HistoryTreeState> historyTrees;
+
+    //! Returns the cached state for an epoch, reading it if needed. Requires cs_historyTrees.
+    HistoryTreeState& LoadHistoryTree(uint32_t epochId) const;
+    //! Applies history tree updates that have just been written.
+    void UpdateHistoryTrees(const CHistoryCacheMap& historyCacheMap);
+
 protected:
     CDBWrapper db;
-    CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    //! Estimated size in bytes of the last batch written by BatchWrite
+    size_t nLastBatchSize;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    //! Open a chainstate in the named directory of the data directory.
+    CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile::Chainstate());
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile::Chainstate());
+
+    //! The underlying database, for statistics
+    const CDBWrapper& GetDB() const { return db; }
+    size_t GetLastBatchSize() const { return nLastBatchSize; }
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor(ShieldedType type) const;
+    HistoryIndex GetHistoryLength(uint32_t epochId) const;
+    HistoryNode GetHistoryAt(uint32_t epochId, HistoryIndex index) const;
+    uint256 GetHistoryRoot(uint32_t epochId) const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashSproutAnchor,
+                    const uint256 &hashSaplingAnchor,
+                    CAnchorsSproutMap &mapSproutAnchors,
+                    CAnchorsSaplingMap &mapSaplingAnchors,
+                    CNullifiersMap &mapSproutNullifiers,
+                    CNullifiersMap &mapSaplingNullifiers,
+                    CHistoryCacheMap &historyCacheMap);
+    bool GetStats(CCoinsStats &stats) const;
+
+    //! Attempt to update from an older database format. Returns false if interrupted by shutdown.
+    bool Upgrade();
+
+    //! Returns an iterator over the database as of now, for WriteSnapshot.
+    CDBIterator* Cursor() const { return const_cast<CDBWrapper&>(db).NewIterator(); }
+    //! Write every record visible to a cursor whose best block is hashBlock to a snapshot.
+    bool WriteSnapshot(CDBIterator& cursor, const uint256& hashBlock, CHashingWriter<CAutoFile>& stream, CChainstateSnapshotStats& stats) const;
+    //! Read the records of a snapshot taken at hashBlock into an empty database.
+    bool ReadSnapshot(CAutoFile& stream, const uint256& hashBlock, CChainstateSnapshotStats& stats);
+    //! Erase every chainstate record, to undo an incomplete ReadSnapshot.
+    bool EraseAll();
+    /**
+     * Hash the coins, nullifiers, anchors, best anchors, and each epoch's
+     * history tree length and root, so that two chainstates built from the
+     * same blocks can be compared. Records that a reorganization may leave
+     * behind, such as history nodes past the end of a tree, are not hashed.
+     */
+    bool HashContents(uint256& hash) const;
+};
+
+/** Statistics about chainstate writes done by CCoinsViewFlusher */
+struct CCoinsFlushStats
+{
+    //! Number of completed writes
+    uint64_t nFlushes;
+    //! Whether a write is currently in progress
+    bool fInProgress;
+    //! Duration and estimated size of the last completed write
+    int64_t nLastDurationMicros;
+    size_t nLastBytes;
+    //! Totals over all completed writes
+    int64_t nTotalDurationMicros;
+    uint64_t nTotalBytes;
+    //! Time callers spent waiting for a previous write to finish
+    int64_t nTotalWaitMicros;
+
+    CCoinsFlushStats() : nFlushes(0), fInProgress(false), nLastDurationMicros(0), nLastBytes(0),
+        nTotalDurationMicros(0), nTotalBytes(0), nTotalWaitMicros(0) {}
+};
+
+/**
+ * Coins view layer that writes to the coin database on a background thread.
+ *
+ * BatchWrite() takes ownership of the flushed cache contents by swapping them
+ * into a pending write, which is constant time, and returns immediately. A
+ * writer thread then commits the pending write to the database. Until it is
+ * committed, lookups are answered from the pending write first and from the
+ * database otherwise, so the cache above sees a consistent view throughout.
+ *
+ * At most one write is in flight: a BatchWrite() issued while the previous
+ * write is still running waits for it to finish first.
+ */
+class CCoinsViewFlusher : public CCoinsViewBacked
+{
+private:
+    struct PendingWrite
+    {
+        CCoinsMap mapCoins;
+        uint256 hashBlock;
+        uint256 hashSproutAnchor;
+        uint256 hashSaplingAnchor;
+        CAnchorsSproutMap mapSproutAnchors;
+        CAnchorsSaplingMap mapSaplingAnchors;
+        CNullifiersMap mapSproutNullifiers;
+        CNullifiersMap mapSaplingNullifiers;
+        CHistoryCacheMap historyCacheMap;
+        size_t nMemoryUsage;
+    };
+
+    CCoinsViewDB* db;
+
+    mutable std::mutex cs;
+    mutable std::condition_variable cond;
+    //! The write being committed, if any. Only the writer thread clears it.
+    std::unique_ptr<PendingWrite> pending;
+    //! Set once a write has failed; the pending write is then kept forever.
+    bool fFailed;
+    bool fStop;
+    CCoinsFlushStats stats;
+    std::thread writer;
+
+    void ThreadWrite();
+    //! Wait, with cs held through lock, until no write is in progress.
+    bool WaitIdle(std::unique_lock<std::mutex>& lock) const;
+
+public:
+    CCoinsViewFlusher(CCoinsViewDB* dbIn);
+    ~CCoinsViewFlusher();
+
+    bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
+    bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
+    bool GetNullifier(const uint256 &nullifier, ShieldedType type) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
     HistoryIndex GetHistoryLength(uint32_t epochId) const;
@@ -101,19 +280,28 @@ public:
                     CNullifiersMap &mapSaplingNullifiers,
                     CHistoryCacheMap &historyCacheMap);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Wait for the write in progress, if any. Returns false if a write failed.
+    bool Sync();
+    //! Memory held by the write in progress, which is in addition to the cache above.
+    size_t PendingMemoryUsage() const;
+    CCoinsFlushStats GetFlushStats() const;
 };
 
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile::Index());
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    bool WriteDiskBlockIndex(const std::vector<CDiskBlockIndex>& vIndex);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
+    //! Erase every block index entry, to undo an incomplete snapshot load.
+    bool EraseBlockIndex();
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &info);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindexing);
@@ -139,6 +327,12 @@ public:
 
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! Progress of an index being built in the background, see CBlockTreeIndexBuilder.
+    bool WriteIndexBestBlock(const std::string &name, const uint256 &hash, int nHeight);
+    bool ReadIndexBestBlock(const std::string &name, uint256 &hash, int &nHeight);
+    bool EraseIndexBestBlock(const std::string &name);
+    bool WriteSnapshotTarget(const CChainstateSnapshotTarget &target);
+    bool ReadSnapshotTarget(CChainstateSnapshotTarget &target);
     bool LoadBlockIndexGuts(
         std::function<CBlockIndex*(const uint256&)> insertBlockIndex,
         const CChainParams& chainParams);
@@ -0,0 +1,74 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "txheightindex.h"
+
+#include "chain.h"
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "util.h"
+
+static const char DB_TXHEIGHT = 'h';
+static const char DB_BEST_BLOCK = 'B';
+
+CTxHeightIndex* ptxheightindex = NULL;
+
+CTxHeightIndex::CTxHeightIndex(size_t nCacheSize, bool fMemory, bool fWipe) :
+    CBaseIndex("txheightindex"),
+    db(GetDataDir() / "indexes" / "txheight", nCacheSize, fMemory, fWipe, CDBProfile::Index())
+{
+    std::pair<uint256, int> best;
+    if (db.Read(DB_BEST_BLOCK, best))
+        SetBestBlock(best.first, best.second);
+}
+
+std::vector<CTxHeightIndexEntry> CTxHeightIndex::Find(const uint256& txid) const
+{
+    std::vector<CTxHeightIndexEntry> vEntries;
+    CTxHeightIndexKey keyStart(txid, 0);
+
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_TXHEIGHT, keyStart));
+    while (pcursor->Valid()) {
+        std::pair<char, CTxHeightIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_TXHEIGHT ||
+                memcmp(key.second.prefix, keyStart.prefix, TXHEIGHTINDEX_PREFIX_SIZE) != 0)
+            break;
+        unsigned int nTxOffset;
+        CVarInt<unsigned int> value(nTxOffset);
+        if (pcursor->GetValue(value))
+            vEntries.emplace_back(key.second.nHeight, nTxOffset);
+        pcursor->Next();
+    }
+    return vEntries;
+}
+
+bool CTxHeightIndex::WriteBatch(CDBBatch& batch, const uint256& hashBest, int nHeight)
+{
+    batch.Write(DB_BEST_BLOCK, std::make_pair(hashBest, nHeight));
+    if (!db.WriteBatch(batch))
+        return false;
+    SetBestBlock(hashBest, nHeight);
+    return true;
+}
+
+bool CTxHeightIndex::ConnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo)
+{
+    CDBBatch batch(db);
+    // Offsets are counted from the end of the block header, as in CDiskTxPos.
+    unsigned int nTxOffset = GetSizeOfCompactSize(block.vtx.size());
+    for (const CTransactionRef& ptx : block.vtx) {
+        batch.Write(std::make_pair(DB_TXHEIGHT, CTxHeightIndexKey(ptx->GetHash(), pindex->nHeight)), VARINT(nTxOffset));
+        nTxOffset += ::GetSerializeSize(*ptx, SER_DISK, CLIENT_VERSION);
+    }
+    return WriteBatch(batch, pindex->GetBlockHash(), pindex->nHeight);
+}
+
+bool CTxHeightIndex::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo)
+{
+    CDBBatch batch(db);
+    for (const CTransactionRef& ptx : block.vtx)
+        batch.Erase(std::make_pair(DB_TXHEIGHT, CTxHeightIndexKey(ptx->GetHash(), pindex->nHeight)));
+    return WriteBatch(batch, pindex->pprev ? pindex->pprev->GetBlockHash() : uint256(), pindex->nHeight - 1);
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2020 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_TXHEIGHTINDEX_H
+#define BITCOIN_TXHEIGHTINDEX_H
+
+#include "baseindex.h"
+#include "dbwrapper.h"
+#include "uint256.h"
+
+#include <string.h>
+#include <vector>
+
+//! -txheightindex default
+static const bool DEFAULT_TXHEIGHTINDEX = false;
+
+//! Number of txid bytes kept in the index.
+static const size_t TXHEIGHTINDEX_PREFIX_SIZE = 8;
+
+struct CTxHeightIndexKey {
+    unsigned char prefix[TXHEIGHTINDEX_PREFIX_SIZE];
+    unsigned int nHeight;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return TXHEIGHTINDEX_PREFIX_SIZE + 4;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        s.write((const char*)prefix, TXHEIGHTINDEX_PREFIX_SIZE);
+        ser_writedata32be(s, nHeight);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s.read((char*)prefix, TXHEIGHTINDEX_PREFIX_SIZE);
+        nHeight = ser_readdata32be(s);
+    }
+
+    CTxHeightIndexKey(const uint256& txid, unsigned int nHeightIn) {
+        memcpy(prefix, txid.begin(), TXHEIGHTINDEX_PREFIX_SIZE);
+        nHeight = nHeightIn;
+    }
+
+    CTxHeightIndexKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        memset(prefix, 0, TXHEIGHTINDEX_PREFIX_SIZE);
+        nHeight = 0;
+    }
+};
+
+/** Where a transaction may be: the height of its block, and its offset after the block header. */
+struct CTxHeightIndexEntry {
+    int nHeight;
+    unsigned int nTxOffset;
+
+    CTxHeightIndexEntry(int nHeightIn, unsigned int nTxOffsetIn) : nHeight(nHeightIn), nTxOffset(nTxOffsetIn) {}
+};
+
+/**
+ * A compact index from txid to the height of the block containing the
+ * transaction and its position in that block, for getrawtransaction without
+ * -txindex. Only the first TXHEIGHTINDEX_PREFIX_SIZE bytes of each txid are
+ * kept, so a lookup can return several candidates, and callers must check
+ * the txid of the transaction they read. The block position comes from the
+ * block index at lookup time, so entries stay valid across -reindex.
+ *
+ * The index is built in the background once the node has synced, and then
+ * follows the active chain. It keeps its own best block, written atomically
+ * with the entries of that block.
+ */
+class CTxHeightIndex : public CBaseIndex
+{
+private:
+    mutable CDBWrapper db;
+
+    bool WriteBatch(CDBBatch& batch, const uint256& hashBest, int nHeight);
+
+public:
+    CTxHeightIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    /** Candidate positions of a transaction, in ascending height order. */
+    std::vector<CTxHeightIndexEntry> Find(const uint256& txid) const;
+
+    bool ConnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo);
+    bool DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, const CBlockUndo& blockundo);
+};
+
+/** Global variable that points to the txid to height index, or NULL if it is disabled (protected by cs_main). */
+extern CTxHeightIndex* ptxheightindex;
+
+#endif // BITCOIN_TXHEIGHTINDEX_H
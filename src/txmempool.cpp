@@ -10,6 +10,7 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "policy/fees.h"
+#include "script/interpreter.h"
 #include "streams.h"
 #include "timedata.h"
 #include "util.h"
@@ -22,23 +23,27 @@
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
+    tx(MakeTransactionRef()), nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
     hadNoDependencies(false), spendsCoinbase(false)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight, bool poolHasNoInputsOf,
-                                 bool _spendsCoinbase, uint32_t _nBranchId):
+                                 bool _spendsCoinbase, uint32_t _nBranchId,
+                                 std::shared_ptr<const PrecomputedTransactionData> _txdata):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
     hadNoDependencies(poolHasNoInputsOf),
-    spendsCoinbase(_spendsCoinbase), nBranchId(_nBranchId)
+    spendsCoinbase(_spendsCoinbase), nBranchId(_nBranchId), txdata(_txdata)
 {
-    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-    nModSize = tx.CalculateModifiedSize(nTxSize);
-    nUsageSize = RecursiveDynamicUsage(tx);
+    if (!txdata) {
+        txdata = std::make_shared<const PrecomputedTransactionData>(*tx);
+    }
+    nTxSize = tx->GetTotalSize();
+    nModSize = tx->CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx) + memusage::DynamicUsage(txdata);
     feeRate = CFeeRate(nFee, nTxSize);
 }
 
@@ -50,7 +55,7 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    CAmount nValueIn = tx.GetValueOut()+nFee;
+    CAmount nValueIn = tx->GetValueOut()+nFee;
     double deltaPriority = ((double)(currentHeight-nHeight)*nValueIn)/nModSize;
     double dResult = dPriority + deltaPriority;
     return dResult;
@@ -74,17 +79,10 @@ CTxMemPool::~CTxMemPool()
     delete weightedTxTree;
 }
 
-void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
+bool CTxMemPool::isSpent(const COutPoint& outpoint)
 {
     LOCK(cs);
-
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
-    }
+    return mapNextTx.count(outpoint);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -108,8 +106,9 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     LOCK(cs);
     weightedTxTree->add(WeightedTxInfo::from(entry.GetTx(), entry.GetFee()));
     mapTx.insert(entry);
-    const CTransaction& tx = mapTx.find(hash)->GetTx();
-    mapRecentlyAddedTx[tx.GetHash()] = &tx;
+    indexed_transaction_set::const_iterator newit = mapTx.find(hash);
+    const CTransaction& tx = newit->GetTx();
+    mapRecentlyAddedTx[tx.GetHash()] = newit->GetSharedTx();
     nRecentlyAddedSequence += 1;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
@@ -210,6 +209,18 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
     mapSpentInserted.insert(make_pair(txhash, inserted));
 }
 
+void CTxMemPool::addIndexes(const CCoinsViewCache &view, bool fAddress, bool fSpent)
+{
+    LOCK(cs);
+    for (const CTxMemPoolEntry& entry : mapTx) {
+        const uint256& txhash = entry.GetTx().GetHash();
+        if (fAddress && !mapAddressInserted.count(txhash))
+            addAddressIndex(entry, view);
+        if (fSpent && !mapSpentInserted.count(txhash))
+            addSpentIndex(entry, view);
+    }
+}
+
 bool CTxMemPool::getSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value)
 {
     LOCK(cs);
@@ -282,6 +293,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 mapSaplingNullifiers.erase(spendDescription.nullifier);
             }
             removed.push_back(tx);
+            NotifyEntryRemoved(*mapTx.find(hash));
             totalTxSize -= mapTx.find(hash)->GetTxSize();
             cachedInnerUsage -= mapTx.find(hash)->DynamicMemoryUsage();
             mapTx.erase(hash);
@@ -314,9 +326,9 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
                 if (it2 != mapTx.end())
                     continue;
-                const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
-		if (nCheckFrequency != 0) assert(coins);
-                if (!coins || (coins->IsCoinBase() && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
+                const Coin &coin = pcoins->AccessCoin(txin.prevout);
+                if (nCheckFrequency != 0) assert(!coin.IsSpent());
+                if (coin.IsSpent() || (coin.IsCoinBase() && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
                     transactionsToRemove.push_back(tx);
                     break;
                 }
@@ -433,21 +445,22 @@ std::vector<uint256> CTxMemPool::removeExpired(unsigned int nBlockHeight)
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
+void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
                                 std::list<CTransaction>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
-    for (const CTransaction& tx : vtx)
+    for (const CTransactionRef& ptx : vtx)
     {
-        uint256 hash = tx.GetHash();
+        uint256 hash = ptx->GetHash();
 
         indexed_transaction_set::iterator i = mapTx.find(hash);
         if (i != mapTx.end())
             entries.push_back(*i);
     }
-    for (const CTransaction& tx : vtx)
+    for (const CTransactionRef& ptx : vtx)
     {
+        const CTransaction& tx = *ptx;
         std::list<CTransaction> dummy;
         remove(tx, dummy, false);
         removeConflicts(tx, conflicts);
@@ -521,8 +534,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
             } else {
-                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
-                assert(coins && coins->IsAvailable(txin.prevout.n));
+                assert(pcoins->HaveCoin(txin.prevout));
             }
             // Check whether its inputs are marked in mapNextTx.
             std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
@@ -638,6 +650,56 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
         vtxid.push_back(mi->GetTx().GetHash());
 }
 
+std::vector<RelayOrderEntry> CTxMemPool::MakeRelayHeap(const std::vector<uint256>& vtxid) const
+{
+    LOCK(cs);
+    std::set<uint256> setBatch(vtxid.begin(), vtxid.end());
+    std::map<uint256, int> mapDepth;
+    for (const uint256& hash : vtxid) {
+        // Walk up to the parents without recursing, as chains of unconfirmed
+        // transactions can be long.
+        std::vector<uint256> vStack(1, hash);
+        while (!vStack.empty()) {
+            const uint256 cur = vStack.back();
+            if (mapDepth.count(cur)) {
+                vStack.pop_back();
+                continue;
+            }
+            int nDepth = 0;
+            bool fParentsDone = true;
+            indexed_transaction_set::const_iterator it = mapTx.find(cur);
+            if (it != mapTx.end()) {
+                for (const CTxIn& txin : it->GetTx().vin) {
+                    const uint256& parent = txin.prevout.hash;
+                    if (!setBatch.count(parent))
+                        continue;
+                    std::map<uint256, int>::const_iterator mi = mapDepth.find(parent);
+                    if (mi == mapDepth.end()) {
+                        vStack.push_back(parent);
+                        fParentsDone = false;
+                    } else {
+                        nDepth = std::max(nDepth, mi->second + 1);
+                    }
+                }
+            }
+            if (fParentsDone) {
+                mapDepth[cur] = nDepth;
+                vStack.pop_back();
+            }
+        }
+    }
+
+    std::vector<RelayOrderEntry> vHeap;
+    vHeap.reserve(vtxid.size());
+    for (const uint256& hash : vtxid) {
+        indexed_transaction_set::const_iterator it = mapTx.find(hash);
+        bool fInPool = it != mapTx.end();
+        vHeap.push_back({hash, fInPool, mapDepth[hash], fInPool ? it->GetFeeRate() : CFeeRate()});
+    }
+    std::make_heap(vHeap.begin(), vHeap.end(), CompareRelayOrder());
+    return vHeap;
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
@@ -647,6 +709,22 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+CTransactionRef CTxMemPool::get(const uint256& hash) const
+{
+    LOCK(cs);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return nullptr;
+    return i->GetSharedTx();
+}
+
+std::shared_ptr<const PrecomputedTransactionData> CTxMemPool::GetTxData(const uint256& hash) const
+{
+    LOCK(cs);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return nullptr;
+    return i->GetTxData();
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -741,15 +819,15 @@ bool CTxMemPool::nullifierExists(const uint256& nullifier, ShieldedType type) co
     }
 }
 
-std::pair<std::vector<CTransaction>, uint64_t> CTxMemPool::DrainRecentlyAdded()
+std::pair<std::vector<CTransactionRef>, uint64_t> CTxMemPool::DrainRecentlyAdded()
 {
     uint64_t recentlyAddedSequence;
-    std::vector<CTransaction> txs;
+    std::vector<CTransactionRef> txs;
     {
         LOCK(cs);
         recentlyAddedSequence = nRecentlyAddedSequence;
         for (const auto& kv : mapRecentlyAddedTx) {
-            txs.push_back(*(kv.second));
+            txs.push_back(kv.second);
         }
         mapRecentlyAddedTx.clear();
     }
@@ -776,20 +854,25 @@ bool CCoinsViewMemPool::GetNullifier(const uint256 &nf, ShieldedType type) const
     return mempool.nullifierExists(nf, type) || base->GetNullifier(nf, type);
 }
 
-bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
     CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
-        return true;
+    if (mempool.lookup(outpoint.hash, tx)) {
+        if (outpoint.n < tx.vout.size()) {
+            coin = Coin(tx.vout[outpoint.n], MEMPOOL_HEIGHT, false);
+            return true;
+        } else {
+            return false;
+        }
     }
-    return (base->GetCoins(txid, coins) && !coins.IsPruned());
+    return (base->GetCoin(outpoint, coin) && !coin.IsSpent());
 }
 
-bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
-    return mempool.exists(txid) || base->HaveCoins(txid);
+bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) const {
+    Coin coin;
+    return GetCoin(outpoint, coin);
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
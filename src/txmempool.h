@@ -7,6 +7,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <memory>
 
 #include "amount.h"
 #include "coins.h"
@@ -22,7 +23,10 @@
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
 
+#include <boost/signals2/signal.hpp>
+
 class CAutoFile;
+struct PrecomputedTransactionData;
 
 inline double AllowFreeThreshold()
 {
@@ -36,7 +40,7 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
@@ -45,7 +49,7 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 class CTxMemPoolEntry
 {
 private:
-    CTransaction tx;
+    CTransactionRef tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
     size_t nTxSize;            //!< ... and avoid recomputing tx size
     size_t nModSize;           //!< ... and modified size for priority
@@ -57,15 +61,18 @@ private:
     bool hadNoDependencies;    //!< Not dependent on any other txs when it entered the mempool
     bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
     uint32_t nBranchId;        //!< Branch ID this transaction is known to commit to, cached for efficiency
+    std::shared_ptr<const PrecomputedTransactionData> txdata; //!< Signature hash midstates, shared with block validation
 
 public:
-    CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
+    CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _dPriority, unsigned int _nHeight,
-                    bool poolHasNoInputsOf, bool spendsCoinbase, uint32_t nBranchId);
+                    bool poolHasNoInputsOf, bool spendsCoinbase, uint32_t nBranchId,
+                    std::shared_ptr<const PrecomputedTransactionData> txdata = nullptr);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    CTransactionRef GetSharedTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     CFeeRate GetFeeRate() const { return feeRate; }
@@ -77,6 +84,7 @@ public:
 
     bool GetSpendsCoinbase() const { return spendsCoinbase; }
     uint32_t GetValidatedBranchId() const { return nBranchId; }
+    const std::shared_ptr<const PrecomputedTransactionData>& GetTxData() const { return txdata; }
 };
 
 // extracts a TxMemPoolEntry's transaction hash
@@ -100,6 +108,37 @@ public:
     }
 };
 
+/** A transaction hash queued for announcement to a peer, see CTxMemPool::MakeRelayHeap. */
+struct RelayOrderEntry
+{
+    uint256 hash;
+    bool fInPool;
+    //! Number of generations of ancestors among the queued hashes
+    int nDepth;
+    CFeeRate feeRate;
+};
+
+/**
+ * Heap order for announcing transactions: parents before their children,
+ * then by decreasing feerate, and hashes that are not in the mempool last.
+ * Returns true when a is announced after b, so std::pop_heap yields the
+ * transaction to announce next.
+ */
+class CompareRelayOrder
+{
+public:
+    bool operator()(const RelayOrderEntry& a, const RelayOrderEntry& b) const
+    {
+        if (a.fInPool != b.fInPool)
+            return b.fInPool;
+        if (a.nDepth != b.nDepth)
+            return a.nDepth > b.nDepth;
+        if (!(a.feeRate == b.feeRate))
+            return a.feeRate < b.feeRate;
+        return b.hash < a.hash;
+    }
+};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -136,7 +175,7 @@ private:
     uint64_t totalTxSize = 0;  //!< sum of all mempool tx' byte sizes
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
 
-    std::map<uint256, const CTransaction*> mapRecentlyAddedTx;
+    std::map<uint256, CTransactionRef> mapRecentlyAddedTx;
     uint64_t nRecentlyAddedSequence = 0;
     uint64_t nNotifiedSequence = 0;
 
@@ -175,6 +214,9 @@ public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /** Called with each entry just before it is removed from the pool, while cs is held. */
+    boost::signals2::signal<void (const CTxMemPoolEntry&)> NotifyEntryRemoved;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -198,6 +240,8 @@ public:
     void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
     bool getSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value);
     void removeSpentIndex(const uint256 txhash);
+    /** Add the address and/or spent index entries of the transactions in the pool that lack them. */
+    void addIndexes(const CCoinsViewCache &view, bool fAddress, bool fSpent);
     // END insightexplorer
 
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
@@ -205,12 +249,18 @@ public:
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     std::vector<uint256> removeExpired(unsigned int nBlockHeight);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
+    void removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void removeWithoutBranchId(uint32_t nMemPoolBranchId);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
+    /**
+     * Arrange transaction hashes for announcing to a peer as a heap ordered
+     * by CompareRelayOrder, so that only the entries popped from it are
+     * sorted.
+     */
+    std::vector<RelayOrderEntry> MakeRelayHeap(const std::vector<uint256>& vtxid) const;
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -226,7 +276,7 @@ public:
 
     bool nullifierExists(const uint256& nullifier, ShieldedType type) const;
 
-    std::pair<std::vector<CTransaction>, uint64_t> DrainRecentlyAdded();
+    std::pair<std::vector<CTransactionRef>, uint64_t> DrainRecentlyAdded();
     void SetNotifiedSequence(uint64_t recentlyAddedSequence);
     bool IsFullyNotified();
 
@@ -249,6 +299,15 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Return a shared reference to a mempool transaction, or nullptr if it is not in the mempool. */
+    CTransactionRef get(const uint256& hash) const;
+
+    /**
+     * Return the signature hash midstates computed when the transaction was
+     * accepted, so that block validation need not hash it again. Returns
+     * nullptr if the transaction is not in the mempool.
+     */
+    std::shared_ptr<const PrecomputedTransactionData> GetTxData(const uint256& hash) const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
@@ -286,8 +345,8 @@ protected:
 public:
     CCoinsViewMemPool(CCoinsView *baseIn, CTxMemPool &mempoolIn);
     bool GetNullifier(const uint256 &txid, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
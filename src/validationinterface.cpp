@@ -26,7 +26,7 @@ CMainSignals& GetMainSignals()
 }
 
 void RegisterValidationInterface(CValidationInterface* pwalletIn) {
-    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
+    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2));
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
     g_signals.EraseTransaction.connect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
@@ -48,7 +48,7 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.EraseTransaction.disconnect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
-    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
+    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2));
 }
 
 void UnregisterAllValidationInterfaces() {
@@ -118,7 +118,7 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
         // Transactions that have been recently conflicted out of the mempool.
         std::pair<std::map<CBlockIndex*, std::list<CTransaction>>, uint64_t> recentlyConflicted;
         // Transactions that have been recently added to the mempool.
-        std::pair<std::vector<CTransaction>, uint64_t> recentlyAdded;
+        std::pair<std::vector<CTransactionRef>, uint64_t> recentlyAdded;
 
         {
             LOCK(cs_main);
@@ -185,7 +185,8 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
 
             // Let wallets know transactions went from 1-confirmed to
             // 0-confirmed or conflicted:
-            for (const CTransaction &tx : block.vtx) {
+            for (const CTransactionRef& ptx : block.vtx) {
+                const CTransaction& tx = *ptx;
                 SyncWithWallets(tx, NULL, pindexLastTip->nHeight);
             }
             // Update cached incremental witnesses
@@ -216,7 +217,8 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
                 SyncWithWallets(tx, NULL, blockData.pindex->nHeight + 1);
             }
             // ... and about transactions that got confirmed:
-            for (const CTransaction &tx : block.vtx) {
+            for (const CTransactionRef& ptx : block.vtx) {
+                const CTransaction& tx = *ptx;
                 SyncWithWallets(tx, &block, blockData.pindex->nHeight);
             }
             // Update cached incremental witnesses
@@ -227,9 +229,9 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
         }
 
         // Notify transactions in the mempool
-        for (auto tx : recentlyAdded.first) {
+        for (const CTransactionRef& ptx : recentlyAdded.first) {
             try {
-                SyncWithWallets(tx, NULL, pindexLastTip->nHeight + 1);
+                SyncWithWallets(*ptx, NULL, pindexLastTip->nHeight + 1);
             } catch (const boost::thread_interrupted&) {
                 throw;
             } catch (const std::exception& e) {
@@ -17,6 +17,8 @@
 
 #include <optional>
 
+#include <univalue.h>
+
 using ::testing::Return;
 
 ACTION(ThrowLogicError) {
@@ -74,6 +76,12 @@ public:
     void MarkAffectedTransactionsDirty(const CTransaction& tx) {
         CWallet::MarkAffectedTransactionsDirty(tx);
     }
+    void PublishTransactionEvents(const CWalletTx& wtx) {
+        CWallet::PublishTransactionEvents(wtx);
+    }
+    void PublishBlockEvent(const CBlockIndex *pindex, const CBlock *pblock, bool fConnected) {
+        CWallet::PublishBlockEvent(pindex, pblock, fConnected);
+    }
 };
 
 std::vector<SaplingOutPoint> SetSaplingNoteData(CWalletTx& wtx) {
@@ -104,7 +112,7 @@ std::pair<JSOutPoint, SaplingOutPoint> CreateValidBlock(TestWallet& wallet,
     auto saplingNotes = SetSaplingNoteData(wtx);
     wallet.AddToWallet(wtx, true, NULL);
 
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     wallet.IncrementNoteWitnesses(&index, &block, sproutTree, saplingTree);
     return std::make_pair(jsoutpt, saplingNotes[0]);
 }
@@ -191,7 +199,7 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     // Fake-mine the transaction
     EXPECT_EQ(-1, chainActive.Height());
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -228,7 +236,7 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     // Fake-mine a spend transaction
     EXPECT_EQ(0, chainActive.Height());
     CBlock block2;
-    block2.vtx.push_back(wtx2);
+    block2.vtx.push_back(MakeTransactionRef(wtx2));
     block2.hashMerkleRoot = block2.BuildMerkleTree();
     block2.hashPrevBlock = blockHash;
     auto blockHash2 = block2.GetHash();
@@ -287,7 +295,7 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     // Fake-mine the new transaction
     EXPECT_EQ(1, chainActive.Height());
     CBlock block3;
-    block3.vtx.push_back(wtx3);
+    block3.vtx.push_back(MakeTransactionRef(wtx3));
     block3.hashMerkleRoot = block3.BuildMerkleTree();
     block3.hashPrevBlock = blockHash2;
     auto blockHash3 = block3.GetHash();
@@ -762,7 +770,7 @@ TEST(WalletTests, GetConflictedSaplingNotes) {
         EXPECT_EQ(-1, chainActive.Height());
         SproutMerkleTree sproutTree;
         CBlock block;
-        block.vtx.push_back(wtx);
+        block.vtx.push_back(MakeTransactionRef(wtx));
         block.hashMerkleRoot = block.BuildMerkleTree();
         auto blockHash = block.GetHash();
         CBlockIndex fakeIndex {block};
@@ -874,7 +882,7 @@ TEST(WalletTests, SproutNullifierIsSpent) {
     // Fake-mine the transaction
     EXPECT_EQ(-1, chainActive.Height());
     CBlock block;
-    block.vtx.push_back(wtx2);
+    block.vtx.push_back(MakeTransactionRef(wtx2));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -927,7 +935,7 @@ TEST(WalletTests, SaplingNullifierIsSpent) {
     // Fake-mine the transaction
     EXPECT_EQ(-1, chainActive.Height());
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -1013,7 +1021,7 @@ TEST(WalletTests, NavigateFromSaplingNullifierToNote) {
     EXPECT_EQ(-1, chainActive.Height());
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -1146,7 +1154,7 @@ TEST(WalletTests, SpentSaplingNoteIsFromMe) {
         EXPECT_EQ(-1, chainActive.Height());
         SproutMerkleTree sproutTree;
         CBlock block;
-        block.vtx.push_back(wtx);
+        block.vtx.push_back(MakeTransactionRef(wtx));
         block.hashMerkleRoot = block.BuildMerkleTree();
         auto blockHash = block.GetHash();
         CBlockIndex fakeIndex {block};
@@ -1226,7 +1234,7 @@ TEST(WalletTests, SpentSaplingNoteIsFromMe) {
         // Fake-mine this tx into the next block
         EXPECT_EQ(0, chainActive.Height());
         CBlock block2;
-        block2.vtx.push_back(wtx2);
+        block2.vtx.push_back(MakeTransactionRef(wtx2));
         block2.hashMerkleRoot = block2.BuildMerkleTree();
         block2.hashPrevBlock = blockHash;
         auto blockHash2 = block2.GetHash();
@@ -1301,7 +1309,7 @@ TEST(WalletTests, CachedWitnessesEmptyChain) {
     EXPECT_FALSE((bool) saplingWitnesses[0]);
 
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     CBlockIndex index(block);
     SproutMerkleTree sproutTree;
     SaplingMerkleTree saplingTree;
@@ -1371,7 +1379,7 @@ TEST(WalletTests, CachedWitnessesChainTip) {
         // Second block
         CBlock block2;
         block2.hashPrevBlock = block1.GetHash();
-        block2.vtx.push_back(wtx);
+        block2.vtx.push_back(MakeTransactionRef(wtx));
         CBlockIndex index2(block2);
         index2.nHeight = 2;
         SproutMerkleTree sproutTree2 {sproutTree};
@@ -1950,7 +1958,7 @@ TEST(WalletTests, UpdatedSaplingNoteData) {
     EXPECT_EQ(-1, chainActive.Height());
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -2101,7 +2109,7 @@ TEST(WalletTests, MarkAffectedSaplingTransactionsDirty) {
     SaplingMerkleTree saplingTree;
     SproutMerkleTree sproutTree;
     CBlock block;
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -2174,6 +2182,81 @@ TEST(WalletTests, MarkAffectedSaplingTransactionsDirty) {
     RegtestDeactivateSapling();
 }
 
+TEST(WalletTests, WalletEvents) {
+    auto consensusParams = RegtestActivateSapling();
+    KeyIO keyIO(Params());
+
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    std::vector<UniValue> events;
+    wallet.NotifyWalletEvent.connect([&events](const std::string& strEvent) {
+        UniValue event;
+        ASSERT_TRUE(event.read(strEvent));
+        events.push_back(event);
+    });
+
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto expsk = sk.expsk;
+    auto extfvk = sk.ToXFVK();
+    auto pk = sk.DefaultAddress();
+    ASSERT_TRUE(wallet.AddSaplingZKey(sk));
+
+    // A transaction paying a note to the wallet, spending one it does not know about
+    libzcash::SaplingNote note(pk, 50000, libzcash::Zip212Enabled::BeforeZip212);
+    SaplingMerkleTree saplingTree;
+    saplingTree.append(note.cmu().value());
+    auto builder = TransactionBuilder(consensusParams, 1);
+    builder.AddSaplingSpend(expsk, note, saplingTree.root(), saplingTree.witness());
+    builder.AddSaplingOutput(extfvk.fvk.ovk, pk, 35000, {});
+    auto tx = builder.Build().GetTxOrThrow();
+    CWalletTx wtx {&wallet, tx};
+    auto saplingNoteData = wallet.FindMySaplingNotes(wtx, 1).first;
+    ASSERT_EQ(1, saplingNoteData.size());
+    wtx.SetSaplingNoteData(saplingNoteData);
+    wallet.AddToWallet(wtx, true, NULL);
+    EXPECT_EQ(0, events.size());
+
+    wallet.PublishTransactionEvents(wallet.mapWallet[wtx.GetHash()]);
+    ASSERT_EQ(1, events.size());
+    EXPECT_EQ("received", find_value(events[0], "event").get_str());
+    EXPECT_EQ("sapling", find_value(events[0], "pool").get_str());
+    EXPECT_EQ(wtx.GetHash().GetHex(), find_value(events[0], "txid").get_str());
+    EXPECT_TRUE(find_value(events[0], "blockhash").isNull());
+    EXPECT_EQ(0, find_value(events[0], "outindex").get_int());
+    EXPECT_EQ(keyIO.EncodePaymentAddress(pk), find_value(events[0], "address").get_str());
+    EXPECT_EQ(35000, find_value(events[0], "amountZat").get_int64());
+
+    // Note data read back from disk has not been decrypted, and is not published
+    CWalletTx wtxLoaded {&wallet, tx};
+    wtxLoaded.SetSaplingNoteData(saplingNoteData);
+    wtxLoaded.mapSaplingNoteData.begin()->second.value = std::nullopt;
+    wallet.PublishTransactionEvents(wtxLoaded);
+    EXPECT_EQ(1, events.size());
+
+    // The block event lists the wallet transactions in the block
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(wtx));
+    uint256 blockHash = block.GetHash();
+    CBlockIndex fakeIndex {block};
+    fakeIndex.nHeight = 7;
+    fakeIndex.phashBlock = &blockHash;
+    wallet.PublishBlockEvent(&fakeIndex, &block, true);
+    ASSERT_EQ(2, events.size());
+    EXPECT_EQ("blockconnected", find_value(events[1], "event").get_str());
+    EXPECT_EQ(blockHash.GetHex(), find_value(events[1], "blockhash").get_str());
+    EXPECT_EQ(7, find_value(events[1], "height").get_int());
+    ASSERT_EQ(1, find_value(events[1], "txids").size());
+    EXPECT_EQ(wtx.GetHash().GetHex(), find_value(events[1], "txids")[0].get_str());
+
+    // Nothing is built without a listener
+    wallet.NotifyWalletEvent.disconnect_all_slots();
+    wallet.PublishTransactionEvents(wallet.mapWallet[wtx.GetHash()]);
+    EXPECT_EQ(2, events.size());
+
+    RegtestDeactivateSapling();
+}
+
 TEST(WalletTests, SproutNoteLocking) {
     TestWallet wallet;
     LOCK(wallet.cs_wallet);
@@ -1383,7 +1383,7 @@ BOOST_AUTO_TEST_CASE(rpc_z_sendmany_taddr_to_sapling)
     BOOST_CHECK_EQUAL(0, chainActive.Height());
     CBlock block;
     block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
-    block.vtx.push_back(wtx);
+    block.vtx.push_back(MakeTransactionRef(wtx));
     block.hashMerkleRoot = block.BuildMerkleTree();
     auto blockHash = block.GetHash();
     CBlockIndex fakeIndex {block};
@@ -2064,7 +2064,7 @@ void TestWTxStatus(const Consensus::Params consensusParams, const int delta) {
     auto FakeMine = [&](const int height, bool has_trx) {
         BOOST_CHECK_EQUAL(height, chainActive.Height());
         CBlock block;
-        if (has_trx) block.vtx.push_back(wtx);
+        if (has_trx) block.vtx.push_back(MakeTransactionRef(wtx));
         block.hashMerkleRoot = block.BuildMerkleTree();
         auto blockHash = block.GetHash();
         CBlockIndex fakeIndex {block};
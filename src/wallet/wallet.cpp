@@ -692,6 +692,138 @@ void CWallet::ChainTip(const CBlockIndex *pindex,
         UpdateSaplingNullifierNoteMapForBlock(pblock);
 #endif // YCASH_WR
     }
+
+    PublishBlockEvent(pindex, pblock, (bool)added);
+}
+
+static UniValue WalletEvent(const std::string& strType, const CWalletTx& wtx)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("event", strType);
+    obj.pushKV("txid", wtx.GetHash().GetHex());
+    if (wtx.hashBlock.IsNull())
+        obj.pushKV("blockhash", NullUniValue);
+    else
+        obj.pushKV("blockhash", wtx.hashBlock.GetHex());
+    return obj;
+}
+
+void CWallet::PublishTransactionEvents(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    if (NotifyWalletEvent.empty())
+        return;
+
+    KeyIO keyIO(Params());
+    std::vector<UniValue> vEvents;
+
+    // Shielded notes received, as decrypted by FindMySproutNotes and
+    // FindMySaplingNotes when the transaction was found.
+    for (const auto& pair : wtx.mapSproutNoteData) {
+        const JSOutPoint& jsop = pair.first;
+        const SproutNoteData& nd = pair.second;
+        if (!nd.value)
+            continue;
+        UniValue obj = WalletEvent("received", wtx);
+        obj.pushKV("pool", "sprout");
+        obj.pushKV("jsindex", (int)jsop.js);
+        obj.pushKV("jsoutindex", (int)jsop.n);
+        obj.pushKV("address", keyIO.EncodePaymentAddress(nd.address));
+        obj.pushKV("amount", ValueFromAmount(*nd.value));
+        obj.pushKV("amountZat", *nd.value);
+        obj.pushKV("memo", HexStr(nd.memo));
+        vEvents.push_back(obj);
+    }
+    for (const auto& pair : wtx.mapSaplingNoteData) {
+        const SaplingOutPoint& op = pair.first;
+        const SaplingNoteData& nd = pair.second;
+        if (!nd.address || !nd.value)
+            continue;
+        UniValue obj = WalletEvent("received", wtx);
+        obj.pushKV("pool", "sapling");
+        obj.pushKV("outindex", (int)op.n);
+        obj.pushKV("address", keyIO.EncodePaymentAddress(*nd.address));
+        obj.pushKV("amount", ValueFromAmount(*nd.value));
+        obj.pushKV("amountZat", *nd.value);
+        obj.pushKV("memo", HexStr(nd.memo));
+        vEvents.push_back(obj);
+    }
+
+    // Transparent outputs received
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const CTxOut& txout = wtx.vout[i];
+        if (IsMine(txout) == ISMINE_NO)
+            continue;
+        UniValue obj = WalletEvent("received", wtx);
+        obj.pushKV("pool", "transparent");
+        obj.pushKV("vout", (int)i);
+        CTxDestination address;
+        if (ExtractDestination(txout.scriptPubKey, address))
+            obj.pushKV("address", keyIO.EncodeDestination(address));
+        obj.pushKV("amount", ValueFromAmount(txout.nValue));
+        obj.pushKV("amountZat", txout.nValue);
+        vEvents.push_back(obj);
+    }
+
+    // Wallet notes and outputs spent
+    for (const JSDescription& jsdesc : wtx.vJoinSplit) {
+        for (const uint256& nullifier : jsdesc.nullifiers) {
+            auto it = mapSproutNullifiersToNotes.find(nullifier);
+            if (it == mapSproutNullifiersToNotes.end())
+                continue;
+            UniValue obj = WalletEvent("spent", wtx);
+            obj.pushKV("pool", "sprout");
+            obj.pushKV("spenttxid", it->second.hash.GetHex());
+            obj.pushKV("jsindex", (int)it->second.js);
+            obj.pushKV("jsoutindex", (int)it->second.n);
+            vEvents.push_back(obj);
+        }
+    }
+    for (const SpendDescription& spend : wtx.vShieldedSpend) {
+        auto it = mapSaplingNullifiersToNotes.find(spend.nullifier);
+        if (it == mapSaplingNullifiersToNotes.end())
+            continue;
+        UniValue obj = WalletEvent("spent", wtx);
+        obj.pushKV("pool", "sapling");
+        obj.pushKV("spenttxid", it->second.hash.GetHex());
+        obj.pushKV("outindex", (int)it->second.n);
+        vEvents.push_back(obj);
+    }
+    for (const CTxIn& txin : wtx.vin) {
+        auto it = mapWallet.find(txin.prevout.hash);
+        if (it == mapWallet.end() || txin.prevout.n >= it->second.vout.size() ||
+                IsMine(it->second.vout[txin.prevout.n]) == ISMINE_NO)
+            continue;
+        UniValue obj = WalletEvent("spent", wtx);
+        obj.pushKV("pool", "transparent");
+        obj.pushKV("spenttxid", txin.prevout.hash.GetHex());
+        obj.pushKV("vout", (int)txin.prevout.n);
+        vEvents.push_back(obj);
+    }
+
+    for (const UniValue& obj : vEvents)
+        NotifyWalletEvent(obj.write());
+}
+
+void CWallet::PublishBlockEvent(const CBlockIndex *pindex, const CBlock *pblock, bool fConnected)
+{
+    LOCK(cs_wallet);
+    if (NotifyWalletEvent.empty())
+        return;
+
+    // Subscribers work out confirmation depths from the height of the tip,
+    // and the wallet transactions that the block confirms or unconfirms.
+    UniValue txids(UniValue::VARR);
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        if (mapWallet.count(ptx->GetHash()))
+            txids.push_back(ptx->GetHash().GetHex());
+    }
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("event", fConnected ? "blockconnected" : "blockdisconnected");
+    obj.pushKV("blockhash", pindex->GetBlockHash().GetHex());
+    obj.pushKV("height", pindex->nHeight);
+    obj.pushKV("txids", txids);
+    NotifyWalletEvent(obj.write());
 }
 
 void CWallet::RunSaplingMigration(int blockHeight) {
@@ -1453,7 +1585,8 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
         pblock = &block;
     }
 
-    for (const CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
         // Sprout
@@ -1715,8 +1848,9 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
                 ReadBlockFromDisk(block, pblockindex, Params().GetConsensus());
                 pblock = &block;
 
-                for (const CTransaction& tx : block.vtx)
+                for (const CTransactionRef& ptx : block.vtx)
                 {
+                    const CTransaction& tx = *ptx;
                     auto hash = tx.GetHash();
 
                     for (size_t i = 0; i < tx.vJoinSplit.size(); i++)
@@ -1815,8 +1949,9 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
                 ReadBlockFromDisk(block, pblockindex, Params().GetConsensus());
                 pblock = &block;
 
-                for (const CTransaction& tx : block.vtx)
+                for (const CTransactionRef& ptx : block.vtx)
                 {
+                    const CTransaction& tx = *ptx;
                     auto hash = tx.GetHash();
 
                     // Sapling
@@ -1948,8 +2083,9 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly)
                             nd->witnesses.pop_back();
                         }
 
-                        for (const CTransaction& tx : block.vtx)
+                        for (const CTransactionRef& ptx : block.vtx)
                         {
+                            const CTransaction& tx = *ptx;
                             for (size_t i = 0; i < tx.vJoinSplit.size(); i++)
                             {
                                 const JSDescription& jsdesc = tx.vJoinSplit[i];
@@ -1977,8 +2113,9 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly)
                             nd->witnesses.pop_back();
                         }
 
-                        for (const CTransaction& tx : block.vtx)
+                        for (const CTransactionRef& ptx : block.vtx)
                         {
+                            const CTransaction& tx = *ptx;
                             for (uint32_t i = 0; i < tx.vShieldedOutput.size(); i++)
                             {
                                 const uint256& note_commitment = tx.vShieldedOutput[i].cmu;
@@ -2335,7 +2472,8 @@ void CWallet::UpdateSaplingNullifierNoteMapForBlock(const CBlock *pblock) {
 #endif // YCASH_WR
     LOCK(cs_wallet);
 
-    for (const CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
         if (txIsOurs) {
@@ -2464,6 +2602,12 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
+        // Notify external listeners of what it means for the wallet, once,
+        // when it first arrives. Confirmations are followed through the
+        // blockconnected and blockdisconnected events instead.
+        if (fInsertedNew)
+            PublishTransactionEvents(wtx);
+
         // notify an external script when a wallet transaction comes in or is updated
         std::string strCmd = GetArg("-walletnotify", "");
 
@@ -2625,7 +2769,8 @@ std::optional<uint256> CWallet::GetSproutNoteNullifier(const JSDescription &jsde
                                                          const libzcash::SproutPaymentAddress &address,
                                                          const ZCNoteDecryption &dec,
                                                          const uint256 &hSig,
-                                                         uint8_t n) const
+                                                         uint8_t n,
+                                                         libzcash::SproutNotePlaintext* pplaintext) const
 {
     std::optional<uint256> ret;
     auto note_pt = libzcash::SproutNotePlaintext::decrypt(
@@ -2640,6 +2785,9 @@ std::optional<uint256> CWallet::GetSproutNoteNullifier(const JSDescription &jsde
     if (note.cm() != jsdesc.commitments[n]) {
         throw libzcash::note_decryption_failed();
     }
+    if (pplaintext) {
+        *pplaintext = note_pt;
+    }
 
     // SpendingKeys are only available if:
     // - We have them (this isn't a viewing key)
@@ -2675,18 +2823,16 @@ mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
                 try {
                     auto address = item.first;
                     JSOutPoint jsoutpt {hash, i, j};
+                    SproutNotePlaintext plaintext;
                     auto nullifier = GetSproutNoteNullifier(
                         tx.vJoinSplit[i],
                         address,
                         item.second,
-                        hSig, j);
-                    if (nullifier) {
-                        SproutNoteData nd {address, *nullifier};
-                        noteData.insert(std::make_pair(jsoutpt, nd));
-                    } else {
-                        SproutNoteData nd {address};
-                        noteData.insert(std::make_pair(jsoutpt, nd));
-                    }
+                        hSig, j, &plaintext);
+                    SproutNoteData nd = nullifier ? SproutNoteData {address, *nullifier} : SproutNoteData {address};
+                    nd.value = plaintext.value();
+                    nd.memo = plaintext.memo();
+                    noteData.insert(std::make_pair(jsoutpt, nd));
                     break;
                 } catch (const note_decryption_failed &err) {
                     // Couldn't decrypt with this decryptor
@@ -2736,6 +2882,9 @@ std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySap
                 SaplingOutPoint op {hash, i};
                 SaplingNoteData nd;
                 nd.ivk = ivk;
+                nd.address = address;
+                nd.value = result.value().value();
+                nd.memo = result.value().memo();
                 noteData.insert(std::make_pair(op, nd));
                 found = true;
                 break;
@@ -2761,6 +2910,9 @@ std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySap
                 SaplingOutPoint op {hash, i};
                 SaplingNoteData nd;
                 nd.ivk = ivk;
+                nd.address = ivk.address(result.value().d);
+                nd.value = result.value().value();
+                nd.memo = result.value().memo();
                 noteData.insert(std::make_pair(op, nd));
                 break;
             }
@@ -3520,8 +3672,9 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
         CBlock block;
         ReadBlockFromDisk(block, pindex, Params().GetConsensus());
 
-        for (const CTransaction& tx : block.vtx)
+        for (const CTransactionRef& ptx : block.vtx)
         {
+            const CTransaction& tx = *ptx;
             for (const JSDescription& jsdesc : tx.vJoinSplit)
             {
                 for (const uint256 &note_commitment : jsdesc.commitments)
@@ -3548,7 +3701,7 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
         uint256 current_anchor = tree.root();
 
         // Consistency check: we should be able to find the current tree
-        // in our CCoins view.
+        // in our coins view.
         SproutMerkleTree dummy_tree;
         assert(pcoinsTip->GetSproutAnchorAt(current_anchor, dummy_tree));
 
@@ -4110,8 +4263,9 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             CBlock block;
             bool blockInvolvesMe = false;
             ReadBlockFromDisk(block, pindex, consensus_params);
-            for (const CTransaction& tx : block.vtx)
+            for (const CTransactionRef& ptx : block.vtx)
             {
+                const CTransaction& tx = *ptx;
                 if (AddToWalletIfInvolvingMe(tx, &block, pindex->nHeight, fUpdate))
                 {
                     blockInvolvesMe = true;
@@ -6329,7 +6483,8 @@ bool CWallet::InitLoadWallet(bool clearWitnessCaches)
         // We can't rescan beyond non-pruned blocks, stop and throw an error.
         // This might happen if a user uses an old wallet within a pruned node,
         // or if they ran -disablewallet for a longer time, then decided to re-enable.
-        if (fPruneMode)
+        // Nodes loaded from a chainstate snapshot lack the blocks before it too.
+        if (fPruneMode || fSnapshotChainstate)
         {
             CBlockIndex *block = chainActive.Tip();
             while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
@@ -6471,7 +6626,7 @@ void CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size())
     {
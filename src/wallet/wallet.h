@@ -271,6 +271,11 @@ public:
      */
     int witnessHeight;
 
+    //In Memory Only; the note's value and memo, set when FindMySproutNotes
+    //decrypts it, so that wallet events do not have to decrypt it again.
+    std::optional<CAmount> value;
+    std::array<unsigned char, ZC_MEMO_SIZE> memo {};
+
 #ifdef YCASH_WR
     //In Memory Only
     bool witnessRootValidated;
@@ -334,6 +339,13 @@ public:
     libzcash::SaplingIncomingViewingKey ivk;
     std::optional<uint256> nullifier;
 
+    //In Memory Only; the note's address, value and memo, set when
+    //FindMySaplingNotes decrypts it, so that wallet events do not have to
+    //decrypt it again.
+    std::optional<libzcash::SaplingPaymentAddress> address;
+    std::optional<CAmount> value;
+    std::array<unsigned char, ZC_MEMO_SIZE> memo {};
+
 #ifdef YCASH_WR
     //In Memory Only
     bool witnessRootValidated;
@@ -963,6 +975,8 @@ private:
 protected:
     bool UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx);
     void MarkAffectedTransactionsDirty(const CTransaction& tx);
+    void PublishTransactionEvents(const CWalletTx& wtx);
+    void PublishBlockEvent(const CBlockIndex *pindex, const CBlock *pblock, bool fConnected);
 
     /* the hd chain data model (chain counters) */
     CHDChain hdChain;
@@ -1352,7 +1366,8 @@ public:
         const libzcash::SproutPaymentAddress& address,
         const ZCNoteDecryption& dec,
         const uint256& hSig,
-        uint8_t n) const;
+        uint8_t n,
+        libzcash::SproutNotePlaintext* pplaintext = nullptr) const;
     mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx) const;
     std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx, int height) const;
     bool IsSproutNullifierFromMe(const uint256& nullifier) const;
@@ -1463,6 +1478,16 @@ public:
     boost::signals2::signal<void (CWallet *wallet, const uint256 &hashTx,
             ChangeType status)> NotifyTransactionChanged;
 
+    /**
+     * Wallet events for external notification (-zmqpubwalletevent), each a
+     * JSON object: shielded notes and transparent outputs received, wallet
+     * notes and outputs spent, once when a transaction first enters the
+     * wallet, and blocks connected or disconnected. Only built when something
+     * is connected.
+     * @note called with lock cs_wallet held.
+     */
+    boost::signals2::signal<void (const std::string &strEvent)> NotifyWalletEvent;
+
     /** Show progress e.g. for rescan */
     boost::signals2::signal<void (const std::string &title, int nProgress)> ShowProgress;
 
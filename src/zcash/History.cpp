@@ -10,6 +10,133 @@
 
 namespace libzcash {
 
+// Computes floor(log2(x)).
+static inline uint32_t floor_log2(uint32_t x) {
+    assert(x > 0);
+    int log = 0;
+    while (x >>= 1) { ++log; }
+    return log;
+}
+
+// Computes the altitude of the largest subtree for an MMR with n nodes,
+// which is floor(log2(n + 1)) - 1.
+static inline uint32_t altitude(uint32_t n) {
+    return floor_log2(n + 1) - 1;
+}
+
+uint32_t GetPeakPositions(HistoryIndex treeLength, bool extra, std::vector<std::pair<uint32_t, uint32_t>> &positions) {
+    if (treeLength <= 0) {
+        throw std::runtime_error("Invalid GetPeakPositions state called - tree should exist");
+    } else if (treeLength == 1) {
+        positions.emplace_back(0, 0);
+        return 1;
+    }
+
+    uint32_t last_peak_pos = 0;
+    uint32_t last_peak_alt = 0;
+    uint32_t alt = 0;
+    uint32_t peak_pos = 0;
+    uint32_t total_peaks = 0;
+
+    // Assume the following example peak layout with 14 leaves, and 25 stored nodes in
+    // total (the "tree length"):
+    //
+    //             P
+    //            /\
+    //           /  \
+    //          / \  \
+    //        /    \  \  Altitude
+    //     _A_      \  \    3
+    //   _/   \_     B  \   2
+    //  / \   / \   / \  C  1
+    // /\ /\ /\ /\ /\ /\ /\ 0
+    //
+    // We start by determining the altitude of the highest peak (A).
+    alt = altitude(treeLength);
+
+    // We determine the position of the highest peak (A) by pretending it is the right
+    // sibling in a tree, and its left-most leaf has position 0. Then the left sibling
+    // of (A) has position -1, and so we can "jump" to the peak's position by computing
+    // -1 + 2^(alt + 1) - 1.
+    peak_pos = (1 << (alt + 1)) - 2;
+
+    // Now that we have the position and altitude of the highest peak (A), we collect
+    // the remaining peaks (B, C). We navigate the peaks as if they were nodes in this
+    // Merkle tree (with additional imaginary nodes 1 and 2, that have positions beyond
+    // the MMR's length):
+    //
+    //             / \
+    //            /   \
+    //           /     \
+    //         /         \
+    //       A ==========> 1
+    //      / \          //  \
+    //    _/   \_       B ==> 2
+    //   /\     /\     /\    //
+    //  /  \   /  \   /  \   C
+    // /\  /\ /\  /\ /\  /\ /\
+    //
+    while (alt != 0) {
+        // If peak_pos is out of bounds of the tree, we compute the position of its left
+        // child, and drop down one level in the tree.
+        if (peak_pos >= treeLength) {
+            // left child, -2^alt
+            peak_pos = peak_pos - (1 << alt);
+            alt = alt - 1;
+        }
+
+        // If the peak exists, we take it and then continue with its right sibling.
+        if (peak_pos < treeLength) {
+            positions.emplace_back(peak_pos, alt);
+
+            last_peak_pos = peak_pos;
+            last_peak_alt = alt;
+
+            // right sibling
+            peak_pos = peak_pos + (1 << (alt + 1)) - 1;
+        }
+    }
+
+    total_peaks = positions.size();
+
+    // Return early if we don't require extra nodes.
+    if (!extra) return total_peaks;
+
+    alt = last_peak_alt;
+    peak_pos = last_peak_pos;
+
+
+    //             P
+    //            /\
+    //           /  \
+    //          / \  \
+    //        /    \  \
+    //     _A_      \  \
+    //   _/   \_     B  \
+    //  / \   / \   / \  C
+    // /\ /\ /\ /\ /\ /\ /\
+    //                   D E
+    //
+    // For extra peaks needed for deletion, we do extra pass on right slope of the last peak
+    // and add those nodes + their siblings. Extra would be (D, E) for the picture above.
+    while (alt > 0) {
+        uint32_t left_pos = peak_pos - (1 << alt);
+        uint32_t right_pos = peak_pos - 1;
+        alt = alt - 1;
+
+        // left child
+        positions.emplace_back(left_pos, alt);
+
+        // right child
+        positions.emplace_back(right_pos, alt);
+
+        // continuing on right slope
+        peak_pos = right_pos;
+    }
+
+    return total_peaks;
+}
+
 void HistoryCache::Extend(const HistoryNode &leaf) {
     appends[length++] = leaf;
 }
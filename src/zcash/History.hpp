@@ -3,6 +3,8 @@
 
 #include <stdexcept>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <boost/foreach.hpp>
 
 #include "serialize.h"
@@ -58,6 +60,12 @@ HistoryEntry NodeToEntry(const HistoryNode node, uint32_t left, uint32_t right);
 // Convert history node to leaf node (end nodes without children)
 HistoryEntry LeafToEntry(const HistoryNode node);
 
+// Collects the positions and altitudes of the nodes needed to append to or
+// delete from an MMR with treeLength nodes: its peaks from left to right,
+// followed, if extra is set, by both children at each level of the right
+// slope of the last peak. Returns the number of peaks.
+uint32_t GetPeakPositions(HistoryIndex treeLength, bool extra, std::vector<std::pair<uint32_t, uint32_t>> &positions);
+
 }
 
 typedef libzcash::HistoryCache HistoryCache;
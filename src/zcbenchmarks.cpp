@@ -344,7 +344,7 @@ double benchmark_increment_sprout_note_witnesses(size_t nTxs)
     for (int i = 0; i < nTxs; ++i) {
         auto wtx = CreateSproutTxWithNoteData(sproutSpendingKey);
         wallet.AddToWallet(wtx, true, NULL);
-        block1.vtx.push_back(wtx);
+        block1.vtx.push_back(MakeTransactionRef(wtx));
     }
 
     CBlockIndex index1(block1);
@@ -359,7 +359,7 @@ double benchmark_increment_sprout_note_witnesses(size_t nTxs)
     {
         auto sproutTx = CreateSproutTxWithNoteData(sproutSpendingKey);
         wallet.AddToWallet(sproutTx, true, NULL);
-        block2.vtx.push_back(sproutTx);
+        block2.vtx.push_back(MakeTransactionRef(sproutTx));
     }
 
     CBlockIndex index2(block2);
@@ -406,7 +406,7 @@ double benchmark_increment_sapling_note_witnesses(size_t nTxs)
     for (int i = 0; i < nTxs; ++i) {
         auto wtx = CreateSaplingTxWithNoteData(consensusParams, wallet, saplingSpendingKey);
         wallet.AddToWallet(wtx, true, NULL);
-        block1.vtx.push_back(wtx);
+        block1.vtx.push_back(MakeTransactionRef(wtx));
     }
 
     CBlockIndex index1(block1);
@@ -421,7 +421,7 @@ double benchmark_increment_sapling_note_witnesses(size_t nTxs)
     {
         auto saplingTx = CreateSaplingTxWithNoteData(consensusParams, wallet, saplingSpendingKey);
         wallet.AddToWallet(saplingTx, true, NULL);
-        block1.vtx.push_back(saplingTx);
+        block1.vtx.push_back(MakeTransactionRef(saplingTx));
     }
 
     CBlockIndex index2(block2);
@@ -435,22 +435,21 @@ double benchmark_increment_sapling_note_witnesses(size_t nTxs)
 
 // Fake the input of a given block
 // This class is based on the class CCoinsViewDB, but with limited functionality.
-// The constructor and the functions `GetCoins` and `HaveCoins` come directly from
+// The constructor and the functions `GetCoin` and `HaveCoin` come directly from
 // CCoinsViewDB, but the rest are either mocks and/or don't really do anything.
-
-// The following constant is a duplicate of the one found in txdb.cpp
-static const char DB_COINS = 'c';
-
-class FakeCoinsViewDB : public CCoinsView {
-
-    CDBWrapper db;
+class FakeCoinsViewDB : public CCoinsViewDB {
 
     uint256 hash;
     SproutMerkleTree sproutTree;
     SaplingMerkleTree saplingTree;
 
 public:
-    FakeCoinsViewDB(std::string dbName, uint256& hash) : db(GetDataDir() / dbName, 100, false, false), hash(hash) {}
+    FakeCoinsViewDB(std::string dbName, uint256& hash) : CCoinsViewDB(dbName, 100, false, false), hash(hash) {
+        // The benchmark inputs may still be in the per-transaction format.
+        if (!Upgrade()) {
+            throw std::runtime_error("Failed to upgrade benchmark inputs database");
+        }
+    }
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
         if (rt == sproutTree.root()) {
@@ -472,14 +471,6 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
-        return db.Read(std::make_pair(DB_COINS, txid), coins);
-    }
-
-    bool HaveCoins(const uint256 &txid) const {
-        return db.Exists(std::make_pair(DB_COINS, txid));
-    }
-
     uint256 GetBestBlock() const {
         return hash;
     }
@@ -502,7 +493,8 @@ public:
                     CAnchorsSproutMap &mapSproutAnchors,
                     CAnchorsSaplingMap &mapSaplingAnchors,
                     CNullifiersMap &mapSproutNullifiers,
-                    CNullifiersMap &mapSaplingNullifiers) {
+                    CNullifiersMap &mapSaplingNullifiers,
+                    CHistoryCacheMap &historyCacheMap) {
         return false;
     }
 
@@ -11,7 +11,7 @@ CZMQAbstractNotifier::~CZMQAbstractNotifier()
     assert(!psocket);
 }
 
-bool CZMQAbstractNotifier::NotifyBlock(const CBlockIndex * /*CBlockIndex*/)
+bool CZMQAbstractNotifier::NotifyBlock(const CBlockIndex * /*CBlockIndex*/, const CBlock * /*pblock*/)
 {
     return true;
 }
@@ -25,3 +25,13 @@ bool CZMQAbstractNotifier::NotifyTransaction(const CTransaction &/*transaction*/
 {
     return true;
 }
+
+bool CZMQAbstractNotifier::NotifyShieldedTransaction(const CTransaction &/*transaction*/, const CBlock * /*pblock*/)
+{
+    return true;
+}
+
+bool CZMQAbstractNotifier::NotifyWalletEvent(const std::string &/*strEvent*/)
+{
+    return true;
+}
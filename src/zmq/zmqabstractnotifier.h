@@ -32,9 +32,17 @@ public:
     virtual bool Initialize(void *pcontext) = 0;
     virtual void Shutdown() = 0;
 
-    virtual bool NotifyBlock(const CBlockIndex *pindex);
+    /** pblock is the new tip itself when it is in memory, and NULL otherwise. */
+    virtual bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
     virtual bool NotifyBlock(const CBlock& pblock);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    /**
+     * Called for transactions with Sprout or Sapling data, with the block
+     * they were connected in, or NULL for the mempool and disconnects.
+     */
+    virtual bool NotifyShieldedTransaction(const CTransaction &transaction, const CBlock *pblock);
+    /** strEvent is a wallet event, as a JSON object. */
+    virtual bool NotifyWalletEvent(const std::string &strEvent);
 
 protected:
     void *psocket;
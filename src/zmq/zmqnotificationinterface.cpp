@@ -40,6 +40,9 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
     factories["pubcheckedblock"] = CZMQAbstractNotifier::Create<CZMQPublishCheckedBlockNotifier>;
+    factories["pubshieldedoutputs"] = CZMQAbstractNotifier::Create<CZMQPublishShieldedOutputsNotifier>;
+    factories["pubnullifiers"] = CZMQAbstractNotifier::Create<CZMQPublishNullifiersNotifier>;
+    factories["pubwalletevent"] = CZMQAbstractNotifier::Create<CZMQPublishWalletEventNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -57,10 +60,15 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
 
     if (!notifiers.empty())
     {
+        size_t nMaxSendQueueBytes = DEFAULT_ZMQ_SEND_QUEUE_SIZE;
+        std::map<std::string, std::string>::const_iterator it = args.find("-zmqsendqueuesize");
+        if (it != args.end())
+            nMaxSendQueueBytes = std::max(atoi64(it->second), (int64_t)0);
+
         notificationInterface = new CZMQNotificationInterface();
         notificationInterface->notifiers = notifiers;
 
-        if (!notificationInterface->Initialize())
+        if (!notificationInterface->Initialize(nMaxSendQueueBytes * 1000000))
         {
             delete notificationInterface;
             notificationInterface = NULL;
@@ -71,7 +79,7 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
 }
 
 // Called at startup to conditionally set up ZMQ socket(s)
-bool CZMQNotificationInterface::Initialize()
+bool CZMQNotificationInterface::Initialize(size_t nMaxSendQueueBytes)
 {
     int major = 0, minor = 0, patch = 0;
     zmq_version(&major, &minor, &patch);
@@ -88,6 +96,8 @@ bool CZMQNotificationInterface::Initialize()
         return false;
     }
 
+    CZMQAbstractPublishNotifier::StartSendThread(nMaxSendQueueBytes);
+
     std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin();
     for (; i!=notifiers.end(); ++i)
     {
@@ -105,6 +115,14 @@ bool CZMQNotificationInterface::Initialize()
 
     if (i!=notifiers.end())
     {
+        // Undo what was set up, only for the notifiers that were initialized.
+        CZMQAbstractPublishNotifier::StopSendThread();
+        for (std::list<CZMQAbstractNotifier*>::iterator j=notifiers.begin(); j!=i; ++j)
+        {
+            (*j)->Shutdown();
+        }
+        zmq_ctx_term(pcontext);
+        pcontext = 0;
         return false;
     }
 
@@ -117,6 +135,7 @@ void CZMQNotificationInterface::Shutdown()
     LogPrint("zmq", "zmq: Shutdown notification interface\n");
     if (pcontext)
     {
+        CZMQAbstractPublishNotifier::StopSendThread();
         for (std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin(); i!=notifiers.end(); ++i)
         {
             CZMQAbstractNotifier *notifier = *i;
@@ -129,12 +148,12 @@ void CZMQNotificationInterface::Shutdown()
     }
 }
 
-void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock)
 {
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyBlock(pindex))
+        if (notifier->NotifyBlock(pindex, pblock))
         {
             i++;
         }
@@ -172,7 +191,24 @@ void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CB
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyTransaction(tx))
+        if (notifier->NotifyTransaction(tx) && notifier->NotifyShieldedTransaction(tx, pblock))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
+
+void CZMQNotificationInterface::WalletEvent(const std::string &strEvent)
+{
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyWalletEvent(strEvent))
         {
             i++;
         }
@@ -13,6 +13,9 @@
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
+/** Default for -zmqsendqueuesize, in megabytes. */
+static const size_t DEFAULT_ZMQ_SEND_QUEUE_SIZE = 64;
+
 class CZMQNotificationInterface : public CValidationInterface
 {
 public:
@@ -20,13 +23,16 @@ public:
 
     static CZMQNotificationInterface* CreateWithArguments(const std::map<std::string, std::string> &args);
 
+    /** Publish a wallet event, as a JSON object. Connected to CWallet::NotifyWalletEvent. */
+    void WalletEvent(const std::string &strEvent);
+
 protected:
-    bool Initialize();
+    bool Initialize(size_t nMaxSendQueueBytes);
     void Shutdown();
 
     // CValidationInterface
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock, const int nHeight);
-    void UpdatedBlockTip(const CBlockIndex *pindex);
+    void UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock);
     void BlockChecked(const CBlock& block, const CValidationState& state);
 
 private:
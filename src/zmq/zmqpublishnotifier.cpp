@@ -7,6 +7,10 @@
 #include "main.h"
 #include "util.h"
 
+#include <deque>
+
+#include <boost/thread.hpp>
+
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
 
 static const char *MSG_HASHBLOCK = "hashblock";
@@ -14,6 +18,37 @@ static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
 static const char *MSG_CHECKEDBLOCK = "checkedblock";
+static const char *MSG_SHIELDEDOUTPUTS = "shieldedoutputs";
+static const char *MSG_NULLIFIERS = "nullifiers";
+static const char *MSG_WALLETEVENT = "walletevent";
+
+namespace {
+
+struct CZMQQueuedMessage
+{
+    void *psocket;
+    const char *command;
+    CDataStream data;
+    ZMQMessageLoader loader;
+    uint32_t nSequence;
+    //! Bytes counted against the send queue limit; for loaded messages, the most the loader can add.
+    size_t nSize;
+
+    CZMQQueuedMessage(void *psocketIn, const char *commandIn, CDataStream&& dataIn, const ZMQMessageLoader& loaderIn, uint32_t nSequenceIn, size_t nSizeIn) :
+        psocket(psocketIn), command(commandIn), data(std::move(dataIn)), loader(loaderIn), nSequence(nSequenceIn), nSize(nSizeIn) {}
+};
+
+boost::mutex csSendQueue;
+boost::condition_variable condSendQueue;
+std::deque<CZMQQueuedMessage> sendQueue;
+size_t nSendQueueBytes = 0;
+size_t nMaxSendQueueBytes = 0;
+bool fSendThreadRunning = false;
+//! The socket the send thread is using outside the lock, if any.
+void *psocketSending = NULL;
+boost::thread sendThread;
+
+}
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -115,6 +150,22 @@ void CZMQAbstractPublishNotifier::Shutdown()
 
     if (count == 1)
     {
+        // Drop anything still queued for the socket, and wait for the send
+        // thread to finish with it.
+        {
+            boost::unique_lock<boost::mutex> lock(csSendQueue);
+            for (auto it = sendQueue.begin(); it != sendQueue.end(); ) {
+                if (it->psocket == psocket) {
+                    nSendQueueBytes -= it->nSize;
+                    it = sendQueue.erase(it);
+                } else {
+                    it++;
+                }
+            }
+            while (psocketSending == psocket)
+                condSendQueue.wait(lock);
+        }
+
         LogPrint("zmq", "Close socket at address %s\n", address);
         int linger = 0;
         zmq_setsockopt(psocket, ZMQ_LINGER, &linger, sizeof(linger));
@@ -124,24 +175,108 @@ void CZMQAbstractPublishNotifier::Shutdown()
     psocket = 0;
 }
 
-bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* data, size_t size)
+static void ThreadZMQSend()
+{
+    RenameThread("zcash-zmqsend");
+
+    boost::unique_lock<boost::mutex> lock(csSendQueue);
+    while (true) {
+        while (fSendThreadRunning && sendQueue.empty())
+            condSendQueue.wait(lock);
+        if (!fSendThreadRunning)
+            break;
+
+        CZMQQueuedMessage msg = std::move(sendQueue.front());
+        sendQueue.pop_front();
+        nSendQueueBytes -= msg.nSize;
+        psocketSending = msg.psocket;
+        lock.unlock();
+
+        if (!msg.loader || msg.loader(msg.data)) {
+            /* send three parts, command & data & a LE 4byte sequence number */
+            unsigned char msgseq[sizeof(uint32_t)];
+            WriteLE32(&msgseq[0], msg.nSequence);
+            int rc = zmq_send_multipart(msg.psocket, msg.command, strlen(msg.command), &(*msg.data.begin()), msg.data.size(), msgseq, (size_t)sizeof(uint32_t), (void*)0);
+            if (rc == -1)
+                LogPrint("zmq", "zmq: Failed to send %s message %u\n", msg.command, msg.nSequence);
+        } else {
+            LogPrint("zmq", "zmq: Failed to load %s message %u\n", msg.command, msg.nSequence);
+        }
+
+        lock.lock();
+        psocketSending = NULL;
+        condSendQueue.notify_all();
+    }
+}
+
+void CZMQAbstractPublishNotifier::StartSendThread(size_t nMaxQueuedBytes)
+{
+    boost::unique_lock<boost::mutex> lock(csSendQueue);
+    assert(!fSendThreadRunning);
+    nMaxSendQueueBytes = nMaxQueuedBytes;
+    fSendThreadRunning = true;
+    sendThread = boost::thread(&ThreadZMQSend);
+}
+
+void CZMQAbstractPublishNotifier::StopSendThread()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csSendQueue);
+        if (!fSendThreadRunning)
+            return;
+        fSendThreadRunning = false;
+        condSendQueue.notify_all();
+    }
+    sendThread.join();
+
+    boost::unique_lock<boost::mutex> lock(csSendQueue);
+    if (!sendQueue.empty())
+        LogPrint("zmq", "zmq: Dropping %u unsent messages\n", sendQueue.size());
+    sendQueue.clear();
+    nSendQueueBytes = 0;
+}
+
+bool CZMQAbstractPublishNotifier::QueueMessage(const char *command, CDataStream&& data, const ZMQMessageLoader& loader, size_t nSize)
 {
     assert(psocket);
 
-    /* send three parts, command & data & a LE 4byte sequence number */
-    unsigned char msgseq[sizeof(uint32_t)];
-    WriteLE32(&msgseq[0], nSequence);
-    int rc = zmq_send_multipart(psocket, command, strlen(command), data, size, msgseq, (size_t)sizeof(uint32_t), (void*)0);
-    if (rc == -1)
-        return false;
+    boost::unique_lock<boost::mutex> lock(csSendQueue);
 
-    /* increment memory only sequence number after sending */
-    nSequence++;
+    // A dropped message still uses up its sequence number, so that
+    // subscribers can tell that they missed something.
+    uint32_t nMsgSequence = nSequence++;
 
+    if (!fSendThreadRunning)
+        return true;
+    if (!sendQueue.empty() && nSendQueueBytes + nSize > nMaxSendQueueBytes) {
+        LogPrint("zmq", "zmq: Send queue full, dropping %s message %u\n", command, nMsgSequence);
+        return true;
+    }
+
+    nSendQueueBytes += nSize;
+    sendQueue.emplace_back(psocket, command, std::move(data), loader, nMsgSequence, nSize);
+    condSendQueue.notify_all();
     return true;
 }
 
-bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* data, size_t size)
+{
+    const char *pdata = (const char *)data;
+    return QueueMessage(command, CDataStream(pdata, pdata + size, SER_NETWORK, PROTOCOL_VERSION), ZMQMessageLoader(), size);
+}
+
+bool CZMQAbstractPublishNotifier::SendMessage(const char *command, CDataStream&& data)
+{
+    size_t nSize = data.size();
+    return QueueMessage(command, std::move(data), ZMQMessageLoader(), nSize);
+}
+
+bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const ZMQMessageLoader& loader, size_t nMaxSize)
+{
+    return QueueMessage(command, CDataStream(SER_NETWORK, PROTOCOL_VERSION), loader, nMaxSize);
+}
+
+bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock * /*pblock*/)
 {
     uint256 hash = pindex->GetBlockHash();
     LogPrint("zmq", "zmq: Publish hashblock %s\n", hash.GetHex());
@@ -161,25 +296,33 @@ bool CZMQPublishHashTransactionNotifier::NotifyTransaction(const CTransaction &t
     return SendMessage(MSG_HASHTX, data, 32);
 }
 
-bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock)
 {
-    LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
+    uint256 hash = pindex->GetBlockHash();
+    LogPrint("zmq", "zmq: Publish rawblock %s\n", hash.GetHex());
 
-    const Consensus::Params& consensusParams = Params().GetConsensus();
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    if (pblock) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << *pblock;
+        return SendMessage(MSG_RAWBLOCK, std::move(ss));
+    }
+
+    // Otherwise the send thread reads it from disk. Its size is not known
+    // yet, so it takes up as much of the send queue as the largest block.
+    CDiskBlockPos pos;
     {
         LOCK(cs_main);
+        pos = pindex->GetBlockPos();
+    }
+    return SendMessage(MSG_RAWBLOCK, [pos, hash](CDataStream& ss) {
         CBlock block;
-        if(!ReadBlockFromDisk(block, pindex, consensusParams))
-        {
+        if (!ReadBlockFromDisk(block, pos, Params().GetConsensus()) || block.GetHash() != hash) {
             zmqError("Can't read block from disk");
             return false;
         }
-
         ss << block;
-    }
-
-    return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
+        return true;
+    }, MAX_BLOCK_SIZE);
 }
 
 bool CZMQPublishCheckedBlockNotifier::NotifyBlock(const CBlock& block)
@@ -187,12 +330,9 @@ bool CZMQPublishCheckedBlockNotifier::NotifyBlock(const CBlock& block)
     LogPrint("zmq", "zmq: Publish checkedblock %s\n", block.GetHash().GetHex());
 
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    {
-        LOCK(cs_main);
-        ss << block;
-    }
+    ss << block;
 
-    return SendMessage(MSG_CHECKEDBLOCK, &(*ss.begin()), ss.size());
+    return SendMessage(MSG_CHECKEDBLOCK, std::move(ss));
 }
 
 bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
@@ -201,5 +341,46 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     LogPrint("zmq", "zmq: Publish rawtx %s\n", hash.GetHex());
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     ss << transaction;
-    return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
+    return SendMessage(MSG_RAWTX, std::move(ss));
+}
+
+bool CZMQPublishShieldedOutputsNotifier::NotifyShieldedTransaction(const CTransaction &transaction, const CBlock *pblock)
+{
+    if (transaction.vJoinSplit.empty() && transaction.vShieldedOutput.empty())
+        return true;
+
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish shieldedoutputs %s\n", hash.GetHex());
+    std::vector<uint256> vSproutCommitments;
+    for (const JSDescription& jsdesc : transaction.vJoinSplit)
+        vSproutCommitments.insert(vSproutCommitments.end(), jsdesc.commitments.begin(), jsdesc.commitments.end());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hash << (pblock ? pblock->GetHash() : uint256()) << vSproutCommitments << transaction.vShieldedOutput;
+    return SendMessage(MSG_SHIELDEDOUTPUTS, std::move(ss));
+}
+
+bool CZMQPublishNullifiersNotifier::NotifyShieldedTransaction(const CTransaction &transaction, const CBlock *pblock)
+{
+    if (transaction.vJoinSplit.empty() && transaction.vShieldedSpend.empty())
+        return true;
+
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish nullifiers %s\n", hash.GetHex());
+    std::vector<uint256> vSproutNullifiers;
+    for (const JSDescription& jsdesc : transaction.vJoinSplit)
+        vSproutNullifiers.insert(vSproutNullifiers.end(), jsdesc.nullifiers.begin(), jsdesc.nullifiers.end());
+    std::vector<uint256> vSaplingNullifiers;
+    for (const SpendDescription& spend : transaction.vShieldedSpend)
+        vSaplingNullifiers.push_back(spend.nullifier);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hash << (pblock ? pblock->GetHash() : uint256()) << vSproutNullifiers << vSaplingNullifiers;
+    return SendMessage(MSG_NULLIFIERS, std::move(ss));
+}
+
+bool CZMQPublishWalletEventNotifier::NotifyWalletEvent(const std::string &strEvent)
+{
+    LogPrint("zmq", "zmq: Publish walletevent\n");
+    return SendMessage(MSG_WALLETEVENT, strEvent.data(), strEvent.size());
 }
@@ -6,32 +6,55 @@
 #define BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H
 
 #include "zmqabstractnotifier.h"
+#include "streams.h"
+
+#include <functional>
 
 class CBlockIndex;
 
+/** Fills in the data of a message on the send thread. */
+typedef std::function<bool(CDataStream&)> ZMQMessageLoader;
+
 class CZMQAbstractPublishNotifier : public CZMQAbstractNotifier
 {
 private:
     uint32_t nSequence; //! upcounting per message sequence number
 
+    bool QueueMessage(const char *command, CDataStream&& data, const ZMQMessageLoader& loader, size_t nSize);
+
 public:
 
-    /* send zmq multipart message
+    /* queue zmq multipart message for the send thread
        parts:
           * command
           * data
           * message sequence number
+
+       Messages that do not fit in the send queue are dropped, and
+       subscribers see a gap in the sequence numbers.
     */
     bool SendMessage(const char *command, const void* data, size_t size);
+    bool SendMessage(const char *command, CDataStream&& data);
+    //! For data that is slow to get, such as blocks that have to be read
+    //! from disk. nMaxSize bytes are counted against the send queue limit.
+    bool SendMessage(const char *command, const ZMQMessageLoader& loader, size_t nMaxSize);
 
     bool Initialize(void *pcontext);
     void Shutdown();
+
+    /**
+     * Messages are sent from a single thread, so that notifications do not
+     * wait for serialization, disk reads or the network. At most
+     * nMaxQueuedBytes of message data wait to be sent.
+     */
+    static void StartSendThread(size_t nMaxQueuedBytes);
+    static void StopSendThread();
 };
 
 class CZMQPublishHashBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
 };
 
 class CZMQPublishHashTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -43,7 +66,7 @@ public:
 class CZMQPublishRawBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
 };
 
 class CZMQPublishRawTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -58,4 +81,22 @@ public:
     bool NotifyBlock(const CBlock &block);
 };
 
+class CZMQPublishShieldedOutputsNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyShieldedTransaction(const CTransaction &transaction, const CBlock *pblock);
+};
+
+class CZMQPublishNullifiersNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyShieldedTransaction(const CTransaction &transaction, const CBlock *pblock);
+};
+
+class CZMQPublishWalletEventNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyWalletEvent(const std::string &strEvent);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H